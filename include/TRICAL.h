@@ -23,21 +23,454 @@ SOFTWARE.
 #ifndef _TRICAL_H_
 #define _TRICAL_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+Calibration model, selected by the number of filter states:
+* 3: bias only (state[0:3]);
+* 6: bias, plus the diagonal of the scale matrix D (state[3:6]);
+* 12: bias, plus the full scale matrix D in row-major order (state[3:12]).
+
+The filter is specialized for the selected model at compile time, so the
+smaller models are much cheaper to run.
+*/
+#ifndef TRICAL_STATE_DIM
 #define TRICAL_STATE_DIM 12
+#endif
+
+#if TRICAL_STATE_DIM != 3 && TRICAL_STATE_DIM != 6 && TRICAL_STATE_DIM != 12
+#error "TRICAL_STATE_DIM must be 3, 6 or 12"
+#endif
+
+/*
+Number of elements in the lower triangle of a TRICAL_STATE_DIM x
+TRICAL_STATE_DIM symmetric matrix, used for packed covariance storage
+*/
+#define TRICAL_PACKED_COVARIANCE_DIM \
+    (TRICAL_STATE_DIM * (TRICAL_STATE_DIM + 1) / 2)
+
+/*
+Number of elements in TRICAL_instance_t.state_covariance. Define
+TRICAL_PACKED_COVARIANCE to store only the lower triangle of the covariance
+(or its Cholesky factor), which saves about 260 bytes per instance but changes
+the layout of TRICAL_instance_t.
+*/
+#ifdef TRICAL_PACKED_COVARIANCE
+#define TRICAL_COVARIANCE_DIM TRICAL_PACKED_COVARIANCE_DIM
+#else
+#define TRICAL_COVARIANCE_DIM (TRICAL_STATE_DIM * TRICAL_STATE_DIM)
+#endif
+
+/*
+Element type of TRICAL_instance_t.state_covariance. Define
+TRICAL_DOUBLE_COVARIANCE to keep the state covariance (and its Cholesky
+factorization) in double precision, which stops it drifting away from
+symmetric positive-definite over very long runs; measurements, field vectors
+and the state itself remain single-precision. This doubles the size of the
+covariance and changes the layout of TRICAL_instance_t.
+*/
+#ifdef TRICAL_DOUBLE_COVARIANCE
+typedef double TRICAL_covariance_t;
+#else
+typedef float TRICAL_covariance_t;
+#endif
+
+/*
+Alignment, in bytes, of the arrays in TRICAL_workspace_t which the vector
+kernels work through (32 covers AVX, SSE2 and NEON). TRICAL_ALIGN(n) aligns
+a declaration to `n` bytes, and is empty on compilers without a way to do
+that; the kernels only use unaligned loads and stores, so alignment just
+keeps their vectors from straddling cache lines.
+*/
+#ifndef TRICAL_ALIGNMENT
+#define TRICAL_ALIGNMENT 32
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TRICAL_ALIGN(n) __attribute__((aligned(n)))
+#elif defined(_MSC_VER)
+#define TRICAL_ALIGN(n) __declspec(align(n))
+#else
+#define TRICAL_ALIGN(n)
+#endif
+
+/*
+Number of instances in a TRICAL_bank_t. Must be a multiple of the vector
+width of the target (8 covers AVX, SSE2 and NEON), and no more than 32.
+*/
+#ifndef TRICAL_BANK_WIDTH
+#define TRICAL_BANK_WIDTH 8
+#endif
+
+/*
+Resolution of the direction coverage histogram. Directions are binned by
+projecting onto the faces of a cube, and splitting each face into a
+TRICAL_COVERAGE_RESOLUTION x TRICAL_COVERAGE_RESOLUTION grid, so there are
+TRICAL_COVERAGE_BINS bins in total.
+*/
+#ifndef TRICAL_COVERAGE_RESOLUTION
+#define TRICAL_COVERAGE_RESOLUTION 2
+#endif
+
+#define TRICAL_COVERAGE_BINS \
+    (6 * TRICAL_COVERAGE_RESOLUTION * TRICAL_COVERAGE_RESOLUTION)
+
+/*
+Filter instrumentation, collected for each instance when the library is
+built with TRICAL_STATS defined (which changes the layout of
+TRICAL_instance_t), and read with TRICAL_stats_get. Cycle counts come from
+TRICAL_CYCLES(), which defaults to the time-stamp counter on x86, the virtual
+counter on AArch64 and TSCL/TSCH on C6000 (which must be started by the
+application); define it to use a different timer.
+
+The pivots are the diagonal elements of the state covariance Cholesky factor
+squared, i.e. the variance of each state conditioned on the preceding ones;
+a minimum pivot close to zero (or below it) means the covariance is about to
+lose positive-definiteness.
+*/
+typedef struct {
+    /*
+    Number of full filter updates, and the total time spent in the filter
+    (including readings it rejected)
+    */
+    unsigned int update_count;
+    uint64_t update_cycles;
+
+    /*
+    Total time spent factorizing (or, in square-root mode, downdating) the
+    state covariance
+    */
+    uint64_t cholesky_cycles;
+
+    /* Smallest covariance pivot seen at the start of an update */
+    float min_pivot;
+
+    /*
+    Innovation statistics: the running mean, the sum of squared deviations
+    from the mean (divide by update_count - 1 for the variance), and the
+    largest absolute innovation
+    */
+    float innovation_mean;
+    float innovation_m2;
+    float innovation_max;
+
+    /*
+    Number of readings rejected by the outlier gate (see
+    TRICAL_outlier_gate_set); these aren't included in update_count or the
+    innovation statistics
+    */
+    unsigned int outlier_count;
+} TRICAL_stats_t;
+
+/*
+A snapshot of a calibration estimate, for applying a converged calibration
+to large numbers of measurements. Unlike TRICAL_instance_t, the scale is
+stored as the complete (I + D) matrix (row-major), so nothing needs to be
+rebuilt for each measurement.
+*/
+typedef struct {
+    float bias[3];
+    float scale[9];
+} TRICAL_frozen_t;
+
+/*
+A calibration estimate published by an instance (see TRICAL_published_set),
+which any number of readers on other tasks or cores can read without locks
+while the instance is being updated. The estimate is double-buffered: each
+publication makes `sequence` odd, writes the buffer readers aren't using,
+then makes `sequence` even again to switch them over to it. A reader only has
+to retry if the publication after next has started writing to its buffer
+while it's copying the estimate.
+
+Use TRICAL_published_get or TRICAL_published_calibrate to read it, rather
+than reading the members directly.
+*/
+typedef struct {
+    volatile unsigned int sequence;
+    TRICAL_frozen_t estimate[2];
+} TRICAL_published_t;
+
+/*
+Capacity of a TRICAL_queue_t, in samples. Must be a power of two.
+*/
+#ifndef TRICAL_QUEUE_CAPACITY
+#define TRICAL_QUEUE_CAPACITY 64u
+#endif
+
+/*
+What TRICAL_queue_push does with a sample when the queue is full:
+* TRICAL_QUEUE_DROP_OLDEST overwrites the oldest queued sample, so the queue
+always holds the most recent readings;
+* TRICAL_QUEUE_DECIMATE drops the new sample, and halves the rate at which
+samples are queued from then on (down to one in 64) until the queue has
+drained to a quarter full, which spreads the losses evenly over time rather
+than dropping a run of consecutive readings;
+* TRICAL_QUEUE_PREFER_COVERAGE overwrites the oldest queued sample if the
+new one points into a different direction bin (see TRICAL_coverage_get) to
+the last sample queued, and otherwise drops the new sample, so that a long
+run of readings in one direction can't push out the rest.
+*/
+typedef enum {
+    TRICAL_QUEUE_DROP_OLDEST = 0,
+    TRICAL_QUEUE_DECIMATE,
+    TRICAL_QUEUE_PREFER_COVERAGE
+} TRICAL_queue_policy_t;
+
+typedef struct {
+    float measurement[3];
+    float reference_field[3];
+    unsigned int fixed_field;
+} TRICAL_queue_entry_t;
+
+/*
+A fixed-capacity queue of raw samples waiting to be processed by an instance
+(see TRICAL_queue_set), for one producer (e.g. a sensor interrupt handler)
+calling TRICAL_queue_push and one consumer calling TRICAL_pump, without
+locks. `head` is only written by the producer, and `tail` by the consumer;
+the other members are internal to one side or the other.
+*/
+typedef struct {
+    TRICAL_queue_entry_t entries[TRICAL_QUEUE_CAPACITY];
+    volatile unsigned int head;
+    volatile unsigned int tail;
+
+    /* Producer state */
+    TRICAL_queue_policy_t policy;
+    unsigned int decimation;
+    unsigned int decimation_count;
+    unsigned int last_bin;
+    volatile unsigned int overwriting;
+    volatile unsigned int dropped;
+
+    /* Consumer state: samples overwritten before they could be processed */
+    volatile unsigned int overwritten;
+} TRICAL_queue_t;
+
+/*
+Results of TRICAL_estimate_update:
+* TRICAL_STATUS_UPDATED: the reading was incorporated into the estimate;
+* TRICAL_STATUS_SKIPPED: the reading was skipped by the update gate or
+coverage limit (see TRICAL_gate_set and TRICAL_coverage_limit_set);
+* TRICAL_STATUS_REPAIRED: the state covariance had lost positive
+definiteness, so it was repaired (see TRICAL_repair_count_get) before the
+reading was incorporated;
+* TRICAL_STATUS_REJECTED: the reading wasn't finite, failed the outlier gate
+(see TRICAL_outlier_gate_set), or the update wouldn't have left the
+estimate finite, so the reading was discarded. The state covariance may
+still have been repaired first (and the repair counted by
+TRICAL_repair_count_get), since the checks need the covariance to be
+factorized.
+*/
+typedef enum {
+    TRICAL_STATUS_UPDATED = 0,
+    TRICAL_STATUS_SKIPPED,
+    TRICAL_STATUS_REPAIRED,
+    TRICAL_STATUS_REJECTED
+} TRICAL_status_t;
 
 typedef struct {
     float field_norm;
     float measurement_noise;
 
     float state[TRICAL_STATE_DIM];
-    float state_covariance[TRICAL_STATE_DIM * TRICAL_STATE_DIM];
+
+    /*
+    If `square_root` is zero, this is the state covariance matrix; otherwise
+    it's the lower-triangular Cholesky factor of the state covariance
+    (column-major, with an all-zero upper triangle). With
+    TRICAL_PACKED_COVARIANCE, only the lower triangle is stored, column by
+    column.
+    */
+    TRICAL_covariance_t state_covariance[TRICAL_COVARIANCE_DIM];
     unsigned int measurement_count;
+
+    unsigned int square_root;
+
+    /*
+    Process model configuration (see TRICAL_process_noise_set and
+    TRICAL_forgetting_set): the variance added to each state before each
+    update, and the factor the state covariance is divided by before each
+    update
+    */
+    float process_noise;
+    float forgetting;
+
+    /*
+    Fixed reference field direction (normalized), used when no reference
+    field is passed to TRICAL_estimate_update; `field_fixed` is non-zero if
+    it's been set (see TRICAL_field_set)
+    */
+    float field[3];
+    unsigned int field_fixed;
+
+    /*
+    Update gating configuration (see TRICAL_gate_set,
+    TRICAL_outlier_gate_set and TRICAL_coverage_limit_set), the number of
+    readings from each direction bin which have contributed to the estimate
+    so far (saturating at USHRT_MAX), and the number of readings skipped by
+    the gate (or rejected)
+    */
+    float gate_innovation;
+    float gate_trace;
+    float gate_outlier;
+    unsigned int coverage_limit;
+    unsigned short coverage[TRICAL_COVERAGE_BINS];
+    unsigned int skipped_count;
+
+    /* Number of updates which had to repair the state covariance */
+    unsigned int repair_count;
+
+    /*
+    Where the calibration estimate is published after each update, or NULL
+    (see TRICAL_published_set)
+    */
+    TRICAL_published_t *published;
+
+    /* Queue of samples processed by TRICAL_pump, or NULL */
+    TRICAL_queue_t *queue;
+
+#ifdef TRICAL_STATS
+    TRICAL_stats_t stats;
+#endif
 } TRICAL_instance_t;
 
+/*
+Scratch storage for filter updates: the scaled Cholesky factor of the state
+covariance, the sigma point measurement estimates and the cross-correlation
+vector. Without a workspace, TRICAL_estimate_update and
+TRICAL_estimate_update_batch keep these on the stack (about 800 bytes with
+the default model, or 2 KB with TRICAL_DOUBLE_COVARIANCE); the
+_workspace variants use a caller-provided one instead, so it can be
+statically allocated. The arrays the vector kernels use are aligned to
+TRICAL_ALIGNMENT bytes where the compiler supports it (see TRICAL_ALIGN).
+
+A workspace holds nothing between updates, so one can be shared by any number
+of instances; it just mustn't be used by two updates at once (e.g. give each
+thread its own). Initialize it with TRICAL_workspace_init before first use.
+*/
+typedef struct {
+#ifdef TRICAL_DOUBLE_COVARIANCE
+    double covariance_llt_d[TRICAL_STATE_DIM * TRICAL_STATE_DIM];
+#endif
+    TRICAL_ALIGN(TRICAL_ALIGNMENT)
+    float covariance_llt[TRICAL_STATE_DIM * TRICAL_STATE_DIM];
+    TRICAL_ALIGN(TRICAL_ALIGNMENT)
+    float measurement_estimates[2 * TRICAL_STATE_DIM + 1];
+    float cross_correlation[TRICAL_STATE_DIM];
+    TRICAL_covariance_t downdate[TRICAL_STATE_DIM];
+} TRICAL_workspace_t;
+
+/*
+Accumulated moments for a batch least-squares ellipsoid fit (see
+TRICAL_fit_add and TRICAL_fit_solve). Each reading (x, y, z) contributes a
+row of TRICAL_FIT_TERMS terms, (x^2, y^2, z^2, 2xy, 2xz, 2yz, 2x, 2y, 2z),
+to the normal equations of an algebraic fit; `moments` holds the sum of the
+outer products of those rows as a packed lower triangle (column-major, as
+for TRICAL_PACKED_COVARIANCE_DIM), and `terms` the sum of the rows. Since
+everything is a sum over readings, fits can be merged (see
+TRICAL_fit_merge). The layout is the same for every calibration model.
+*/
+#define TRICAL_FIT_TERMS 9
+#define TRICAL_FIT_MOMENTS (TRICAL_FIT_TERMS * (TRICAL_FIT_TERMS + 1) / 2)
+
+typedef struct {
+    double moments[TRICAL_FIT_MOMENTS];
+    double terms[TRICAL_FIT_TERMS];
+    unsigned int count;
+} TRICAL_fit_t;
+
+/*
+A bank of TRICAL_BANK_WIDTH independent instances, stored in
+structure-of-arrays form so that all of them can be updated in lockstep, one
+instance per vector lane. Element `i` of instance `n`'s state is
+`state[i][n]`, and its state covariance is stored as a packed lower triangle
+(column-major, see TRICAL_PACKED_COVARIANCE_DIM) in the same way. For an
+instance in square-root mode (bit `n` of `square_root` set), that's the
+lower-triangular Cholesky factor of the covariance instead.
+
+Use TRICAL_bank_instance_set and TRICAL_bank_instance_get to move individual
+instances between a bank and a TRICAL_instance_t. Besides the estimate, a
+bank holds each instance's field norm, measurement noise, outlier gate and
+process model (process noise and forgetting factor).
+*/
+typedef struct {
+    float field_norm[TRICAL_BANK_WIDTH];
+    float measurement_noise[TRICAL_BANK_WIDTH];
+    float outlier_gate[TRICAL_BANK_WIDTH];
+    float process_noise[TRICAL_BANK_WIDTH];
+    float forgetting[TRICAL_BANK_WIDTH];
+    unsigned int square_root;
+
+    float state[TRICAL_STATE_DIM][TRICAL_BANK_WIDTH];
+    float state_covariance[TRICAL_PACKED_COVARIANCE_DIM][TRICAL_BANK_WIDTH];
+    unsigned int measurement_count[TRICAL_BANK_WIDTH];
+} TRICAL_bank_t;
+
+/*
+Checkpoint formats. TRICAL_CHECKPOINT_FULL holds the complete estimator state
+(configuration, measurement count, state and the lower triangle of the state
+covariance); TRICAL_CHECKPOINT_ESTIMATE holds the same, but with only the
+diagonal of the state covariance.
+*/
+typedef enum {
+    TRICAL_CHECKPOINT_FULL = 1,
+    TRICAL_CHECKPOINT_ESTIMATE = 2
+} TRICAL_checkpoint_format_t;
+
+/* Results of TRICAL_checkpoint_load */
+typedef enum {
+    TRICAL_CHECKPOINT_OK = 0,
+    TRICAL_CHECKPOINT_ERROR_SIZE,
+    TRICAL_CHECKPOINT_ERROR_MAGIC,
+    TRICAL_CHECKPOINT_ERROR_VERSION,
+    TRICAL_CHECKPOINT_ERROR_CRC,
+    TRICAL_CHECKPOINT_ERROR_MODEL,
+    TRICAL_CHECKPOINT_ERROR_VALUE
+} TRICAL_checkpoint_status_t;
+
+/*
+Sizes in bytes of the checkpoint formats: an 8-byte header, the field norm,
+measurement noise and measurement count, the state, the covariance (or its
+diagonal) and a CRC-32, all 4 bytes per value. With the default 12-state
+model these are 384 and 120 bytes respectively.
+*/
+#define TRICAL_CHECKPOINT_SIZE \
+    (8u + 4u * (3u + TRICAL_STATE_DIM + TRICAL_PACKED_COVARIANCE_DIM) + 4u)
+#define TRICAL_CHECKPOINT_ESTIMATE_SIZE \
+    (8u + 4u * (3u + 2u * TRICAL_STATE_DIM) + 4u)
+
+/*
+Fixed-point calibration, for targets without an FPU. Values are signed
+Q2.29 (so 1.0 is TRICAL_FIXED_ONE, and the range is [-4, 4)); scale the
+sensor readings so that the field norm is around 1.0, and no more than 2.0.
+*/
+typedef int32_t TRICAL_fixed_t;
+
+#define TRICAL_FIXED_ONE ((TRICAL_fixed_t)1 << 29)
+#define TRICAL_FIXED_FROM_FLOAT(x) \
+    ((TRICAL_fixed_t)((x) * (float)TRICAL_FIXED_ONE))
+#define TRICAL_FIXED_TO_FLOAT(x) ((float)(x) * (1.0f / TRICAL_FIXED_ONE))
+
+/*
+A fixed-point calibration instance. This always runs in square-root mode,
+storing the lower-triangular Cholesky factor of the state covariance in
+packed form (see TRICAL_PACKED_COVARIANCE_DIM), which keeps the dynamic range
+needed for the covariance within Q2.29.
+*/
+typedef struct {
+    TRICAL_fixed_t field_norm;
+    TRICAL_fixed_t measurement_noise;
+
+    TRICAL_fixed_t state[TRICAL_STATE_DIM];
+    TRICAL_fixed_t state_covariance[TRICAL_PACKED_COVARIANCE_DIM];
+    unsigned int measurement_count;
+} TRICAL_fixed_instance_t;
+
 /*
 TRICAL_init:
 Initializes `instance`. Must be called prior to any other TRICAL procedures
@@ -50,7 +483,7 @@ void TRICAL_init(TRICAL_instance_t *instance);
 
 /*
 TRICAL_reset:
-Resets the state and state covariance of `instance`.
+Resets the state, state covariance and direction coverage of `instance`.
 */
 void TRICAL_reset(TRICAL_instance_t *instance);
 
@@ -66,7 +499,7 @@ void TRICAL_norm_set(TRICAL_instance_t *instance, float norm);
 TRICAL_norm_get:
 Returns the expected field norm (magnitude) of `instance`.
 */
-float TRICAL_norm_get(TRICAL_instance_t *instance);
+float TRICAL_norm_get(const TRICAL_instance_t *instance);
 
 /*
 TRICAL_noise_set:
@@ -78,52 +511,660 @@ void TRICAL_noise_set(TRICAL_instance_t *instance, float noise);
 TRICAL_noise_get:
 Returns the standard deviation in measurements supplied to `instance`.
 */
-float TRICAL_noise_get(TRICAL_instance_t *instance);
+float TRICAL_noise_get(const TRICAL_instance_t *instance);
+
+/*
+TRICAL_square_root_set:
+Enables (if `enabled` is non-zero) or disables square-root filtering for
+`instance`. In square-root mode the instance stores the Cholesky factor of the
+state covariance instead of the covariance itself, and updates it with a
+rank-1 downdate after each measurement instead of re-factorizing the whole
+covariance matrix. This is cheaper per update, and guarantees the state
+covariance stays positive definite over long runs.
+
+The current state covariance is converted in-place, so this can be called at
+any time without losing the calibration estimate.
+*/
+void TRICAL_square_root_set(TRICAL_instance_t *instance,
+unsigned int enabled);
+
+/*
+TRICAL_square_root_get:
+Returns non-zero if `instance` is in square-root mode.
+*/
+unsigned int TRICAL_square_root_get(const TRICAL_instance_t *instance);
+
+/*
+TRICAL_process_noise_set:
+Sets the variance added to each element of the state of `instance` before
+each update, which stops the state covariance shrinking towards zero and lets
+the estimate follow a calibration that changes over time. The default is zero
+(no process noise).
+*/
+void TRICAL_process_noise_set(TRICAL_instance_t *instance, float noise);
+
+/*
+TRICAL_process_noise_get:
+Returns the process noise variance of `instance`.
+*/
+float TRICAL_process_noise_get(const TRICAL_instance_t *instance);
+
+/*
+TRICAL_forgetting_set:
+Sets the forgetting factor of `instance`, between 0 (exclusive) and 1. The
+state covariance is divided by `factor` before each update, so the weight of
+older readings decays exponentially, with a time constant of about
+1 / (1 - `factor`) updates. The default of 1.0 disables forgetting.
+
+Forgetting also inflates the variance of states the readings don't constrain
+(e.g. while the sensor isn't rotating), so factors well below 1 should be
+combined with some process noise, or avoided in favour of it.
+*/
+void TRICAL_forgetting_set(TRICAL_instance_t *instance, float factor);
+
+/*
+TRICAL_forgetting_get:
+Returns the forgetting factor of `instance`.
+*/
+float TRICAL_forgetting_get(const TRICAL_instance_t *instance);
+
+/*
+TRICAL_field_set:
+Sets a fixed reference field direction for `instance`, for installations in
+which the field doesn't change between readings. `field` is normalized, so
+it can be given in any units. Once set, NULL can be passed as the reference
+field to TRICAL_estimate_update and TRICAL_estimate_update_batch. Passing a
+NULL `field` clears the fixed field.
+*/
+void TRICAL_field_set(TRICAL_instance_t *instance, const float field[3]);
+
+/*
+TRICAL_field_get:
+Copies the fixed reference field direction of `instance` to `field` and
+returns non-zero, or returns zero (leaving `field` unchanged) if there isn't
+one.
+*/
+unsigned int TRICAL_field_get(const TRICAL_instance_t *instance,
+float field[3]);
+
+/*
+TRICAL_gate_set:
+Enables update gating for `instance`, which skips the (comparatively
+expensive) filter update for readings which are unlikely to change the
+calibration estimate. Only one measurement reduction with the current
+estimate is needed to decide whether a reading should be skipped.
+
+With gating enabled, a reading is only incorporated into the estimate if:
+* the absolute innovation of the current estimate, divided by the
+measurement noise, exceeds `innovation_threshold`;
+* the trace of the state covariance exceeds `trace_threshold`; or
+* the calibrated reading points into a direction bin (one of
+TRICAL_COVERAGE_BINS regions of the unit sphere) which hasn't contributed to
+the estimate yet.
+
+Readings which don't meet any of those criteria are counted by
+TRICAL_skipped_count_get instead of TRICAL_measurement_count_get. Set
+`innovation_threshold` to zero to disable gating, which is the default.
+*/
+void TRICAL_gate_set(TRICAL_instance_t *instance, float innovation_threshold,
+float trace_threshold);
+
+/*
+TRICAL_outlier_gate_set:
+Enables the outlier gate for `instance`, which rejects readings during a
+transient magnetic disturbance (a motor spinning up, a passing vehicle)
+rather than letting them drag the estimate away. A reading is rejected if
+its squared innovation, divided by the filter's estimate of the innovation
+variance, exceeds `threshold`: a chi-square test with one degree of
+freedom, so 9 rejects readings more than about three standard deviations
+out. The test is made as soon as the sigma points have been evaluated, so a
+rejected reading skips the cross-correlation and the state and covariance
+updates.
+
+Rejected readings are counted by TRICAL_skipped_count_get (and by the
+outlier_count of TRICAL_stats_t, with TRICAL_STATS). If the field genuinely
+changes -- or the estimate becomes overconfident -- the gate can reject
+everything from then on; process noise or forgetting (see
+TRICAL_process_noise_set and TRICAL_forgetting_set) stop the innovation
+variance from collapsing. A `threshold` of zero, the default, disables the
+gate.
+*/
+void TRICAL_outlier_gate_set(TRICAL_instance_t *instance, float threshold);
+
+/*
+TRICAL_coverage_limit_set:
+Limits the number of readings from each direction bin which are
+incorporated into the estimate of `instance` to `limit`. Once a bin is full,
+further readings in that direction are skipped (and counted by
+TRICAL_skipped_count_get) before any filter update is run, whether or not
+they'd pass the gate set by TRICAL_gate_set. This stops a long run of
+readings in one direction -- e.g. from a stationary vehicle -- from taking
+up filter time and pulling the estimate towards that direction. Only readings
+which were incorporated count towards the limit: those rejected by the
+outlier gate or the health checks don't fill a bin.
+
+A `limit` of zero, the default, disables the limit.
+*/
+void TRICAL_coverage_limit_set(TRICAL_instance_t *instance,
+unsigned int limit);
+
+/*
+TRICAL_coverage_get:
+Returns the fraction (0 to 1) of the TRICAL_COVERAGE_BINS direction bins
+which have contributed at least one reading to the estimate of `instance`
+since it was last reset. A value close to 1 means the readings so far cover
+the whole sphere, which the calibration needs to be well-conditioned.
+*/
+float TRICAL_coverage_get(const TRICAL_instance_t *instance);
 
 /*
 TRICAL_measurement_count_get:
 Returns the number of measurements previously provided to `instance` via
-TRICAL_estimate_update.
+TRICAL_estimate_update, excluding any skipped by the update gate.
+*/
+unsigned int TRICAL_measurement_count_get(
+const TRICAL_instance_t *instance);
+
+/*
+TRICAL_skipped_count_get:
+Returns the number of measurements provided to `instance` via
+TRICAL_estimate_update which were skipped by the update gate, or rejected
+(see TRICAL_status_t).
+*/
+unsigned int TRICAL_skipped_count_get(const TRICAL_instance_t *instance);
+
+/*
+TRICAL_repair_count_get:
+Returns the number of updates of `instance` which found that the state
+covariance had lost positive definiteness, and repaired it before carrying
+on. The repair adds a little jitter to the diagonal, increasing it until the
+covariance can be factorized again; only if that doesn't work, or the
+covariance isn't finite at all, is it reinitialized (keeping the state).
+*/
+unsigned int TRICAL_repair_count_get(const TRICAL_instance_t *instance);
+
+/*
+TRICAL_stats_get:
+Copies the instrumentation counters of `instance` to `stats`. If the library
+was built without TRICAL_STATS, `stats` is zero-filled.
 */
-unsigned int TRICAL_measurement_count_get(TRICAL_instance_t *instance);
+void TRICAL_stats_get(const TRICAL_instance_t *instance,
+TRICAL_stats_t *stats);
+
+/*
+TRICAL_stats_reset:
+Resets the instrumentation counters of `instance`. Does nothing if the
+library was built without TRICAL_STATS.
+*/
+void TRICAL_stats_reset(TRICAL_instance_t *instance);
 
 /*
 TRICAL_estimate_update
 Updates the calibration estimate of `instance` based on the new data in
 `measurement`, and the current field direction estimate `reference_field`.
 Call this function with each reading you receive from your sensor.
+
+If a fixed field has been set with TRICAL_field_set, `reference_field` may be
+NULL to use it.
+
+Every update checks that the state covariance factorizes cleanly, and that
+the updated estimate will be finite. Returns a TRICAL_status_t saying
+whether the reading was used, and whether anything needed fixing; a failed
+update is discarded rather than left to poison the estimate, so there's no
+need to call TRICAL_reset and lose the calibration.
 */
-void TRICAL_estimate_update(TRICAL_instance_t *instance,
-float measurement[3], float reference_field[3]);
+TRICAL_status_t TRICAL_estimate_update(TRICAL_instance_t *instance,
+const float measurement[3], const float reference_field[3]);
+
+/*
+TRICAL_estimate_update_batch
+Updates the calibration estimate of `instance` based on `count` consecutive
+readings, equivalent to calling TRICAL_estimate_update on each one in turn.
+
+Reading `i` is read from `measurements[i * measurement_stride]`, and its
+field direction estimate from `reference_fields[i * reference_field_stride]`.
+Strides are in floats, so `float[count][3]` arrays have a stride of 3; a
+`reference_field_stride` of 0 uses the same field direction estimate for all
+readings. If a fixed field has been set with TRICAL_field_set,
+`reference_fields` may be NULL to use it for all readings.
+
+Use this when draining a sensor FIFO to avoid re-validating the arguments and
+re-initializing the filter working storage for each reading.
+*/
+void TRICAL_estimate_update_batch(TRICAL_instance_t *instance,
+const float measurements[], unsigned int measurement_stride,
+const float reference_fields[], unsigned int reference_field_stride,
+unsigned int count);
+
+/*
+TRICAL_workspace_init
+Initializes `workspace`. Must be called before `workspace` is first passed to
+TRICAL_estimate_update_workspace or TRICAL_estimate_update_batch_workspace.
+*/
+void TRICAL_workspace_init(TRICAL_workspace_t *workspace);
+
+/*
+TRICAL_estimate_update_workspace
+Same as TRICAL_estimate_update, but uses `workspace` instead of the stack for
+the filter working storage. A NULL `workspace` falls back to the stack.
+*/
+TRICAL_status_t TRICAL_estimate_update_workspace(TRICAL_instance_t *instance,
+TRICAL_workspace_t *workspace, const float measurement[3],
+const float reference_field[3]);
+
+/*
+TRICAL_estimate_update_batch_workspace
+Same as TRICAL_estimate_update_batch, but uses `workspace` instead of the
+stack for the filter working storage. A NULL `workspace` falls back to the
+stack.
+*/
+void TRICAL_estimate_update_batch_workspace(TRICAL_instance_t *instance,
+TRICAL_workspace_t *workspace, const float measurements[],
+unsigned int measurement_stride, const float reference_fields[],
+unsigned int reference_field_stride, unsigned int count);
 
 /*
 TRICAL_estimate_get
 Copies the calibration bias and scale esimates of `instance` to
 `bias_estimate` and `scale_estimate` respectively. A new calibration estimate
 will be available after every call to TRICAL_estimate_update.
+
+The scale estimate is always a full 3x3 matrix; elements which aren't part of
+the calibration model selected by TRICAL_STATE_DIM are set to zero.
 */
-void TRICAL_estimate_get(TRICAL_instance_t *instance, float bias_estimate[3],
-float scale_estimate[9]);
+void TRICAL_estimate_get(const TRICAL_instance_t *instance,
+float bias_estimate[3], float scale_estimate[9]);
 
 /*
 TRICAL_estimate_get_ext
 Same as TRICAL_estimate_get, but additionally copies the bias and scale
 estimate variances to `bias_estimate_variance` and `scale_estimate_variance`.
 */
-void TRICAL_estimate_get_ext(TRICAL_instance_t *instance,
+void TRICAL_estimate_get_ext(const TRICAL_instance_t *instance,
 float bias_estimate[3], float scale_estimate[9],
 float bias_estimate_variance[3], float scale_estimate_variance[9]);
 
 /*
 TRICAL_measurement_calibrate
 Calibrates `measurement` based on the current calibration estimates, and
-copies the result to `calibrated_measurement`.
+copies the result to `calibrated_measurement`. The `measurement` and
+`calibrated_measurement` parameters may be pointers to the same vector.
 
 DO NOT pass the calibrated measurement into TRICAL_estimate_update, as it
 needs the raw measurement values to work.
 */
-void TRICAL_measurement_calibrate(TRICAL_instance_t *instance,
-float measurement[3], float calibrated_measurement[3]);
+void TRICAL_measurement_calibrate(const TRICAL_instance_t *instance,
+const float measurement[3], float calibrated_measurement[3]);
+
+/*
+TRICAL_bank_init:
+Initializes every instance in `bank` to the same default state as
+TRICAL_init.
+*/
+void TRICAL_bank_init(TRICAL_bank_t *bank);
+
+/*
+TRICAL_bank_instance_set:
+Copies the field norm, measurement noise, outlier gate, process model,
+measurement count, calibration estimate and state covariance of `instance`
+into slot `index` of `bank`. A square-root instance keeps its Cholesky factor
+in the bank, so no factorization is needed. The bank doesn't hold any other
+settings: the update gate, coverage limit and histogram, fixed reference
+field, skipped and repair counts, published estimate and queue have no effect
+on TRICAL_bank_estimate_update.
+*/
+void TRICAL_bank_instance_set(TRICAL_bank_t *bank, unsigned int index,
+const TRICAL_instance_t *instance);
+
+/*
+TRICAL_bank_instance_get:
+Copies slot `index` of `bank` (everything TRICAL_bank_instance_set copies in)
+into `instance`, which must have been initialized. The settings the bank
+doesn't hold are left as they are, so getting an instance back into the one
+that was set only brings its estimate up to date. The resulting instance is
+not in square-root mode.
+*/
+void TRICAL_bank_instance_get(const TRICAL_bank_t *bank, unsigned int index,
+TRICAL_instance_t *instance);
+
+/*
+TRICAL_bank_estimate_update:
+Updates the calibration estimate of every instance in `bank` for which the
+corresponding bit of `active` is set, using `measurements[n]` and
+`reference_fields[n]` for instance `n`. Instances with a clear `active` bit
+are left unchanged, and their readings are ignored.
+
+As in TRICAL_estimate_update, each active instance's process model is applied
+first, and a reading which fails the instance's outlier gate, or whose update
+wouldn't leave the estimate finite, isn't used. The
+bank can't repair a state covariance which has lost positive definiteness,
+so an instance whose covariance can't be factorized is left unchanged as
+well; move it out with TRICAL_bank_instance_get and update it on its own to
+repair it. Only the instances whose reading was used have their measurement
+count incremented.
+*/
+void TRICAL_bank_estimate_update(TRICAL_bank_t *bank,
+const float measurements[TRICAL_BANK_WIDTH][3],
+const float reference_fields[TRICAL_BANK_WIDTH][3], unsigned int active);
+
+/*
+TRICAL_estimate_update_multi:
+Updates each of the `count` instances in `instances` with its own reading,
+`measurements[n]` and `reference_fields[n]` for instance `n`, as if by
+TRICAL_estimate_update but in lockstep: up to TRICAL_BANK_WIDTH instances
+at a time are updated together by the bank filter, so their Cholesky
+factorizations and sigma points are all evaluated in the same vector
+operations. Intended for boards running one instance per sensor, off the
+same sample tick.
+
+If `reference_fields` is NULL, each instance uses its fixed reference field
+(see TRICAL_field_set). Every other per-instance setting (square-root mode,
+process noise, forgetting, update, outlier gate and coverage limit, and
+published estimate) is honoured, and readings are skipped, rejected and
+counted as by TRICAL_estimate_update. An instance whose covariance needs
+repairing is updated on its own instead, so it's repaired in the same way.
+
+The differences are that the bank filter works in single precision whatever
+the covariance storage, so results match TRICAL_estimate_update to within
+rounding rather than exactly, and that the TRICAL_STATS instrumentation
+isn't updated for the instances it updates. `instances` must not contain the
+same instance twice.
+*/
+void TRICAL_estimate_update_multi(TRICAL_instance_t *const instances[],
+const float measurements[][3], const float reference_fields[][3],
+unsigned int count);
+
+/*
+TRICAL_bank_measurement_calibrate:
+Calibrates `measurement` based on the current calibration estimate of
+instance `index` in `bank`, and copies the result to
+`calibrated_measurement`.
+*/
+void TRICAL_bank_measurement_calibrate(const TRICAL_bank_t *bank,
+unsigned int index, const float measurement[3],
+float calibrated_measurement[3]);
+
+/*
+TRICAL_frozen_get:
+Copies the current calibration estimate of `instance` to `frozen`. Later
+updates to `instance` don't affect `frozen`.
+*/
+void TRICAL_frozen_get(const TRICAL_instance_t *instance,
+TRICAL_frozen_t *frozen);
+
+/*
+TRICAL_calibrate_many:
+Calibrates the `count` measurements in `measurements` based on the
+calibration in `frozen`, and copies the results to `calibrated_measurements`.
+The results are the same as calling TRICAL_measurement_calibrate on each
+measurement with the instance `frozen` was taken from.
+
+`measurements` and `calibrated_measurements` may point to the same array, but
+mustn't otherwise overlap.
+*/
+void TRICAL_calibrate_many(const TRICAL_frozen_t *frozen,
+float measurements[][3], float calibrated_measurements[][3],
+unsigned int count);
+
+/*
+TRICAL_published_init:
+Initializes `published` with an identity calibration (zero bias and unit
+scale). Must be called before `published` is passed to any other
+TRICAL_published procedures.
+*/
+void TRICAL_published_init(TRICAL_published_t *published);
+
+/*
+TRICAL_published_set:
+Makes `instance` publish its calibration estimate to `published` (or, if
+`published` is NULL, stop publishing it), and publishes the current
+estimate. From then on, the estimate is re-published by every
+TRICAL_estimate_update (or TRICAL_estimate_update_batch) call which changes
+it, and by TRICAL_reset and TRICAL_checkpoint_load; call this again to
+publish changes made any other way.
+
+Only one instance may publish to a given TRICAL_published_t, and its updates
+must not run concurrently, but readers can use `published` from any task at
+any time.
+*/
+void TRICAL_published_set(TRICAL_instance_t *instance,
+TRICAL_published_t *published);
+
+/*
+TRICAL_published_get:
+Copies the most recent calibration estimate published to `published` to
+`frozen`, and returns the number of estimates published so far (which can be
+used to detect a new estimate). Never blocks the publishing instance.
+*/
+unsigned int TRICAL_published_get(const TRICAL_published_t *published,
+TRICAL_frozen_t *frozen);
+
+/*
+TRICAL_published_calibrate:
+Calibrates `measurement` based on the most recent calibration estimate
+published to `published`, and copies the result to `calibrated_measurement`.
+The `measurement` and `calibrated_measurement` parameters may be pointers to
+the same vector.
+*/
+void TRICAL_published_calibrate(const TRICAL_published_t *published,
+const float measurement[3], float calibrated_measurement[3]);
+
+/*
+TRICAL_queue_init:
+Initializes `queue` as an empty queue, with overflow policy `policy`. Must be
+called before `queue` is passed to any other TRICAL_queue procedures.
+*/
+void TRICAL_queue_init(TRICAL_queue_t *queue, TRICAL_queue_policy_t policy);
+
+/*
+TRICAL_queue_set:
+Makes `queue` (or, if NULL, no queue) the source of samples for TRICAL_pump
+on `instance`.
+*/
+void TRICAL_queue_set(TRICAL_instance_t *instance, TRICAL_queue_t *queue);
+
+/*
+TRICAL_queue_push:
+Adds the raw sensor reading `measurement` and its field direction estimate
+`reference_field` to `queue`, to be incorporated into the calibration
+estimate by a later TRICAL_pump call. `reference_field` may be NULL if the
+instance will have a fixed field (see TRICAL_field_set). Returns non-zero if
+the sample was queued, or zero if the queue was full and the overflow policy
+dropped it.
+
+This only copies the sample, so it's cheap enough to call from an interrupt
+handler. Only one task may push to a given queue.
+*/
+unsigned int TRICAL_queue_push(TRICAL_queue_t *queue,
+const float measurement[3], const float reference_field[3]);
+
+/*
+TRICAL_queue_count_get:
+Returns the number of samples waiting in `queue`.
+*/
+unsigned int TRICAL_queue_count_get(const TRICAL_queue_t *queue);
+
+/*
+TRICAL_queue_dropped_get:
+Returns the number of samples pushed to `queue` which were dropped, or
+overwritten before they could be processed. Overwritten samples are only
+counted once TRICAL_pump reaches them.
+*/
+unsigned int TRICAL_queue_dropped_get(const TRICAL_queue_t *queue);
+
+/*
+TRICAL_pump:
+Updates the calibration estimate of `instance` with up to `budget` samples
+from its queue (see TRICAL_queue_set), oldest first, exactly as if each had
+been passed to TRICAL_estimate_update, then publishes the estimate once (see
+TRICAL_published_set). Returns the number of samples processed, which is
+less than `budget` if the queue ran out.
+
+Only one task may pump a given queue, but it can run at the same time as the
+task pushing to it.
+*/
+unsigned int TRICAL_pump(TRICAL_instance_t *instance, unsigned int budget);
+
+/*
+TRICAL_fit_init:
+Initializes `fit` with no readings. Must be called before `fit` is passed to
+any other TRICAL_fit procedures.
+*/
+void TRICAL_fit_init(TRICAL_fit_t *fit);
+
+/*
+TRICAL_fit_add:
+Adds the raw sensor reading `measurement` to `fit`.
+*/
+void TRICAL_fit_add(TRICAL_fit_t *fit, const float measurement[3]);
+
+/*
+TRICAL_fit_add_many:
+Adds `count` raw sensor readings to `fit`. Reading `i` is read from
+`measurements + i * measurement_stride`, as for
+TRICAL_estimate_update_batch.
+*/
+void TRICAL_fit_add_many(TRICAL_fit_t *fit, const float measurements[],
+unsigned int measurement_stride, unsigned int count);
+
+/*
+TRICAL_fit_merge:
+Adds the readings accumulated in `other` to `fit`, so that `fit` ends up as
+if both sets of readings had been added to it. Partial fits of separate
+shards of a data set (on separate threads, or separate machines) can be
+combined this way in any order; the result only differs by rounding.
+*/
+void TRICAL_fit_merge(TRICAL_fit_t *fit, const TRICAL_fit_t *other);
+
+/*
+TRICAL_fit_solve:
+Fits an ellipsoid to the readings added to `fit`, and copies the bias and
+scale estimates that map it onto a sphere of radius `field_norm` to
+`bias_estimate` and `scale_estimate`, in the same form as
+TRICAL_estimate_get. The scale estimate is symmetric, and restricted to the
+calibration model: axis-aligned for the 6-state model, and zero (a sphere)
+for the 3-state model.
+
+Returns non-zero on success, or zero (leaving the estimates unchanged) if
+there are too few readings or they don't determine an ellipsoid, e.g.
+because they all lie in one plane.
+*/
+unsigned int TRICAL_fit_solve(const TRICAL_fit_t *fit, float field_norm,
+float bias_estimate[3], float scale_estimate[9]);
+
+/*
+TRICAL_fit_seed:
+Replaces the state of `instance` with the result of TRICAL_fit_solve for its
+field norm, and its state covariance with the uncertainty of that result.
+The fit only sees the magnitude of the calibrated readings, so it can't
+estimate a rotation of the sensor axes; that part of the scale estimate keeps
+the same variance as in a newly-initialized instance, for the filter to
+refine from the reference field. Returns non-zero on success, or zero (leaving
+`instance` unchanged) if the fit fails.
+*/
+unsigned int TRICAL_fit_seed(const TRICAL_fit_t *fit,
+TRICAL_instance_t *instance);
+
+/*
+TRICAL_checkpoint_save:
+Serializes `instance` to `buffer` in `format`, and returns the number of bytes
+written (TRICAL_CHECKPOINT_SIZE or TRICAL_CHECKPOINT_ESTIMATE_SIZE). `size`
+must be at least that large. Checkpoints are the same whatever the
+square-root mode and covariance storage options of the instance.
+*/
+size_t TRICAL_checkpoint_save(const TRICAL_instance_t *instance,
+TRICAL_checkpoint_format_t format, uint8_t *buffer, size_t size);
+
+/*
+TRICAL_checkpoint_load:
+Restores the field norm, measurement noise, measurement count, state and state
+covariance of `instance` from the checkpoint in `buffer`, which may be in
+either format. `instance` must have been initialized, and its other settings
+are kept. If the checkpoint is truncated, corrupt, or was saved with a
+different calibration model, `instance` is left unchanged and an error is
+returned.
+*/
+TRICAL_checkpoint_status_t TRICAL_checkpoint_load(TRICAL_instance_t *instance,
+const uint8_t *buffer, size_t size);
+
+/*
+TRICAL_fixed_init:
+Initializes the fixed-point instance `instance`, with the same defaults as
+TRICAL_init. Must be called prior to any other TRICAL_fixed procedures taking
+`instance` as a parameter.
+*/
+void TRICAL_fixed_init(TRICAL_fixed_instance_t *instance);
+
+/*
+TRICAL_fixed_reset:
+Resets the state and state covariance of `instance`.
+*/
+void TRICAL_fixed_reset(TRICAL_fixed_instance_t *instance);
+
+/*
+TRICAL_fixed_norm_set:
+Sets the expected field norm (magnitude) of `instance` to `norm`, which must
+be greater than zero and less than 2.0.
+*/
+void TRICAL_fixed_norm_set(TRICAL_fixed_instance_t *instance,
+TRICAL_fixed_t norm);
+
+/*
+TRICAL_fixed_norm_get:
+Returns the expected field norm (magnitude) of `instance`.
+*/
+TRICAL_fixed_t TRICAL_fixed_norm_get(const TRICAL_fixed_instance_t *instance);
+
+/*
+TRICAL_fixed_noise_set:
+Sets the standard deviation in measurement supplied to `instance` to `noise`.
+*/
+void TRICAL_fixed_noise_set(TRICAL_fixed_instance_t *instance,
+TRICAL_fixed_t noise);
+
+/*
+TRICAL_fixed_noise_get:
+Returns the standard deviation in measurements supplied to `instance`.
+*/
+TRICAL_fixed_t TRICAL_fixed_noise_get(const TRICAL_fixed_instance_t *instance);
+
+/*
+TRICAL_fixed_measurement_count_get:
+Returns the number of measurements previously provided to `instance` via
+TRICAL_fixed_estimate_update.
+*/
+unsigned int TRICAL_fixed_measurement_count_get(
+const TRICAL_fixed_instance_t *instance);
+
+/*
+TRICAL_fixed_estimate_update:
+Updates the calibration estimate of `instance` based on the new data in
+`measurement`, and the current field direction estimate `reference_field`,
+in the same way as TRICAL_estimate_update for an instance in square-root
+mode.
+*/
+void TRICAL_fixed_estimate_update(TRICAL_fixed_instance_t *instance,
+const TRICAL_fixed_t measurement[3], const TRICAL_fixed_t reference_field[3]);
+
+/*
+TRICAL_fixed_estimate_get:
+Copies the calibration bias and scale estimates of `instance` to
+`bias_estimate` and `scale_estimate` respectively, as for
+TRICAL_estimate_get.
+*/
+void TRICAL_fixed_estimate_get(const TRICAL_fixed_instance_t *instance,
+TRICAL_fixed_t bias_estimate[3], TRICAL_fixed_t scale_estimate[9]);
+
+/*
+TRICAL_fixed_measurement_calibrate:
+Calibrates `measurement` based on the current calibration estimates of
+`instance`, and copies the result to `calibrated_measurement`. The
+`measurement` and `calibrated_measurement` parameters may be pointers to the
+same vector.
+*/
+void TRICAL_fixed_measurement_calibrate(
+const TRICAL_fixed_instance_t *instance, const TRICAL_fixed_t measurement[3],
+TRICAL_fixed_t calibrated_measurement[3]);
 
 #ifdef __cplusplus
 }
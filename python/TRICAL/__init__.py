@@ -33,12 +33,43 @@ convenient interface for tests than anything else.
 If run directly (i.e. `python -m TRICAL`), we read expect comma-separated
 readings on stdin (3 values per line, ending with \\n), and write calibrated
 values on stdout in the same format.
+
+The structure definitions below assume the library was built with the
+default options (full 12-state model, unpacked covariance).
 """
 
 
+# Must match TRICAL_STATE_DIM in TRICAL.h
+_STATE_DIM = 12
+
+# Must match TRICAL_COVERAGE_BINS in TRICAL.h
+_COVERAGE_BINS = 24
+
+# Results of Instance.update (TRICAL_status_t in TRICAL.h)
+STATUS_UPDATED = 0
+STATUS_SKIPPED = 1
+STATUS_REPAIRED = 2
+STATUS_REJECTED = 3
+
+
 _TRICAL = None
 
 
+class _Frozen(Structure):
+    _fields_ = [
+        ("bias", c_float * 3),
+        ("scale", c_float * 9)
+    ]
+
+
+class _Fit(Structure):
+    _fields_ = [
+        ("moments", c_double * 45),
+        ("terms", c_double * 9),
+        ("count", c_uint)
+    ]
+
+
 class _Instance(Structure):
     def __repr__(self):
         fields = {
@@ -46,7 +77,19 @@ class _Instance(Structure):
             "measurement_noise": self.measurement_noise,
             "state": tuple(self.state),
             "state_covariance": tuple(self.state_covariance),
-            "measurement_count": self.measurement_count
+            "measurement_count": self.measurement_count,
+            "square_root": self.square_root,
+            "process_noise": self.process_noise,
+            "forgetting": self.forgetting,
+            "field": tuple(self.field),
+            "field_fixed": self.field_fixed,
+            "gate_innovation": self.gate_innovation,
+            "gate_trace": self.gate_trace,
+            "gate_outlier": self.gate_outlier,
+            "coverage_limit": self.coverage_limit,
+            "coverage": tuple(self.coverage),
+            "skipped_count": self.skipped_count,
+            "repair_count": self.repair_count
         }
         return str(fields)
 
@@ -60,17 +103,37 @@ def _init():
 
     global _TRICAL
 
-    # TODO: search properly
-    lib = os.path.join(os.path.dirname(__file__), "libTRICAL.dylib")
+    # Look for the library built by setup.py alongside this file
+    if sys.platform.startswith("win"):
+        lib_name = "TRICAL.dll"
+    elif sys.platform == "darwin":
+        lib_name = "libTRICAL.dylib"
+    else:
+        lib_name = "libTRICAL.so"
+    lib = os.path.join(os.path.dirname(__file__), lib_name)
     _TRICAL = cdll.LoadLibrary(lib)
 
     # Set up the _Instance structure based on the definition in TRICAL.h
     _Instance._fields_ = [
         ("field_norm", c_float),
         ("measurement_noise", c_float),
-        ("state", c_float * 9),
-        ("state_covariance", c_float * 9 * 9),
-        ("measurement_count", c_uint)
+        ("state", c_float * _STATE_DIM),
+        ("state_covariance", c_float * _STATE_DIM * _STATE_DIM),
+        ("measurement_count", c_uint),
+        ("square_root", c_uint),
+        ("process_noise", c_float),
+        ("forgetting", c_float),
+        ("field", c_float * 3),
+        ("field_fixed", c_uint),
+        ("gate_innovation", c_float),
+        ("gate_trace", c_float),
+        ("gate_outlier", c_float),
+        ("coverage_limit", c_uint),
+        ("coverage", c_ushort * _COVERAGE_BINS),
+        ("skipped_count", c_uint),
+        ("repair_count", c_uint),
+        ("published", c_void_p),
+        ("queue", c_void_p)
     ]
 
     _TRICAL.TRICAL_init.argtypes = [POINTER(_Instance)]
@@ -91,9 +154,61 @@ def _init():
     _TRICAL.TRICAL_measurement_count_get.argtypes = [POINTER(_Instance)]
     _TRICAL.TRICAL_measurement_count_get.restype = c_uint
 
+    _TRICAL.TRICAL_process_noise_set.argtypes = [POINTER(_Instance),
+                                                 c_float]
+    _TRICAL.TRICAL_process_noise_set.restype = None
+
+    _TRICAL.TRICAL_forgetting_set.argtypes = [POINTER(_Instance), c_float]
+    _TRICAL.TRICAL_forgetting_set.restype = None
+
+    _TRICAL.TRICAL_gate_set.argtypes = [POINTER(_Instance), c_float, c_float]
+    _TRICAL.TRICAL_gate_set.restype = None
+
+    _TRICAL.TRICAL_outlier_gate_set.argtypes = [POINTER(_Instance), c_float]
+    _TRICAL.TRICAL_outlier_gate_set.restype = None
+
+    _TRICAL.TRICAL_coverage_limit_set.argtypes = [POINTER(_Instance), c_uint]
+    _TRICAL.TRICAL_coverage_limit_set.restype = None
+
+    _TRICAL.TRICAL_coverage_get.argtypes = [POINTER(_Instance)]
+    _TRICAL.TRICAL_coverage_get.restype = c_float
+
+    _TRICAL.TRICAL_skipped_count_get.argtypes = [POINTER(_Instance)]
+    _TRICAL.TRICAL_skipped_count_get.restype = c_uint
+
+    _TRICAL.TRICAL_repair_count_get.argtypes = [POINTER(_Instance)]
+    _TRICAL.TRICAL_repair_count_get.restype = c_uint
+
     _TRICAL.TRICAL_estimate_update.argtypes = [POINTER(_Instance),
+                                               POINTER(c_float * 3),
                                                POINTER(c_float * 3)]
-    _TRICAL.TRICAL_estimate_update.restype = None
+    _TRICAL.TRICAL_estimate_update.restype = c_int
+
+    # The bulk entry points take raw buffer pointers, so NumPy arrays can be
+    # passed without copying
+    _TRICAL.TRICAL_estimate_update_batch.argtypes = [POINTER(_Instance),
+                                                     c_void_p, c_uint,
+                                                     c_void_p, c_uint,
+                                                     c_uint]
+    _TRICAL.TRICAL_estimate_update_batch.restype = None
+
+    _TRICAL.TRICAL_fit_init.argtypes = [POINTER(_Fit)]
+    _TRICAL.TRICAL_fit_init.restype = None
+
+    _TRICAL.TRICAL_fit_add_many.argtypes = [POINTER(_Fit), c_void_p, c_uint,
+                                            c_uint]
+    _TRICAL.TRICAL_fit_add_many.restype = None
+
+    _TRICAL.TRICAL_fit_seed.argtypes = [POINTER(_Fit), POINTER(_Instance)]
+    _TRICAL.TRICAL_fit_seed.restype = c_uint
+
+    _TRICAL.TRICAL_frozen_get.argtypes = [POINTER(_Instance),
+                                          POINTER(_Frozen)]
+    _TRICAL.TRICAL_frozen_get.restype = None
+
+    _TRICAL.TRICAL_calibrate_many.argtypes = [POINTER(_Frozen), c_void_p,
+                                              c_void_p, c_uint]
+    _TRICAL.TRICAL_calibrate_many.restype = None
 
     _TRICAL.TRICAL_estimate_get.argtypes = [POINTER(_Instance),
                                             POINTER(c_float * 3),
@@ -145,17 +260,157 @@ class Instance(object):
         self.bias = (0.0, 0.0, 0.0)
         self.scale = (0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0)
         self.measurement_count = 0
+        self.skipped_count = 0
+        self.repair_count = 0
+
+    def process_noise(self, noise):
+        """
+        Add `noise` to the variance of each state before every update, so the
+        estimate keeps adapting if the calibration changes over time (e.g.
+        after a payload change). The default is 0.0.
+        """
+        if noise < 0.0:
+            raise ValueError("Process noise must be >= 0.0 (got %f)" % noise)
+
+        _TRICAL.TRICAL_process_noise_set(self._instance, noise)
+
+    def forgetting(self, factor):
+        """
+        Divide the state covariance by `factor` before every update, so the
+        weight of older readings decays exponentially. The default of 1.0
+        disables forgetting.
+        """
+        if factor <= 0.0 or factor > 1.0:
+            raise ValueError("Forgetting factor must be in (0.0, 1.0] "
+                             "(got %f)" % factor)
+
+        _TRICAL.TRICAL_forgetting_set(self._instance, factor)
+
+    def gate(self, innovation_threshold, trace_threshold):
+        """
+        Skip the filter update for readings whose innovation (in units of the
+        measurement noise) is below `innovation_threshold`, while the state
+        covariance trace is below `trace_threshold`, unless they add a new
+        direction to the calibration coverage. An `innovation_threshold` of 0
+        disables gating.
+        """
+        if innovation_threshold < 0.0 or trace_threshold < 0.0:
+            raise ValueError("Gate thresholds must be >= 0.0")
+
+        _TRICAL.TRICAL_gate_set(self._instance, innovation_threshold,
+                                trace_threshold)
+
+    def outlier_gate(self, threshold):
+        """
+        Reject readings whose squared innovation exceeds `threshold` times
+        its variance (a chi-square test with one degree of freedom, so 9 is
+        about three standard deviations), e.g. during a transient magnetic
+        disturbance. A `threshold` of 0 disables the gate.
+        """
+        if threshold < 0.0:
+            raise ValueError("Outlier gate threshold must be >= 0.0")
+
+        _TRICAL.TRICAL_outlier_gate_set(self._instance, threshold)
+
+    def coverage_limit(self, limit):
+        """
+        Use at most `limit` readings from each direction bin; further
+        readings in the same direction are skipped. A `limit` of 0 disables
+        the limit.
+        """
+        if limit < 0:
+            raise ValueError("Coverage limit must be >= 0")
+
+        _TRICAL.TRICAL_coverage_limit_set(self._instance, limit)
+
+    @property
+    def coverage(self):
+        """
+        Fraction (0.0-1.0) of the direction bins covered by the readings used
+        so far.
+        """
+        return _TRICAL.TRICAL_coverage_get(self._instance)
 
     def update(self, measurement):
         """
-        Update the calibration estimate based on a new measurement.
+        Update the calibration estimate based on a new measurement. The
+        measurement is also used as the reference field direction.
+
+        Returns one of the STATUS_ constants: whether the measurement was
+        used, skipped by the update gate, used after repairing the filter's
+        covariance, or rejected (see TRICAL_status_t in TRICAL.h).
         """
         if not measurement or len(measurement) != 3:
             raise ValueError("Measurement must be a sequence with 3 items")
 
-        _TRICAL.TRICAL_estimate_update(self._instance,
-                                       (c_float * 3)(*measurement))
+        m = (c_float * 3)(*measurement)
+        status = _TRICAL.TRICAL_estimate_update(self._instance, m, m)
+        self._update_estimate()
+        return status
+
+    def update_many(self, measurements, fields=None):
+        """
+        Update the calibration estimate based on an N x 3 NumPy array of
+        measurements, equivalent to (but much faster than) calling `update`
+        for each row.
+
+        If `fields` is supplied, it's either an N x 3 array of reference field
+        directions (one per measurement) or a single 3-element reference
+        field direction used for all measurements; otherwise, each
+        measurement is used as its own reference field direction.
+
+        float32 arrays whose rows are contiguous (including row slices of
+        wider arrays) are passed straight to the library without copying.
+        """
+        measurements, measurement_stride = _float32_rows(measurements)
+        count = measurements.shape[0]
+
+        if fields is None:
+            fields, field_stride = measurements, measurement_stride
+        else:
+            fields = _numpy().asarray(fields)
+            if fields.shape == (3, ):
+                fields = _numpy().ascontiguousarray(fields, dtype="float32")
+                field_stride = 0
+            else:
+                fields, field_stride = _float32_rows(fields)
+                if fields.shape[0] != count:
+                    raise ValueError("Fields must have one row per "
+                                     "measurement")
+
+        if count:
+            _TRICAL.TRICAL_estimate_update_batch(
+                self._instance, measurements.ctypes.data, measurement_stride,
+                fields.ctypes.data, field_stride, count)
+
+        self._update_estimate()
+
+    def seed(self, measurements):
+        """
+        Replace the calibration estimate with a batch least-squares ellipsoid
+        fit of an N x 3 NumPy array of measurements, which is much faster
+        than filtering them with `update_many` and can be refined by further
+        updates. Raises ValueError if the measurements don't determine an
+        ellipsoid.
+        """
+        measurements, measurement_stride = _float32_rows(measurements)
+
+        fit = _Fit()
+        _TRICAL.TRICAL_fit_init(fit)
+        if measurements.shape[0]:
+            _TRICAL.TRICAL_fit_add_many(fit, measurements.ctypes.data,
+                                        measurement_stride,
+                                        measurements.shape[0])
+
+        if not _TRICAL.TRICAL_fit_seed(fit, self._instance):
+            raise ValueError("Measurements don't determine an ellipsoid")
 
+        self._update_estimate()
+
+    def _update_estimate(self):
+        """
+        Copy the current calibration estimate to the Python attributes.
+        """
         bias = (c_float * 3)()
         scale = (c_float * 9)()
 
@@ -164,6 +419,8 @@ class Instance(object):
         self.scale = tuple(scale[0:9])
         self.measurement_count = \
             _TRICAL.TRICAL_measurement_count_get(self._instance)
+        self.skipped_count = _TRICAL.TRICAL_skipped_count_get(self._instance)
+        self.repair_count = _TRICAL.TRICAL_repair_count_get(self._instance)
 
     def calibrate(self, measurement):
         """
@@ -180,6 +437,55 @@ class Instance(object):
 
         return tuple(calibrated_measurement[0:3])
 
+    def calibrate_many(self, measurements):
+        """
+        Given an N x 3 NumPy array of measurements, return an N x 3 float32
+        array of measurements calibrated with the current calibration
+        estimate.
+        """
+        np = _numpy()
+        measurements = np.ascontiguousarray(measurements, dtype="float32")
+        if measurements.ndim != 2 or measurements.shape[1] != 3:
+            raise ValueError("Measurements must be an N x 3 array")
+
+        frozen = _Frozen()
+        _TRICAL.TRICAL_frozen_get(self._instance, frozen)
+
+        calibrated = np.empty(measurements.shape, dtype="float32")
+        if measurements.shape[0]:
+            _TRICAL.TRICAL_calibrate_many(frozen, measurements.ctypes.data,
+                                          calibrated.ctypes.data,
+                                          measurements.shape[0])
+
+        return calibrated
+
+
+def _numpy():
+    """
+    Import NumPy on demand, so the rest of the module works without it.
+    """
+    import numpy
+    return numpy
+
+
+def _float32_rows(a):
+    """
+    Return an N x 3 float32 array with the same contents as `a`, along with
+    its row stride in floats. `a` is returned as-is if each row's 3 values
+    are contiguous and the rows are evenly spaced; otherwise it's copied.
+    """
+    np = _numpy()
+    a = np.asarray(a)
+    if a.ndim != 2 or a.shape[1] != 3:
+        raise ValueError("Measurements must be an N x 3 array")
+
+    itemsize = np.dtype("float32").itemsize
+    if a.dtype != np.float32 or a.strides[1] != itemsize or \
+            a.strides[0] < 3 * itemsize or a.strides[0] % itemsize:
+        a = np.ascontiguousarray(a, dtype="float32")
+
+    return a, a.strides[0] // itemsize
+
 
 def _squared_norm(v):
     return v[0] * v[0] + v[1] * v[1] + v[2] * v[2]
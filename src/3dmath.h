@@ -125,7 +125,7 @@ static inline double recip(double b) {
 
 #endif
 
-static void matrix_cholesky_decomp_scale_f(unsigned int dim, float L[],
+static inline void matrix_cholesky_decomp_scale_f(unsigned int dim, float L[],
 const float A[], const float mul) {
     assert(L && A && dim);
     _nassert((size_t)L % 8 == 0);
@@ -155,6 +155,240 @@ const float A[], const float mul) {
     }
 }
 
+/*
+Same as matrix_cholesky_decomp_scale_f, but reads the lower triangle of `A`
+from packed storage (column by column, so element (i, j), i >= j, is at
+A[i + j * (2 * dim - j - 1) / 2]). The output `L` is a full column-major
+matrix as usual.
+*/
+static inline void matrix_cholesky_decomp_scale_packed_f(unsigned int dim,
+float L[], const float A[], const float mul) {
+    assert(L && A && dim);
+    _nassert((size_t)L % 8 == 0);
+    _nassert((size_t)A % 8 == 0);
+
+    unsigned int i, j, kn, in, jn, jp;
+    for (i = 0, in = 0; i < dim; i++, in += dim) {
+        L[i + 0] = (i == 0) ? fsqrt(A[0]*mul) : recip(L[0]) * (A[i]*mul);
+
+        for (j = 1, jn = dim, jp = dim - 1; j <= i;
+                jp += dim - j - 1, j++, jn += dim) {
+            float s = 0;
+            #pragma MUST_ITERATE(1,11)
+            for (kn = 0; kn < j*dim; kn += dim) {
+                s += L[i + kn] * L[j + kn];
+            }
+
+            L[i + jn] = (i == j) ? fsqrt(A[i + jp]*mul - s) :
+                recip(L[j + jn]) * (A[i + jp]*mul - s);
+        }
+    }
+}
+
+/*
+Rank-1 downdate of the lower-triangular Cholesky factor `L` (column-major, as
+output by matrix_cholesky_decomp_scale_f), such that on exit
+L * Lt = (L * Lt)_prev - x * xt. The contents of `x` are destroyed.
+
+If the downdated matrix would not be positive definite, the affected pivots
+are clamped to a small fraction of their previous value rather than being
+allowed to go to zero or NaN.
+*/
+static inline void matrix_cholesky_downdate_f(unsigned int dim, float L[],
+float x[]) {
+    assert(L && x && dim);
+    _nassert((size_t)L % 8 == 0);
+
+    /*
+    12x12:
+    264 mult
+    24 recip
+    12 sqrt
+    */
+
+    unsigned int i, k, kn;
+    float r2, r, c, s, inv_lkk, inv_c, l_kk_2;
+    for (k = 0, kn = 0; k < dim; k++, kn += dim) {
+        l_kk_2 = L[k + kn] * L[k + kn];
+        r2 = l_kk_2 - x[k] * x[k];
+
+        /* Don't let the pivot reach zero */
+        if (r2 < l_kk_2 * FLT_EPSILON) {
+            r2 = l_kk_2 * FLT_EPSILON;
+        }
+
+        r = fsqrt(r2);
+        inv_lkk = recip(L[k + kn]);
+        c = r * inv_lkk;
+        s = x[k] * inv_lkk;
+        inv_c = recip(c);
+        L[k + kn] = r;
+
+        #pragma MUST_ITERATE(0,11)
+        for (i = k + 1; i < dim; i++) {
+            L[i + kn] = (L[i + kn] - s * x[i]) * inv_c;
+            x[i] = c * x[i] - s * L[i + kn];
+        }
+    }
+}
+
+/*
+Same as matrix_cholesky_downdate_f, but with `L` in packed storage (as for
+matrix_cholesky_decomp_scale_packed_f).
+*/
+static inline void matrix_cholesky_downdate_packed_f(unsigned int dim,
+float L[], float x[]) {
+    assert(L && x && dim);
+    _nassert((size_t)L % 8 == 0);
+
+    unsigned int i, k, kp;
+    float r2, r, c, s, inv_lkk, inv_c, l_kk_2;
+    for (k = 0, kp = 0; k < dim; kp += dim - k - 1, k++) {
+        l_kk_2 = L[k + kp] * L[k + kp];
+        r2 = l_kk_2 - x[k] * x[k];
+
+        /* Don't let the pivot reach zero */
+        if (r2 < l_kk_2 * FLT_EPSILON) {
+            r2 = l_kk_2 * FLT_EPSILON;
+        }
+
+        r = fsqrt(r2);
+        inv_lkk = recip(L[k + kp]);
+        c = r * inv_lkk;
+        s = x[k] * inv_lkk;
+        inv_c = recip(c);
+        L[k + kp] = r;
+
+        #pragma MUST_ITERATE(0,11)
+        for (i = k + 1; i < dim; i++) {
+            L[i + kp] = (L[i + kp] - s * x[i]) * inv_c;
+            x[i] = c * x[i] - s * L[i + kp];
+        }
+    }
+}
+
+/*
+Double-precision versions of the Cholesky routines above, used for the state
+covariance when TRICAL_DOUBLE_COVARIANCE is defined.
+*/
+#ifdef __TI_COMPILER_VERSION__
+#define fsqrt_d(a) fsqrt((a))
+#define recip_d(a) recip((a))
+#else
+#define fsqrt_d(a) sqrt((a))
+#define recip_d(a) (1.0 / (a))
+#endif
+
+static inline void matrix_cholesky_decomp_scale_d(unsigned int dim, double L[],
+const double A[], const double mul) {
+    assert(L && A && dim);
+    _nassert((size_t)L % 8 == 0);
+    _nassert((size_t)A % 8 == 0);
+
+    unsigned int i, j, kn, in, jn;
+    for (i = 0, in = 0; i < dim; i++, in += dim) {
+        L[i + 0] = (i == 0) ? fsqrt_d(A[i + in]*mul) :
+            recip_d(L[0]) * (A[i]*mul);
+
+        for (j = 1, jn = dim; j <= i; j++, jn += dim) {
+            double s = 0;
+            #pragma MUST_ITERATE(1,9)
+            for (kn = 0; kn < j*dim; kn += dim) {
+                s += L[i + kn] * L[j + kn];
+            }
+
+            L[i + jn] = (i == j) ? fsqrt_d(A[i + in]*mul - s) :
+                recip_d(L[j + jn]) * (A[i + jn]*mul - s);
+        }
+    }
+}
+
+static inline void matrix_cholesky_decomp_scale_packed_d(unsigned int dim,
+double L[], const double A[], const double mul) {
+    assert(L && A && dim);
+    _nassert((size_t)L % 8 == 0);
+    _nassert((size_t)A % 8 == 0);
+
+    unsigned int i, j, kn, in, jn, jp;
+    for (i = 0, in = 0; i < dim; i++, in += dim) {
+        L[i + 0] = (i == 0) ? fsqrt_d(A[0]*mul) : recip_d(L[0]) * (A[i]*mul);
+
+        for (j = 1, jn = dim, jp = dim - 1; j <= i;
+                jp += dim - j - 1, j++, jn += dim) {
+            double s = 0;
+            #pragma MUST_ITERATE(1,11)
+            for (kn = 0; kn < j*dim; kn += dim) {
+                s += L[i + kn] * L[j + kn];
+            }
+
+            L[i + jn] = (i == j) ? fsqrt_d(A[i + jp]*mul - s) :
+                recip_d(L[j + jn]) * (A[i + jp]*mul - s);
+        }
+    }
+}
+
+static inline void matrix_cholesky_downdate_d(unsigned int dim, double L[],
+double x[]) {
+    assert(L && x && dim);
+    _nassert((size_t)L % 8 == 0);
+
+    unsigned int i, k, kn;
+    double r2, r, c, s, inv_lkk, inv_c, l_kk_2;
+    for (k = 0, kn = 0; k < dim; k++, kn += dim) {
+        l_kk_2 = L[k + kn] * L[k + kn];
+        r2 = l_kk_2 - x[k] * x[k];
+
+        /* Don't let the pivot reach zero */
+        if (r2 < l_kk_2 * DBL_EPSILON) {
+            r2 = l_kk_2 * DBL_EPSILON;
+        }
+
+        r = fsqrt_d(r2);
+        inv_lkk = recip_d(L[k + kn]);
+        c = r * inv_lkk;
+        s = x[k] * inv_lkk;
+        inv_c = recip_d(c);
+        L[k + kn] = r;
+
+        #pragma MUST_ITERATE(0,11)
+        for (i = k + 1; i < dim; i++) {
+            L[i + kn] = (L[i + kn] - s * x[i]) * inv_c;
+            x[i] = c * x[i] - s * L[i + kn];
+        }
+    }
+}
+
+static inline void matrix_cholesky_downdate_packed_d(unsigned int dim,
+double L[], double x[]) {
+    assert(L && x && dim);
+    _nassert((size_t)L % 8 == 0);
+
+    unsigned int i, k, kp;
+    double r2, r, c, s, inv_lkk, inv_c, l_kk_2;
+    for (k = 0, kp = 0; k < dim; kp += dim - k - 1, k++) {
+        l_kk_2 = L[k + kp] * L[k + kp];
+        r2 = l_kk_2 - x[k] * x[k];
+
+        /* Don't let the pivot reach zero */
+        if (r2 < l_kk_2 * DBL_EPSILON) {
+            r2 = l_kk_2 * DBL_EPSILON;
+        }
+
+        r = fsqrt_d(r2);
+        inv_lkk = recip_d(L[k + kp]);
+        c = r * inv_lkk;
+        s = x[k] * inv_lkk;
+        inv_c = recip_d(c);
+        L[k + kp] = r;
+
+        #pragma MUST_ITERATE(0,11)
+        for (i = k + 1; i < dim; i++) {
+            L[i + kp] = (L[i + kp] - s * x[i]) * inv_c;
+            x[i] = c * x[i] - s * L[i + kp];
+        }
+    }
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -28,6 +28,30 @@ SOFTWARE.
 #include "TRICAL.h"
 #include "filter.h"
 
+/*
+_scale_from_state
+Expands the scale part of `state` (everything after the bias) into the full
+3x3 matrix `scale`, leaving any elements not in the calibration model at
+zero.
+*/
+static void _scale_from_state(const float state[TRICAL_STATE_DIM],
+float scale[9]);
+
+static void _scale_from_state(const float state[TRICAL_STATE_DIM],
+float scale[9]) {
+#if TRICAL_STATE_DIM == 12
+    memcpy(scale, &state[3], 9 * sizeof(float));
+#elif TRICAL_STATE_DIM == 6
+    memset(scale, 0, 9 * sizeof(float));
+    scale[0] = state[3];
+    scale[4] = state[4];
+    scale[8] = state[5];
+#else
+    (void)state;
+    memset(scale, 0, 9 * sizeof(float));
+#endif
+}
+
 /*
 TRICAL_init:
 Initializes `instance`. Must be called prior to any other TRICAL procedures
@@ -38,42 +62,38 @@ reset that instance to its default state.
 */
 void TRICAL_init(TRICAL_instance_t *instance) {
     assert(instance);
+    assert(TRICAL_DIM_PLUS_LAMBDA > 0.0f);
 
     memset(instance, 0, sizeof(TRICAL_instance_t));
 
     instance->field_norm = 1.0f;
     instance->measurement_noise = 1e-6f;
+    instance->forgetting = 1.0f;
+
+    TRICAL_stats_reset(instance);
 
     /*
     Set the state covariance diagonal to a small value, so that we can run the
     Cholesky decomposition without blowing up
     */
     unsigned int i;
-    for (i = 0; i < TRICAL_STATE_DIM * TRICAL_STATE_DIM;
-            i += (TRICAL_STATE_DIM + 1)) {
-        instance->state_covariance[i] = 1e-2f;
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        instance->state_covariance[TRICAL_COVARIANCE_INDEX(i, i)] = 1e-2f;
     }
 }
 
 /*
 TRICAL_reset:
-Resets the state and state covariance of `instance`.
+Resets the state, state covariance and direction coverage of `instance`.
 */
 void TRICAL_reset(TRICAL_instance_t *instance) {
     assert(instance);
 
     memset(instance->state, 0, sizeof(instance->state));
-    memset(instance->state_covariance, 0, sizeof(instance->state_covariance));
+    memset(instance->coverage, 0, sizeof(instance->coverage));
+    _trical_covariance_reset(instance);
 
-    /*
-    Set the state covariance diagonal to a small value, so that we can run the
-    Cholesky decomposition without blowing up
-    */
-    unsigned int i;
-    for (i = 0; i < TRICAL_STATE_DIM * TRICAL_STATE_DIM;
-            i += (TRICAL_STATE_DIM + 1)) {
-        instance->state_covariance[i] = 1e-2f;
-    }
+    _trical_publish(instance);
 }
 
 /*
@@ -91,7 +111,7 @@ void TRICAL_norm_set(TRICAL_instance_t *instance, float norm) {
 TRICAL_norm_get:
 Returns the expected field norm (magnitude) of `instance`.
 */
-float TRICAL_norm_get(TRICAL_instance_t *instance) {
+float TRICAL_norm_get(const TRICAL_instance_t *instance) {
     assert(instance);
 
     return instance->field_norm;
@@ -112,37 +132,394 @@ void TRICAL_noise_set(TRICAL_instance_t *instance, float noise) {
 TRICAL_noise_get:
 Returns the standard deviation in measurements supplied to `instance`.
 */
-float TRICAL_noise_get(TRICAL_instance_t *instance) {
+float TRICAL_noise_get(const TRICAL_instance_t *instance) {
     assert(instance);
 
     return instance->measurement_noise;
 }
 
+/*
+TRICAL_square_root_set:
+Enables (if `enabled` is non-zero) or disables square-root filtering for
+`instance`. In square-root mode the instance stores the Cholesky factor of the
+state covariance instead of the covariance itself, and updates it with a
+rank-1 downdate after each measurement instead of re-factorizing the whole
+covariance matrix.
+
+The current state covariance is converted in-place, so this can be called at
+any time without losing the calibration estimate.
+*/
+void TRICAL_square_root_set(TRICAL_instance_t *instance,
+unsigned int enabled) {
+    assert(instance);
+
+    enabled = enabled ? 1u : 0u;
+    if (enabled == instance->square_root) {
+        return;
+    }
+
+    if (enabled) {
+        _trical_covariance_to_sqrt(instance->state_covariance);
+    } else {
+        _trical_covariance_from_sqrt(instance->state_covariance);
+    }
+
+    instance->square_root = enabled;
+}
+
+/*
+TRICAL_square_root_get:
+Returns non-zero if `instance` is in square-root mode.
+*/
+unsigned int TRICAL_square_root_get(const TRICAL_instance_t *instance) {
+    assert(instance);
+
+    return instance->square_root;
+}
+
+/*
+TRICAL_process_noise_set:
+Sets the variance added to each element of the state of `instance` before
+each update. In square-root mode it's added to the squares of the diagonal
+elements of the Cholesky factor, which adds exactly `noise` to each state
+variance (but also scales up the covariances between the states slightly)
+without needing a full Cholesky update.
+*/
+void TRICAL_process_noise_set(TRICAL_instance_t *instance, float noise) {
+    assert(instance);
+    assert(noise >= 0.0f);
+
+    instance->process_noise = noise;
+}
+
+/*
+TRICAL_process_noise_get:
+Returns the process noise variance of `instance`.
+*/
+float TRICAL_process_noise_get(const TRICAL_instance_t *instance) {
+    assert(instance);
+
+    return instance->process_noise;
+}
+
+/*
+TRICAL_forgetting_set:
+Sets the forgetting factor of `instance` to `factor`. The state covariance (or
+in square-root mode, its Cholesky factor) is scaled up by 1 / `factor` (or its
+square root) before each update.
+*/
+void TRICAL_forgetting_set(TRICAL_instance_t *instance, float factor) {
+    assert(instance);
+    assert(factor > FLT_EPSILON && factor <= 1.0f);
+
+    instance->forgetting = factor;
+}
+
+/*
+TRICAL_forgetting_get:
+Returns the forgetting factor of `instance`.
+*/
+float TRICAL_forgetting_get(const TRICAL_instance_t *instance) {
+    assert(instance);
+
+    return instance->forgetting;
+}
+
+/*
+TRICAL_field_set:
+Sets (or with a NULL `field`, clears) the fixed reference field direction of
+`instance`. The field is stored normalized.
+*/
+void TRICAL_field_set(TRICAL_instance_t *instance, const float field[3]) {
+    assert(instance);
+
+    if (!field) {
+        memset(instance->field, 0, sizeof(instance->field));
+        instance->field_fixed = 0;
+        return;
+    }
+
+    float norm = (float)sqrt(field[0] * field[0] + field[1] * field[1] +
+                             field[2] * field[2]);
+    assert(norm > FLT_EPSILON);
+
+    norm = 1.0f / norm;
+    instance->field[0] = field[0] * norm;
+    instance->field[1] = field[1] * norm;
+    instance->field[2] = field[2] * norm;
+    instance->field_fixed = 1u;
+}
+
+/*
+TRICAL_field_get:
+Copies the fixed reference field direction of `instance` to `field`, and
+returns non-zero if there is one.
+*/
+unsigned int TRICAL_field_get(const TRICAL_instance_t *instance,
+float field[3]) {
+    assert(instance);
+    assert(field);
+
+    if (instance->field_fixed) {
+        memcpy(field, instance->field, sizeof(instance->field));
+    }
+
+    return instance->field_fixed;
+}
+
+/*
+TRICAL_gate_set:
+Enables update gating for `instance`: a reading is only incorporated into the
+estimate if its normalized innovation exceeds `innovation_threshold`, the
+trace of the state covariance exceeds `trace_threshold`, or it adds a new
+direction bin to the coverage of the estimate. Set `innovation_threshold` to
+zero to disable gating.
+*/
+void TRICAL_gate_set(TRICAL_instance_t *instance, float innovation_threshold,
+float trace_threshold) {
+    assert(instance);
+    assert(innovation_threshold >= 0.0f);
+    assert(trace_threshold >= 0.0f);
+
+    instance->gate_innovation = innovation_threshold;
+    instance->gate_trace = trace_threshold;
+}
+
+/*
+TRICAL_outlier_gate_set:
+Enables the outlier gate for `instance`: a reading is rejected if its
+squared innovation exceeds `threshold` times the innovation variance. Set
+`threshold` to zero to disable the gate.
+*/
+void TRICAL_outlier_gate_set(TRICAL_instance_t *instance, float threshold) {
+    assert(instance);
+    assert(threshold >= 0.0f);
+
+    instance->gate_outlier = threshold;
+}
+
+/*
+TRICAL_coverage_limit_set:
+Limits the number of readings from each direction bin which are
+incorporated into the estimate of `instance` to `limit`; further readings in
+that direction are skipped. A `limit` of zero disables the limit.
+*/
+void TRICAL_coverage_limit_set(TRICAL_instance_t *instance,
+unsigned int limit) {
+    assert(instance);
+
+    instance->coverage_limit = limit;
+}
+
+/*
+TRICAL_coverage_get:
+Returns the fraction (0 to 1) of the TRICAL_COVERAGE_BINS direction bins
+which have contributed at least one reading to the estimate of `instance`
+since it was last reset.
+*/
+float TRICAL_coverage_get(const TRICAL_instance_t *instance) {
+    assert(instance);
+
+    unsigned int i, occupied = 0;
+    for (i = 0; i < TRICAL_COVERAGE_BINS; i++) {
+        if (instance->coverage[i]) {
+            occupied++;
+        }
+    }
+
+    return (float)occupied * (1.0f / (float)TRICAL_COVERAGE_BINS);
+}
+
 /*
 TRICAL_measurement_count_get:
 Returns the number of measurements previously provided to `instance` via
-TRICAL_estimate_update.
+TRICAL_estimate_update, excluding any skipped by the update gate.
 */
-unsigned int TRICAL_measurement_count_get(TRICAL_instance_t *instance) {
+unsigned int TRICAL_measurement_count_get(
+const TRICAL_instance_t *instance) {
     assert(instance);
 
     return instance->measurement_count;
 }
 
+/*
+TRICAL_skipped_count_get:
+Returns the number of measurements provided to `instance` via
+TRICAL_estimate_update which were skipped by the update gate, or rejected.
+*/
+unsigned int TRICAL_skipped_count_get(const TRICAL_instance_t *instance) {
+    assert(instance);
+
+    return instance->skipped_count;
+}
+
+/*
+TRICAL_repair_count_get:
+Returns the number of updates of `instance` which had to repair the state
+covariance before carrying on.
+*/
+unsigned int TRICAL_repair_count_get(const TRICAL_instance_t *instance) {
+    assert(instance);
+
+    return instance->repair_count;
+}
+
+/*
+TRICAL_stats_get:
+Copies the instrumentation counters of `instance` to `stats`. If the library
+was built without TRICAL_STATS, `stats` is zero-filled.
+*/
+void TRICAL_stats_get(const TRICAL_instance_t *instance,
+TRICAL_stats_t *stats) {
+    assert(instance);
+    assert(stats);
+
+#ifdef TRICAL_STATS
+    memcpy(stats, &instance->stats, sizeof(TRICAL_stats_t));
+#else
+    (void)instance;
+    memset(stats, 0, sizeof(TRICAL_stats_t));
+#endif
+}
+
+/*
+TRICAL_stats_reset:
+Resets the instrumentation counters of `instance`. Does nothing if the
+library was built without TRICAL_STATS.
+*/
+void TRICAL_stats_reset(TRICAL_instance_t *instance) {
+    assert(instance);
+
+#ifdef TRICAL_STATS
+    memset(&instance->stats, 0, sizeof(TRICAL_stats_t));
+    instance->stats.min_pivot = FLT_MAX;
+#else
+    (void)instance;
+#endif
+}
+
 /*
 TRICAL_estimate_update
 Updates the calibration estimate of `instance` based on the new data in
 `measurement`, and the current field direction estimate `reference_field`.
 Call this function with each reading you receive from your sensor.
+
+If a fixed field has been set with TRICAL_field_set, `reference_field` may be
+NULL to use it.
+
+Returns whether the reading was incorporated, skipped, rejected, or
+incorporated after repairing the state covariance (see TRICAL_status_t).
 */
-void TRICAL_estimate_update(TRICAL_instance_t *instance,
-float measurement[3], float reference_field[3]) {
+TRICAL_status_t TRICAL_estimate_update(TRICAL_instance_t *instance,
+const float measurement[3], const float reference_field[3]) {
+    return TRICAL_estimate_update_workspace(instance, NULL, measurement,
+                                            reference_field);
+}
+
+/*
+TRICAL_estimate_update_batch
+Updates the calibration estimate of `instance` based on `count` consecutive
+readings, equivalent to calling TRICAL_estimate_update on each one in turn.
+
+Reading `i` is read from `measurements[i * measurement_stride]`, and its
+field direction estimate from `reference_fields[i * reference_field_stride]`.
+Strides are in floats, so `float[count][3]` arrays have a stride of 3; a
+`reference_field_stride` of 0 uses the same field direction estimate for all
+readings. If a fixed field has been set with TRICAL_field_set,
+`reference_fields` may be NULL to use it for all readings.
+
+Use this when draining a sensor FIFO to avoid re-validating the arguments and
+re-initializing the filter working storage for each reading.
+*/
+void TRICAL_estimate_update_batch(TRICAL_instance_t *instance,
+const float measurements[], unsigned int measurement_stride,
+const float reference_fields[], unsigned int reference_field_stride,
+unsigned int count) {
+    TRICAL_estimate_update_batch_workspace(instance, NULL, measurements,
+                                           measurement_stride,
+                                           reference_fields,
+                                           reference_field_stride, count);
+}
+
+/*
+TRICAL_workspace_init
+Initializes `workspace`. Only the lower triangle of the Cholesky factor is
+written by each update, so the upper triangle has to start out zeroed.
+*/
+void TRICAL_workspace_init(TRICAL_workspace_t *workspace) {
+    assert(workspace);
+
+    memset(workspace, 0, sizeof(TRICAL_workspace_t));
+}
+
+/*
+TRICAL_estimate_update_workspace
+Same as TRICAL_estimate_update, but uses `workspace` instead of the stack for
+the filter working storage. TRICAL_estimate_update calls this with a NULL
+`workspace`.
+*/
+TRICAL_status_t TRICAL_estimate_update_workspace(TRICAL_instance_t *instance,
+TRICAL_workspace_t *workspace, const float measurement[3],
+const float reference_field[3]) {
     assert(instance);
     assert(measurement);
-    assert(reference_field);
+    assert(reference_field || instance->field_fixed);
+
+    TRICAL_status_t status;
+
+    if (!reference_field) {
+        reference_field = instance->field;
+    }
+
+    status = _trical_filter_iterate(instance, workspace, measurement,
+                                    reference_field);
+    if (status == TRICAL_STATUS_UPDATED ||
+            status == TRICAL_STATUS_REPAIRED) {
+        instance->measurement_count++;
+        _trical_publish(instance);
+    } else {
+        instance->skipped_count++;
+    }
 
-    _trical_filter_iterate(instance, measurement, reference_field);
-    instance->measurement_count++;
+    return status;
+}
+
+/*
+TRICAL_estimate_update_batch_workspace
+Same as TRICAL_estimate_update_batch, but uses `workspace` instead of the
+stack for the filter working storage. TRICAL_estimate_update_batch calls this
+with a NULL `workspace`.
+*/
+void TRICAL_estimate_update_batch_workspace(TRICAL_instance_t *instance,
+TRICAL_workspace_t *workspace, const float measurements[],
+unsigned int measurement_stride, const float reference_fields[],
+unsigned int reference_field_stride, unsigned int count) {
+    assert(instance);
+    assert(measurements || !count);
+    assert(reference_fields || instance->field_fixed || !count);
+    assert(measurement_stride >= 3 || count <= 1);
+
+    if (!count) {
+        return;
+    }
+
+    if (!reference_fields) {
+        reference_fields = instance->field;
+        reference_field_stride = 0;
+    }
+
+    unsigned int updated;
+    updated = _trical_filter_iterate_batch(instance, workspace, measurements,
+                                           measurement_stride,
+                                           reference_fields,
+                                           reference_field_stride, count);
+    instance->measurement_count += updated;
+    instance->skipped_count += count - updated;
+
+    /* Readers only see the estimate at the end of the batch */
+    if (updated) {
+        _trical_publish(instance);
+    }
 }
 
 /*
@@ -150,8 +527,11 @@ TRICAL_estimate_get
 Copies the calibration bias and scale esimates of `instance` to
 `bias_estimate` and `scale_estimate` respectively. A new calibration estimate
 will be available after every call to TRICAL_estimate_update.
+
+The scale estimate is always a full 3x3 matrix; elements which aren't part of
+the calibration model selected by TRICAL_STATE_DIM are set to zero.
 */
-void TRICAL_estimate_get(TRICAL_instance_t *restrict instance,
+void TRICAL_estimate_get(const TRICAL_instance_t *restrict instance,
 float bias_estimate[3], float scale_estimate[9]) {
     assert(instance);
     assert(bias_estimate);
@@ -162,7 +542,7 @@ float bias_estimate[3], float scale_estimate[9]) {
     memcpy(bias_estimate, instance->state, 3 * sizeof(float));
 
     /* Copy the scale estimate to the destination matrix */
-    memcpy(scale_estimate, &instance->state[3], 9 * sizeof(float));
+    _scale_from_state(instance->state, scale_estimate);
 }
 
 /*
@@ -170,7 +550,7 @@ TRICAL_estimate_get_ext
 Same as TRICAL_estimate_get, but additionally copies the bias and scale
 estimate variances to `bias_estimate_variance` and `scale_estimate_variance`.
 */
-void TRICAL_estimate_get_ext(TRICAL_instance_t *restrict instance,
+void TRICAL_estimate_get_ext(const TRICAL_instance_t *restrict instance,
 float bias_estimate[3], float scale_estimate[9],
 float bias_estimate_variance[3], float scale_estimate_variance[9]) {
     TRICAL_estimate_get(instance, bias_estimate, scale_estimate);
@@ -184,23 +564,46 @@ float bias_estimate_variance[3], float scale_estimate_variance[9]) {
     assert(scale_estimate != scale_estimate_variance);
     assert(bias_estimate_variance != scale_estimate_variance);
 
+    /*
+    In square-root mode, the variances have to be reconstructed from the
+    Cholesky factor first
+    */
+    float variance[TRICAL_STATE_DIM];
+    if (instance->square_root) {
+        _trical_covariance_diagonal_from_sqrt(instance->state_covariance,
+                                              variance);
+    } else {
+        unsigned int i;
+        for (i = 0; i < TRICAL_STATE_DIM; i++) {
+            variance[i] = (float)
+                instance->state_covariance[TRICAL_COVARIANCE_INDEX(i, i)];
+        }
+    }
+
     /* Copy bias estimate covariance from the state covariance diagonal */
-    bias_estimate_variance[0] = instance->state_covariance[0 * 12 + 0];
-    bias_estimate_variance[1] = instance->state_covariance[1 * 12 + 1];
-    bias_estimate_variance[2] = instance->state_covariance[2 * 12 + 2];
+    memcpy(bias_estimate_variance, variance, 3 * sizeof(float));
 
     /* Now copy scale estimate covariance. */
-    scale_estimate_variance[0] = instance->state_covariance[3 * 12 + 3];
-    scale_estimate_variance[1] = instance->state_covariance[4 * 12 + 4];
-    scale_estimate_variance[2] = instance->state_covariance[5 * 12 + 5];
+    _scale_from_state(variance, scale_estimate_variance);
+}
+
+/*
+TRICAL_frozen_get:
+Copies the current calibration estimate of `instance` to `frozen`. Later
+updates to `instance` don't affect `frozen`.
+*/
+void TRICAL_frozen_get(const TRICAL_instance_t *instance,
+TRICAL_frozen_t *frozen) {
+    assert(instance);
+    assert(frozen);
 
-    scale_estimate_variance[3] = instance->state_covariance[6 * 12 + 6];
-    scale_estimate_variance[4] = instance->state_covariance[7 * 12 + 7];
-    scale_estimate_variance[5] = instance->state_covariance[8 * 12 + 8];
+    memcpy(frozen->bias, instance->state, 3 * sizeof(float));
 
-    scale_estimate_variance[6] = instance->state_covariance[9 * 12 + 9];
-    scale_estimate_variance[7] = instance->state_covariance[10 * 12 + 10];
-    scale_estimate_variance[8] = instance->state_covariance[11 * 12 + 11];
+    /* Add the identity matrix to the scale estimate */
+    _scale_from_state(instance->state, frozen->scale);
+    frozen->scale[0] += 1.0f;
+    frozen->scale[4] += 1.0f;
+    frozen->scale[8] += 1.0f;
 }
 
 /*
@@ -212,8 +615,8 @@ copies the result to `calibrated_measurement`. The `measurement` and
 DO NOT pass the calibrated measurement into TRICAL_estimate_update, as it
 needs the raw measurement values to work.
 */
-void TRICAL_measurement_calibrate(TRICAL_instance_t *restrict instance,
-float measurement[3], float calibrated_measurement[3]) {
+void TRICAL_measurement_calibrate(const TRICAL_instance_t *restrict instance,
+const float measurement[3], float calibrated_measurement[3]) {
     assert(instance);
     assert(measurement);
     assert(calibrated_measurement);
@@ -0,0 +1,821 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <assert.h>
+#include <math.h>
+#include <float.h>
+#include <string.h>
+
+#include "TRICAL.h"
+#include "filter.h"
+#include "3dmath.h"
+#include "filter_simd.h"
+
+#if TRICAL_BANK_WIDTH % TRICAL_SIMD_WIDTH != 0
+#error "TRICAL_BANK_WIDTH must be a multiple of the target vector width"
+#endif
+
+#if TRICAL_BANK_WIDTH > 32
+#error "TRICAL_BANK_WIDTH must be no more than 32"
+#endif
+
+/*
+The bank filter is the same UKF as _trical_filter_iterate (see the notes at
+the top of filter.c), but every operation works on a vector holding the same
+quantity for TRICAL_SIMD_WIDTH different instances. Since the instances are
+independent, they can all step through the filter together without any
+shuffling between lanes. The only per-instance work is done on values
+stored out of the vectors: the checks an update has to pass (the pivots, the
+outlier gate and the finiteness of the result), and the factor of an
+instance in square-root mode, which is patched in and downdated one lane at
+a time.
+
+The scaled Cholesky factor of the state covariance is kept in packed form as
+well, so the upper triangle zeros are never touched.
+*/
+
+/* Mask of the bits of `active` covering one vector of instances */
+#define TRICAL_BANK_VECTOR_MASK ((1u << (TRICAL_SIMD_WIDTH - 1u)) * 2u - 1u)
+
+/*
+_trical_bank_step
+Runs one filter iteration for the TRICAL_SIMD_WIDTH instances of `bank`
+starting at `lane`. `measurement` and `field` are the readings for those
+instances in structure-of-arrays form, and bit `w` of `active` is set if
+instance `lane + w` should be updated.
+
+Returns a mask with bit `w` set for each instance which was updated. Any
+other instance is left unchanged: an active one has failed its outlier gate,
+would not have been finite after the update, or -- if its bit is set in
+`failed` -- has a state covariance which can't be factorized.
+*/
+static unsigned int _trical_bank_step(TRICAL_bank_t *restrict bank,
+unsigned int lane, const vfloat_t *restrict measurement,
+const vfloat_t *restrict field, unsigned int active,
+unsigned int *restrict failed);
+
+static unsigned int _trical_bank_step(TRICAL_bank_t *restrict bank,
+unsigned int lane, const vfloat_t *restrict measurement,
+const vfloat_t *restrict field, unsigned int active,
+unsigned int *restrict failed) {
+    unsigned int i, j, k, w, bit, finite, square_root, nonfinite, updated;
+    vfloat_t state[TRICAL_STATE_DIM], sigma[TRICAL_STATE_DIM],
+             cross_correlation[TRICAL_STATE_DIM],
+             covariance_llt[TRICAL_PACKED_COVARIANCE_DIM],
+             measurement_estimates[TRICAL_NUM_SIGMA], temp, inv, pivots;
+    float lanes[TRICAL_SIMD_WIDTH], innovations[TRICAL_SIMD_WIDTH],
+          covariances[TRICAL_SIMD_WIDTH], variances[TRICAL_SIMD_WIDTH],
+          checks[TRICAL_SIMD_WIDTH], pivot_checks[TRICAL_SIMD_WIDTH], value;
+
+    square_root = (bank->square_root >> lane) & TRICAL_BANK_VECTOR_MASK;
+    *failed = 0;
+
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        state[i] = vf_load(&bank->state[i][lane]);
+    }
+
+    /*
+    LLT decomposition on state covariance matrix, with result multiplied by
+    TRICAL_DIM_PLUS_LAMBDA. The reciprocals of the pivots are summed on the
+    way: the sum can only be finite if no pivot is negative or zero, so the
+    pivots themselves only need checking in lanes where it isn't.
+    */
+    pivots = vf_set1(0.0f);
+    if (square_root != TRICAL_BANK_VECTOR_MASK) {
+        inv = vf_set1(0.0f);
+        for (j = 0; j < TRICAL_STATE_DIM; j++) {
+            for (i = j; i < TRICAL_STATE_DIM; i++) {
+                temp = vf_mul(vf_load(&bank->state_covariance[
+                                          TRICAL_PACKED_INDEX(i, j)][lane]),
+                              vf_set1(TRICAL_DIM_PLUS_LAMBDA));
+
+                for (k = 0; k < j; k++) {
+                    temp = vf_sub(temp, vf_mul(
+                        covariance_llt[TRICAL_PACKED_INDEX(i, k)],
+                        covariance_llt[TRICAL_PACKED_INDEX(j, k)]));
+                }
+
+                if (i == j) {
+                    covariance_llt[TRICAL_PACKED_INDEX(j, j)] =
+                        vf_sqrt(temp);
+                    inv = vf_div(vf_set1(1.0f),
+                                 covariance_llt[TRICAL_PACKED_INDEX(j, j)]);
+                    pivots = vf_add(pivots, inv);
+                } else {
+                    covariance_llt[TRICAL_PACKED_INDEX(i, j)] =
+                        vf_mul(temp, inv);
+                }
+            }
+        }
+    }
+
+    /*
+    Instances in square-root mode already have the Cholesky factor, which
+    just needs scaling by sqrt(TRICAL_DIM_PLUS_LAMBDA); it replaces whatever
+    the factorization made of their lanes. Their factor is checked on the
+    way, as in _factorize.
+    */
+    if (square_root) {
+        value = fsqrt(TRICAL_DIM_PLUS_LAMBDA);
+        for (j = 0; j < TRICAL_STATE_DIM; j++) {
+            for (i = j; i < TRICAL_STATE_DIM; i++) {
+                k = TRICAL_PACKED_INDEX(i, j);
+                if (square_root != TRICAL_BANK_VECTOR_MASK) {
+                    vf_store(lanes, covariance_llt[k]);
+                }
+
+                for (w = 0; w < TRICAL_SIMD_WIDTH; w++) {
+                    if (!(square_root & (1u << w))) {
+                        continue;
+                    }
+
+                    lanes[w] = bank->state_covariance[k][lane + w] * value;
+                    if (i == j ? !(lanes[w] > 0.0f && lanes[w] <= FLT_MAX) :
+                                 !((float)fabs(lanes[w]) <= FLT_MAX)) {
+                        *failed |= 1u << w;
+                    }
+                }
+
+                covariance_llt[k] = vf_load(lanes);
+            }
+        }
+    }
+
+    /*
+    Generate the sigma points, and use them as the basis of the measurement
+    estimates. Column `i` of the Cholesky factor is zero above the diagonal,
+    so those elements of the sigma points are just the state.
+
+    The cross-correlation is accumulated in the same pass, from the
+    difference between the estimates of each pair of sigma points, as in
+    _trical_filter_iterate.
+    */
+    vfloat_t measurement_estimate_mean = vf_set1(0.0f);
+
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (j = 0; j < TRICAL_STATE_DIM; j++) {
+        cross_correlation[j] = vf_set1(0.0f);
+    }
+
+    measurement_estimates[0] = _trical_measurement_reduce_lanes(
+        state, measurement, field);
+
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        /* Positive sigma point */
+        for (k = 0; k < i; k++) {
+            sigma[k] = state[k];
+        }
+        for (k = i; k < TRICAL_STATE_DIM; k++) {
+            sigma[k] = vf_add(state[k],
+                              covariance_llt[TRICAL_PACKED_INDEX(k, i)]);
+        }
+        measurement_estimates[i + 1] = _trical_measurement_reduce_lanes(
+            sigma, measurement, field);
+
+        /* Negative sigma point */
+        for (k = i; k < TRICAL_STATE_DIM; k++) {
+            sigma[k] = vf_sub(state[k],
+                              covariance_llt[TRICAL_PACKED_INDEX(k, i)]);
+        }
+        measurement_estimates[i + 1 + TRICAL_STATE_DIM] =
+            _trical_measurement_reduce_lanes(sigma, measurement, field);
+
+        measurement_estimate_mean = vf_add(measurement_estimate_mean,
+            vf_add(measurement_estimates[i + 1],
+                   measurement_estimates[i + 1 + TRICAL_STATE_DIM]));
+
+        temp = vf_sub(measurement_estimates[i + 1],
+                      measurement_estimates[i + 1 + TRICAL_STATE_DIM]);
+        for (k = i; k < TRICAL_STATE_DIM; k++) {
+            cross_correlation[k] = vf_add(cross_correlation[k],
+                vf_mul(temp, covariance_llt[TRICAL_PACKED_INDEX(k, i)]));
+        }
+    }
+
+    measurement_estimate_mean = vf_add(
+        vf_mul(measurement_estimate_mean, vf_set1(TRICAL_SIGMA_WMI)),
+        vf_mul(measurement_estimates[0], vf_set1(TRICAL_SIGMA_WM0)));
+
+    /*
+    Convert estimates to deviation from mean, and calculate the measurement
+    estimate covariance
+    */
+    vfloat_t measurement_estimate_covariance = vf_set1(0.0f);
+
+    #pragma MUST_ITERATE(TRICAL_NUM_SIGMA, TRICAL_NUM_SIGMA);
+    for (i = 0; i < TRICAL_NUM_SIGMA; i++) {
+        measurement_estimates[i] = vf_sub(measurement_estimates[i],
+                                          measurement_estimate_mean);
+        measurement_estimate_covariance = vf_add(
+            measurement_estimate_covariance,
+            vf_mul(measurement_estimates[i], measurement_estimates[i]));
+    }
+
+    /*
+    The outlier gate's estimate of the innovation variance: weighted, and
+    without the central point, as in _trical_filter_iterate
+    */
+    temp = vf_load(&bank->measurement_noise[lane]);
+    temp = vf_mul(temp, temp);
+    vf_store(variances, vf_add(vf_mul(
+        vf_sub(measurement_estimate_covariance,
+               vf_mul(measurement_estimates[0], measurement_estimates[0])),
+        vf_set1(TRICAL_SIGMA_WCI)), temp));
+    measurement_estimate_covariance = vf_add(measurement_estimate_covariance,
+                                             temp);
+
+    vfloat_t innovation = vf_sub(vf_load(&bank->field_norm[lane]),
+                                 measurement_estimate_mean);
+
+    /*
+    Sum the magnitudes of everything the update uses: the sum is only finite
+    if all of them are, so the values need looking at one at a time only in
+    lanes where it isn't
+    */
+    temp = vf_abs(innovation);
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (j = 0; j < TRICAL_STATE_DIM; j++) {
+        cross_correlation[j] = vf_mul(cross_correlation[j],
+                                      vf_set1(TRICAL_SIGMA_WCI));
+        temp = vf_add(temp, vf_abs(cross_correlation[j]));
+    }
+
+    vf_store(checks, temp);
+    vf_store(pivot_checks, pivots);
+    vf_store(innovations, innovation);
+    vf_store(covariances, measurement_estimate_covariance);
+
+    /*
+    Check each instance's update as _trical_filter_iterate does. Every lane
+    is checked for finiteness, since a lane which isn't finite has to be
+    cleared rather than just masked out of the update.
+    */
+    updated = nonfinite = 0;
+    for (w = 0; w < TRICAL_SIMD_WIDTH; w++) {
+        bit = 1u << w;
+        finite = covariances[w] > 0.0f && covariances[w] <= FLT_MAX;
+
+        if (finite && !((float)fabs(checks[w]) <= FLT_MAX)) {
+            finite = (float)fabs(innovations[w]) <= FLT_MAX;
+            for (j = 0; j < TRICAL_STATE_DIM; j++) {
+                vf_store(lanes, cross_correlation[j]);
+                finite &= (float)fabs(lanes[w]) <= FLT_MAX;
+            }
+        }
+
+        if (!finite) {
+            nonfinite |= bit;
+        }
+
+        if (!(active & bit)) {
+            continue;
+        }
+
+        /* The pivots, exactly as in _factorize */
+        if (!(square_root & bit) &&
+                (!finite || !((float)fabs(pivot_checks[w]) <= FLT_MAX))) {
+            for (j = 0; j < TRICAL_STATE_DIM; j++) {
+                vf_store(lanes, covariance_llt[TRICAL_PACKED_INDEX(j, j)]);
+                if (!(lanes[w] > 0.0f && lanes[w] <= FLT_MAX)) {
+                    *failed |= bit;
+                }
+            }
+        }
+
+        value = bank->outlier_gate[lane + w];
+        if (!finite || (*failed & bit) || (value > 0.0f &&
+                innovations[w] * innovations[w] > value * variances[w])) {
+            continue;
+        }
+
+        updated |= bit;
+    }
+
+    /*
+    Lanes which aren't finite get a cross-correlation and innovation of zero,
+    so they stay exactly where they are rather than picking up NaNs; the rest
+    of the lanes which aren't updated just get a gain of zero.
+    */
+    if (nonfinite) {
+        for (w = 0; w < TRICAL_SIMD_WIDTH; w++) {
+            if (nonfinite & (1u << w)) {
+                innovations[w] = 0.0f;
+                covariances[w] = 1.0f;
+            }
+        }
+        innovation = vf_load(innovations);
+
+        for (j = 0; j < TRICAL_STATE_DIM; j++) {
+            vf_store(lanes, cross_correlation[j]);
+            for (w = 0; w < TRICAL_SIMD_WIDTH; w++) {
+                if (nonfinite & (1u << w)) {
+                    lanes[w] = 0.0f;
+                }
+            }
+            cross_correlation[j] = vf_load(lanes);
+        }
+    }
+
+    for (w = 0; w < TRICAL_SIMD_WIDTH; w++) {
+        lanes[w] = (updated & (1u << w)) ? 1.0f : 0.0f;
+        /* Reused below to leave square-root factors out of the update */
+        variances[w] = (square_root & (1u << w)) ? 0.0f : 1.0f;
+    }
+    inv = vf_mul(vf_div(vf_set1(1.0f), vf_load(covariances)),
+                 vf_load(lanes));
+
+    /*
+    Update the state and the state covariance, as in _trical_filter_iterate
+    */
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        temp = vf_mul(cross_correlation[i], inv);
+        vf_store(&bank->state[i][lane],
+                 vf_add(state[i], vf_mul(temp, innovation)));
+
+        if (square_root == TRICAL_BANK_VECTOR_MASK) {
+            continue;
+        } else if (square_root) {
+            temp = vf_mul(temp, vf_load(variances));
+        }
+
+        for (j = i; j < TRICAL_STATE_DIM; j++) {
+            float *covariance =
+                &bank->state_covariance[TRICAL_PACKED_INDEX(j, i)][lane];
+            vf_store(covariance, vf_sub(vf_load(covariance),
+                                        vf_mul(temp, cross_correlation[j])));
+        }
+    }
+
+    /*
+    The factor of an instance in square-root mode gets a rank-1 downdate by
+    cross correlation * sqrt(1 / measurement estimate covariance) instead
+    */
+    for (w = 0; w < TRICAL_SIMD_WIDTH; w++) {
+        if (!(updated & square_root & (1u << w))) {
+            continue;
+        }
+
+        float factor[TRICAL_PACKED_COVARIANCE_DIM], downdate[TRICAL_STATE_DIM];
+
+        value = sqrt_inv(covariances[w]);
+        for (j = 0; j < TRICAL_STATE_DIM; j++) {
+            vf_store(lanes, cross_correlation[j]);
+            downdate[j] = lanes[w] * value;
+        }
+        for (k = 0; k < TRICAL_PACKED_COVARIANCE_DIM; k++) {
+            factor[k] = bank->state_covariance[k][lane + w];
+        }
+
+        matrix_cholesky_downdate_packed_f(TRICAL_STATE_DIM, factor, downdate);
+
+        for (k = 0; k < TRICAL_PACKED_COVARIANCE_DIM; k++) {
+            bank->state_covariance[k][lane + w] = factor[k];
+        }
+    }
+
+    return updated;
+}
+
+/*
+_trical_bank_lane_reset
+Sets slot `index` of `bank` to the same default state as TRICAL_init.
+*/
+static void _trical_bank_lane_reset(TRICAL_bank_t *restrict bank,
+unsigned int index);
+
+static void _trical_bank_lane_reset(TRICAL_bank_t *restrict bank,
+unsigned int index) {
+    unsigned int i, j;
+
+    bank->field_norm[index] = 1.0f;
+    bank->measurement_noise[index] = 1e-6f;
+    bank->outlier_gate[index] = 0.0f;
+    bank->process_noise[index] = 0.0f;
+    bank->forgetting[index] = 1.0f;
+    bank->measurement_count[index] = 0;
+    bank->square_root &= ~(1u << index);
+
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        bank->state[i][index] = 0.0f;
+
+        for (j = i; j < TRICAL_STATE_DIM; j++) {
+            bank->state_covariance[TRICAL_PACKED_INDEX(j, i)][index] =
+                (i == j) ? 1e-2f : 0.0f;
+        }
+    }
+}
+
+/*
+TRICAL_bank_init:
+Initializes every instance in `bank` to the same default state as
+TRICAL_init.
+*/
+void TRICAL_bank_init(TRICAL_bank_t *bank) {
+    assert(bank);
+
+    memset(bank, 0, sizeof(TRICAL_bank_t));
+
+    unsigned int n;
+    for (n = 0; n < TRICAL_BANK_WIDTH; n++) {
+        _trical_bank_lane_reset(bank, n);
+    }
+}
+
+/*
+TRICAL_bank_instance_set:
+Copies the field norm, measurement noise, outlier gate, process model,
+measurement count, calibration estimate and state covariance of `instance`
+into slot `index` of `bank`; the bank doesn't hold any other settings. An
+instance in square-root mode keeps its Cholesky factor in the bank, so it
+isn't converted back and forth.
+*/
+void TRICAL_bank_instance_set(TRICAL_bank_t *bank, unsigned int index,
+const TRICAL_instance_t *instance) {
+    assert(bank);
+    assert(instance);
+    assert(index < TRICAL_BANK_WIDTH);
+
+    unsigned int i, j;
+
+    bank->field_norm[index] = instance->field_norm;
+    bank->measurement_noise[index] = instance->measurement_noise;
+    bank->outlier_gate[index] = instance->gate_outlier;
+    bank->process_noise[index] = instance->process_noise;
+    bank->forgetting[index] = instance->forgetting;
+    bank->measurement_count[index] = instance->measurement_count;
+
+    if (instance->square_root) {
+        bank->square_root |= 1u << index;
+    } else {
+        bank->square_root &= ~(1u << index);
+    }
+
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        bank->state[i][index] = instance->state[i];
+
+        for (j = i; j < TRICAL_STATE_DIM; j++) {
+            bank->state_covariance[TRICAL_PACKED_INDEX(j, i)][index] =
+                (float)instance->state_covariance[
+                    TRICAL_COVARIANCE_INDEX(j, i)];
+        }
+    }
+}
+
+/*
+TRICAL_bank_instance_get:
+Copies slot `index` of `bank` into `instance`, which must have been
+initialized; the settings the bank doesn't hold are left as they are. The
+resulting instance is not in square-root mode.
+*/
+void TRICAL_bank_instance_get(const TRICAL_bank_t *bank, unsigned int index,
+TRICAL_instance_t *instance) {
+    assert(bank);
+    assert(instance);
+    assert(index < TRICAL_BANK_WIDTH);
+
+    unsigned int i, j;
+
+    instance->field_norm = bank->field_norm[index];
+    instance->measurement_noise = bank->measurement_noise[index];
+    instance->gate_outlier = bank->outlier_gate[index];
+    instance->process_noise = bank->process_noise[index];
+    instance->forgetting = bank->forgetting[index];
+    instance->measurement_count = bank->measurement_count[index];
+    instance->square_root = 0;
+
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        instance->state[i] = bank->state[i][index];
+
+        for (j = i; j < TRICAL_STATE_DIM; j++) {
+            instance->state_covariance[TRICAL_COVARIANCE_INDEX(j, i)] =
+                bank->state_covariance[TRICAL_PACKED_INDEX(j, i)][index];
+#ifndef TRICAL_PACKED_COVARIANCE
+            instance->state_covariance[j * TRICAL_STATE_DIM + i] =
+                instance->state_covariance[TRICAL_COVARIANCE_INDEX(j, i)];
+#endif
+        }
+    }
+
+    /* Only the lower triangle of the factor is read */
+    if (bank->square_root & (1u << index)) {
+        _trical_covariance_from_sqrt(instance->state_covariance);
+    }
+}
+
+/*
+_trical_bank_update
+Runs TRICAL_bank_estimate_update, and returns a mask with bit `n` set for
+each instance `n` which was updated. Bit `n` of `failed` is set for each
+active instance which wasn't, because its state covariance can't be
+factorized.
+*/
+static unsigned int _trical_bank_update(TRICAL_bank_t *restrict bank,
+const float measurements[TRICAL_BANK_WIDTH][3],
+const float reference_fields[TRICAL_BANK_WIDTH][3], unsigned int active,
+unsigned int *restrict failed);
+
+static unsigned int _trical_bank_update(TRICAL_bank_t *restrict bank,
+const float measurements[TRICAL_BANK_WIDTH][3],
+const float reference_fields[TRICAL_BANK_WIDTH][3], unsigned int active,
+unsigned int *restrict failed) {
+    float lanes[6][TRICAL_SIMD_WIDTH];
+    vfloat_t measurement[3], field[3];
+    unsigned int n, w, i, lane_active, lane_failed, updated = 0;
+
+    *failed = 0;
+    for (n = 0; n < TRICAL_BANK_WIDTH; n += TRICAL_SIMD_WIDTH) {
+        /* Groups of lanes with nothing to update would be left unchanged */
+        lane_active = (active >> n) & TRICAL_BANK_VECTOR_MASK;
+        if (!lane_active) {
+            continue;
+        }
+
+        /*
+        Transpose the readings into structure-of-arrays form. Readings for
+        inactive instances might be garbage, so replace them with something
+        that's guaranteed not to produce NaNs.
+        */
+        for (w = 0; w < TRICAL_SIMD_WIDTH; w++) {
+            for (i = 0; i < 3; i++) {
+                if (lane_active & (1u << w)) {
+                    lanes[i][w] = measurements[n + w][i];
+                    lanes[i + 3][w] = reference_fields[n + w][i];
+                } else {
+                    lanes[i][w] = 1.0f;
+                    lanes[i + 3][w] = 1.0f;
+                }
+            }
+        }
+
+        for (i = 0; i < 3; i++) {
+            measurement[i] = vf_load(lanes[i]);
+            field[i] = vf_load(lanes[i + 3]);
+        }
+
+        updated |= _trical_bank_step(bank, n, measurement, field,
+                                     lane_active, &lane_failed) << n;
+        *failed |= lane_failed << n;
+    }
+
+    for (n = 0; n < TRICAL_BANK_WIDTH; n++) {
+        if (updated & (1u << n)) {
+            bank->measurement_count[n]++;
+        }
+    }
+
+    return updated;
+}
+
+/*
+_trical_bank_predict
+Applies the process model of instance `index` of `bank` to its state
+covariance (or Cholesky factor), as _trical_filter_predict does.
+*/
+static void _trical_bank_predict(TRICAL_bank_t *restrict bank,
+unsigned int index);
+
+static void _trical_bank_predict(TRICAL_bank_t *restrict bank,
+unsigned int index) {
+    unsigned int i, square_root = bank->square_root & (1u << index);
+    float scale, l_ii, process_noise = bank->process_noise[index];
+
+    if (bank->forgetting[index] < 1.0f) {
+        scale = square_root ? sqrt_inv(bank->forgetting[index]) :
+                              recip(bank->forgetting[index]);
+        for (i = 0; i < TRICAL_PACKED_COVARIANCE_DIM; i++) {
+            bank->state_covariance[i][index] *= scale;
+        }
+    }
+
+    if (process_noise > 0.0f) {
+        #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM)
+        for (i = 0; i < TRICAL_STATE_DIM; i++) {
+            float *covariance =
+                &bank->state_covariance[TRICAL_PACKED_INDEX(i, i)][index];
+            if (square_root) {
+                l_ii = *covariance;
+                *covariance = fsqrt(l_ii * l_ii + process_noise);
+            } else {
+                *covariance += process_noise;
+            }
+        }
+    }
+}
+
+/*
+TRICAL_bank_estimate_update:
+Updates the calibration estimate of every instance in `bank` for which the
+corresponding bit of `active` is set, using `measurements[n]` and
+`reference_fields[n]` for instance `n`. Each active instance's process model
+is applied first. Instances with a clear `active` bit are left unchanged, and
+their readings are ignored, as are the readings of instances which fail the
+checks of TRICAL_estimate_update; the bank can't repair a covariance, so it
+leaves one which needs repairing as it is.
+*/
+void TRICAL_bank_estimate_update(TRICAL_bank_t *bank,
+const float measurements[TRICAL_BANK_WIDTH][3],
+const float reference_fields[TRICAL_BANK_WIDTH][3], unsigned int active) {
+    assert(bank);
+    assert(measurements);
+    assert(reference_fields);
+
+    unsigned int n, failed;
+
+    for (n = 0; n < TRICAL_BANK_WIDTH; n++) {
+        if ((active & (1u << n)) && (bank->forgetting[n] < 1.0f ||
+                                     bank->process_noise[n] > 0.0f)) {
+            _trical_bank_predict(bank, n);
+        }
+    }
+
+    _trical_bank_update(bank, measurements, reference_fields, active,
+                        &failed);
+}
+
+/*
+_trical_bank_lane_get
+Copies the calibration estimate and state covariance (or its Cholesky
+factor, if `instance` is in square-root mode -- as it was when it was copied
+into the bank) in slot `index` of `bank` back into `instance`, leaving its
+other settings as they are.
+*/
+static void _trical_bank_lane_get(const TRICAL_bank_t *restrict bank,
+unsigned int index, TRICAL_instance_t *restrict instance);
+
+static void _trical_bank_lane_get(const TRICAL_bank_t *restrict bank,
+unsigned int index, TRICAL_instance_t *restrict instance) {
+    unsigned int i, j;
+
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        instance->state[i] = bank->state[i][index];
+
+        for (j = i; j < TRICAL_STATE_DIM; j++) {
+            instance->state_covariance[TRICAL_COVARIANCE_INDEX(j, i)] =
+                bank->state_covariance[TRICAL_PACKED_INDEX(j, i)][index];
+#ifndef TRICAL_PACKED_COVARIANCE
+            /* The upper triangle of a factor stays zero */
+            if (!instance->square_root) {
+                instance->state_covariance[j * TRICAL_STATE_DIM + i] =
+                    instance->state_covariance[TRICAL_COVARIANCE_INDEX(j, i)];
+            }
+#endif
+        }
+    }
+}
+
+/*
+TRICAL_estimate_update_multi:
+Updates each of the `count` instances in `instances` with its own reading,
+as if by TRICAL_estimate_update, running up to TRICAL_BANK_WIDTH of them at
+a time through the bank filter in lockstep.
+
+The reading checks, gate and process model are applied to each instance
+first, exactly as in _trical_filter_iterate; the instances that pass are
+then copied into the bank (square-root instances keep their factor there),
+updated together, and copied back if the update was used. An instance whose
+covariance the bank can't factorize is updated on its own instead, so it's
+repaired as TRICAL_estimate_update would. Only the TRICAL_STATS
+instrumentation is left out.
+*/
+void TRICAL_estimate_update_multi(TRICAL_instance_t *const instances[],
+const float measurements[][3], const float reference_fields[][3],
+unsigned int count) {
+    assert(instances || !count);
+    assert(measurements || !count);
+
+    TRICAL_bank_t bank;
+    TRICAL_workspace_t workspace;
+    float lane_measurements[TRICAL_BANK_WIDTH][3],
+          lane_fields[TRICAL_BANK_WIDTH][3];
+    TRICAL_instance_t *instance;
+    TRICAL_status_t status;
+    const float *field;
+    unsigned int first, n, active, updated, failed,
+                 bins[TRICAL_BANK_WIDTH], workspace_ready = 0;
+
+    for (first = 0; first < count; first += TRICAL_BANK_WIDTH) {
+        active = 0;
+
+        for (n = 0; n < TRICAL_BANK_WIDTH && first + n < count; n++) {
+            instance = instances[first + n];
+            assert(instance);
+            assert(reference_fields || instance->field_fixed);
+
+            field = reference_fields ? reference_fields[first + n] :
+                                       instance->field;
+            if (!_trical_reading_finite(measurements[first + n], field) ||
+                    !_trical_filter_gate(instance, measurements[first + n],
+                                         field, &bins[n])) {
+                instance->skipped_count++;
+                continue;
+            }
+
+            _trical_state_repair(instance);
+            _trical_filter_predict(instance);
+            TRICAL_bank_instance_set(&bank, n, instance);
+            memcpy(lane_measurements[n], measurements[first + n],
+                   sizeof(lane_measurements[n]));
+            memcpy(lane_fields[n], field, sizeof(lane_fields[n]));
+            active |= 1u << n;
+        }
+
+        if (!active) {
+            continue;
+        }
+
+        /*
+        Unused slots which share a vector with a used one still go through
+        the filter, so give them a valid state rather than whatever was left
+        on the stack
+        */
+        for (n = 0; n < TRICAL_BANK_WIDTH; n++) {
+            if (!(active & (1u << n)) &&
+                    ((active >> (n - n % TRICAL_SIMD_WIDTH)) &
+                     TRICAL_BANK_VECTOR_MASK)) {
+                _trical_bank_lane_reset(&bank, n);
+            }
+        }
+
+        updated = _trical_bank_update(&bank,
+            (const float (*)[3])lane_measurements,
+            (const float (*)[3])lane_fields, active, &failed);
+
+        for (n = 0; n < TRICAL_BANK_WIDTH && first + n < count; n++) {
+            if (!(active & (1u << n))) {
+                continue;
+            }
+
+            instance = instances[first + n];
+            if (failed & (1u << n)) {
+                if (!workspace_ready) {
+                    memset(workspace.covariance_llt, 0,
+                           sizeof(workspace.covariance_llt));
+                    workspace_ready = 1u;
+                }
+
+                status = _trical_filter_correct(instance, &workspace,
+                                                lane_measurements[n],
+                                                lane_fields[n]);
+            } else if (updated & (1u << n)) {
+                _trical_bank_lane_get(&bank, n, instance);
+                status = TRICAL_STATUS_UPDATED;
+            } else {
+                status = TRICAL_STATUS_REJECTED;
+            }
+
+            if (status == TRICAL_STATUS_REJECTED) {
+                instance->skipped_count++;
+            } else {
+                _trical_coverage_add(instance, bins[n]);
+                instance->measurement_count++;
+                _trical_publish(instance);
+            }
+        }
+    }
+}
+
+/*
+TRICAL_bank_measurement_calibrate:
+Calibrates `measurement` based on the current calibration estimate of
+instance `index` in `bank`, and copies the result to
+`calibrated_measurement`.
+*/
+void TRICAL_bank_measurement_calibrate(const TRICAL_bank_t *bank,
+unsigned int index, const float measurement[3],
+float calibrated_measurement[3]) {
+    assert(bank);
+    assert(measurement);
+    assert(calibrated_measurement);
+    assert(index < TRICAL_BANK_WIDTH);
+
+    float state[TRICAL_STATE_DIM];
+    unsigned int i;
+
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        state[i] = bank->state[i][index];
+    }
+
+    _trical_measurement_calibrate(state, measurement, calibrated_measurement);
+}
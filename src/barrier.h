@@ -0,0 +1,47 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _BARRIER_H_
+#define _BARRIER_H_
+
+/*
+TRICAL_MEMORY_BARRIER() orders all memory accesses before it against all
+accesses after it, for both the compiler and the processor; it's used to
+share estimates and samples between tasks without locks. Define it to use
+something other than the compiler's built-in full barrier.
+*/
+
+#ifndef TRICAL_MEMORY_BARRIER
+#if defined(__GNUC__) || defined(__clang__)
+#define TRICAL_MEMORY_BARRIER() __sync_synchronize()
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define TRICAL_MEMORY_BARRIER() _mm_mfence()
+#elif defined(_TMS320C6X)
+#include <c6x.h>
+#define TRICAL_MEMORY_BARRIER() _mfence()
+#else
+#error "Define TRICAL_MEMORY_BARRIER() for this compiler"
+#endif
+#endif
+
+#endif
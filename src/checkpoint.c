@@ -0,0 +1,312 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <assert.h>
+#include <math.h>
+#include <float.h>
+#include <string.h>
+
+#include "TRICAL.h"
+#include "filter.h"
+
+/*
+Checkpoint layout (all multi-byte values little-endian):
+   0  magic ("TRIC")
+   4  version
+   5  format (TRICAL_checkpoint_format_t)
+   6  TRICAL_STATE_DIM
+   7  reserved (0)
+   8  field norm (float)
+  12  measurement noise (float)
+  16  measurement count (uint32)
+  20  state (TRICAL_STATE_DIM floats)
+      then either the lower triangle of the state covariance, column by
+      column (TRICAL_PACKED_COVARIANCE_DIM floats), or its diagonal
+      (TRICAL_STATE_DIM floats)
+      CRC-32 of all preceding bytes
+
+The covariance itself is always stored (never its Cholesky factor), in single
+precision, so checkpoints don't depend on the square-root mode or the
+covariance storage options.
+*/
+#define TRICAL_CHECKPOINT_VERSION 1u
+#define TRICAL_CHECKPOINT_HEADER_SIZE 8u
+
+static const uint8_t _magic[4] = { 'T', 'R', 'I', 'C' };
+
+/*
+_crc32
+Returns the CRC-32 (IEEE 802.3 polynomial, as used by zlib) of `size` bytes
+at `data`. Bitwise rather than table-driven, since checkpoints are only
+written occasionally and the table would cost 1KiB.
+*/
+static uint32_t _crc32(const uint8_t *restrict data, size_t size);
+
+static uint32_t _crc32(const uint8_t *restrict data, size_t size) {
+    uint32_t crc = 0xFFFFFFFFu;
+    size_t i;
+    unsigned int k;
+
+    for (i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+        }
+    }
+
+    return ~crc;
+}
+
+/*
+_write_u32
+Writes `value` to `buffer` in little-endian order, and returns the position
+after it.
+*/
+static uint8_t *_write_u32(uint8_t *restrict buffer, uint32_t value);
+
+static uint8_t *_write_u32(uint8_t *restrict buffer, uint32_t value) {
+    buffer[0] = (uint8_t)value;
+    buffer[1] = (uint8_t)(value >> 8);
+    buffer[2] = (uint8_t)(value >> 16);
+    buffer[3] = (uint8_t)(value >> 24);
+    return buffer + 4;
+}
+
+/*
+_write_float
+Writes the bits of `value` to `buffer` in little-endian order, and returns
+the position after it.
+*/
+static uint8_t *_write_float(uint8_t *restrict buffer, float value);
+
+static uint8_t *_write_float(uint8_t *restrict buffer, float value) {
+    uint32_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    return _write_u32(buffer, bits);
+}
+
+/*
+_read_u32
+Returns the little-endian value at `buffer`.
+*/
+static uint32_t _read_u32(const uint8_t *restrict buffer);
+
+static uint32_t _read_u32(const uint8_t *restrict buffer) {
+    return (uint32_t)buffer[0] | ((uint32_t)buffer[1] << 8) |
+           ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+/*
+_read_float
+Returns the float whose bits are stored little-endian at `buffer`.
+*/
+static float _read_float(const uint8_t *restrict buffer);
+
+static float _read_float(const uint8_t *restrict buffer) {
+    uint32_t bits = _read_u32(buffer);
+    float value;
+
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/*
+TRICAL_checkpoint_save:
+Serializes `instance` to `buffer` in `format`, and returns the number of bytes
+written (TRICAL_CHECKPOINT_SIZE or TRICAL_CHECKPOINT_ESTIMATE_SIZE). `size`
+must be at least that large. Checkpoints are the same whatever the
+square-root mode and covariance storage options of the instance.
+*/
+size_t TRICAL_checkpoint_save(const TRICAL_instance_t *instance,
+TRICAL_checkpoint_format_t format, uint8_t *buffer, size_t size) {
+    assert(instance);
+    assert(buffer);
+    assert(format == TRICAL_CHECKPOINT_FULL ||
+           format == TRICAL_CHECKPOINT_ESTIMATE);
+    assert(size >= (format == TRICAL_CHECKPOINT_FULL ?
+                    TRICAL_CHECKPOINT_SIZE : TRICAL_CHECKPOINT_ESTIMATE_SIZE));
+
+    TRICAL_covariance_t covariance[TRICAL_COVARIANCE_DIM];
+    uint8_t *restrict out = buffer;
+    unsigned int i, j;
+
+    memcpy(covariance, instance->state_covariance, sizeof(covariance));
+    if (instance->square_root) {
+        _trical_covariance_from_sqrt(covariance);
+    }
+
+    memcpy(out, _magic, sizeof(_magic));
+    out[4] = (uint8_t)TRICAL_CHECKPOINT_VERSION;
+    out[5] = (uint8_t)format;
+    out[6] = (uint8_t)TRICAL_STATE_DIM;
+    out[7] = 0;
+    out += TRICAL_CHECKPOINT_HEADER_SIZE;
+
+    out = _write_float(out, instance->field_norm);
+    out = _write_float(out, instance->measurement_noise);
+    out = _write_u32(out, instance->measurement_count);
+
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        out = _write_float(out, instance->state[i]);
+    }
+
+    if (format == TRICAL_CHECKPOINT_FULL) {
+        for (j = 0; j < TRICAL_STATE_DIM; j++) {
+            for (i = j; i < TRICAL_STATE_DIM; i++) {
+                out = _write_float(out,
+                    (float)covariance[TRICAL_COVARIANCE_INDEX(i, j)]);
+            }
+        }
+    } else {
+        for (i = 0; i < TRICAL_STATE_DIM; i++) {
+            out = _write_float(out,
+                (float)covariance[TRICAL_COVARIANCE_INDEX(i, i)]);
+        }
+    }
+
+    out = _write_u32(out, _crc32(buffer, (size_t)(out - buffer)));
+
+    return (size_t)(out - buffer);
+}
+
+/*
+TRICAL_checkpoint_load:
+Restores the field norm, measurement noise, measurement count, state and state
+covariance of `instance` from the checkpoint in `buffer`, which may be in
+either format. `instance` must have been initialized, and its other settings
+are kept. If the checkpoint is truncated, corrupt, or was saved with a
+different calibration model, `instance` is left unchanged and an error is
+returned.
+*/
+TRICAL_checkpoint_status_t TRICAL_checkpoint_load(TRICAL_instance_t *instance,
+const uint8_t *buffer, size_t size) {
+    assert(instance);
+    assert(buffer || !size);
+
+    TRICAL_covariance_t covariance[TRICAL_COVARIANCE_DIM],
+                        llt[TRICAL_COVARIANCE_DIM], pivot;
+    float state[TRICAL_STATE_DIM], field_norm, measurement_noise;
+    const uint8_t *restrict in;
+    size_t dim, expected_size;
+    unsigned int i, j;
+
+    if (size < TRICAL_CHECKPOINT_HEADER_SIZE) {
+        return TRICAL_CHECKPOINT_ERROR_SIZE;
+    }
+    if (memcmp(buffer, _magic, sizeof(_magic)) != 0) {
+        return TRICAL_CHECKPOINT_ERROR_MAGIC;
+    }
+    if (buffer[4] != TRICAL_CHECKPOINT_VERSION) {
+        return TRICAL_CHECKPOINT_ERROR_VERSION;
+    }
+
+    /*
+    The size depends on the state dimension the checkpoint was saved with;
+    check the size and CRC against that before comparing it with ours, so a
+    corrupt header isn't reported as a model mismatch
+    */
+    dim = buffer[6];
+    if (buffer[5] == TRICAL_CHECKPOINT_FULL) {
+        expected_size = dim * (dim + 1u) / 2u;
+    } else if (buffer[5] == TRICAL_CHECKPOINT_ESTIMATE) {
+        expected_size = dim;
+    } else {
+        return TRICAL_CHECKPOINT_ERROR_VERSION;
+    }
+    expected_size = TRICAL_CHECKPOINT_HEADER_SIZE +
+                    4u * (3u + dim + expected_size) + 4u;
+
+    if (size < expected_size) {
+        return TRICAL_CHECKPOINT_ERROR_SIZE;
+    }
+    if (_crc32(buffer, expected_size - 4u) !=
+            _read_u32(&buffer[expected_size - 4u])) {
+        return TRICAL_CHECKPOINT_ERROR_CRC;
+    }
+    if (dim != TRICAL_STATE_DIM) {
+        return TRICAL_CHECKPOINT_ERROR_MODEL;
+    }
+
+    in = buffer + TRICAL_CHECKPOINT_HEADER_SIZE;
+    field_norm = _read_float(in);
+    measurement_noise = _read_float(in + 4);
+    in += 12;
+
+    for (i = 0; i < TRICAL_STATE_DIM; i++, in += 4) {
+        state[i] = _read_float(in);
+    }
+
+    memset(covariance, 0, sizeof(covariance));
+    if (buffer[5] == TRICAL_CHECKPOINT_FULL) {
+        for (j = 0; j < TRICAL_STATE_DIM; j++) {
+            for (i = j; i < TRICAL_STATE_DIM; i++, in += 4) {
+                covariance[TRICAL_COVARIANCE_INDEX(i, j)] = _read_float(in);
+#ifndef TRICAL_PACKED_COVARIANCE
+                covariance[j + i * TRICAL_STATE_DIM] =
+                    covariance[TRICAL_COVARIANCE_INDEX(i, j)];
+#endif
+            }
+        }
+    } else {
+        for (i = 0; i < TRICAL_STATE_DIM; i++, in += 4) {
+            covariance[TRICAL_COVARIANCE_INDEX(i, i)] = _read_float(in);
+        }
+    }
+
+    /*
+    A valid CRC doesn't guarantee the values are usable (the checkpoint could
+    have been saved from a diverged instance), so reject anything the filter
+    couldn't continue from: the state must be finite, and the covariance
+    positive-definite, i.e. its Cholesky factor must have a positive, finite
+    diagonal
+    */
+    if (!(field_norm > 0.0f && field_norm <= FLT_MAX &&
+            measurement_noise > 0.0f && measurement_noise <= FLT_MAX)) {
+        return TRICAL_CHECKPOINT_ERROR_VALUE;
+    }
+
+    memcpy(llt, covariance, sizeof(llt));
+    _trical_covariance_to_sqrt(llt);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        pivot = llt[TRICAL_COVARIANCE_INDEX(i, i)];
+        if (!((float)fabs(state[i]) <= FLT_MAX &&
+                pivot > (TRICAL_covariance_t)0.0f &&
+                pivot <= (TRICAL_covariance_t)FLT_MAX)) {
+            return TRICAL_CHECKPOINT_ERROR_VALUE;
+        }
+    }
+
+    if (instance->square_root) {
+        memcpy(covariance, llt, sizeof(covariance));
+    }
+
+    instance->field_norm = field_norm;
+    instance->measurement_noise = measurement_noise;
+    instance->measurement_count =
+        _read_u32(buffer + TRICAL_CHECKPOINT_HEADER_SIZE + 8u);
+    memcpy(instance->state, state, sizeof(state));
+    memcpy(instance->state_covariance, covariance, sizeof(covariance));
+
+    _trical_publish(instance);
+    return TRICAL_CHECKPOINT_OK;
+}
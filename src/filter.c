@@ -24,10 +24,13 @@ SOFTWARE.
 #include <math.h>
 #include <float.h>
 #include <string.h>
+#include <limits.h>
 
 #include "TRICAL.h"
 #include "filter.h"
 #include "3dmath.h"
+#include "simd.h"
+#include "stats.h"
 
 #ifdef DEBUG
 #include <stdio.h>
@@ -49,6 +52,29 @@ size_t cols) {
 #define _print_matrix(a, b, c, d)
 #endif
 
+/*
+Cholesky routines matching the precision of TRICAL_covariance_t
+*/
+#ifdef TRICAL_DOUBLE_COVARIANCE
+#define _cholesky_decomp_scale matrix_cholesky_decomp_scale_d
+#define _cholesky_decomp_scale_packed matrix_cholesky_decomp_scale_packed_d
+#define _cholesky_downdate matrix_cholesky_downdate_d
+#define _cholesky_downdate_packed matrix_cholesky_downdate_packed_d
+#else
+#define _cholesky_decomp_scale matrix_cholesky_decomp_scale_f
+#define _cholesky_decomp_scale_packed matrix_cholesky_decomp_scale_packed_f
+#define _cholesky_downdate matrix_cholesky_downdate_f
+#define _cholesky_downdate_packed matrix_cholesky_downdate_packed_f
+#endif
+
+/*
+Covariance repair (see _covariance_repair): the first diagonal jitter, as a
+fraction of the average state variance, and the number of times it's
+increased before giving up and reinitializing the covariance
+*/
+#define TRICAL_REPAIR_JITTER 1e-4f
+#define TRICAL_REPAIR_ATTEMPTS 4u
+
 /*
 A bit about the UKF formulation in this file: main references are
 [1]: http://www.acsu.buffalo.edu/~johnc/mag_cal05.pdf
@@ -78,10 +104,12 @@ The implementation follows the general approach of https://github.com/sfwa/ukf
 however there a number of simplifications due to the restricted problem
 domain.
 
-Since there is no process model, the apriori mean is the same as the state at
-the start of the update step, and W' is just the set of sigma points. That in
-turn means that there's no need to calculate propagated state covariance from
-W'; it's the same as the covariance was at the start of the update step.
+The calibration is modelled as a random walk, so the apriori mean is the same
+as the state at the start of the update step, and W' is just the set of sigma
+points. That in turn means that there's no need to calculate propagated state
+covariance from W'; it's the covariance at the start of the update step,
+inflated by the (optional) forgetting factor and process noise. See
+_trical_filter_predict.
 
 The scalar measurement model also simplifies a lot of the cross-correlation
 and Kalman gain calculation.
@@ -94,6 +122,36 @@ probably not strictly necessary to use the scaled formulation, but we'd
 already implemented that so it seemed easier to continue with that approach.
 */
 
+/*
+_calibrate
+Implementation of _trical_measurement_calibrate, without the argument checks
+so it can be used on the sigma point hot path.
+*/
+static inline void _calibrate(const float *restrict s,
+const float measurement[3], float calibrated_measurement[3]) {
+    float v[3], *c = calibrated_measurement;
+    v[0] = measurement[0] - s[0];
+    v[1] = measurement[1] - s[1];
+    v[2] = measurement[2] - s[2];
+
+#if TRICAL_STATE_DIM == 12
+    /* 3x3 matrix multiply */
+    c[0] = v[0] * (s[3] + 1.0f) + v[1] * s[4] + v[2] * s[5];
+    c[1] = v[0] * s[6] + v[1] * (s[7] + 1.0f) + v[2] * s[8];
+    c[2] = v[0] * s[9] + v[1] * s[10] + v[2] * (s[11] + 1.0f);
+#elif TRICAL_STATE_DIM == 6
+    /* Diagonal scale only */
+    c[0] = v[0] * (s[3] + 1.0f);
+    c[1] = v[1] * (s[4] + 1.0f);
+    c[2] = v[2] * (s[5] + 1.0f);
+#else
+    /* Bias only */
+    c[0] = v[0];
+    c[1] = v[1];
+    c[2] = v[2];
+#endif
+}
+
 /*
 _trical_measurement_reduce
 Reduces `measurement` to a scalar value based on the calibration estimate in
@@ -106,10 +164,10 @@ above, when we can just apply the current calibration estimate to the
 measurement and take its magnitude. Look into this further if the below
 approach doesn't work.
 */
-float _trical_measurement_reduce(float state[TRICAL_STATE_DIM], float
-measurement[3], float field[3]) {
+float _trical_measurement_reduce(const float state[TRICAL_STATE_DIM],
+const float measurement[3], const float field[3]) {
     float temp[3];
-    _trical_measurement_calibrate(state, measurement, temp);
+    _calibrate(state, measurement, temp);
 
     return fsqrt(fabs(temp[X] * field[X] + temp[Y] * field[Y] +
                       temp[Z] * field[Z]));
@@ -128,41 +186,584 @@ where B' is the calibrated measurement, I_{3x3} is the 3x3 identity matrix,
 D is the scale calibration matrix, B is the raw measurement, and b is the bias
 vector.
 */
-void _trical_measurement_calibrate(float state[TRICAL_STATE_DIM],
-float measurement[3], float calibrated_measurement[3]) {
+void _trical_measurement_calibrate(const float state[TRICAL_STATE_DIM],
+const float measurement[3], float calibrated_measurement[3]) {
     assert(state && measurement && calibrated_measurement);
 
-    float v[3], *restrict s = state, *restrict c = calibrated_measurement;
-    v[0] = measurement[0] - s[0];
-    v[1] = measurement[1] - s[1];
-    v[2] = measurement[2] - s[2];
+    _calibrate(state, measurement, calibrated_measurement);
+}
 
-    /* 3x3 matrix multiply */
-    c[0] = v[0] * (s[3] + 1.0f) + v[1] * s[4] + v[2] * s[5];
-    c[1] = v[0] * s[6] + v[1] * (s[7] + 1.0f) + v[2] * s[8];
-    c[2] = v[0] * s[9] + v[1] * s[10] + v[2] * (s[11] + 1.0f);
+/*
+_reduce_setup
+Computes the coefficients of the part of the sigma point reduction that is
+linear in the offset from `state` (see _trical_measurement_reduce_sigma),
+and returns z0, the reduction of `measurement` at `state` before the
+absolute value and square root.
+*/
+static float _reduce_setup(const float state[TRICAL_STATE_DIM],
+const float measurement[3], const float field[3],
+float coeffs[TRICAL_STATE_DIM]);
+
+static float _reduce_setup(const float state[TRICAL_STATE_DIM],
+const float measurement[3], const float field[3],
+float coeffs[TRICAL_STATE_DIM]) {
+    float v[3], g[3];
+    unsigned int l;
+
+    v[X] = measurement[X] - state[X];
+    v[Y] = measurement[Y] - state[Y];
+    v[Z] = measurement[Z] - state[Z];
+
+#if TRICAL_STATE_DIM == 12
+    unsigned int r;
+
+    /* g = (I + D)t x f, and the scale coefficients f_r x v_k */
+    for (l = 0; l < 3; l++) {
+        g[l] = field[l] + field[X] * state[3 + l] + field[Y] * state[6 + l] +
+               field[Z] * state[9 + l];
+    }
+    for (r = 0; r < 3; r++) {
+        for (l = 0; l < 3; l++) {
+            coeffs[3 + r * 3 + l] = field[r] * v[l];
+        }
+    }
+#elif TRICAL_STATE_DIM == 6
+    /* Diagonal scale only */
+    for (l = 0; l < 3; l++) {
+        g[l] = field[l] * (state[3 + l] + 1.0f);
+        coeffs[3 + l] = field[l] * v[l];
+    }
+#else
+    /* Bias only */
+    (void)l;
+    g[X] = field[X];
+    g[Y] = field[Y];
+    g[Z] = field[Z];
+#endif
+
+    /* Bias coefficients */
+    coeffs[X] = -g[X];
+    coeffs[Y] = -g[Y];
+    coeffs[Z] = -g[Z];
+
+    return g[X] * v[X] + g[Y] * v[Y] + g[Z] * v[Z];
 }
 
 /*
-_trical_filter_iterate
-Generates a new calibration estimate for `instance` incorporating the raw
-sensor readings in `measurement`.
+_reduce_column
+Evaluates the pair of sigma points generated from column `i` of the scaled
+Cholesky factor (at `col`), given the coefficients and z0 from _reduce_setup:
+returns the quadratic part, common to both points, and sets `linear` to the
+part which changes sign between them. Only rows i onwards of `col` are read.
 */
-void _trical_filter_iterate(TRICAL_instance_t *instance,
-float measurement[3], float field[3]) {
-    unsigned int i, j, k, l, col;
+static inline float _reduce_column(const float *restrict col, unsigned int i,
+const float coeffs[TRICAL_STATE_DIM], const float field[3], float z0,
+float *restrict linear);
 
-    float *restrict covariance = instance->state_covariance;
-    float *restrict state = instance->state;
+static inline float _reduce_column(const float *restrict col, unsigned int i,
+const float coeffs[TRICAL_STATE_DIM], const float field[3], float z0,
+float *restrict linear) {
+    float centre, sum;
+    unsigned int l;
+
+    sum = 0.0f;
+    #pragma MUST_ITERATE(1, TRICAL_STATE_DIM);
+    for (l = i; l < TRICAL_STATE_DIM; l++) {
+        sum += coeffs[l] * col[l];
+    }
+    *linear = sum;
+
+    /* Quadratic term, ft x dD x db */
+    centre = z0;
+    if (i < 3) {
+#if TRICAL_STATE_DIM == 12
+        unsigned int r;
+        for (r = 0; r < 3; r++) {
+            centre -= field[r] * (col[3 + r * 3] * col[X] +
+                                  col[4 + r * 3] * col[Y] +
+                                  col[5 + r * 3] * col[Z]);
+        }
+#elif TRICAL_STATE_DIM == 6
+        for (l = 0; l < 3; l++) {
+            centre -= field[l] * col[3 + l] * col[l];
+        }
+#else
+        (void)field;
+#endif
+    }
+
+    return centre;
+}
+
+/*
+_trical_measurement_reduce_sigma
+Evaluates _trical_measurement_reduce for every sigma point generated from
+`state` and the columns of the scaled Cholesky factor `covariance_llt`,
+writing the results to `measurement_estimates` in the same order as
+_trical_filter_iterate: central point first, then the positive sigma points,
+then the negative ones. Only the lower triangle of `covariance_llt` is read.
+
+Before the absolute value and square root, the reduction is
+z = ft x (I + D) x (B - b), where f is the field. For a sigma point offset
+from the state by (db, dD), that expands to
+
+z = z0 - gt x db + sum_rk(f_r x v_k x dD_rk) - ft x dD x db
+
+where v = B - b, g = (I + D)t x f and z0 = gt x v are computed once per update
+from the state. The middle two terms are linear in the offset (a single dot
+product of the offset with a fixed coefficient vector) and just change sign
+between the positive and negative sigma points, while the last is quadratic
+and is the same for both, so each pair of sigma points is evaluated together
+without generating the sigma points at all.
+
+Since the factor is lower-triangular, the dot product for column i only
+needs rows i onwards, and only the first three columns have a bias offset (so
+the quadratic term is zero for the rest). The square roots are then taken
+TRICAL_SIMD_WIDTH at a time.
+*/
+void _trical_measurement_reduce_sigma(const float state[TRICAL_STATE_DIM],
+const float covariance_llt[TRICAL_STATE_DIM * TRICAL_STATE_DIM],
+const float measurement[3], const float field[3],
+float measurement_estimates[TRICAL_NUM_SIGMA]) {
+    assert(state && covariance_llt && measurement && field &&
+           measurement_estimates);
+
+    float coeffs[TRICAL_STATE_DIM], z0, linear, centre;
+    unsigned int i;
+
+    z0 = _reduce_setup(state, measurement, field, coeffs);
+    measurement_estimates[0] = z0;
+
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        centre = _reduce_column(&covariance_llt[i * TRICAL_STATE_DIM], i,
+                                coeffs, field, z0, &linear);
+
+        measurement_estimates[i + 1] = centre + linear;
+        measurement_estimates[i + 1 + TRICAL_STATE_DIM] = centre - linear;
+    }
+
+    /* sqrt(|z|) for every sigma point */
+    for (i = 0; i + TRICAL_SIMD_WIDTH <= TRICAL_NUM_SIGMA;
+            i += TRICAL_SIMD_WIDTH) {
+        vf_store(&measurement_estimates[i],
+                 vf_sqrt(vf_abs(vf_load(&measurement_estimates[i]))));
+    }
+    for (; i < TRICAL_NUM_SIGMA; i++) {
+        measurement_estimates[i] = fsqrt(fabs(measurement_estimates[i]));
+    }
+}
+
+#ifdef TRICAL_FUSED_ITERATE
+/*
+_reduce_fused
+Evaluates every sigma point as _trical_measurement_reduce_sigma does, but
+reduces them on the fly instead of storing the measurement estimates,
+reading each column of the scaled Cholesky factor `covariance_llt` exactly
+once. Returns the measurement estimate mean, and sets
+`measurement_estimate_covariance` (without the sensor noise) and
+`cross_correlation` as in _trical_filter_step, and `central_estimate` to the
+measurement estimate of the central sigma point.
+
+The deviations are accumulated relative to the central measurement
+estimate, which is close to the mean, so the covariance can be computed
+from the sums of the deviations and of their squares without losing
+precision: with y = Z - Z0 and c = mean - Z0, the sum of (y - c)^2 over all
+TRICAL_NUM_SIGMA points is sum(y^2) - 2 x c x sum(y) + TRICAL_NUM_SIGMA x c^2.
+*/
+static float _reduce_fused(const float state[TRICAL_STATE_DIM],
+const float covariance_llt[TRICAL_STATE_DIM * TRICAL_STATE_DIM],
+const float measurement[3], const float field[3],
+float *restrict measurement_estimate_covariance,
+float cross_correlation[TRICAL_STATE_DIM], float *restrict central_estimate);
+
+static float _reduce_fused(const float state[TRICAL_STATE_DIM],
+const float covariance_llt[TRICAL_STATE_DIM * TRICAL_STATE_DIM],
+const float measurement[3], const float field[3],
+float *restrict measurement_estimate_covariance,
+float cross_correlation[TRICAL_STATE_DIM], float *restrict central_estimate) {
+    float coeffs[TRICAL_STATE_DIM], z0, z_central, linear, centre, pos, neg,
+          delta, sum, sum_squares, c;
+    const float *restrict col;
+    unsigned int i, j;
+
+    z0 = _reduce_setup(state, measurement, field, coeffs);
+    z_central = (float)fsqrt(fabs(z0));
+
+    sum = 0.0f;
+    sum_squares = 0.0f;
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (j = 0; j < TRICAL_STATE_DIM; j++) {
+        cross_correlation[j] = 0.0f;
+    }
+
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        col = &covariance_llt[i * TRICAL_STATE_DIM];
+        centre = _reduce_column(col, i, coeffs, field, z0, &linear);
+
+        pos = (float)fsqrt(fabs(centre + linear)) - z_central;
+        neg = (float)fsqrt(fabs(centre - linear)) - z_central;
+        sum += pos + neg;
+        sum_squares += pos * pos + neg * neg;
+
+        delta = pos - neg;
+        #pragma MUST_ITERATE(1, TRICAL_STATE_DIM);
+        for (j = i; j < TRICAL_STATE_DIM; j++) {
+            cross_correlation[j] += delta * col[j];
+        }
+    }
+
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (j = 0; j < TRICAL_STATE_DIM; j++) {
+        cross_correlation[j] *= TRICAL_SIGMA_WCI;
+    }
+
+    /* The central point has a deviation of zero from itself */
+    c = sum * TRICAL_SIGMA_WMI;
+    *measurement_estimate_covariance =
+        sum_squares - 2.0f * c * sum + (float)TRICAL_NUM_SIGMA * c * c;
+    *central_estimate = z_central;
+
+    return z_central + c;
+}
+#endif
+
+#ifdef TRICAL_STATS
+/*
+_stats_update
+Records the smallest covariance pivot (from the scaled Cholesky factor
+`covariance_llt`) and the innovation of a filter update in the
+instrumentation counters of `instance`.
+*/
+static void _stats_update(TRICAL_instance_t *restrict instance,
+const float *restrict covariance_llt, float innovation);
+
+static void _stats_update(TRICAL_instance_t *restrict instance,
+const float *restrict covariance_llt, float innovation) {
+    TRICAL_stats_t *restrict stats = &instance->stats;
+    float pivot, delta;
+    unsigned int i;
+
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        pivot = covariance_llt[i * TRICAL_STATE_DIM + i] *
+                covariance_llt[i * TRICAL_STATE_DIM + i] *
+                (1.0f / TRICAL_DIM_PLUS_LAMBDA);
+
+        /* Written this way round so a NaN pivot is recorded too */
+        if (!(pivot >= stats->min_pivot)) {
+            stats->min_pivot = pivot;
+        }
+    }
+
+    /* Welford's running mean and variance */
+    stats->update_count++;
+    delta = innovation - stats->innovation_mean;
+    stats->innovation_mean += delta / (float)stats->update_count;
+    stats->innovation_m2 += delta * (innovation - stats->innovation_mean);
+
+    if ((float)fabs(innovation) > stats->innovation_max) {
+        stats->innovation_max = (float)fabs(innovation);
+    }
+}
+#endif
+
+/*
+_trical_filter_predict
+Applies the process model of `instance` to its state covariance: divides it
+by the forgetting factor, then adds the process noise to the diagonal. In
+square-root mode, the Cholesky factor is scaled by the square root of
+1 / forgetting factor instead, and the process noise is added to the squares
+of the diagonal elements of the factor; that adds the right amount to each
+state variance, and keeps the factor lower-triangular with a positive
+diagonal, without the cost of a full Cholesky update.
+*/
+void _trical_filter_predict(TRICAL_instance_t *restrict instance) {
+    TRICAL_covariance_t *restrict covariance = instance->state_covariance;
+    TRICAL_covariance_t l_ii;
+    float scale;
+    unsigned int i;
+
+    if (instance->forgetting < 1.0f) {
+        scale = instance->square_root ? sqrt_inv(instance->forgetting) :
+                                        recip(instance->forgetting);
+        #pragma MUST_ITERATE(TRICAL_COVARIANCE_DIM, TRICAL_COVARIANCE_DIM)
+        for (i = 0; i < TRICAL_COVARIANCE_DIM; i++) {
+            covariance[i] *= (TRICAL_covariance_t)scale;
+        }
+    }
+
+    if (instance->process_noise > 0.0f) {
+        #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM)
+        for (i = 0; i < TRICAL_STATE_DIM; i++) {
+            if (instance->square_root) {
+                l_ii = covariance[TRICAL_COVARIANCE_INDEX(i, i)];
+                l_ii = l_ii * l_ii +
+                       (TRICAL_covariance_t)instance->process_noise;
+                covariance[TRICAL_COVARIANCE_INDEX(i, i)] =
+                    (TRICAL_covariance_t)sqrt(l_ii);
+            } else {
+                covariance[TRICAL_COVARIANCE_INDEX(i, i)] +=
+                    (TRICAL_covariance_t)instance->process_noise;
+            }
+        }
+    }
+}
+
+/*
+_factorize
+Writes the Cholesky factor of the state covariance of `instance`, multiplied
+by sqrt(TRICAL_DIM_PLUS_LAMBDA), to `workspace->covariance_llt` (factorizing
+the covariance first unless the instance is in square-root mode). Returns
+non-zero if every pivot of the factor is positive and finite; if not, the
+factor is unusable, and the covariance needs repairing.
+*/
+static unsigned int _factorize(TRICAL_instance_t *restrict instance,
+TRICAL_workspace_t *restrict workspace);
+
+static unsigned int _factorize(TRICAL_instance_t *restrict instance,
+TRICAL_workspace_t *restrict workspace) {
+    TRICAL_covariance_t *restrict covariance = instance->state_covariance;
+    float *restrict covariance_llt = workspace->covariance_llt;
+    float temp;
+    unsigned int i, j, finite;
+
+    if (instance->square_root) {
+        /*
+        The Cholesky factor is already available, so just scale it by
+        sqrt(TRICAL_DIM_PLUS_LAMBDA). Nothing below the diagonal feeds into
+        the pivots, so check the rest of the factor is finite on the way.
+        */
+        temp = fsqrt(TRICAL_DIM_PLUS_LAMBDA);
+        finite = 1u;
+        #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+        for (j = 0; j < TRICAL_STATE_DIM; j++) {
+            for (i = j; i < TRICAL_STATE_DIM; i++) {
+                covariance_llt[j * TRICAL_STATE_DIM + i] =
+                    (float)covariance[TRICAL_COVARIANCE_INDEX(i, j)] * temp;
+                finite &= (float)fabs(covariance_llt[j * TRICAL_STATE_DIM +
+                                                     i]) <= FLT_MAX;
+            }
+        }
+
+        if (!finite) {
+            return 0;
+        }
+    } else {
+        /*
+        LLT decomposition on state covariance matrix, with result multiplied
+        by TRICAL_DIM_PLUS_LAMBDA
+        */
+#ifdef TRICAL_DOUBLE_COVARIANCE
+        /*
+        Decompose in double precision, then round the factor to single
+        precision for sigma point generation
+        */
+        double *restrict llt = workspace->covariance_llt_d;
+#ifdef TRICAL_PACKED_COVARIANCE
+        _cholesky_decomp_scale_packed(TRICAL_STATE_DIM, llt, covariance,
+                                      TRICAL_DIM_PLUS_LAMBDA);
+#else
+        _cholesky_decomp_scale(TRICAL_STATE_DIM, llt, covariance,
+                               TRICAL_DIM_PLUS_LAMBDA);
+#endif
+        #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+        for (j = 0; j < TRICAL_STATE_DIM; j++) {
+            for (i = j; i < TRICAL_STATE_DIM; i++) {
+                covariance_llt[j * TRICAL_STATE_DIM + i] =
+                    (float)llt[j * TRICAL_STATE_DIM + i];
+            }
+        }
+#elif defined(TRICAL_PACKED_COVARIANCE)
+        matrix_cholesky_decomp_scale_packed_f(TRICAL_STATE_DIM,
+            covariance_llt, covariance, TRICAL_DIM_PLUS_LAMBDA);
+#else
+        matrix_cholesky_decomp_scale_f(TRICAL_STATE_DIM, covariance_llt,
+                                       covariance, TRICAL_DIM_PLUS_LAMBDA);
+#endif
+    }
 
     /*
-    LLT decomposition on state covariance matrix, with result multiplied by
-    TRICAL_DIM_PLUS_LAMBDA
+    Written this way round so that NaN pivots fail too. A negative pivot
+    comes out of the factorization as NaN (or zero, where the square root is
+    clamped), and a zero one leaves Inf or NaN in the rest of the factor.
     */
-    float covariance_llt[TRICAL_STATE_DIM * TRICAL_STATE_DIM];
-    memset(covariance_llt, 0, sizeof(covariance_llt));
-    matrix_cholesky_decomp_scale_f(
-        TRICAL_STATE_DIM, covariance_llt, covariance, TRICAL_DIM_PLUS_LAMBDA);
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        temp = covariance_llt[i * TRICAL_STATE_DIM + i];
+        if (!(temp > 0.0f && temp <= FLT_MAX)) {
+            return 0;
+        }
+    }
+
+    return 1u;
+}
+
+/*
+_covariance_repair
+Repairs the state covariance of `instance` after the Cholesky factorization
+has failed for the `attempt`th time in this update. Only the lower triangle
+of the covariance is ever read, so it can't be asymmetric; the repair adds
+jitter to the diagonal instead, starting at TRICAL_REPAIR_JITTER times the
+average state variance and increasing tenfold with each attempt. In
+square-root mode, the jitter is added to the squares of the diagonal
+elements of the factor (as for the process noise) after making them
+positive. If the covariance isn't finite, or TRICAL_REPAIR_ATTEMPTS attempts
+haven't been enough, it's reinitialized as in TRICAL_reset, which keeps the
+state but not its confidence.
+*/
+static void _covariance_repair(TRICAL_instance_t *restrict instance,
+unsigned int attempt);
+
+static void _covariance_repair(TRICAL_instance_t *restrict instance,
+unsigned int attempt) {
+    TRICAL_covariance_t *restrict covariance = instance->state_covariance;
+    TRICAL_covariance_t l_ii, jitter;
+    unsigned int i, j;
+
+    if (attempt == 0) {
+        instance->repair_count++;
+    }
+
+    jitter = 0.0f;
+    #pragma MUST_ITERATE(TRICAL_COVARIANCE_DIM, TRICAL_COVARIANCE_DIM)
+    for (i = 0; i < TRICAL_COVARIANCE_DIM; i++) {
+        if (!((float)fabs(covariance[i]) <= FLT_MAX)) {
+            attempt = TRICAL_REPAIR_ATTEMPTS;
+        }
+    }
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM)
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        l_ii = covariance[TRICAL_COVARIANCE_INDEX(i, i)];
+        jitter += instance->square_root ? l_ii * l_ii :
+                                          (TRICAL_covariance_t)fabs(l_ii);
+    }
+
+    if (attempt >= TRICAL_REPAIR_ATTEMPTS ||
+            !(jitter > (TRICAL_covariance_t)0.0f)) {
+        _trical_covariance_reset(instance);
+        return;
+    }
+
+    jitter *= (TRICAL_covariance_t)(TRICAL_REPAIR_JITTER / TRICAL_STATE_DIM);
+    for (i = 0; i < attempt; i++) {
+        jitter *= (TRICAL_covariance_t)10.0f;
+    }
+
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM)
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        l_ii = covariance[TRICAL_COVARIANCE_INDEX(i, i)];
+        if (instance->square_root) {
+            /* Negating a column of the factor doesn't change the covariance */
+            if (l_ii < (TRICAL_covariance_t)0.0f) {
+                for (j = i; j < TRICAL_STATE_DIM; j++) {
+                    covariance[TRICAL_COVARIANCE_INDEX(j, i)] =
+                        -covariance[TRICAL_COVARIANCE_INDEX(j, i)];
+                }
+            }
+            covariance[TRICAL_COVARIANCE_INDEX(i, i)] =
+                (TRICAL_covariance_t)sqrt(l_ii * l_ii + jitter);
+        } else {
+            covariance[TRICAL_COVARIANCE_INDEX(i, i)] =
+                (TRICAL_covariance_t)fabs(l_ii) + jitter;
+        }
+    }
+}
+
+/*
+_trical_state_repair
+Resets the state and state covariance of `instance` (counting a repair) if
+its state isn't finite, e.g. after it's been set directly. There's nothing to
+roll back to, so it has to start again from scratch. Returns non-zero if it
+was reset.
+*/
+unsigned int _trical_state_repair(TRICAL_instance_t *restrict instance) {
+    unsigned int i;
+
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        if (!((float)fabs(instance->state[i]) <= FLT_MAX)) {
+            memset(instance->state, 0, sizeof(instance->state));
+            _trical_covariance_reset(instance);
+            instance->repair_count++;
+            return 1u;
+        }
+    }
+
+    return 0;
+}
+
+/*
+_trical_filter_step
+Runs a single filter iteration for `instance`: _trical_state_repair, the
+process model, then _trical_filter_correct with `workspace` as scratch space.
+
+Only the lower triangle of the Cholesky factor is written, so the caller must
+zero `workspace->covariance_llt` once before the first call; after that the
+same workspace can be re-used for any number of iterations, of any instance.
+
+Returns TRICAL_STATUS_REPAIRED if the state had to be reset and the reading
+was used, and otherwise the result of _trical_filter_correct.
+*/
+static TRICAL_status_t _trical_filter_step(
+TRICAL_instance_t *restrict instance, TRICAL_workspace_t *restrict workspace,
+const float measurement[3], const float field[3]);
+
+static TRICAL_status_t _trical_filter_step(
+TRICAL_instance_t *restrict instance, TRICAL_workspace_t *restrict workspace,
+const float measurement[3], const float field[3]) {
+    unsigned int repaired;
+    TRICAL_status_t status;
+
+    repaired = _trical_state_repair(instance);
+    _trical_filter_predict(instance);
+
+    status = _trical_filter_correct(instance, workspace, measurement, field);
+    if (repaired && status == TRICAL_STATUS_UPDATED) {
+        status = TRICAL_STATUS_REPAIRED;
+    }
+    return status;
+}
+
+/*
+_trical_filter_correct
+Incorporates a reading into the estimate of `instance`, whose process model
+has already been applied, using `workspace` as scratch space for the scaled
+Cholesky decomposition of the state covariance, the measurement estimates and
+the cross-correlation (see _trical_filter_step for its initialization).
+
+Returns TRICAL_STATUS_UPDATED, or TRICAL_STATUS_REPAIRED if the state
+covariance couldn't be factorized and had to be repaired first. If the
+reading fails the outlier gate, or the update wouldn't leave the estimate
+finite (e.g. with an infinite innovation), it isn't applied, and
+TRICAL_STATUS_REJECTED is returned.
+*/
+TRICAL_status_t _trical_filter_correct(TRICAL_instance_t *restrict instance,
+TRICAL_workspace_t *restrict workspace, const float measurement[3],
+const float field[3]) {
+    TRICAL_status_t status = TRICAL_STATUS_UPDATED;
+    unsigned int i, j, attempt;
+    float temp;
+
+    TRICAL_covariance_t *restrict covariance = instance->state_covariance;
+    float *restrict state = instance->state;
+    float *restrict covariance_llt = workspace->covariance_llt;
+#ifndef TRICAL_FUSED_ITERATE
+    float *restrict measurement_estimates = workspace->measurement_estimates;
+#endif
+    float *restrict cross_correlation = workspace->cross_correlation;
+
+    TRICAL_STATS_TIMER(update_start);
+
+    TRICAL_STATS_TIMER(cholesky_start);
+
+    for (attempt = 0; !_factorize(instance, workspace); attempt++) {
+        _covariance_repair(instance, attempt);
+        status = TRICAL_STATUS_REPAIRED;
+    }
+
+    TRICAL_STATS_ADD_CYCLES(instance, cholesky_cycles, cholesky_start);
 
     _print_matrix("LLT:\n", covariance_llt, TRICAL_STATE_DIM,
                   TRICAL_STATE_DIM);
@@ -171,44 +772,28 @@ float measurement[3], float field[3]) {
     Generate the sigma points, and use them as the basis of the measurement
     estimates
     */
-    float temp_sigma[TRICAL_STATE_DIM], temp;
-    float measurement_estimates[TRICAL_NUM_SIGMA], measurement_estimate_mean;
+    float measurement_estimate_mean, measurement_estimate_covariance,
+          central_deviation;
 
+#ifdef TRICAL_FUSED_ITERATE
+    measurement_estimate_mean = _reduce_fused(state, covariance_llt,
+        measurement, field, &measurement_estimate_covariance,
+        cross_correlation, &central_deviation);
+    central_deviation -= measurement_estimate_mean;
+#else
     measurement_estimate_mean = 0.0;
 
     /*
-    Handle central sigma point -- process the measurement based on the current
-    state vector
+    Evaluate all the sigma points TRICAL_SIMD_WIDTH pairs at a time, then sum
+    the results
     */
-    measurement_estimates[0] = _trical_measurement_reduce(state, measurement,
-                                                          field);
-
-    #pragma MUST_ITERATE(12, 12);
-    for (i = 0, col = 0; i < TRICAL_STATE_DIM; i++, col += TRICAL_STATE_DIM) {
-        /*
-        Handle the positive sigma point -- perturb the state vector based on
-        the current column of the covariance matrix, and process the
-        measurement based on the resulting state estimate
-        */
-        #pragma MUST_ITERATE(12, 12);
-        for (k = col, l = 0; l < TRICAL_STATE_DIM; k++, l++) {
-            temp_sigma[l] = state[l] + covariance_llt[k];
-        }
-        measurement_estimates[i + 1] =
-            _trical_measurement_reduce(temp_sigma, measurement, field);
-
-        /* Handle the negative sigma point -- mirror of the above */
-        #pragma MUST_ITERATE(12, 12);
-        for (k = col, l = 0; l < TRICAL_STATE_DIM; k++, l++) {
-            temp_sigma[l] = state[l] - covariance_llt[k];
-        }
-        measurement_estimates[i + 1 + TRICAL_STATE_DIM] =
-            _trical_measurement_reduce(temp_sigma, measurement, field);
+    _trical_measurement_reduce_sigma(state, covariance_llt, measurement, field,
+                                     measurement_estimates);
 
-        /* Calculate the measurement estimate sum as we go */
-        temp = measurement_estimates[i + 1] +
-               measurement_estimates[i + 1 + TRICAL_STATE_DIM];
-        measurement_estimate_mean += temp;
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        measurement_estimate_mean += measurement_estimates[i + 1] +
+            measurement_estimates[i + 1 + TRICAL_STATE_DIM];
     }
 
     measurement_estimate_mean = measurement_estimate_mean * TRICAL_SIGMA_WMI +
@@ -221,74 +806,129 @@ float measurement[3], float field[3]) {
     While we're at it, calculate the measurement estimate covariance (which
     is a scalar quantity).
     */
-    float measurement_estimate_covariance = 0.0;
+    measurement_estimate_covariance = 0.0;
 
-    #pragma MUST_ITERATE(25, 25);
+    #pragma MUST_ITERATE(TRICAL_NUM_SIGMA, TRICAL_NUM_SIGMA);
     for (i = 0; i < TRICAL_NUM_SIGMA; i++) {
         measurement_estimates[i] -= measurement_estimate_mean;
 
         temp = measurement_estimates[i] * measurement_estimates[i];
         measurement_estimate_covariance += temp;
     }
+    central_deviation = measurement_estimates[0];
 
     _print_matrix("Measurement estimates:\n", measurement_estimates, 1,
                   TRICAL_NUM_SIGMA);
-
-    /* Add the sensor noise to the measurement estimate covariance */
-    temp = instance->measurement_noise * instance->measurement_noise;
-    measurement_estimate_covariance += temp;
-
-    /* Calculate cross-correlation matrix (1 x TRICAL_STATE_DIM) */
-    float cross_correlation[TRICAL_STATE_DIM];
-    memset(cross_correlation, 0, sizeof(cross_correlation));
+#endif
 
     /*
     Calculate the innovation (difference between the expected value, i.e. the
     field norm, and the measurement estimate mean).
     */
-    float innovation;
+    float innovation, sensor_variance;
     innovation = instance->field_norm - measurement_estimate_mean;
+    sensor_variance = instance->measurement_noise *
+                      instance->measurement_noise;
 
-    /* Iterate over sigma points, two at a time */
-    #pragma MUST_ITERATE(12, 12);
-    for (i = 0; i < TRICAL_STATE_DIM; i++) {
-        /* Iterate over the cross-correlation matrix */
-        #pragma MUST_ITERATE(12, 12);
-        for (j = 0; j < TRICAL_STATE_DIM; j++) {
-            /*
-            We're regenerating the sigma points as we go, so that we don't
-            need to store W'.
-            */
-            temp = measurement_estimates[i + 1] *
-                (state[j] + covariance_llt[i * TRICAL_STATE_DIM + j]);
-            cross_correlation[j] += temp;
+    /*
+    Outlier gate: a chi-square test (with one degree of freedom) on the
+    innovation, normalized by its variance. The measurement estimate
+    covariance is an unweighted sum over the sigma points -- about
+    2 x TRICAL_DIM_PLUS_LAMBDA times the variance -- so the variance is
+    worked out again with the sigma point weights. The central point is left
+    out of it: it contributes little, and its weight can be negative, which
+    could make the variance negative too.
 
-            temp = measurement_estimates[i + 1 + TRICAL_STATE_DIM] *
-                (state[j] - covariance_llt[i * TRICAL_STATE_DIM + j]);
-            cross_correlation[j] += temp;
+    Written this way round so a NaN innovation gets through to the
+    finiteness check below, and is rejected there instead.
+    */
+    if (instance->gate_outlier > 0.0f) {
+        temp = (measurement_estimate_covariance -
+                central_deviation * central_deviation) * TRICAL_SIGMA_WCI +
+               sensor_variance;
+        if (innovation * innovation > instance->gate_outlier * temp) {
+#ifdef TRICAL_STATS
+            instance->stats.outlier_count++;
+#endif
+            TRICAL_STATS_ADD_CYCLES(instance, update_cycles, update_start);
+            return TRICAL_STATUS_REJECTED;
         }
     }
 
+    /* Add the sensor noise to the measurement estimate covariance */
+    measurement_estimate_covariance += sensor_variance;
+
+#ifdef TRICAL_STATS
+    _stats_update(instance, covariance_llt, innovation);
+#endif
+
+#ifndef TRICAL_FUSED_ITERATE
     /*
-    Scale the results of the previous step, and add in the scaled central
-    sigma point
+    Calculate the cross-correlation matrix (1 x TRICAL_STATE_DIM). Sigma
+    points i + 1 and i + 1 + TRICAL_STATE_DIM are the state plus and minus
+    column i of the Cholesky factor, and the weighted mean of the sigma
+    points is the state, so each pair adds the difference of its measurement
+    estimates times that column. The difference doesn't depend on the
+    measurement estimate mean (which has been subtracted from both by now),
+    and there's no need to store W'.
+
+    This is left until the reading has got past the outlier gate, so a
+    rejected reading doesn't pay for it. (The fused reduction can't separate
+    it out, so it's been calculated already.)
     */
-    #pragma MUST_ITERATE(12, 12);
+    memset(cross_correlation, 0, sizeof(workspace->cross_correlation));
+
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        temp = measurement_estimates[i + 1] -
+               measurement_estimates[i + 1 + TRICAL_STATE_DIM];
+
+        /* Column i of the factor is zero above the diagonal */
+        #pragma MUST_ITERATE(1, TRICAL_STATE_DIM);
+        for (j = i; j < TRICAL_STATE_DIM; j++) {
+            cross_correlation[j] += temp *
+                                    covariance_llt[i * TRICAL_STATE_DIM + j];
+        }
+    }
+
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
     for (j = 0; j < TRICAL_STATE_DIM; j++) {
-        temp = TRICAL_SIGMA_WC0 * measurement_estimates[0] * state[j];
-        cross_correlation[j] = TRICAL_SIGMA_WCI * cross_correlation[j] + temp;
+        cross_correlation[j] *= TRICAL_SIGMA_WCI;
     }
+#endif
 
     _print_matrix("Cross-correlation:\n", cross_correlation, 1,
                   TRICAL_STATE_DIM);
 
+    /*
+    With a finite state and covariance, and a finite reading, the update can
+    still fail to be finite (an infinite field norm, or overflow in the
+    measurement estimates). Everything the update uses is known at this
+    point, so check it before anything is changed, and reject the reading if
+    it's no good. The process model has already been applied, which is
+    right: time has passed whether or not the reading is used.
+    */
+    unsigned int finite =
+        (float)fabs(innovation) <= FLT_MAX &&
+        measurement_estimate_covariance > 0.0f &&
+        measurement_estimate_covariance <= FLT_MAX;
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        finite &= (float)fabs(cross_correlation[i]) <= FLT_MAX;
+    }
+
+    if (!finite) {
+        TRICAL_STATS_ADD_CYCLES(instance, update_cycles, update_start);
+        return TRICAL_STATUS_REJECTED;
+    }
+
     /*
     Update the state -- since the measurement is a scalar, we can calculate
     the Kalman gain and update in a single pass.
     */
     float kalman_gain;
     temp = recip(measurement_estimate_covariance);
-    #pragma MUST_ITERATE(12, 12);
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
     for (i = 0; i < TRICAL_STATE_DIM; i++) {
         kalman_gain = cross_correlation[i] * temp;
         state[i] += kalman_gain * innovation;
@@ -307,20 +947,426 @@ float measurement[3], float field[3]) {
 
     And, of course, since kalman gain is cross correlation *
     (1 / measurement estimate covariance), and we multiply by measurement
-    estimate covariance during the outer product, we can skip that whole step
-    and just use cross correlation instead.
+    estimate covariance during the outer product, one of those factors
+    cancels out and the update is just
+    covariance = covariance - cross correlation *
+                 (transpose of cross correlation) /
+                 measurement estimate covariance
+
+    In square-root mode, the same update is a rank-1 downdate of the Cholesky
+    factor by cross correlation * sqrt(1 / measurement estimate covariance).
+
+    Only the lower triangle is updated; without TRICAL_PACKED_COVARIANCE,
+    it's then copied to the upper triangle.
     */
-    #pragma MUST_ITERATE(12, 12)
-    for (i = 0; i < TRICAL_STATE_DIM; i++) {
-        temp = -cross_correlation[i];
+    if (instance->square_root) {
+        TRICAL_covariance_t *restrict downdate = workspace->downdate;
+        temp = sqrt_inv(measurement_estimate_covariance);
+        #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM)
+        for (i = 0; i < TRICAL_STATE_DIM; i++) {
+            downdate[i] = (TRICAL_covariance_t)(cross_correlation[i] * temp);
+        }
 
-        #pragma MUST_ITERATE(12, 12)
-        for (j = 0; j < TRICAL_STATE_DIM; j++) {
-            covariance[i * TRICAL_STATE_DIM + j] +=
-                temp * cross_correlation[j];
+        TRICAL_STATS_TIMER(downdate_start);
+#ifdef TRICAL_PACKED_COVARIANCE
+        _cholesky_downdate_packed(TRICAL_STATE_DIM, covariance, downdate);
+#else
+        _cholesky_downdate(TRICAL_STATE_DIM, covariance, downdate);
+#endif
+        TRICAL_STATS_ADD_CYCLES(instance, cholesky_cycles, downdate_start);
+    } else {
+        temp = recip(measurement_estimate_covariance);
+        #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM)
+        for (i = 0; i < TRICAL_STATE_DIM; i++) {
+            kalman_gain = -cross_correlation[i] * temp;
+
+#ifdef TRICAL_PACKED_COVARIANCE
+            #pragma MUST_ITERATE(1, TRICAL_STATE_DIM)
+            for (j = i; j < TRICAL_STATE_DIM; j++) {
+                covariance[TRICAL_PACKED_INDEX(j, i)] +=
+                    (TRICAL_covariance_t)kalman_gain *
+                    (TRICAL_covariance_t)cross_correlation[j];
+            }
+#else
+            /*
+            Update the lower triangle and mirror it, so rounding can't make
+            the covariance drift away from symmetric
+            */
+            #pragma MUST_ITERATE(1, TRICAL_STATE_DIM)
+            for (j = i; j < TRICAL_STATE_DIM; j++) {
+                covariance[i * TRICAL_STATE_DIM + j] +=
+                    (TRICAL_covariance_t)kalman_gain *
+                    (TRICAL_covariance_t)cross_correlation[j];
+                covariance[j * TRICAL_STATE_DIM + i] =
+                    covariance[i * TRICAL_STATE_DIM + j];
+            }
+#endif
         }
     }
 
+#ifdef TRICAL_PACKED_COVARIANCE
+    _print_matrix("State covariance:\n", covariance, 1,
+                  TRICAL_COVARIANCE_DIM);
+#else
     _print_matrix("State covariance:\n", covariance, TRICAL_STATE_DIM,
                   TRICAL_STATE_DIM);
+#endif
+
+    TRICAL_STATS_ADD_CYCLES(instance, update_cycles, update_start);
+    return status;
+}
+
+/*
+_trical_direction_bin
+Returns the index (0 to TRICAL_COVERAGE_BINS - 1) of the direction bin
+containing `v`: the unit sphere is split into the six faces of a cube, and
+each face into a TRICAL_COVERAGE_RESOLUTION x TRICAL_COVERAGE_RESOLUTION
+grid.
+
+The grid is uniform in the (gnomonic) face coordinates, so bins near the
+face centres cover slightly more of the sphere than those near the edges,
+which doesn't matter for the purposes of coverage tracking.
+*/
+unsigned int _trical_direction_bin(const float v[3]) {
+    assert(v);
+
+    float a[3], inv;
+    unsigned int axis, u, w, cu, cw;
+
+    a[X] = (float)fabs(v[X]);
+    a[Y] = (float)fabs(v[Y]);
+    a[Z] = (float)fabs(v[Z]);
+
+    /* Pick the face from the dominant axis and its sign */
+    if (a[X] >= a[Y] && a[X] >= a[Z]) {
+        axis = X;
+    } else if (a[Y] >= a[Z]) {
+        axis = Y;
+    } else {
+        axis = Z;
+    }
+    u = (axis + 1u) % 3u;
+    w = (axis + 2u) % 3u;
+
+    /*
+    Then the grid cell from the projection onto that face; a zero vector
+    ends up in the first cell of the +X face
+    */
+    inv = a[axis] > 0.0f ? 0.5f * TRICAL_COVERAGE_RESOLUTION / a[axis] :
+                           0.0f;
+    cu = (unsigned int)((v[u] * inv) + 0.5f * TRICAL_COVERAGE_RESOLUTION);
+    cw = (unsigned int)((v[w] * inv) + 0.5f * TRICAL_COVERAGE_RESOLUTION);
+    if (cu >= TRICAL_COVERAGE_RESOLUTION) {
+        cu = TRICAL_COVERAGE_RESOLUTION - 1u;
+    }
+    if (cw >= TRICAL_COVERAGE_RESOLUTION) {
+        cw = TRICAL_COVERAGE_RESOLUTION - 1u;
+    }
+
+    return ((axis * 2u + (v[axis] < 0.0f ? 1u : 0u)) *
+            TRICAL_COVERAGE_RESOLUTION + cu) * TRICAL_COVERAGE_RESOLUTION + cw;
+}
+
+/*
+_covariance_trace
+Returns the trace of the state covariance of `instance`. In square-root mode
+that's the sum of the squares of the Cholesky factor elements.
+*/
+static float _covariance_trace(
+const TRICAL_instance_t *restrict instance);
+
+static float _covariance_trace(
+const TRICAL_instance_t *restrict instance) {
+    const TRICAL_covariance_t *restrict covariance =
+        instance->state_covariance;
+    TRICAL_covariance_t trace = 0.0f;
+    unsigned int i, j;
+
+    if (instance->square_root) {
+        #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+        for (j = 0; j < TRICAL_STATE_DIM; j++) {
+            for (i = j; i < TRICAL_STATE_DIM; i++) {
+                trace += covariance[TRICAL_COVARIANCE_INDEX(i, j)] *
+                         covariance[TRICAL_COVARIANCE_INDEX(i, j)];
+            }
+        }
+    } else {
+        #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM);
+        for (i = 0; i < TRICAL_STATE_DIM; i++) {
+            trace += covariance[TRICAL_COVARIANCE_INDEX(i, i)];
+        }
+    }
+
+    return (float)trace;
+}
+
+/*
+_trical_filter_gate
+Returns non-zero if the raw sensor reading in `measurement` passes the
+coverage limit and update gate of `instance` (or neither is enabled), and
+should be incorporated into the calibration estimate. The reading's direction
+bin is written to `bin` either way; it's left to the caller to add it to the
+coverage histogram with _trical_coverage_add once the update has used the
+reading, so readings the update rejects don't fill the histogram.
+
+The checks are done in order of cost: the direction bin and innovation both
+come from the reading calibrated with the current estimate (the central sigma
+point of a full update), and the trace needs a pass over the covariance.
+*/
+unsigned int _trical_filter_gate(const TRICAL_instance_t *instance,
+const float measurement[3], const float field[3], unsigned int *bin) {
+    assert(instance && measurement && field && bin);
+
+    float calibrated[3], innovation;
+
+    _calibrate(instance->state, measurement, calibrated);
+    *bin = _trical_direction_bin(calibrated);
+
+    if (instance->coverage_limit &&
+            instance->coverage[*bin] >= instance->coverage_limit) {
+        return 0;
+    }
+
+    if (instance->gate_innovation > 0.0f && instance->coverage[*bin]) {
+        innovation = instance->field_norm -
+                     fsqrt(fabs(calibrated[X] * field[X] +
+                                calibrated[Y] * field[Y] +
+                                calibrated[Z] * field[Z]));
+
+        if ((float)fabs(innovation) <= instance->gate_innovation *
+                                       instance->measurement_noise &&
+                _covariance_trace(instance) <= instance->gate_trace) {
+            return 0;
+        }
+    }
+
+    return 1u;
+}
+
+/*
+_trical_coverage_add
+Adds a reading in direction bin `bin` (from _trical_filter_gate) to the
+coverage histogram of `instance`.
+*/
+void _trical_coverage_add(TRICAL_instance_t *instance, unsigned int bin) {
+    assert(instance);
+    assert(bin < TRICAL_COVERAGE_BINS);
+
+    if (instance->coverage[bin] < USHRT_MAX) {
+        instance->coverage[bin]++;
+    }
+}
+
+/*
+_trical_filter_iterate
+Generates a new calibration estimate for `instance` incorporating the raw
+sensor readings in `measurement`, if they're finite and pass the update gate.
+Returns TRICAL_STATUS_REJECTED for a non-finite reading,
+TRICAL_STATUS_SKIPPED if the update gate skipped it, and otherwise the
+result of the update (see _trical_filter_step).
+
+The update uses `workspace` for its working storage, or if `workspace` is
+NULL, a temporary one on the stack; that's only cleared once the reading has
+passed the gate, so skipped readings stay cheap.
+*/
+TRICAL_status_t _trical_filter_iterate(TRICAL_instance_t *instance,
+TRICAL_workspace_t *workspace, const float measurement[3],
+const float field[3]) {
+    TRICAL_workspace_t temp;
+    TRICAL_status_t status;
+    unsigned int bin;
+
+    if (!_trical_reading_finite(measurement, field)) {
+        return TRICAL_STATUS_REJECTED;
+    }
+
+    if (!_trical_filter_gate(instance, measurement, field, &bin)) {
+        return TRICAL_STATUS_SKIPPED;
+    }
+
+    if (!workspace) {
+        memset(temp.covariance_llt, 0, sizeof(temp.covariance_llt));
+        workspace = &temp;
+    }
+
+    status = _trical_filter_step(instance, workspace, measurement, field);
+    if (status != TRICAL_STATUS_REJECTED) {
+        _trical_coverage_add(instance, bin);
+    }
+    return status;
+}
+
+/*
+_trical_filter_iterate_batch
+Generates a new calibration estimate for `instance` incorporating `count`
+raw sensor readings from `measurements`, each with its own field direction
+estimate from `fields`. Reading `i` starts at `measurements[i *
+measurement_stride]`, and its field direction estimate at `fields[i *
+field_stride]`. Readings which aren't finite, don't pass the update gate or
+are rejected by the update are skipped; returns the number of readings
+incorporated into the estimate.
+
+The working storage is shared between all iterations, so if `workspace` is
+NULL, the temporary one on the stack only needs to be cleared once per batch
+rather than once per reading.
+*/
+unsigned int _trical_filter_iterate_batch(TRICAL_instance_t *instance,
+TRICAL_workspace_t *workspace, const float measurements[],
+unsigned int measurement_stride, const float fields[],
+unsigned int field_stride, unsigned int count) {
+    TRICAL_workspace_t temp;
+    if (!workspace) {
+        memset(temp.covariance_llt, 0, sizeof(temp.covariance_llt));
+        workspace = &temp;
+    }
+
+    unsigned int i, bin, updated = 0;
+    for (i = 0; i < count; i++) {
+        if (!_trical_reading_finite(&measurements[i * measurement_stride],
+                                    &fields[i * field_stride]) ||
+                !_trical_filter_gate(instance,
+                                     &measurements[i * measurement_stride],
+                                     &fields[i * field_stride], &bin)) {
+            continue;
+        }
+
+        if (_trical_filter_step(instance, workspace,
+                                &measurements[i * measurement_stride],
+                                &fields[i * field_stride]) !=
+                TRICAL_STATUS_REJECTED) {
+            _trical_coverage_add(instance, bin);
+            updated++;
+        }
+    }
+
+    return updated;
+}
+
+/*
+_trical_reading_finite
+Returns non-zero if every component of the raw sensor reading in
+`measurement`, and of the reference field `field`, is finite.
+*/
+unsigned int _trical_reading_finite(const float measurement[3],
+const float field[3]) {
+    assert(measurement && field);
+
+    /* Written this way round so that NaNs fail too */
+    return (float)fabs(measurement[X]) <= FLT_MAX &&
+           (float)fabs(measurement[Y]) <= FLT_MAX &&
+           (float)fabs(measurement[Z]) <= FLT_MAX &&
+           (float)fabs(field[X]) <= FLT_MAX &&
+           (float)fabs(field[Y]) <= FLT_MAX &&
+           (float)fabs(field[Z]) <= FLT_MAX;
+}
+
+/*
+_trical_covariance_reset
+Sets the state covariance of `instance` to its initial value: a small
+diagonal, so that we can run the Cholesky decomposition without blowing up.
+In square-root mode, the Cholesky factor of that is just the square root of
+the diagonal.
+*/
+void _trical_covariance_reset(TRICAL_instance_t *instance) {
+    assert(instance);
+
+    float initial = instance->square_root ? 1e-1f : 1e-2f;
+    unsigned int i;
+
+    memset(instance->state_covariance, 0, sizeof(instance->state_covariance));
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        instance->state_covariance[TRICAL_COVARIANCE_INDEX(i, i)] = initial;
+    }
+}
+
+/*
+_trical_covariance_to_sqrt
+Replaces the state covariance matrix in `covariance` with its lower-triangular
+Cholesky factor.
+*/
+void _trical_covariance_to_sqrt(
+TRICAL_covariance_t covariance[TRICAL_COVARIANCE_DIM]) {
+    assert(covariance);
+
+    unsigned int i, j;
+
+#ifdef TRICAL_PACKED_COVARIANCE
+    TRICAL_covariance_t llt[TRICAL_STATE_DIM * TRICAL_STATE_DIM];
+
+    _cholesky_decomp_scale_packed(TRICAL_STATE_DIM, llt, covariance, 1.0f);
+
+    /* Pack the lower triangle back into `covariance` */
+    for (j = 0; j < TRICAL_STATE_DIM; j++) {
+        for (i = j; i < TRICAL_STATE_DIM; i++) {
+            covariance[TRICAL_PACKED_INDEX(i, j)] =
+                llt[j * TRICAL_STATE_DIM + i];
+        }
+    }
+#else
+    /*
+    The decomposition can be done in-place, since it only reads the lower
+    triangle of the input and each element is read before it's written
+    */
+    _cholesky_decomp_scale(TRICAL_STATE_DIM, covariance, covariance, 1.0f);
+
+    /* Clear the upper triangle */
+    for (i = 1; i < TRICAL_STATE_DIM; i++) {
+        for (j = 0; j < i; j++) {
+            covariance[i * TRICAL_STATE_DIM + j] = 0.0f;
+        }
+    }
+#endif
+}
+
+/*
+_trical_covariance_from_sqrt
+Replaces the lower-triangular Cholesky factor in `covariance` with the state
+covariance matrix it represents.
+*/
+void _trical_covariance_from_sqrt(
+TRICAL_covariance_t covariance[TRICAL_COVARIANCE_DIM]) {
+    assert(covariance);
+
+    TRICAL_covariance_t llt[TRICAL_COVARIANCE_DIM];
+    unsigned int i, j, k;
+
+    memcpy(llt, covariance, sizeof(llt));
+
+    /* P = L * Lt */
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        for (j = 0; j <= i; j++) {
+            TRICAL_covariance_t s = 0.0f;
+            for (k = 0; k <= j; k++) {
+                s += llt[TRICAL_COVARIANCE_INDEX(i, k)] *
+                     llt[TRICAL_COVARIANCE_INDEX(j, k)];
+            }
+
+            covariance[TRICAL_COVARIANCE_INDEX(i, j)] = s;
+#ifndef TRICAL_PACKED_COVARIANCE
+            covariance[i * TRICAL_STATE_DIM + j] = s;
+#endif
+        }
+    }
+}
+
+/*
+_trical_covariance_diagonal_from_sqrt
+Copies the diagonal of the state covariance matrix represented by the
+lower-triangular Cholesky factor in `covariance` to `diagonal`.
+*/
+void _trical_covariance_diagonal_from_sqrt(
+const TRICAL_covariance_t covariance[TRICAL_COVARIANCE_DIM],
+float diagonal[TRICAL_STATE_DIM]) {
+    assert(covariance && diagonal);
+
+    TRICAL_covariance_t s;
+    unsigned int i, k;
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        s = 0.0f;
+        for (k = 0; k <= i; k++) {
+            s += covariance[TRICAL_COVARIANCE_INDEX(i, k)] *
+                 covariance[TRICAL_COVARIANCE_INDEX(i, k)];
+        }
+        diagonal[i] = (float)s;
+    }
 }
@@ -27,12 +27,29 @@ SOFTWARE.
 extern "C" {
 #endif
 
-/* Unscented Kalman filter sigma point and scaling parameters. */
+/*
+Unscented Kalman filter sigma point and scaling parameters. TRICAL_ALPHA_2
+(alpha squared), TRICAL_BETA and TRICAL_KAPPA can be overridden at build
+time, e.g. with -DTRICAL_ALPHA_2=0.5f; the derived weights below are all
+constant expressions, so they fold into the filter loops whatever the
+values. TRICAL_ALPHA_2 * (TRICAL_STATE_DIM + TRICAL_KAPPA) must be positive.
+
+The measurement estimate covariance is the unweighted sum of the squared
+deviations of the sigma points, so it, and hence TRICAL_BETA, doesn't depend
+on TRICAL_SIGMA_WC0.
+*/
 #define TRICAL_NUM_SIGMA (2 * TRICAL_STATE_DIM + 1)
 
+#ifndef TRICAL_ALPHA_2
 #define TRICAL_ALPHA_2 (1.0f)
+#endif
+#ifndef TRICAL_BETA
 #define TRICAL_BETA (0.0f)
+#endif
+#ifndef TRICAL_KAPPA
 #define TRICAL_KAPPA (1.0f)
+#endif
+
 #define TRICAL_LAMBDA (TRICAL_ALPHA_2 * (TRICAL_STATE_DIM + TRICAL_KAPPA) - \
                        TRICAL_STATE_DIM)
 #define TRICAL_DIM_PLUS_LAMBDA (TRICAL_ALPHA_2 * \
@@ -44,6 +61,23 @@ extern "C" {
 #define TRICAL_SIGMA_WMI (1.0f / (2.0f * TRICAL_DIM_PLUS_LAMBDA))
 #define TRICAL_SIGMA_WCI (TRICAL_SIGMA_WMI)
 
+/*
+Index of element (i, j), i >= j, of a packed lower-triangular
+TRICAL_STATE_DIM x TRICAL_STATE_DIM matrix stored column by column
+*/
+#define TRICAL_PACKED_INDEX(i, j) \
+    ((i) + ((j) * (2u * TRICAL_STATE_DIM - (j) - 1u)) / 2u)
+
+/*
+Index of element (i, j), i >= j, of TRICAL_instance_t.state_covariance, in
+either the full column-major or the packed layout
+*/
+#ifdef TRICAL_PACKED_COVARIANCE
+#define TRICAL_COVARIANCE_INDEX(i, j) TRICAL_PACKED_INDEX((i), (j))
+#else
+#define TRICAL_COVARIANCE_INDEX(i, j) ((i) + (j) * TRICAL_STATE_DIM)
+#endif
+
 /* Internal function prototypes */
 
 /*
@@ -51,8 +85,21 @@ _trical_measurement_reduce
 Reduces `measurement` to a scalar value based on the calibration estimate in
 `state`.
 */
-float _trical_measurement_reduce(float state[TRICAL_STATE_DIM], float
-measurement[3], float field[3]);
+float _trical_measurement_reduce(const float state[TRICAL_STATE_DIM],
+const float measurement[3], const float field[3]);
+
+/*
+_trical_measurement_reduce_sigma
+Evaluates _trical_measurement_reduce for every sigma point generated from
+`state` and the columns of the scaled Cholesky factor `covariance_llt`,
+writing the results to `measurement_estimates` in the same order as
+_trical_filter_iterate: central point first, then the positive sigma points,
+then the negative ones.
+*/
+void _trical_measurement_reduce_sigma(const float state[TRICAL_STATE_DIM],
+const float covariance_llt[TRICAL_STATE_DIM * TRICAL_STATE_DIM],
+const float measurement[3], const float field[3],
+float measurement_estimates[TRICAL_NUM_SIGMA]);
 
 /*
 _trical_measurement_calibrate
@@ -60,16 +107,161 @@ Calibrates `measurement` based on the calibration estimate in `state` and
 copies the result to `calibrated_measurement`. The `measurement` and
 `calibrated_measurement` parameters may be pointers to the same vector.
 */
-void _trical_measurement_calibrate(float state[TRICAL_STATE_DIM],
-float measurement[3], float calibrated_measurement[3]);
+void _trical_measurement_calibrate(const float state[TRICAL_STATE_DIM],
+const float measurement[3], float calibrated_measurement[3]);
+
+/*
+_trical_direction_bin
+Returns the index (0 to TRICAL_COVERAGE_BINS - 1) of the direction bin
+containing `v`: the unit sphere is split into the six faces of a cube, and
+each face into a TRICAL_COVERAGE_RESOLUTION x TRICAL_COVERAGE_RESOLUTION
+grid.
+*/
+unsigned int _trical_direction_bin(const float v[3]);
+
+/*
+_trical_filter_gate
+Returns non-zero if the raw sensor reading in `measurement` passes the
+coverage limit and update gate of `instance` (or neither is enabled), and
+should be incorporated into the calibration estimate. The reading's direction
+bin is written to `bin`, to be added to the coverage histogram with
+_trical_coverage_add once the update has used the reading.
+*/
+unsigned int _trical_filter_gate(const TRICAL_instance_t *instance,
+const float measurement[3], const float field[3], unsigned int *bin);
+
+/*
+_trical_coverage_add
+Adds a reading in direction bin `bin` (from _trical_filter_gate) to the
+coverage histogram of `instance`.
+*/
+void _trical_coverage_add(TRICAL_instance_t *instance, unsigned int bin);
+
+/*
+_trical_filter_predict
+Applies the process model (forgetting factor and process noise) of
+`instance` to its state covariance, as at the start of every filter
+iteration.
+*/
+void _trical_filter_predict(TRICAL_instance_t *instance);
+
+/*
+_trical_state_repair
+Resets the state and state covariance of `instance`, counting a repair, if
+its state isn't finite. Returns non-zero if it was reset. Called at the start
+of every filter iteration, before _trical_filter_predict.
+*/
+unsigned int _trical_state_repair(TRICAL_instance_t *instance);
+
+/*
+_trical_filter_correct
+Incorporates the raw sensor reading in `measurement` into the estimate of
+`instance`, whose process model has already been applied: the rest of a
+filter iteration, including the covariance repair, outlier gate and
+finiteness checks. `workspace` is working storage, with its
+`covariance_llt` zeroed before first use. Returns TRICAL_STATUS_UPDATED,
+TRICAL_STATUS_REPAIRED or TRICAL_STATUS_REJECTED; a rejected reading may
+still have been preceded by a covariance repair.
+*/
+TRICAL_status_t _trical_filter_correct(TRICAL_instance_t *instance,
+TRICAL_workspace_t *workspace, const float measurement[3],
+const float field[3]);
 
 /*
 _trical_filter_iterate
 Generates a new calibration estimate for `instance` incorporating the raw
-sensor readings in `measurement`.
+sensor readings in `measurement`, if they're finite and pass the update
+gate, and returns the result (see TRICAL_status_t). `workspace` is used as
+working storage, or if NULL, a temporary workspace on the stack.
+*/
+TRICAL_status_t _trical_filter_iterate(TRICAL_instance_t *instance,
+TRICAL_workspace_t *workspace, const float measurement[3],
+const float field[3]);
+
+/*
+_trical_filter_iterate_batch
+Generates a new calibration estimate for `instance` incorporating `count`
+raw sensor readings from `measurements`, each with its own field direction
+estimate from `fields`. Reading `i` starts at `measurements[i *
+measurement_stride]`, and its field direction estimate at `fields[i *
+field_stride]`. Readings which aren't finite, don't pass the update gate or
+are rejected by the update are skipped; returns the number of readings
+incorporated into the estimate. `workspace` is used as for
+_trical_filter_iterate.
+*/
+unsigned int _trical_filter_iterate_batch(TRICAL_instance_t *instance,
+TRICAL_workspace_t *workspace, const float measurements[],
+unsigned int measurement_stride, const float fields[],
+unsigned int field_stride, unsigned int count);
+
+/*
+_trical_reading_finite
+Returns non-zero if every component of the raw sensor reading in
+`measurement`, and of the reference field `field`, is finite.
+*/
+unsigned int _trical_reading_finite(const float measurement[3],
+const float field[3]);
+
+/*
+_trical_covariance_reset
+Sets the state covariance of `instance` to its initial value (as after
+TRICAL_reset), for the instance's current covariance mode.
+*/
+void _trical_covariance_reset(TRICAL_instance_t *instance);
+
+/*
+_trical_covariance_to_sqrt
+Replaces the state covariance matrix in `covariance` with its lower-triangular
+Cholesky factor.
+*/
+void _trical_covariance_to_sqrt(
+TRICAL_covariance_t covariance[TRICAL_COVARIANCE_DIM]);
+
+/*
+_trical_covariance_from_sqrt
+Replaces the lower-triangular Cholesky factor in `covariance` with the state
+covariance matrix it represents.
+*/
+void _trical_covariance_from_sqrt(
+TRICAL_covariance_t covariance[TRICAL_COVARIANCE_DIM]);
+
+/*
+_trical_covariance_diagonal_from_sqrt
+Copies the diagonal of the state covariance matrix represented by the
+lower-triangular Cholesky factor in `covariance` to `diagonal`.
+*/
+void _trical_covariance_diagonal_from_sqrt(
+const TRICAL_covariance_t covariance[TRICAL_COVARIANCE_DIM],
+float diagonal[TRICAL_STATE_DIM]);
+
+/*
+_trical_publish
+Publishes the calibration estimate of `instance` to the TRICAL_published_t
+attached by TRICAL_published_set, if there is one.
+*/
+void _trical_publish(const TRICAL_instance_t *instance);
+
+/*
+_trical_publish_begin
+Marks a publication to `published` as in progress, and returns the buffer
+the new estimate should be written to before calling _trical_publish_end.
+*/
+TRICAL_frozen_t *_trical_publish_begin(TRICAL_published_t *published);
+
+/*
+_trical_publish_end
+Completes the publication started by _trical_publish_begin, switching
+readers over to the new estimate.
+*/
+void _trical_publish_end(TRICAL_published_t *published);
+
+/*
+_trical_published_retry
+Returns non-zero if a copy of the estimate in `published` started when its
+sequence was `sequence` may have been overwritten since, and must be retried.
 */
-void _trical_filter_iterate(TRICAL_instance_t *instance,
-float measurement[3], float field[3]);
+unsigned int _trical_published_retry(const TRICAL_published_t *published,
+unsigned int sequence);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,87 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _FILTER_SIMD_H_
+#define _FILTER_SIMD_H_
+
+#include "simd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Vectorized filter kernels for the instance bank, which uses the vector lanes
+for different instances.
+*/
+
+/*
+_trical_measurement_reduce_lanes
+Vector equivalent of _trical_measurement_reduce: reduces `measurement` to a
+scalar value for each of the TRICAL_SIMD_WIDTH states in `s`. All arguments
+are in structure-of-arrays form, so `s[i]` holds state element `i` for every
+lane, and `measurement[X]` holds the X component of every lane's measurement.
+*/
+static inline vfloat_t _trical_measurement_reduce_lanes(
+const vfloat_t *restrict s, const vfloat_t *restrict measurement,
+const vfloat_t *restrict field) {
+    vfloat_t v0, v1, v2, c0, c1, c2;
+
+    v0 = vf_sub(measurement[0], s[0]);
+    v1 = vf_sub(measurement[1], s[1]);
+    v2 = vf_sub(measurement[2], s[2]);
+
+#if TRICAL_STATE_DIM == 12
+    vfloat_t one = vf_set1(1.0f);
+
+    /* 3x3 matrix multiply, as in _trical_measurement_calibrate */
+    c0 = vf_add(vf_add(vf_mul(v0, vf_add(s[3], one)), vf_mul(v1, s[4])),
+                vf_mul(v2, s[5]));
+    c1 = vf_add(vf_add(vf_mul(v0, s[6]), vf_mul(v1, vf_add(s[7], one))),
+                vf_mul(v2, s[8]));
+    c2 = vf_add(vf_add(vf_mul(v0, s[9]), vf_mul(v1, s[10])),
+                vf_mul(v2, vf_add(s[11], one)));
+#elif TRICAL_STATE_DIM == 6
+    vfloat_t one = vf_set1(1.0f);
+
+    /* Diagonal scale only */
+    c0 = vf_mul(v0, vf_add(s[3], one));
+    c1 = vf_mul(v1, vf_add(s[4], one));
+    c2 = vf_mul(v2, vf_add(s[5], one));
+#else
+    /* Bias only */
+    c0 = v0;
+    c1 = v1;
+    c2 = v2;
+#endif
+
+    c0 = vf_add(vf_add(vf_mul(c0, field[0]), vf_mul(c1, field[1])),
+                vf_mul(c2, field[2]));
+
+    return vf_sqrt(vf_abs(c0));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
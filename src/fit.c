@@ -0,0 +1,632 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <assert.h>
+#include <math.h>
+#include <float.h>
+#include <string.h>
+
+#include "TRICAL.h"
+#include "filter.h"
+#include "3dmath.h"
+
+/*
+The fit finds the ellipsoid x'Mx + 2u'x = 1 that best matches the readings in
+the least-squares sense, by solving the normal equations of
+phi(x) . v = 1 for the ellipsoid parameters
+v = (M00, M11, M22, M01, M02, M12, u0, u1, u2). The centre of the ellipsoid is
+the bias, b = -inv(M) u, and mapping it onto a sphere of radius `norm` gives
+the scale as the symmetric square root of M norm^2 / (1 + b'Mb).
+
+The reduced calibration models fit fewer parameters: TRICAL_FIT_PARAMS is the
+number, and _fit_param maps each of the TRICAL_FIT_TERMS ellipsoid parameters
+onto one of them (or -1 for parameters fixed at zero). The 6-state model fits
+an axis-aligned ellipsoid, and the 3-state model a sphere.
+*/
+#if TRICAL_STATE_DIM == 12
+#define TRICAL_FIT_PARAMS 9u
+static const int _fit_param[TRICAL_FIT_TERMS] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8
+};
+#elif TRICAL_STATE_DIM == 6
+#define TRICAL_FIT_PARAMS 6u
+static const int _fit_param[TRICAL_FIT_TERMS] = {
+    0, 1, 2, -1, -1, -1, 3, 4, 5
+};
+#else
+#define TRICAL_FIT_PARAMS 4u
+static const int _fit_param[TRICAL_FIT_TERMS] = {
+    0, 0, 0, -1, -1, -1, 1, 2, 3
+};
+#endif
+
+/* Index of element (i, j), i >= j, of TRICAL_fit_t.moments */
+#define TRICAL_FIT_INDEX(i, j) \
+    ((i) + (j) * (2u * TRICAL_FIT_TERMS - (j) - 1u) / 2u)
+
+/*
+Cholesky pivots smaller than this fraction of the corresponding diagonal
+element of the normal matrix are treated as zero, since the readings then
+don't determine the parameters to any useful precision
+*/
+#define TRICAL_FIT_PIVOT_EPSILON 1e-9
+
+/*
+Variance added to the diagonal of the state covariance produced by
+TRICAL_fit_seed. The fitted variances can be tiny, but the single-precision
+filter diverges from a covariance much worse conditioned than this relative
+to TRICAL_FIT_ROTATION_VARIANCE, so it's a floor for every state.
+*/
+#define TRICAL_FIT_MIN_VARIANCE 1e-6
+
+/*
+The fitted ellipsoid's squared semi-axes may be at most this many times the
+total variance of the readings. Readings close to a plane or a line fit a
+much flatter quadric, which doesn't determine the calibration, whereas a
+genuine ellipsoid is well inside the limit even if the readings only cover a
+small cap of directions.
+*/
+#define TRICAL_FIT_MAX_AXIS_RATIO 1e4
+
+/*
+Variance of the rotation part of the scale estimate, which the fit can't
+determine; this matches the initial state covariance set by TRICAL_init
+*/
+#define TRICAL_FIT_ROTATION_VARIANCE 1e-2
+
+static void _fit_eigen(double a[3][3], double q[3][3]);
+static double _fit_spread(const TRICAL_fit_t *fit);
+static unsigned int _fit_state(const double params[TRICAL_FIT_PARAMS],
+double field_norm, double max_axis, double state[TRICAL_STATE_DIM]);
+static unsigned int _fit_params(const TRICAL_fit_t *fit,
+double params[TRICAL_FIT_PARAMS],
+double llt[TRICAL_FIT_PARAMS * TRICAL_FIT_PARAMS]);
+static void _fit_cholesky_solve(
+const double llt[TRICAL_FIT_PARAMS * TRICAL_FIT_PARAMS],
+double x[TRICAL_FIT_PARAMS]);
+
+/*
+TRICAL_fit_init:
+Initializes `fit` with no readings. Must be called before `fit` is passed to
+any other TRICAL_fit procedures.
+*/
+void TRICAL_fit_init(TRICAL_fit_t *fit) {
+    assert(fit);
+
+    memset(fit, 0, sizeof(TRICAL_fit_t));
+}
+
+/*
+TRICAL_fit_add:
+Adds the raw sensor reading `measurement` to `fit`.
+*/
+void TRICAL_fit_add(TRICAL_fit_t *fit, const float measurement[3]) {
+    assert(fit);
+    assert(measurement);
+
+    TRICAL_fit_add_many(fit, measurement, 3u, 1u);
+}
+
+/*
+TRICAL_fit_add_many:
+Adds `count` raw sensor readings to `fit`. Reading `i` is read from
+`measurements + i * measurement_stride`, as for
+TRICAL_estimate_update_batch.
+*/
+void TRICAL_fit_add_many(TRICAL_fit_t *fit, const float measurements[],
+unsigned int measurement_stride, unsigned int count) {
+    assert(fit);
+    assert(measurements || !count);
+    assert(measurement_stride >= 3u || count <= 1u);
+
+    double phi[TRICAL_FIT_TERMS], x, y, z;
+    const float *restrict m;
+    unsigned int n, i, j, k;
+
+    for (n = 0; n < count; n++) {
+        m = &measurements[n * measurement_stride];
+        x = m[X];
+        y = m[Y];
+        z = m[Z];
+
+        phi[0] = x * x;
+        phi[1] = y * y;
+        phi[2] = z * z;
+        phi[3] = 2.0 * x * y;
+        phi[4] = 2.0 * x * z;
+        phi[5] = 2.0 * y * z;
+        phi[6] = 2.0 * x;
+        phi[7] = 2.0 * y;
+        phi[8] = 2.0 * z;
+
+        #pragma MUST_ITERATE(TRICAL_FIT_TERMS, TRICAL_FIT_TERMS)
+        for (j = 0, k = 0; j < TRICAL_FIT_TERMS; j++) {
+            fit->terms[j] += phi[j];
+            for (i = j; i < TRICAL_FIT_TERMS; i++, k++) {
+                fit->moments[k] += phi[i] * phi[j];
+            }
+        }
+    }
+
+    fit->count += count;
+}
+
+/*
+TRICAL_fit_merge:
+Adds the readings accumulated in `other` to `fit`.
+*/
+void TRICAL_fit_merge(TRICAL_fit_t *fit, const TRICAL_fit_t *other) {
+    assert(fit);
+    assert(other);
+    assert(fit != other);
+
+    unsigned int i;
+
+    #pragma MUST_ITERATE(TRICAL_FIT_MOMENTS, TRICAL_FIT_MOMENTS)
+    for (i = 0; i < TRICAL_FIT_MOMENTS; i++) {
+        fit->moments[i] += other->moments[i];
+    }
+
+    #pragma MUST_ITERATE(TRICAL_FIT_TERMS, TRICAL_FIT_TERMS)
+    for (i = 0; i < TRICAL_FIT_TERMS; i++) {
+        fit->terms[i] += other->terms[i];
+    }
+
+    fit->count += other->count;
+}
+
+/*
+_fit_eigen
+Diagonalizes the symmetric 3x3 matrix `a` in place using cyclic Jacobi
+rotations, and accumulates the eigenvectors as the columns of `q`.
+*/
+static void _fit_eigen(double a[3][3], double q[3][3]) {
+    assert(a);
+    assert(q);
+
+    static const unsigned int pairs[3][2] = { { 0, 1 }, { 0, 2 }, { 1, 2 } };
+    double theta, t, c, s, akp, akr, off, diag;
+    unsigned int sweep, n, p, r, k;
+
+    memset(q, 0, 9u * sizeof(double));
+    q[0][0] = q[1][1] = q[2][2] = 1.0;
+
+    for (sweep = 0; sweep < 32u; sweep++) {
+        off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+        diag = a[0][0] * a[0][0] + a[1][1] * a[1][1] + a[2][2] * a[2][2];
+        if (off <= 1e-30 * diag) {
+            break;
+        }
+
+        for (n = 0; n < 3u; n++) {
+            p = pairs[n][0];
+            r = pairs[n][1];
+            if (fabs(a[p][r]) < DBL_MIN) {
+                continue;
+            }
+
+            /* Rotation angle which zeroes a[p][r] */
+            theta = (a[r][r] - a[p][p]) / (2.0 * a[p][r]);
+            t = 1.0 / (fabs(theta) + sqrt(theta * theta + 1.0));
+            if (theta < 0.0) {
+                t = -t;
+            }
+            c = 1.0 / sqrt(t * t + 1.0);
+            s = t * c;
+
+            for (k = 0; k < 3u; k++) {
+                akp = a[k][p];
+                akr = a[k][r];
+                a[k][p] = c * akp - s * akr;
+                a[k][r] = s * akp + c * akr;
+            }
+            for (k = 0; k < 3u; k++) {
+                akp = a[p][k];
+                akr = a[r][k];
+                a[p][k] = c * akp - s * akr;
+                a[r][k] = s * akp + c * akr;
+            }
+            for (k = 0; k < 3u; k++) {
+                akp = q[k][p];
+                akr = q[k][r];
+                q[k][p] = c * akp - s * akr;
+                q[k][r] = s * akp + c * akr;
+            }
+        }
+    }
+}
+
+/*
+_fit_spread
+Returns the total variance of the readings added to `fit`, i.e. the trace of
+their covariance.
+*/
+static double _fit_spread(const TRICAL_fit_t *fit) {
+    assert(fit);
+    assert(fit->count);
+
+    double n = (double)fit->count, mean, spread = 0.0;
+    unsigned int i;
+
+    for (i = 0; i < 3u; i++) {
+        mean = fit->terms[6u + i] / (2.0 * n);
+        spread += fit->terms[i] / n - mean * mean;
+    }
+
+    return spread;
+}
+
+/*
+_fit_state
+Converts the fitted ellipsoid parameters `params` to a filter state for a
+field of magnitude `field_norm`. Returns zero if the parameters don't
+describe an ellipsoid (M isn't positive-definite), or if any of its squared
+semi-axes exceeds `max_axis`.
+*/
+static unsigned int _fit_state(const double params[TRICAL_FIT_PARAMS],
+double field_norm, double max_axis, double state[TRICAL_STATE_DIM]) {
+    assert(params);
+    assert(state);
+
+    double v[TRICAL_FIT_TERMS], a[3][3], q[3][3], qu[3], scale[3], k;
+    unsigned int i, j;
+
+    #pragma MUST_ITERATE(TRICAL_FIT_TERMS, TRICAL_FIT_TERMS)
+    for (i = 0; i < TRICAL_FIT_TERMS; i++) {
+        v[i] = _fit_param[i] < 0 ? 0.0 : params[_fit_param[i]];
+    }
+
+    a[0][0] = v[0];
+    a[1][1] = v[1];
+    a[2][2] = v[2];
+    a[0][1] = a[1][0] = v[3];
+    a[0][2] = a[2][0] = v[4];
+    a[1][2] = a[2][1] = v[5];
+    _fit_eigen(a, q);
+
+    /*
+    With M = Q diag(lambda) Q', the bias is -Q diag(1/lambda) Q' u, and
+    b'Mb = sum((Q'u)_i^2 / lambda_i)
+    */
+    k = 1.0;
+    for (i = 0; i < 3u; i++) {
+        if (!(a[i][i] > 0.0 && a[i][i] <= DBL_MAX)) {
+            return 0;
+        }
+        qu[i] = (q[X][i] * v[6] + q[Y][i] * v[7] + q[Z][i] * v[8]) / a[i][i];
+        k += qu[i] * qu[i] * a[i][i];
+    }
+
+    /* The squared semi-axes of the ellipsoid are k / lambda_i */
+    for (i = 0; i < 3u; i++) {
+        if (!(k <= max_axis * a[i][i])) {
+            return 0;
+        }
+    }
+
+    for (i = 0; i < 3u; i++) {
+        state[i] = -(q[i][X] * qu[X] + q[i][Y] * qu[Y] + q[i][Z] * qu[Z]);
+        scale[i] = field_norm * sqrt(a[i][i] / k);
+    }
+
+#if TRICAL_STATE_DIM == 12
+    /* Scale is Q diag(scale) Q' - I, row-major */
+    for (i = 0; i < 3u; i++) {
+        for (j = 0; j < 3u; j++) {
+            state[3u + i * 3u + j] = q[i][X] * scale[X] * q[j][X] +
+                                     q[i][Y] * scale[Y] * q[j][Y] +
+                                     q[i][Z] * scale[Z] * q[j][Z] -
+                                     (i == j ? 1.0 : 0.0);
+        }
+    }
+#elif TRICAL_STATE_DIM == 6
+    /*
+    M is diagonal, but the eigenvalues may have been reordered; the eigenvector
+    for each axis is the one with the largest component along it
+    */
+    for (i = 0; i < 3u; i++) {
+        unsigned int axis = 0;
+        for (j = 1u; j < 3u; j++) {
+            if (fabs(q[i][j]) > fabs(q[i][axis])) {
+                axis = j;
+            }
+        }
+        state[3u + i] = scale[axis] - 1.0;
+    }
+#else
+    (void)j;
+    (void)scale;
+#endif
+
+    return 1u;
+}
+
+/*
+_fit_params
+Solves the normal equations accumulated in `fit` for the parameters of the
+calibration model, and copies the Cholesky factor of the (reduced) normal
+matrix to `llt`. Returns zero if the readings don't determine the
+parameters.
+*/
+static unsigned int _fit_params(const TRICAL_fit_t *fit,
+double params[TRICAL_FIT_PARAMS],
+double llt[TRICAL_FIT_PARAMS * TRICAL_FIT_PARAMS]) {
+    assert(fit);
+    assert(params);
+    assert(llt);
+
+    double normal[TRICAL_FIT_PARAMS * TRICAL_FIT_PARAMS];
+    unsigned int i, j;
+    int pi, pj;
+
+    if (fit->count <= TRICAL_FIT_PARAMS) {
+        return 0;
+    }
+
+    /*
+    Reduce the full system to the model parameters: the normal matrix and
+    right-hand side for the expanded parameters are E'NE and E't, where E
+    maps model parameters onto ellipsoid parameters (_fit_param)
+    */
+    memset(normal, 0, sizeof(normal));
+    memset(params, 0, TRICAL_FIT_PARAMS * sizeof(double));
+    for (j = 0; j < TRICAL_FIT_TERMS; j++) {
+        pj = _fit_param[j];
+        if (pj < 0) {
+            continue;
+        }
+
+        params[pj] += fit->terms[j];
+        for (i = 0; i < TRICAL_FIT_TERMS; i++) {
+            pi = _fit_param[i];
+            if (pi < 0) {
+                continue;
+            }
+
+            normal[(unsigned int)pi + (unsigned int)pj * TRICAL_FIT_PARAMS] +=
+                fit->moments[i >= j ? TRICAL_FIT_INDEX(i, j) :
+                                      TRICAL_FIT_INDEX(j, i)];
+        }
+    }
+
+    memset(llt, 0, TRICAL_FIT_PARAMS * TRICAL_FIT_PARAMS * sizeof(double));
+    matrix_cholesky_decomp_scale_d(TRICAL_FIT_PARAMS, llt, normal, 1.0);
+
+    #pragma MUST_ITERATE(TRICAL_FIT_PARAMS, TRICAL_FIT_PARAMS)
+    for (i = 0; i < TRICAL_FIT_PARAMS; i++) {
+        double pivot = llt[i + i * TRICAL_FIT_PARAMS];
+        if (!(pivot * pivot >
+                    TRICAL_FIT_PIVOT_EPSILON *
+                    normal[i + i * TRICAL_FIT_PARAMS] &&
+                pivot <= DBL_MAX)) {
+            return 0;
+        }
+    }
+
+    _fit_cholesky_solve(llt, params);
+    return 1u;
+}
+
+/*
+_fit_cholesky_solve
+Solves LL'x = x in place, where `llt` is the lower-triangular Cholesky factor
+L, stored column-major.
+*/
+static void _fit_cholesky_solve(
+const double llt[TRICAL_FIT_PARAMS * TRICAL_FIT_PARAMS],
+double x[TRICAL_FIT_PARAMS]) {
+    assert(llt);
+    assert(x);
+
+    unsigned int i, j;
+
+    for (i = 0; i < TRICAL_FIT_PARAMS; i++) {
+        for (j = 0; j < i; j++) {
+            x[i] -= llt[i + j * TRICAL_FIT_PARAMS] * x[j];
+        }
+        x[i] /= llt[i + i * TRICAL_FIT_PARAMS];
+    }
+    for (i = TRICAL_FIT_PARAMS; i-- > 0;) {
+        for (j = i + 1u; j < TRICAL_FIT_PARAMS; j++) {
+            x[i] -= llt[j + i * TRICAL_FIT_PARAMS] * x[j];
+        }
+        x[i] /= llt[i + i * TRICAL_FIT_PARAMS];
+    }
+}
+
+/*
+TRICAL_fit_solve:
+Fits an ellipsoid to the readings added to `fit`, and copies the bias and
+scale estimates that map it onto a sphere of radius `field_norm` to
+`bias_estimate` and `scale_estimate`, in the same form as
+TRICAL_estimate_get. Returns non-zero on success, or zero (leaving the
+estimates unchanged) if the fit fails.
+*/
+unsigned int TRICAL_fit_solve(const TRICAL_fit_t *fit, float field_norm,
+float bias_estimate[3], float scale_estimate[9]) {
+    assert(fit);
+    assert(field_norm > FLT_EPSILON);
+    assert(bias_estimate);
+    assert(scale_estimate);
+
+    double params[TRICAL_FIT_PARAMS],
+           llt[TRICAL_FIT_PARAMS * TRICAL_FIT_PARAMS],
+           state[TRICAL_STATE_DIM];
+    float state_f[TRICAL_STATE_DIM];
+    unsigned int i;
+
+    if (!_fit_params(fit, params, llt) ||
+            !_fit_state(params, field_norm,
+                        TRICAL_FIT_MAX_AXIS_RATIO * _fit_spread(fit),
+                        state)) {
+        return 0;
+    }
+
+    /*
+    Go via a temporary instance so the model's scale layout is handled in one
+    place
+    */
+    TRICAL_instance_t temp;
+    TRICAL_init(&temp);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        state_f[i] = (float)state[i];
+    }
+    memcpy(temp.state, state_f, sizeof(state_f));
+    TRICAL_estimate_get(&temp, bias_estimate, scale_estimate);
+
+    return 1u;
+}
+
+/*
+TRICAL_fit_seed:
+Replaces the state of `instance` with the result of TRICAL_fit_solve for its
+field norm, and its state covariance with the uncertainty of that result.
+Returns non-zero on success, or zero (leaving `instance` unchanged) if the
+fit fails.
+*/
+unsigned int TRICAL_fit_seed(const TRICAL_fit_t *fit,
+TRICAL_instance_t *instance) {
+    assert(fit);
+    assert(instance);
+
+    double params[TRICAL_FIT_PARAMS], delta[TRICAL_FIT_PARAMS],
+           llt[TRICAL_FIT_PARAMS * TRICAL_FIT_PARAMS],
+           param_covariance[TRICAL_FIT_PARAMS * TRICAL_FIT_PARAMS],
+           jacobian[TRICAL_STATE_DIM * TRICAL_FIT_PARAMS],
+           state[TRICAL_STATE_DIM], hi[TRICAL_STATE_DIM],
+           lo[TRICAL_STATE_DIM], sigma2, h, sum;
+    TRICAL_covariance_t covariance[TRICAL_COVARIANCE_DIM],
+                        covariance_llt[TRICAL_COVARIANCE_DIM], pivot;
+    float state_f[TRICAL_STATE_DIM];
+    unsigned int i, j, k, l;
+
+    if (!_fit_params(fit, params, llt) ||
+            !_fit_state(params, instance->field_norm,
+                        TRICAL_FIT_MAX_AXIS_RATIO * _fit_spread(fit),
+                        state)) {
+        return 0;
+    }
+
+    /*
+    Parameter covariance is sigma^2 inv(N), where sigma^2 is the residual
+    variance; with N v = t, the residual sum of squares is n - t'v
+    */
+    sum = (double)fit->count;
+    for (i = 0; i < TRICAL_FIT_TERMS; i++) {
+        if (_fit_param[i] >= 0) {
+            sum -= fit->terms[i] * params[_fit_param[i]];
+        }
+    }
+    sigma2 = (sum > 0.0 ? sum : 0.0) /
+             (double)(fit->count - TRICAL_FIT_PARAMS);
+
+    for (j = 0; j < TRICAL_FIT_PARAMS; j++) {
+        double *restrict col = &param_covariance[j * TRICAL_FIT_PARAMS];
+        memset(col, 0, TRICAL_FIT_PARAMS * sizeof(double));
+        col[j] = sigma2;
+        _fit_cholesky_solve(llt, col);
+    }
+
+    /*
+    Propagate that to the state through the Jacobian of _fit_state, by central
+    differences; the perturbations stay well inside the region where the
+    parameters describe an ellipsoid, since they're tiny compared with the
+    parameters themselves
+    */
+    for (j = 0; j < TRICAL_FIT_PARAMS; j++) {
+        h = 1e-6 * (fabs(params[j]) > DBL_MIN ? fabs(params[j]) : 1.0);
+        memcpy(delta, params, sizeof(delta));
+        delta[j] = params[j] + h;
+        if (!_fit_state(delta, instance->field_norm, DBL_MAX, hi)) {
+            return 0;
+        }
+        delta[j] = params[j] - h;
+        if (!_fit_state(delta, instance->field_norm, DBL_MAX, lo)) {
+            return 0;
+        }
+        for (i = 0; i < TRICAL_STATE_DIM; i++) {
+            jacobian[i + j * TRICAL_STATE_DIM] = (hi[i] - lo[i]) / (2.0 * h);
+        }
+    }
+
+    memset(covariance, 0, sizeof(covariance));
+    for (j = 0; j < TRICAL_STATE_DIM; j++) {
+        for (i = j; i < TRICAL_STATE_DIM; i++) {
+            sum = i == j ? TRICAL_FIT_MIN_VARIANCE : 0.0;
+            for (k = 0; k < TRICAL_FIT_PARAMS; k++) {
+                for (l = 0; l < TRICAL_FIT_PARAMS; l++) {
+                    sum += jacobian[i + k * TRICAL_STATE_DIM] *
+                           param_covariance[k + l * TRICAL_FIT_PARAMS] *
+                           jacobian[j + l * TRICAL_STATE_DIM];
+                }
+            }
+
+#if TRICAL_STATE_DIM == 12
+            /*
+            The fitted scale is symmetric; give its antisymmetric part (a
+            small rotation) the variance it would have after TRICAL_init, i.e.
+            add that variance times the projector onto antisymmetric
+            matrices
+            */
+            if (i != j && i >= 3u && j >= 3u) {
+                unsigned int ri = (i - 3u) / 3u, ci = (i - 3u) % 3u,
+                             rj = (j - 3u) / 3u, cj = (j - 3u) % 3u;
+                if (ri == cj && ci == rj) {
+                    sum -= 0.5 * TRICAL_FIT_ROTATION_VARIANCE;
+                }
+            } else if (i == j && i >= 3u && (i - 3u) % 4u != 0) {
+                sum += 0.5 * TRICAL_FIT_ROTATION_VARIANCE;
+            }
+#endif
+
+            covariance[TRICAL_COVARIANCE_INDEX(i, j)] =
+                (TRICAL_covariance_t)sum;
+#ifndef TRICAL_PACKED_COVARIANCE
+            covariance[j + i * TRICAL_STATE_DIM] = (TRICAL_covariance_t)sum;
+#endif
+        }
+    }
+
+    /*
+    As for TRICAL_checkpoint_load, only accept a state and covariance the
+    filter can continue from
+    */
+    memcpy(covariance_llt, covariance, sizeof(covariance_llt));
+    _trical_covariance_to_sqrt(covariance_llt);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        state_f[i] = (float)state[i];
+        pivot = covariance_llt[TRICAL_COVARIANCE_INDEX(i, i)];
+        if (!((float)fabs(state_f[i]) <= FLT_MAX &&
+                pivot > (TRICAL_covariance_t)0.0f &&
+                pivot <= (TRICAL_covariance_t)FLT_MAX)) {
+            return 0;
+        }
+    }
+
+    memcpy(instance->state, state_f, sizeof(state_f));
+    memcpy(instance->state_covariance,
+           instance->square_root ? covariance_llt : covariance,
+           sizeof(covariance));
+
+    _trical_publish(instance);
+    return 1u;
+}
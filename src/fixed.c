@@ -0,0 +1,506 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include <assert.h>
+#include <math.h>
+#include <float.h>
+#include <string.h>
+
+#include "TRICAL.h"
+#include "filter.h"
+#include "3dmath.h"
+
+/*
+A bit about the fixed-point implementation: it's the same UKF as
+_trical_filter_iterate in square-root mode (see the notes in filter.c), with
+every quantity in Q2.29 and every product formed in 64 bits. Square roots and
+reciprocals are done with integer arithmetic, so no floating-point code is
+needed at run time -- the filter weights are converted to Q2.29 at compile
+time.
+
+Two things need more care than in the floating-point version:
+* The measurement estimate covariance can be much smaller than one LSB of
+Q2.29 squared, so it's accumulated in Q4.58 (the native format of a Q2.29
+product), and only its square root is used afterwards; the deviations from
+the mean are clamped to +/-1.5 so that the sum of squares can't overflow.
+* The Cholesky downdate divides by the cosine of each rotation, so each
+pivot is only allowed to shrink to 1/8 of its previous value per update
+(instead of sqrt(FLT_EPSILON)), and never below TRICAL_FIXED_MIN_PIVOT,
+which keeps the reciprocal within range. That slows down the first few
+updates slightly, but doesn't otherwise affect convergence.
+
+Right shifts of negative values are assumed to be arithmetic, which is the
+case for every compiler we care about.
+*/
+
+#define TRICAL_FIXED_SHIFT 29
+
+/* Smallest value of any Cholesky factor pivot (about 1e-6) */
+#define TRICAL_FIXED_MIN_PIVOT ((TRICAL_fixed_t)1 << 9)
+
+/* Largest deviation of a sigma point measurement estimate from the mean */
+#define TRICAL_FIXED_MAX_DEVIATION \
+    (TRICAL_FIXED_ONE + (TRICAL_FIXED_ONE >> 1))
+
+/*
+Unscented transform weights in Q2.29; TRICAL_SIGMA_WM0 must be within
+(-4, 4), which limits how small TRICAL_ALPHA_2 can be in this estimator
+*/
+static const TRICAL_fixed_t _sigma_wm0 = (TRICAL_fixed_t)(TRICAL_SIGMA_WM0 *
+                                         (float)TRICAL_FIXED_ONE);
+static const TRICAL_fixed_t _sigma_wmi = (TRICAL_fixed_t)(TRICAL_SIGMA_WMI *
+                                         (float)TRICAL_FIXED_ONE);
+static const TRICAL_fixed_t _sigma_wci = (TRICAL_fixed_t)(TRICAL_SIGMA_WCI *
+                                         (float)TRICAL_FIXED_ONE);
+
+/* TRICAL_DIM_PLUS_LAMBDA in Q4.58, for taking the square root */
+static const uint64_t _dim_plus_lambda_q58 =
+    (uint64_t)(TRICAL_DIM_PLUS_LAMBDA * 268435456.0f) << 30;
+
+/* Internal function prototypes */
+static inline TRICAL_fixed_t _sat(int64_t a);
+static inline TRICAL_fixed_t _mul(TRICAL_fixed_t a, TRICAL_fixed_t b);
+static inline TRICAL_fixed_t _div(int64_t a, TRICAL_fixed_t b);
+static uint32_t _isqrt(uint64_t a);
+static void _calibrate(const TRICAL_fixed_t *restrict s,
+const TRICAL_fixed_t measurement[3], TRICAL_fixed_t calibrated[3]);
+static TRICAL_fixed_t _reduce(const TRICAL_fixed_t *restrict s,
+const TRICAL_fixed_t measurement[3], const TRICAL_fixed_t field[3]);
+static void _downdate(TRICAL_fixed_t *restrict L, TRICAL_fixed_t *restrict x);
+
+/*
+_sat
+Saturates the Q2.29 value `a` to the range of TRICAL_fixed_t.
+*/
+static inline TRICAL_fixed_t _sat(int64_t a) {
+    if (a > INT32_MAX) {
+        return INT32_MAX;
+    } else if (a < INT32_MIN) {
+        return INT32_MIN;
+    } else {
+        return (TRICAL_fixed_t)a;
+    }
+}
+
+/*
+_mul
+Returns the Q2.29 product of `a` and `b`.
+*/
+static inline TRICAL_fixed_t _mul(TRICAL_fixed_t a, TRICAL_fixed_t b) {
+    return _sat(((int64_t)a * b) >> TRICAL_FIXED_SHIFT);
+}
+
+/*
+_div
+Returns `a` / `b`, where `a` is in Q4.58 and `b` in Q2.29 (so the result is
+in Q2.29). Divide Q2.29 values by passing `a` << 29. Saturates if `b` is too
+small, including zero.
+*/
+static inline TRICAL_fixed_t _div(int64_t a, TRICAL_fixed_t b) {
+    if (!b) {
+        return a < 0 ? INT32_MIN : INT32_MAX;
+    }
+
+    return _sat(a / b);
+}
+
+/*
+_isqrt
+Returns floor(sqrt(`a`)); the square root of a Q4.58 value is in Q2.29.
+Bit-by-bit, so it needs no multiplication or division at all.
+*/
+static uint32_t _isqrt(uint64_t a) {
+    uint64_t r = 0, bit = (uint64_t)1 << 62, t, mask;
+
+    while (bit > a) {
+        bit >>= 2;
+    }
+
+    /* Branch-free, since the branch is almost perfectly unpredictable */
+    while (bit) {
+        t = r + bit;
+        mask = (uint64_t)0 - (uint64_t)(a >= t);
+        a -= t & mask;
+        r = (r >> 1) + (bit & mask);
+        bit >>= 2;
+    }
+
+    return (uint32_t)r;
+}
+
+/*
+_calibrate
+Fixed-point equivalent of _trical_measurement_calibrate: calibrated =
+(I + D)(measurement - b), computed as v + Dv to keep the identity exact.
+*/
+static void _calibrate(const TRICAL_fixed_t *restrict s,
+const TRICAL_fixed_t measurement[3], TRICAL_fixed_t calibrated[3]) {
+    TRICAL_fixed_t v[3];
+
+    v[X] = _sat((int64_t)measurement[X] - s[0]);
+    v[Y] = _sat((int64_t)measurement[Y] - s[1]);
+    v[Z] = _sat((int64_t)measurement[Z] - s[2]);
+
+#if TRICAL_STATE_DIM == 12
+    calibrated[X] = _sat(v[X] + (((int64_t)v[X] * s[3] +
+                                  (int64_t)v[Y] * s[4] +
+                                  (int64_t)v[Z] * s[5]) >> TRICAL_FIXED_SHIFT));
+    calibrated[Y] = _sat(v[Y] + (((int64_t)v[X] * s[6] +
+                                  (int64_t)v[Y] * s[7] +
+                                  (int64_t)v[Z] * s[8]) >> TRICAL_FIXED_SHIFT));
+    calibrated[Z] = _sat(v[Z] + (((int64_t)v[X] * s[9] +
+                                  (int64_t)v[Y] * s[10] +
+                                  (int64_t)v[Z] * s[11]) >>
+                                 TRICAL_FIXED_SHIFT));
+#elif TRICAL_STATE_DIM == 6
+    calibrated[X] = _sat((int64_t)v[X] + _mul(v[X], s[3]));
+    calibrated[Y] = _sat((int64_t)v[Y] + _mul(v[Y], s[4]));
+    calibrated[Z] = _sat((int64_t)v[Z] + _mul(v[Z], s[5]));
+#else
+    calibrated[X] = v[X];
+    calibrated[Y] = v[Y];
+    calibrated[Z] = v[Z];
+#endif
+}
+
+/*
+_reduce
+Fixed-point equivalent of _trical_measurement_reduce.
+*/
+static TRICAL_fixed_t _reduce(const TRICAL_fixed_t *restrict s,
+const TRICAL_fixed_t measurement[3], const TRICAL_fixed_t field[3]) {
+    TRICAL_fixed_t c[3];
+    int64_t dot;
+
+    _calibrate(s, measurement, c);
+
+    /* The dot product is in Q4.58, so its square root is in Q2.29 */
+    dot = (int64_t)c[X] * field[X] + (int64_t)c[Y] * field[Y] +
+          (int64_t)c[Z] * field[Z];
+    if (dot < 0) {
+        dot = -dot;
+    }
+
+    return (TRICAL_fixed_t)_isqrt((uint64_t)dot);
+}
+
+/*
+_downdate
+Fixed-point equivalent of matrix_cholesky_downdate_packed_f, with the pivot
+limits described above. `L` is the packed factor, and `x` is destroyed.
+*/
+static void _downdate(TRICAL_fixed_t *restrict L, TRICAL_fixed_t *restrict x) {
+    unsigned int i, k, kp;
+    int64_t l_kk_2, r2;
+    TRICAL_fixed_t r, c, s, inv_c, l_kk;
+
+    for (k = 0, kp = 0; k < TRICAL_STATE_DIM; kp += TRICAL_STATE_DIM - k - 1,
+            k++) {
+        l_kk = L[k + kp];
+        l_kk_2 = (int64_t)l_kk * l_kk;
+        r2 = l_kk_2 - (int64_t)x[k] * x[k];
+
+        /* Don't let the pivot shrink too quickly or reach zero */
+        if (r2 < (l_kk_2 >> 6)) {
+            r2 = l_kk_2 >> 6;
+        }
+
+        r = (TRICAL_fixed_t)_isqrt((uint64_t)r2);
+        if (r < TRICAL_FIXED_MIN_PIVOT) {
+            r = TRICAL_FIXED_MIN_PIVOT;
+        }
+
+        c = _div((int64_t)r << TRICAL_FIXED_SHIFT, l_kk);
+        s = _div((int64_t)x[k] << TRICAL_FIXED_SHIFT, l_kk);
+
+        /* 1/c is at most 8 (more with the minimum pivot), so use Q5.26 */
+        inv_c = _sat(((int64_t)l_kk << 26) / r);
+        L[k + kp] = r;
+
+        #pragma MUST_ITERATE(0, TRICAL_STATE_DIM - 1)
+        for (i = k + 1; i < TRICAL_STATE_DIM; i++) {
+            L[i + kp] = _sat((((int64_t)L[i + kp] - _mul(s, x[i])) * inv_c)
+                             >> 26);
+            x[i] = _sat((int64_t)_mul(c, x[i]) - _mul(s, L[i + kp]));
+        }
+    }
+}
+
+/*
+TRICAL_fixed_init:
+Initializes the fixed-point instance `instance`, with the same defaults as
+TRICAL_init.
+*/
+void TRICAL_fixed_init(TRICAL_fixed_instance_t *instance) {
+    assert(instance);
+
+    memset(instance, 0, sizeof(TRICAL_fixed_instance_t));
+
+    instance->field_norm = TRICAL_FIXED_ONE;
+    instance->measurement_noise = TRICAL_FIXED_FROM_FLOAT(1e-6f);
+
+    TRICAL_fixed_reset(instance);
+}
+
+/*
+TRICAL_fixed_reset:
+Resets the state and state covariance of `instance`.
+*/
+void TRICAL_fixed_reset(TRICAL_fixed_instance_t *instance) {
+    assert(instance);
+
+    memset(instance->state, 0, sizeof(instance->state));
+    memset(instance->state_covariance, 0, sizeof(instance->state_covariance));
+
+    /*
+    Same initial covariance as TRICAL_reset, so the Cholesky factor has a
+    diagonal of 1e-1
+    */
+    unsigned int i;
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        instance->state_covariance[TRICAL_PACKED_INDEX(i, i)] =
+            TRICAL_FIXED_FROM_FLOAT(1e-1f);
+    }
+}
+
+/*
+TRICAL_fixed_norm_set:
+Sets the expected field norm (magnitude) of `instance` to `norm`, which must
+be greater than zero and less than 2.0.
+*/
+void TRICAL_fixed_norm_set(TRICAL_fixed_instance_t *instance,
+TRICAL_fixed_t norm) {
+    assert(instance);
+    assert(norm > 0 && norm < 2 * TRICAL_FIXED_ONE);
+
+    instance->field_norm = norm;
+}
+
+/*
+TRICAL_fixed_norm_get:
+Returns the expected field norm (magnitude) of `instance`.
+*/
+TRICAL_fixed_t TRICAL_fixed_norm_get(const TRICAL_fixed_instance_t *instance) {
+    assert(instance);
+
+    return instance->field_norm;
+}
+
+/*
+TRICAL_fixed_noise_set:
+Sets the standard deviation in measurement supplied to `instance` to `noise`.
+*/
+void TRICAL_fixed_noise_set(TRICAL_fixed_instance_t *instance,
+TRICAL_fixed_t noise) {
+    assert(instance);
+    assert(noise > 0);
+
+    instance->measurement_noise = noise;
+}
+
+/*
+TRICAL_fixed_noise_get:
+Returns the standard deviation in measurements supplied to `instance`.
+*/
+TRICAL_fixed_t TRICAL_fixed_noise_get(
+const TRICAL_fixed_instance_t *instance) {
+    assert(instance);
+
+    return instance->measurement_noise;
+}
+
+/*
+TRICAL_fixed_measurement_count_get:
+Returns the number of measurements previously provided to `instance` via
+TRICAL_fixed_estimate_update.
+*/
+unsigned int TRICAL_fixed_measurement_count_get(
+const TRICAL_fixed_instance_t *instance) {
+    assert(instance);
+
+    return instance->measurement_count;
+}
+
+/*
+TRICAL_fixed_estimate_update:
+Updates the calibration estimate of `instance` based on the new data in
+`measurement`, and the current field direction estimate `reference_field`,
+in the same way as TRICAL_estimate_update for an instance in square-root
+mode.
+*/
+void TRICAL_fixed_estimate_update(TRICAL_fixed_instance_t *instance,
+const TRICAL_fixed_t measurement[3], const TRICAL_fixed_t reference_field[3]) {
+    assert(instance);
+    assert(measurement);
+    assert(reference_field);
+
+    TRICAL_fixed_t *restrict state = instance->state;
+    TRICAL_fixed_t *restrict covariance = instance->state_covariance;
+    TRICAL_fixed_t sigma[TRICAL_STATE_DIM], delta[TRICAL_STATE_DIM],
+                   measurement_estimates[TRICAL_NUM_SIGMA],
+                   cross_correlation[TRICAL_STATE_DIM];
+    TRICAL_fixed_t scale, mean, innovation, covariance_sqrt, temp;
+    int64_t sum;
+    uint64_t measurement_estimate_covariance;
+    unsigned int i, j;
+
+    /* The sigma points are spread by sqrt(TRICAL_DIM_PLUS_LAMBDA) */
+    scale = (TRICAL_fixed_t)_isqrt(_dim_plus_lambda_q58);
+
+    /*
+    Generate the sigma points one column of the Cholesky factor at a time,
+    and evaluate the measurement estimate for each, in the same order as
+    _trical_filter_iterate
+    */
+    measurement_estimates[0] = _reduce(state, measurement, reference_field);
+    sum = 0;
+
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM)
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        for (j = 0; j < TRICAL_STATE_DIM; j++) {
+            delta[j] = j < i ? 0 :
+                _mul(scale, covariance[TRICAL_PACKED_INDEX(j, i)]);
+            sigma[j] = _sat((int64_t)state[j] + delta[j]);
+        }
+        measurement_estimates[i + 1] = _reduce(sigma, measurement,
+                                               reference_field);
+
+        for (j = i; j < TRICAL_STATE_DIM; j++) {
+            sigma[j] = _sat((int64_t)state[j] - delta[j]);
+        }
+        measurement_estimates[i + 1 + TRICAL_STATE_DIM] =
+            _reduce(sigma, measurement, reference_field);
+
+        sum += (int64_t)measurement_estimates[i + 1] +
+               measurement_estimates[i + 1 + TRICAL_STATE_DIM];
+    }
+
+    mean = _sat((sum * _sigma_wmi + (int64_t)measurement_estimates[0] *
+                 _sigma_wm0) >> TRICAL_FIXED_SHIFT);
+
+    /*
+    Convert estimates to deviation from mean, and calculate the measurement
+    estimate covariance in Q4.58, including the sensor noise
+    */
+    measurement_estimate_covariance =
+        (uint64_t)((int64_t)instance->measurement_noise *
+                   instance->measurement_noise);
+
+    #pragma MUST_ITERATE(TRICAL_NUM_SIGMA, TRICAL_NUM_SIGMA)
+    for (i = 0; i < TRICAL_NUM_SIGMA; i++) {
+        temp = _sat((int64_t)measurement_estimates[i] - mean);
+        if (temp > TRICAL_FIXED_MAX_DEVIATION) {
+            temp = TRICAL_FIXED_MAX_DEVIATION;
+        } else if (temp < -TRICAL_FIXED_MAX_DEVIATION) {
+            temp = -TRICAL_FIXED_MAX_DEVIATION;
+        }
+
+        measurement_estimates[i] = temp;
+        measurement_estimate_covariance += (uint64_t)((int64_t)temp * temp);
+    }
+
+    covariance_sqrt = (TRICAL_fixed_t)_isqrt(measurement_estimate_covariance);
+    innovation = _sat((int64_t)instance->field_norm - mean);
+
+    /*
+    Calculate the cross-correlation. The sigma points are x +/- delta, and
+    their weighted mean is x, so only the delta terms (from pairs of sigma
+    points) contribute.
+    */
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM)
+    for (j = 0; j < TRICAL_STATE_DIM; j++) {
+        sum = 0;
+        for (i = 0; i <= j; i++) {
+            sum += ((int64_t)measurement_estimates[i + 1] -
+                    measurement_estimates[i + 1 + TRICAL_STATE_DIM]) *
+                   _mul(scale, covariance[TRICAL_PACKED_INDEX(j, i)]);
+        }
+
+        cross_correlation[j] = _mul(_sat(sum >> TRICAL_FIXED_SHIFT),
+                                    _sigma_wci);
+    }
+
+    /*
+    Update the state and downdate the Cholesky factor, as in square-root
+    mode: with u = cross correlation / sqrt(measurement estimate
+    covariance), the state update is u * innovation / sqrt(covariance), and
+    the covariance downdate is by u
+    */
+    #pragma MUST_ITERATE(TRICAL_STATE_DIM, TRICAL_STATE_DIM)
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        cross_correlation[i] = _div(
+            (int64_t)cross_correlation[i] << TRICAL_FIXED_SHIFT,
+            covariance_sqrt);
+        state[i] = _sat((int64_t)state[i] +
+                        _div((int64_t)cross_correlation[i] * innovation,
+                             covariance_sqrt));
+    }
+
+    _downdate(covariance, cross_correlation);
+
+    instance->measurement_count++;
+}
+
+/*
+TRICAL_fixed_estimate_get:
+Copies the calibration bias and scale estimates of `instance` to
+`bias_estimate` and `scale_estimate` respectively, as for
+TRICAL_estimate_get.
+*/
+void TRICAL_fixed_estimate_get(const TRICAL_fixed_instance_t *instance,
+TRICAL_fixed_t bias_estimate[3], TRICAL_fixed_t scale_estimate[9]) {
+    assert(instance);
+    assert(bias_estimate);
+    assert(scale_estimate);
+    assert(bias_estimate != scale_estimate);
+
+    memcpy(bias_estimate, instance->state, 3 * sizeof(TRICAL_fixed_t));
+
+#if TRICAL_STATE_DIM == 12
+    memcpy(scale_estimate, &instance->state[3], 9 * sizeof(TRICAL_fixed_t));
+#elif TRICAL_STATE_DIM == 6
+    memset(scale_estimate, 0, 9 * sizeof(TRICAL_fixed_t));
+    scale_estimate[0] = instance->state[3];
+    scale_estimate[4] = instance->state[4];
+    scale_estimate[8] = instance->state[5];
+#else
+    memset(scale_estimate, 0, 9 * sizeof(TRICAL_fixed_t));
+#endif
+}
+
+/*
+TRICAL_fixed_measurement_calibrate:
+Calibrates `measurement` based on the current calibration estimates of
+`instance`, and copies the result to `calibrated_measurement`. The
+`measurement` and `calibrated_measurement` parameters may be pointers to the
+same vector.
+*/
+void TRICAL_fixed_measurement_calibrate(
+const TRICAL_fixed_instance_t *instance, const TRICAL_fixed_t measurement[3],
+TRICAL_fixed_t calibrated_measurement[3]) {
+    assert(instance);
+    assert(measurement);
+    assert(calibrated_measurement);
+
+    _calibrate(instance->state, measurement, calibrated_measurement);
+}
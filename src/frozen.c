@@ -0,0 +1,152 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <assert.h>
+#include <math.h>
+#include <float.h>
+#include <string.h>
+
+#include "TRICAL.h"
+#include "simd.h"
+
+/* Number of measurements staged at a time by TRICAL_calibrate_many */
+#define TRICAL_CALIBRATE_CHUNK (32u * TRICAL_SIMD_WIDTH)
+
+/*
+TRICAL_calibrate_many:
+Calibrates the `count` measurements in `measurements` based on the
+calibration in `frozen`, and copies the results to `calibrated_measurements`.
+The results are the same as calling TRICAL_measurement_calibrate on each
+measurement with the instance `frozen` was taken from.
+
+`measurements` and `calibrated_measurements` may point to the same array, but
+mustn't otherwise overlap.
+
+The vector implementation works on the measurements as a flat array of
+floats, TRICAL_SIMD_WIDTH measurements (3 vectors) at a time, so no
+de-interleaving is needed. Each output element is the dot product of a row of
+(I + D) with its measurement, which lies somewhere between 2 elements before
+and 2 elements after the output element in the flat array; so each output
+vector is a sum of 5 shifted input vectors multiplied by the matching
+elements of (I + D). Terms where the shift crosses into a different
+measurement are masked out rather than multiplied by zero, so a non-finite
+measurement doesn't spread to its neighbours.
+*/
+void TRICAL_calibrate_many(const TRICAL_frozen_t *frozen,
+float measurements[][3], float calibrated_measurements[][3],
+unsigned int count) {
+    assert(frozen);
+    assert(measurements || !count);
+    assert(calibrated_measurements || !count);
+
+    const float *restrict b = frozen->bias, *restrict m = frozen->scale;
+    float v[3];
+    unsigned int i = 0;
+
+#if TRICAL_SIMD_WIDTH > 1
+    /*
+    coeffs[j][d] holds the (I + D) elements multiplying the input shifted by
+    d - 2 for output vector j of each block, and masks[j][d] has every bit set
+    in the lanes where that input is part of the same measurement; biases[j]
+    holds the bias elements matching input vector j
+    */
+    float coeffs[3][5][TRICAL_SIMD_WIDTH], masks[3][5][TRICAL_SIMD_WIDTH],
+          biases[3][TRICAL_SIMD_WIDTH], chunk[3 * TRICAL_CALIBRATE_CHUNK + 4];
+    const uint32_t lane_set = UINT32_MAX, lane_clear = 0;
+    vfloat_t acc;
+    unsigned int j, d, w, row, k, n;
+    int col;
+
+    for (j = 0; j < 3; j++) {
+        for (w = 0; w < TRICAL_SIMD_WIDTH; w++) {
+            row = (j * TRICAL_SIMD_WIDTH + w) % 3u;
+            biases[j][w] = b[row];
+
+            for (d = 0; d < 5; d++) {
+                col = (int)row + (int)d - 2;
+                if (col >= 0 && col < 3) {
+                    coeffs[j][d][w] = m[row * 3u + (unsigned int)col];
+                    memcpy(&masks[j][d][w], &lane_set, sizeof(float));
+                } else {
+                    coeffs[j][d][w] = 0.0f;
+                    memcpy(&masks[j][d][w], &lane_clear, sizeof(float));
+                }
+            }
+        }
+    }
+
+    /*
+    Up to TRICAL_CALIBRATE_CHUNK measurements at a time are bias-corrected
+    into a zero-padded buffer before any output is written, which keeps the
+    shifted loads in bounds and makes in-place operation safe. Staging a
+    whole chunk rather than a single block means the buffer stores have left
+    the store buffer by the time the (misaligned) shifted loads read them
+    back, so the loads don't stall on failed store forwarding.
+    */
+    chunk[0] = chunk[1] = 0.0f;
+    for (; i + TRICAL_SIMD_WIDTH <= count; i += n) {
+        n = count - i;
+        if (n > TRICAL_CALIBRATE_CHUNK) {
+            n = TRICAL_CALIBRATE_CHUNK;
+        }
+        n -= n % TRICAL_SIMD_WIDTH;
+
+        for (k = 0; k < 3u * n; k += 3u * TRICAL_SIMD_WIDTH) {
+            for (j = 0; j < 3; j++) {
+                vf_store(&chunk[2 + k + j * TRICAL_SIMD_WIDTH],
+                         vf_sub(vf_load(&measurements[i][0] + k +
+                                        j * TRICAL_SIMD_WIDTH),
+                                vf_load(biases[j])));
+            }
+        }
+        chunk[2 + 3u * n] = chunk[3 + 3u * n] = 0.0f;
+
+        for (k = 0; k < 3u * n; k += 3u * TRICAL_SIMD_WIDTH) {
+            for (j = 0; j < 3; j++) {
+                acc = vf_set1(0.0f);
+                for (d = 0; d < 5; d++) {
+                    acc = vf_add(acc, vf_and(vf_load(masks[j][d]), vf_mul(
+                        vf_load(coeffs[j][d]),
+                        vf_load(&chunk[k + j * TRICAL_SIMD_WIDTH + d]))));
+                }
+
+                vf_store(&calibrated_measurements[i][0] + k +
+                         j * TRICAL_SIMD_WIDTH, acc);
+            }
+        }
+    }
+#endif
+
+    /* Remaining measurements */
+    for (; i < count; i++) {
+        v[0] = measurements[i][0] - b[0];
+        v[1] = measurements[i][1] - b[1];
+        v[2] = measurements[i][2] - b[2];
+
+        calibrated_measurements[i][0] = v[0] * m[0] + v[1] * m[1] +
+                                        v[2] * m[2];
+        calibrated_measurements[i][1] = v[0] * m[3] + v[1] * m[4] +
+                                        v[2] * m[5];
+        calibrated_measurements[i][2] = v[0] * m[6] + v[1] * m[7] +
+                                        v[2] * m[8];
+    }
+}
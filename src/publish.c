@@ -0,0 +1,189 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <assert.h>
+#include <string.h>
+
+#include "TRICAL.h"
+#include "filter.h"
+#include "barrier.h"
+
+/*
+Publication is a sequence lock over two buffers. `sequence` is twice the
+number of publications, plus one while a publication is in progress. The
+writer makes `sequence` odd, fills the buffer readers aren't using, then
+makes it even again; publication n writes buffer n & 1, so the latest
+complete estimate is always in buffer (sequence >> 1) & 1, odd or even.
+
+A reader reads `sequence`, copies that buffer, and reads `sequence` again.
+The buffer is next rewritten by the publication after next, which marks
+itself in progress (sequence rounded down to even, plus three) before it
+touches the buffer, so the copy is good as long as `sequence` hasn't got
+that far. Readers never write to the shared state, so any number of them
+can run at once, and they needn't wait for a publication to finish.
+*/
+
+/*
+TRICAL_published_init:
+Initializes `published` with an identity calibration.
+*/
+void TRICAL_published_init(TRICAL_published_t *published) {
+    assert(published);
+
+    unsigned int i;
+
+    published->sequence = 0;
+    memset(published->estimate, 0, sizeof(published->estimate));
+    for (i = 0; i < 2; i++) {
+        published->estimate[i].scale[0] = 1.0f;
+        published->estimate[i].scale[4] = 1.0f;
+        published->estimate[i].scale[8] = 1.0f;
+    }
+}
+
+/*
+TRICAL_published_set:
+Attaches `published` to `instance` (or detaches it, if NULL), and publishes
+the current calibration estimate.
+*/
+void TRICAL_published_set(TRICAL_instance_t *instance,
+TRICAL_published_t *published) {
+    assert(instance);
+
+    instance->published = published;
+    _trical_publish(instance);
+}
+
+/*
+_trical_publish
+Publishes the calibration estimate of `instance` to the TRICAL_published_t
+attached by TRICAL_published_set, if there is one.
+*/
+void _trical_publish(const TRICAL_instance_t *instance) {
+    assert(instance);
+
+    TRICAL_published_t *published = instance->published;
+    if (!published) {
+        return;
+    }
+
+    TRICAL_frozen_get(instance, _trical_publish_begin(published));
+    _trical_publish_end(published);
+}
+
+/*
+_trical_publish_begin
+Marks a publication to `published` as in progress, and returns the buffer
+the new estimate should be written to before calling _trical_publish_end.
+*/
+TRICAL_frozen_t *_trical_publish_begin(TRICAL_published_t *published) {
+    assert(published);
+    assert(!(published->sequence & 1u));
+
+    /* Only the writer changes `sequence`, so it can be read without care */
+    unsigned int sequence = published->sequence + 1u;
+    published->sequence = sequence;
+
+    /* Make sure readers can see the write is in progress before it starts */
+    TRICAL_MEMORY_BARRIER();
+    return &published->estimate[((sequence >> 1) + 1u) & 1u];
+}
+
+/*
+_trical_publish_end
+Completes the publication started by _trical_publish_begin, switching
+readers over to the new estimate.
+*/
+void _trical_publish_end(TRICAL_published_t *published) {
+    assert(published);
+    assert(published->sequence & 1u);
+
+    /* Make sure the estimate is complete before readers can switch to it */
+    TRICAL_MEMORY_BARRIER();
+    published->sequence = published->sequence + 1u;
+}
+
+/*
+_trical_published_retry
+Returns non-zero if a copy of the estimate in `published` started when its
+sequence was `sequence` may have been overwritten since, and must be retried.
+*/
+unsigned int _trical_published_retry(const TRICAL_published_t *published,
+unsigned int sequence) {
+    assert(published);
+
+    return published->sequence - (sequence & ~1u) > 2u;
+}
+
+/*
+TRICAL_published_get:
+Copies the most recent calibration estimate published to `published` to
+`frozen`, and returns the number of estimates published so far.
+*/
+unsigned int TRICAL_published_get(const TRICAL_published_t *published,
+TRICAL_frozen_t *frozen) {
+    assert(published);
+    assert(frozen);
+
+    unsigned int sequence;
+
+    do {
+        sequence = published->sequence;
+        TRICAL_MEMORY_BARRIER();
+        memcpy(frozen, &published->estimate[(sequence >> 1) & 1u],
+               sizeof(TRICAL_frozen_t));
+        TRICAL_MEMORY_BARRIER();
+    } while (_trical_published_retry(published, sequence));
+
+    return sequence >> 1;
+}
+
+/*
+TRICAL_published_calibrate:
+Calibrates `measurement` based on the most recent calibration estimate
+published to `published`, and copies the result to `calibrated_measurement`.
+*/
+void TRICAL_published_calibrate(const TRICAL_published_t *published,
+const float measurement[3], float calibrated_measurement[3]) {
+    assert(published);
+    assert(measurement);
+    assert(calibrated_measurement);
+
+    TRICAL_frozen_t frozen;
+    float v[3];
+
+    TRICAL_published_get(published, &frozen);
+
+    v[0] = measurement[0] - frozen.bias[0];
+    v[1] = measurement[1] - frozen.bias[1];
+    v[2] = measurement[2] - frozen.bias[2];
+
+    calibrated_measurement[0] = frozen.scale[0] * v[0] +
+                                frozen.scale[1] * v[1] +
+                                frozen.scale[2] * v[2];
+    calibrated_measurement[1] = frozen.scale[3] * v[0] +
+                                frozen.scale[4] * v[1] +
+                                frozen.scale[5] * v[2];
+    calibrated_measurement[2] = frozen.scale[6] * v[0] +
+                                frozen.scale[7] * v[1] +
+                                frozen.scale[8] * v[2];
+}
@@ -0,0 +1,250 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <assert.h>
+#include <string.h>
+
+#include "TRICAL.h"
+#include "filter.h"
+#include "barrier.h"
+
+#if (TRICAL_QUEUE_CAPACITY & (TRICAL_QUEUE_CAPACITY - 1u)) != 0
+#error "TRICAL_QUEUE_CAPACITY must be a power of two"
+#endif
+
+/* Largest decimation factor used by TRICAL_QUEUE_DECIMATE */
+#define TRICAL_QUEUE_MAX_DECIMATION 64u
+
+/*
+The queue is a ring buffer indexed by free-running counters: the producer
+writes entry `head` and then increments `head`, and the consumer reads entry
+`tail` and then increments `tail`, so `head - tail` is the number of queued
+samples, and each side only ever writes its own counter.
+
+Under TRICAL_QUEUE_DECIMATE, the producer never writes to a full queue. The
+other policies overwrite the oldest entry instead, which the consumer may be
+reading at the time, so the producer sets `overwriting` while it does that.
+After copying an entry, the consumer checks `overwriting` and then `head`,
+and discards the copy if the producer has overwritten the entry since
+(`head` has moved more than a queue's length past it) or is overwriting it
+now (`overwriting` is set, and the queue is exactly full).
+*/
+
+/*
+TRICAL_queue_init:
+Initializes `queue` as an empty queue, with overflow policy `policy`.
+*/
+void TRICAL_queue_init(TRICAL_queue_t *queue, TRICAL_queue_policy_t policy) {
+    assert(queue);
+    assert(policy == TRICAL_QUEUE_DROP_OLDEST ||
+           policy == TRICAL_QUEUE_DECIMATE ||
+           policy == TRICAL_QUEUE_PREFER_COVERAGE);
+
+    memset(queue, 0, sizeof(TRICAL_queue_t));
+
+    queue->policy = policy;
+    queue->decimation = 1u;
+    queue->last_bin = TRICAL_COVERAGE_BINS;
+}
+
+/*
+TRICAL_queue_set:
+Makes `queue` the source of samples for TRICAL_pump on `instance`.
+*/
+void TRICAL_queue_set(TRICAL_instance_t *instance, TRICAL_queue_t *queue) {
+    assert(instance);
+
+    instance->queue = queue;
+}
+
+/*
+TRICAL_queue_push:
+Adds `measurement` and `reference_field` to `queue`, applying the overflow
+policy if it's full. Returns non-zero if the sample was queued.
+*/
+unsigned int TRICAL_queue_push(TRICAL_queue_t *queue,
+const float measurement[3], const float reference_field[3]) {
+    assert(queue);
+    assert(measurement);
+
+    unsigned int head = queue->head, full, bin;
+    TRICAL_queue_entry_t *restrict entry;
+
+    full = head - queue->tail >= TRICAL_QUEUE_CAPACITY;
+
+    if (queue->policy == TRICAL_QUEUE_DECIMATE) {
+        if (full) {
+            if (queue->decimation < TRICAL_QUEUE_MAX_DECIMATION) {
+                queue->decimation *= 2u;
+            }
+            queue->decimation_count = 0;
+            queue->dropped++;
+            return 0;
+        }
+
+        if (head - queue->tail <= TRICAL_QUEUE_CAPACITY / 4u) {
+            queue->decimation = 1u;
+        }
+        if (++queue->decimation_count < queue->decimation) {
+            queue->dropped++;
+            return 0;
+        }
+        queue->decimation_count = 0;
+    } else if (queue->policy == TRICAL_QUEUE_PREFER_COVERAGE) {
+        bin = _trical_direction_bin(measurement);
+        if (full && bin == queue->last_bin) {
+            queue->dropped++;
+            return 0;
+        }
+        queue->last_bin = bin;
+    }
+
+    if (full) {
+        queue->overwriting = 1u;
+        TRICAL_MEMORY_BARRIER();
+    }
+
+    entry = &queue->entries[head & (TRICAL_QUEUE_CAPACITY - 1u)];
+    memcpy(entry->measurement, measurement, sizeof(entry->measurement));
+    if (reference_field) {
+        memcpy(entry->reference_field, reference_field,
+               sizeof(entry->reference_field));
+        entry->fixed_field = 0;
+    } else {
+        entry->fixed_field = 1u;
+    }
+
+    /* Make sure the entry is complete before the consumer can see it */
+    TRICAL_MEMORY_BARRIER();
+    queue->head = head + 1u;
+
+    if (full) {
+        TRICAL_MEMORY_BARRIER();
+        queue->overwriting = 0;
+    }
+
+    return 1u;
+}
+
+/*
+TRICAL_queue_count_get:
+Returns the number of samples waiting in `queue`.
+*/
+unsigned int TRICAL_queue_count_get(const TRICAL_queue_t *queue) {
+    assert(queue);
+
+    unsigned int count = queue->head - queue->tail;
+    return count < TRICAL_QUEUE_CAPACITY ? count : TRICAL_QUEUE_CAPACITY;
+}
+
+/*
+TRICAL_queue_dropped_get:
+Returns the number of samples pushed to `queue` which were dropped or
+overwritten before they could be processed.
+*/
+unsigned int TRICAL_queue_dropped_get(const TRICAL_queue_t *queue) {
+    assert(queue);
+
+    return queue->dropped + queue->overwritten;
+}
+
+/*
+TRICAL_pump:
+Updates the calibration estimate of `instance` with up to `budget` samples
+from its queue, then publishes the estimate. Returns the number of samples
+processed.
+
+The filter working storage is shared by all the samples, as for
+TRICAL_estimate_update_batch.
+*/
+unsigned int TRICAL_pump(TRICAL_instance_t *instance, unsigned int budget) {
+    assert(instance);
+    assert(instance->queue);
+
+    TRICAL_queue_t *queue = instance->queue;
+    TRICAL_queue_entry_t entry;
+    TRICAL_workspace_t workspace;
+    const float *field;
+    unsigned int head, tail, overwriting, n, processed = 0, updated = 0;
+    TRICAL_status_t status;
+
+    tail = queue->tail;
+    if (!budget || queue->head == tail) {
+        return 0;
+    }
+
+    memset(workspace.covariance_llt, 0, sizeof(workspace.covariance_llt));
+
+    for (n = 0; n < budget; n++) {
+        head = queue->head;
+        TRICAL_MEMORY_BARRIER();
+        if (head == tail) {
+            break;
+        }
+
+        /* Skip over anything the producer has already overwritten */
+        if (head - tail > TRICAL_QUEUE_CAPACITY) {
+            queue->overwritten += head - tail - TRICAL_QUEUE_CAPACITY;
+            tail = head - TRICAL_QUEUE_CAPACITY;
+        }
+
+        memcpy(&entry, &queue->entries[tail & (TRICAL_QUEUE_CAPACITY - 1u)],
+               sizeof(entry));
+        TRICAL_MEMORY_BARRIER();
+        overwriting = queue->overwriting;
+        TRICAL_MEMORY_BARRIER();
+        head = queue->head;
+
+        if (head - tail > TRICAL_QUEUE_CAPACITY ||
+                (overwriting && head - tail == TRICAL_QUEUE_CAPACITY)) {
+            /* The entry was overwritten while it was being copied */
+            queue->overwritten++;
+            queue->tail = ++tail;
+            continue;
+        }
+        queue->tail = ++tail;
+
+        if (entry.fixed_field) {
+            assert(instance->field_fixed);
+            field = instance->field;
+        } else {
+            field = entry.reference_field;
+        }
+
+        status = _trical_filter_iterate(instance, &workspace,
+                                        entry.measurement, field);
+        if (status == TRICAL_STATUS_UPDATED ||
+                status == TRICAL_STATUS_REPAIRED) {
+            instance->measurement_count++;
+            updated++;
+        } else {
+            instance->skipped_count++;
+        }
+        processed++;
+    }
+
+    if (updated) {
+        _trical_publish(instance);
+    }
+
+    return processed;
+}
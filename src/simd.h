@@ -0,0 +1,165 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include <stdint.h>
+
+#include "3dmath.h"
+
+/*
+Minimal single-precision vector abstraction for the structure-of-arrays
+kernels. TRICAL_SIMD_WIDTH is the number of floats per vector; it's 1 when no
+vector instruction set is available (or TRICAL_NO_SIMD is defined), in which
+case the "vectors" are plain floats and the kernels still work, just without
+any speed-up.
+
+All loads and stores are unaligned, so callers don't need to worry about
+buffer alignment. vf_and is a bitwise AND, for applying lane masks (lanes
+with every bit set or clear).
+*/
+
+#if defined(TRICAL_NO_SIMD)
+#define TRICAL_SIMD_WIDTH 1
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define TRICAL_SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define TRICAL_SIMD_WIDTH 4
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define TRICAL_SIMD_WIDTH 4
+#else
+#define TRICAL_SIMD_WIDTH 1
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if TRICAL_SIMD_WIDTH == 1
+
+typedef float vfloat_t;
+
+#define vf_load(p) (*(p))
+#define vf_store(p, a) (*(p) = (a))
+#define vf_set1(a) (a)
+#define vf_add(a, b) ((a) + (b))
+#define vf_sub(a, b) ((a) - (b))
+#define vf_mul(a, b) ((a) * (b))
+#define vf_div(a, b) divide((a), (b))
+#define vf_sqrt(a) fsqrt((a))
+#define vf_abs(a) ((a) < 0.0f ? -(a) : (a))
+
+static inline float vf_and(float a, float b) {
+    union { float f; uint32_t u; } x, y;
+    x.f = a;
+    y.f = b;
+    x.u &= y.u;
+    return x.f;
+}
+
+#elif defined(__AVX__)
+
+typedef __m256 vfloat_t;
+
+#define vf_load(p) _mm256_loadu_ps((p))
+#define vf_store(p, a) _mm256_storeu_ps((p), (a))
+#define vf_set1(a) _mm256_set1_ps((a))
+#define vf_add(a, b) _mm256_add_ps((a), (b))
+#define vf_sub(a, b) _mm256_sub_ps((a), (b))
+#define vf_mul(a, b) _mm256_mul_ps((a), (b))
+#define vf_div(a, b) _mm256_div_ps((a), (b))
+#define vf_sqrt(a) _mm256_sqrt_ps((a))
+#define vf_abs(a) _mm256_andnot_ps(_mm256_set1_ps(-0.0f), (a))
+#define vf_and(a, b) _mm256_and_ps((a), (b))
+
+#elif defined(__SSE2__) || defined(_M_X64)
+
+typedef __m128 vfloat_t;
+
+#define vf_load(p) _mm_loadu_ps((p))
+#define vf_store(p, a) _mm_storeu_ps((p), (a))
+#define vf_set1(a) _mm_set1_ps((a))
+#define vf_add(a, b) _mm_add_ps((a), (b))
+#define vf_sub(a, b) _mm_sub_ps((a), (b))
+#define vf_mul(a, b) _mm_mul_ps((a), (b))
+#define vf_div(a, b) _mm_div_ps((a), (b))
+#define vf_sqrt(a) _mm_sqrt_ps((a))
+#define vf_abs(a) _mm_andnot_ps(_mm_set1_ps(-0.0f), (a))
+#define vf_and(a, b) _mm_and_ps((a), (b))
+
+#else
+
+typedef float32x4_t vfloat_t;
+
+#define vf_load(p) vld1q_f32((p))
+#define vf_store(p, a) vst1q_f32((p), (a))
+#define vf_set1(a) vdupq_n_f32((a))
+#define vf_add(a, b) vaddq_f32((a), (b))
+#define vf_sub(a, b) vsubq_f32((a), (b))
+#define vf_mul(a, b) vmulq_f32((a), (b))
+#define vf_abs(a) vabsq_f32((a))
+#define vf_and(a, b) vreinterpretq_f32_u32(vandq_u32( \
+    vreinterpretq_u32_f32((a)), vreinterpretq_u32_f32((b))))
+
+#if defined(__aarch64__)
+#define vf_div(a, b) vdivq_f32((a), (b))
+#define vf_sqrt(a) vsqrtq_f32((a))
+#else
+/*
+ARMv7 NEON has no vector division either, so use the reciprocal estimate
+with two Newton-Raphson steps.
+*/
+static inline float32x4_t vf_div(float32x4_t a, float32x4_t b) {
+    float32x4_t x = vrecpeq_f32(b);
+    x = vmulq_f32(x, vrecpsq_f32(b, x));
+    x = vmulq_f32(x, vrecpsq_f32(b, x));
+    return vmulq_f32(a, x);
+}
+
+/*
+ARMv7 NEON has no vector square root, so use the reciprocal square root
+estimate with two Newton-Raphson steps, and fix up zero inputs (for which the
+estimate is infinite).
+*/
+static inline float32x4_t vf_sqrt(float32x4_t a) {
+    float32x4_t x = vrsqrteq_f32(a);
+    x = vmulq_f32(x, vrsqrtsq_f32(vmulq_f32(a, x), x));
+    x = vmulq_f32(x, vrsqrtsq_f32(vmulq_f32(a, x), x));
+    return vbslq_f32(vceqq_f32(a, vdupq_n_f32(0.0f)), a, vmulq_f32(a, x));
+}
+#endif
+
+#endif
+
+/* Round `n` up to a whole number of vectors */
+#define TRICAL_SIMD_ROUND_UP(n) \
+    ((((n) + TRICAL_SIMD_WIDTH - 1) / TRICAL_SIMD_WIDTH) * TRICAL_SIMD_WIDTH)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,72 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+/*
+Instrumentation hooks for the filter hot path. With TRICAL_STATS undefined,
+all of these expand to nothing, so the instrumentation costs nothing at all.
+
+TRICAL_STATS_TIMER(t) declares a cycle timer `t` and starts it;
+TRICAL_STATS_ADD_CYCLES(instance, field, t) adds the cycles elapsed since `t`
+was started to `instance->stats.field`.
+*/
+
+#ifdef TRICAL_STATS
+
+#ifndef TRICAL_CYCLES
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define TRICAL_CYCLES() ((uint64_t)__rdtsc())
+#elif defined(__aarch64__)
+static inline uint64_t _trical_cycles(void) {
+    uint64_t t;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+}
+#define TRICAL_CYCLES() _trical_cycles()
+#elif defined(_TMS320C6X)
+#include <c6x.h>
+#define TRICAL_CYCLES() ((uint64_t)_itoll(TSCH, TSCL))
+#else
+#define TRICAL_CYCLES() ((uint64_t)0)
+#endif
+#endif
+
+#define TRICAL_STATS_TIMER(t) uint64_t t = TRICAL_CYCLES()
+#define TRICAL_STATS_ADD_CYCLES(instance, field, t) \
+    ((instance)->stats.field += TRICAL_CYCLES() - (t))
+
+#else
+
+#define TRICAL_STATS_TIMER(t) ((void)0)
+#define TRICAL_STATS_ADD_CYCLES(instance, field, t) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,481 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Microbenchmarks for the filter hot path.
+
+Each benchmark runs over synthetic magnetometer data (a field rotating
+through every direction, distorted by a fixed hard- and soft-iron
+calibration, plus noise), and reports the best time of several repetitions
+as CSV on stdout:
+
+    benchmark,instances,samples,ns_per_sample,cycles_per_sample
+
+`cycles_per_sample` is measured with the time-stamp counter on x86, and is
+empty on other targets. Run `bench <repetitions>` to change the number of
+repetitions (default 5).
+*/
+
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cfloat>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_CYCLES 1
+#else
+#define BENCH_HAVE_CYCLES 0
+#endif
+
+/* C++ complains about the C99 'restrict' qualifier. Just ignore it. */
+#define restrict
+
+#include "TRICAL.h"
+#include "filter.h"
+#include "3dmath.h"
+
+/* Number of synthetic readings per pass */
+#define BENCH_SAMPLES 4096u
+
+/* Number of instances for the multi-instance benchmarks */
+#define BENCH_INSTANCES 64u
+
+/*
+Prevent the compiler from optimizing away results which are never used
+*/
+static volatile float bench_sink;
+
+struct bench_timer_t {
+    std::chrono::steady_clock::time_point start_time;
+    unsigned long long start_cycles;
+
+    void start() {
+#if BENCH_HAVE_CYCLES
+        start_cycles = __rdtsc();
+#endif
+        start_time = std::chrono::steady_clock::now();
+    }
+
+    /* Returns the elapsed time in ns, and the elapsed cycles in `cycles` */
+    double stop(double *cycles) {
+        std::chrono::steady_clock::time_point end_time =
+            std::chrono::steady_clock::now();
+#if BENCH_HAVE_CYCLES
+        *cycles = (double)(__rdtsc() - start_cycles);
+#else
+        *cycles = 0.0;
+#endif
+        return std::chrono::duration<double, std::nano>(
+            end_time - start_time).count();
+    }
+};
+
+struct bench_result_t {
+    double ns;
+    double cycles;
+};
+
+/*
+Generates `count` synthetic readings into `measurements`, with the matching
+reference field directions in `fields`. `seed` varies the hard-iron bias, so
+that each instance in the multi-instance benchmarks sees different data.
+*/
+static void bench_generate(unsigned int seed, unsigned int count,
+float measurements[][3], float fields[][3]) {
+    const float scale[9] = {
+        1.05f, 0.02f, -0.01f,
+        0.02f, 0.95f, 0.03f,
+        -0.01f, 0.03f, 1.01f
+    };
+    float bias[3] = {
+        0.1f + 0.01f * (float)(seed % 7u),
+        -0.2f + 0.01f * (float)(seed % 5u),
+        0.05f
+    };
+    unsigned int i, j, lcg = 12345u + seed;
+    float theta, phi, noise;
+
+    for (i = 0; i < count; i++) {
+        theta = (float)i * 0.0137f;
+        phi = sinf((float)i * 0.0031f) * 1.4f;
+
+        fields[i][0] = cosf(theta) * cosf(phi);
+        fields[i][1] = sinf(theta) * cosf(phi);
+        fields[i][2] = sinf(phi);
+
+        for (j = 0; j < 3; j++) {
+            lcg = lcg * 1664525u + 1013904223u;
+            noise = ((float)(lcg >> 8) / 16777216.0f - 0.5f) * 2e-3f;
+
+            measurements[i][j] = scale[j * 3 + 0] * fields[i][0] +
+                                 scale[j * 3 + 1] * fields[i][1] +
+                                 scale[j * 3 + 2] * fields[i][2] +
+                                 bias[j] + noise;
+        }
+    }
+}
+
+static void bench_init_instance(TRICAL_instance_t *instance) {
+    TRICAL_init(instance);
+    TRICAL_noise_set(instance, 1e-2f);
+}
+
+static void bench_report(const char *name, unsigned int instances,
+unsigned long samples, const bench_result_t &result) {
+    printf("%s,%u,%lu,%.3f,", name, instances, samples,
+           result.ns / (double)samples);
+    if (BENCH_HAVE_CYCLES) {
+        printf("%.1f", result.cycles / (double)samples);
+    }
+    printf("\n");
+}
+
+/*
+Runs `body` `repetitions` times, each after calling `setup`, and returns the
+fastest run. Only `body` is timed.
+*/
+template <typename Setup, typename Body>
+static bench_result_t bench_run(unsigned int repetitions, Setup setup,
+Body body) {
+    bench_result_t best = { DBL_MAX, DBL_MAX };
+    bench_timer_t timer;
+    double ns, cycles;
+    unsigned int r;
+
+    for (r = 0; r < repetitions; r++) {
+        setup();
+
+        timer.start();
+        body();
+        ns = timer.stop(&cycles);
+
+        if (ns < best.ns) {
+            best.ns = ns;
+            best.cycles = cycles;
+        }
+    }
+
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int repetitions = argc > 1 ? (unsigned int)atoi(argv[1]) : 5u;
+    if (repetitions == 0) {
+        repetitions = 1;
+    }
+
+    std::vector<float> measurement_data(BENCH_INSTANCES * BENCH_SAMPLES * 3),
+                       field_data(BENCH_INSTANCES * BENCH_SAMPLES * 3),
+                       output_data(BENCH_SAMPLES * 3);
+    float (*measurements)[3] = (float (*)[3])&measurement_data[0];
+    float (*fields)[3] = (float (*)[3])&field_data[0];
+    float (*output)[3] = (float (*)[3])&output_data[0];
+    std::vector<TRICAL_instance_t> instances(BENCH_INSTANCES);
+    TRICAL_instance_t instance;
+    bench_result_t result;
+    unsigned int i, n;
+
+    for (n = 0; n < BENCH_INSTANCES; n++) {
+        bench_generate(n, BENCH_SAMPLES, &measurements[n * BENCH_SAMPLES],
+                       &fields[n * BENCH_SAMPLES]);
+    }
+
+    printf("benchmark,instances,samples,ns_per_sample,cycles_per_sample\n");
+
+    /* Single-instance filter iteration, one reading at a time */
+    result = bench_run(repetitions, [&]() {
+        bench_init_instance(&instance);
+    }, [&]() {
+        for (i = 0; i < BENCH_SAMPLES; i++) {
+            _trical_filter_iterate(&instance, NULL, measurements[i],
+                                   fields[i]);
+        }
+        bench_sink = instance.state[0];
+    });
+    bench_report("filter_iterate", 1, BENCH_SAMPLES, result);
+
+    /* Same again through the public batch API */
+    result = bench_run(repetitions, [&]() {
+        bench_init_instance(&instance);
+    }, [&]() {
+        TRICAL_estimate_update_batch(&instance, &measurements[0][0], 3,
+                                     &fields[0][0], 3, BENCH_SAMPLES);
+        bench_sink = instance.state[0];
+    });
+    bench_report("estimate_update_batch", 1, BENCH_SAMPLES, result);
+
+    /* Square-root mode */
+    result = bench_run(repetitions, [&]() {
+        bench_init_instance(&instance);
+        TRICAL_square_root_set(&instance, 1);
+    }, [&]() {
+        for (i = 0; i < BENCH_SAMPLES; i++) {
+            _trical_filter_iterate(&instance, NULL, measurements[i],
+                                   fields[i]);
+        }
+        bench_sink = instance.state[0];
+    });
+    bench_report("filter_iterate_square_root", 1, BENCH_SAMPLES, result);
+
+    /*
+    Steady state with update gating: the instance has already seen the data
+    once, so most readings should be skipped
+    */
+    TRICAL_instance_t converged;
+    bench_init_instance(&converged);
+    TRICAL_estimate_update_batch(&converged, &measurements[0][0], 3,
+                                 &fields[0][0], 3, BENCH_SAMPLES);
+    TRICAL_gate_set(&converged, 3.0f, 0.1f);
+    result = bench_run(repetitions, [&]() {
+        memcpy(&instance, &converged, sizeof(instance));
+    }, [&]() {
+        TRICAL_estimate_update_batch(&instance, &measurements[0][0], 3,
+                                     &fields[0][0], 3, BENCH_SAMPLES);
+        bench_sink = instance.state[0];
+    });
+    bench_report("estimate_update_gated", 1, BENCH_SAMPLES, result);
+
+    /* Fixed-point filter, on the same readings converted to Q2.29 */
+    std::vector<TRICAL_fixed_t> fixed_measurements(BENCH_SAMPLES * 3),
+                                fixed_fields(BENCH_SAMPLES * 3);
+    TRICAL_fixed_instance_t fixed_instance;
+    for (i = 0; i < BENCH_SAMPLES * 3; i++) {
+        fixed_measurements[i] =
+            TRICAL_FIXED_FROM_FLOAT(measurements[i / 3][i % 3]);
+        fixed_fields[i] = TRICAL_FIXED_FROM_FLOAT(fields[i / 3][i % 3]);
+    }
+
+    result = bench_run(repetitions, [&]() {
+        TRICAL_fixed_init(&fixed_instance);
+        TRICAL_fixed_noise_set(&fixed_instance,
+                               TRICAL_FIXED_FROM_FLOAT(1e-2f));
+    }, [&]() {
+        for (i = 0; i < BENCH_SAMPLES; i++) {
+            TRICAL_fixed_estimate_update(&fixed_instance,
+                                         &fixed_measurements[i * 3],
+                                         &fixed_fields[i * 3]);
+        }
+        bench_sink = (float)fixed_instance.state[0];
+    });
+    bench_report("fixed_estimate_update", 1, BENCH_SAMPLES, result);
+
+    /*
+    Cholesky decomposition of a realistic state covariance (the covariance
+    after a few hundred readings)
+    */
+    float covariance[TRICAL_STATE_DIM * TRICAL_STATE_DIM],
+          llt[TRICAL_STATE_DIM * TRICAL_STATE_DIM];
+    bench_init_instance(&instance);
+    for (i = 0; i < 256; i++) {
+        _trical_filter_iterate(&instance, NULL, measurements[i], fields[i]);
+    }
+    TRICAL_square_root_set(&instance, 1);
+    TRICAL_square_root_set(&instance, 0);
+#ifndef TRICAL_PACKED_COVARIANCE
+    for (i = 0; i < TRICAL_COVARIANCE_DIM; i++) {
+        covariance[i] = (float)instance.state_covariance[i];
+    }
+#else
+    {
+        /* Expand to a full matrix for the full-storage decomposition */
+        unsigned int j;
+
+        for (i = 0; i < TRICAL_STATE_DIM; i++) {
+            for (j = 0; j <= i; j++) {
+                covariance[i + j * TRICAL_STATE_DIM] =
+                    covariance[j + i * TRICAL_STATE_DIM] = (float)
+                    instance.state_covariance[TRICAL_PACKED_INDEX(i, j)];
+            }
+        }
+    }
+#endif
+
+    result = bench_run(repetitions, [&]() {
+        memset(llt, 0, sizeof(llt));
+    }, [&]() {
+        for (i = 0; i < BENCH_SAMPLES; i++) {
+            covariance[0] += 1e-9f;
+            matrix_cholesky_decomp_scale_f(TRICAL_STATE_DIM, llt, covariance,
+                                           TRICAL_DIM_PLUS_LAMBDA);
+        }
+        bench_sink = llt[TRICAL_STATE_DIM * TRICAL_STATE_DIM - 1];
+    });
+    bench_report("cholesky_decomp_scale", 1, BENCH_SAMPLES, result);
+
+    /* Measurement reduction and calibration with a converged estimate */
+    result = bench_run(repetitions, []() {}, [&]() {
+        float sum = 0.0f;
+        for (i = 0; i < BENCH_SAMPLES; i++) {
+            sum += _trical_measurement_reduce(instance.state, measurements[i],
+                                              fields[i]);
+        }
+        bench_sink = sum;
+    });
+    bench_report("measurement_reduce", 1, BENCH_SAMPLES, result);
+
+    result = bench_run(repetitions, []() {}, [&]() {
+        for (i = 0; i < BENCH_SAMPLES; i++) {
+            TRICAL_measurement_calibrate(&instance, measurements[i],
+                                         output[i]);
+        }
+        bench_sink = output[BENCH_SAMPLES - 1][0];
+    });
+    bench_report("measurement_calibrate", 1, BENCH_SAMPLES, result);
+
+    TRICAL_frozen_t frozen;
+    TRICAL_frozen_get(&instance, &frozen);
+    result = bench_run(repetitions, []() {}, [&]() {
+        TRICAL_calibrate_many(&frozen, measurements, output, BENCH_SAMPLES);
+        bench_sink = output[BENCH_SAMPLES - 1][0];
+    });
+    bench_report("calibrate_many", 1, BENCH_SAMPLES, result);
+
+    /*
+    Multi-instance: interleaved updates of many instances, as when one
+    processor handles many sensors
+    */
+    result = bench_run(repetitions, [&]() {
+        for (n = 0; n < BENCH_INSTANCES; n++) {
+            bench_init_instance(&instances[n]);
+        }
+    }, [&]() {
+        for (i = 0; i < BENCH_SAMPLES; i++) {
+            for (n = 0; n < BENCH_INSTANCES; n++) {
+                TRICAL_estimate_update(&instances[n],
+                                       measurements[n * BENCH_SAMPLES + i],
+                                       fields[n * BENCH_SAMPLES + i]);
+            }
+        }
+        bench_sink = instances[0].state[0];
+    });
+    bench_report("estimate_update_interleaved", BENCH_INSTANCES,
+                 (unsigned long)BENCH_INSTANCES * BENCH_SAMPLES, result);
+
+    /* The same, sharing one caller-provided workspace between instances */
+    TRICAL_workspace_t workspace;
+    TRICAL_workspace_init(&workspace);
+    result = bench_run(repetitions, [&]() {
+        for (n = 0; n < BENCH_INSTANCES; n++) {
+            bench_init_instance(&instances[n]);
+        }
+    }, [&]() {
+        for (i = 0; i < BENCH_SAMPLES; i++) {
+            for (n = 0; n < BENCH_INSTANCES; n++) {
+                TRICAL_estimate_update_workspace(&instances[n], &workspace,
+                    measurements[n * BENCH_SAMPLES + i],
+                    fields[n * BENCH_SAMPLES + i]);
+            }
+        }
+        bench_sink = instances[0].state[0];
+    });
+    bench_report("estimate_update_interleaved_workspace", BENCH_INSTANCES,
+                 (unsigned long)BENCH_INSTANCES * BENCH_SAMPLES, result);
+
+    /* The same updates through instance banks */
+    std::vector<TRICAL_bank_t> banks(BENCH_INSTANCES / TRICAL_BANK_WIDTH);
+    float bank_measurements[TRICAL_BANK_WIDTH][3],
+          bank_fields[TRICAL_BANK_WIDTH][3];
+    unsigned int b, w;
+
+    result = bench_run(repetitions, [&]() {
+        for (b = 0; b < banks.size(); b++) {
+            for (w = 0; w < TRICAL_BANK_WIDTH; w++) {
+                bench_init_instance(&instance);
+                TRICAL_bank_instance_set(&banks[b], w, &instance);
+            }
+        }
+    }, [&]() {
+        for (i = 0; i < BENCH_SAMPLES; i++) {
+            for (b = 0; b < banks.size(); b++) {
+                for (w = 0; w < TRICAL_BANK_WIDTH; w++) {
+                    n = (b * TRICAL_BANK_WIDTH + w) * BENCH_SAMPLES + i;
+                    memcpy(bank_measurements[w], measurements[n],
+                           sizeof(bank_measurements[w]));
+                    memcpy(bank_fields[w], fields[n], sizeof(bank_fields[w]));
+                }
+
+                TRICAL_bank_estimate_update(&banks[b], bank_measurements,
+                                            bank_fields, ~0u);
+            }
+        }
+        bench_sink = banks[0].state[0][0];
+    });
+    bench_report("bank_estimate_update", BENCH_INSTANCES,
+                 (unsigned long)BENCH_INSTANCES * BENCH_SAMPLES, result);
+
+    /*
+    A handful of sensors on one board, updated once per tick as separate
+    instances: one call per instance, then one call for all of them
+    */
+    const unsigned int sensors = 4u;
+    TRICAL_instance_t *sensor_instances[4];
+    float tick_measurements[4][3], tick_fields[4][3];
+
+    result = bench_run(repetitions, [&]() {
+        for (n = 0; n < sensors; n++) {
+            bench_init_instance(&instances[n]);
+        }
+    }, [&]() {
+        for (i = 0; i < BENCH_SAMPLES; i++) {
+            for (n = 0; n < sensors; n++) {
+                TRICAL_estimate_update(&instances[n],
+                                       measurements[n * BENCH_SAMPLES + i],
+                                       fields[n * BENCH_SAMPLES + i]);
+            }
+        }
+        bench_sink = instances[0].state[0];
+    });
+    bench_report("estimate_update_sensors", sensors,
+                 (unsigned long)sensors * BENCH_SAMPLES, result);
+
+    for (n = 0; n < sensors; n++) {
+        sensor_instances[n] = &instances[n];
+    }
+    result = bench_run(repetitions, [&]() {
+        for (n = 0; n < sensors; n++) {
+            bench_init_instance(&instances[n]);
+        }
+    }, [&]() {
+        for (i = 0; i < BENCH_SAMPLES; i++) {
+            for (n = 0; n < sensors; n++) {
+                memcpy(tick_measurements[n],
+                       measurements[n * BENCH_SAMPLES + i],
+                       sizeof(tick_measurements[n]));
+                memcpy(tick_fields[n], fields[n * BENCH_SAMPLES + i],
+                       sizeof(tick_fields[n]));
+            }
+
+            TRICAL_estimate_update_multi(sensor_instances, tick_measurements,
+                                         tick_fields, sensors);
+        }
+        bench_sink = instances[0].state[0];
+    });
+    bench_report("estimate_update_multi", sensors,
+                 (unsigned long)sensors * BENCH_SAMPLES, result);
+
+    return 0;
+}
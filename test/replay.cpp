@@ -0,0 +1,132 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Replay harness: runs every estimator variant over a corpus of sensor traces,
+and reports how far each one's final estimate is from the reference
+(_trical_filter_iterate with the full state covariance), along with its
+throughput, as CSV on stdout:
+
+    trace,variant,readings,norm_error,norm_error_delta,state_delta,
+    ns_per_reading,speedup
+
+`norm_error` is the RMS error of the calibrated field norm over the trace,
+and `norm_error_delta` its difference from the reference's; `state_delta` is
+the largest difference from the reference's estimate. `speedup` is the
+reference's time per reading over the variant's.
+
+    replay [-r repetitions] [trace.trc ...]
+    replay -w directory
+
+With no trace files, the synthetic corpus (see trace.h) is replayed; `-w`
+writes it out in the binary trace format instead, e.g. as a starting point
+for recorded traces. The build options (TRICAL_NO_SIMD,
+TRICAL_FUSED_ITERATE, ...) select what the variants are built with, so build
+the harness once for each configuration being compared.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+/* Number of readings in each synthetic trace */
+#define REPLAY_READINGS 4000u
+
+static void _replay_report(const trace_t &trace, unsigned int repetitions) {
+    replay_result_t reference, result;
+    float reference_error, error;
+    size_t v;
+
+    replay_variants[0].run(trace, repetitions, &reference);
+    reference_error = replay_norm_error(trace, reference.state);
+
+    for (v = 0; v < replay_variant_count; v++) {
+        if (v == 0) {
+            result = reference;
+        } else {
+            replay_variants[v].run(trace, repetitions, &result);
+        }
+        error = replay_norm_error(trace, result.state);
+
+        printf("%s,%s,%lu,%.6g,%.3g,%.3g,%.1f,%.2f\n", trace.name,
+               replay_variants[v].name, (unsigned long)trace.count(), error,
+               error - reference_error,
+               replay_state_delta(result.state, reference.state),
+               result.ns_per_reading,
+               reference.ns_per_reading / result.ns_per_reading);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int repetitions = 5u;
+    const char *write_dir = NULL;
+    std::vector<const char *> paths;
+    trace_t trace;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            repetitions = (unsigned int)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            write_dir = argv[++i];
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+
+    if (write_dir) {
+        for (i = 0; i < TRACE_KINDS; i++) {
+            trace_generate((trace_kind_t)i, REPLAY_READINGS, &trace);
+            std::string path = std::string(write_dir) + "/" + trace.name +
+                               ".trc";
+            if (!trace_save(path.c_str(), trace)) {
+                fprintf(stderr, "replay: can't write %s\n", path.c_str());
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    printf("trace,variant,readings,norm_error,norm_error_delta,state_delta,"
+           "ns_per_reading,speedup\n");
+
+    if (paths.empty()) {
+        for (i = 0; i < TRACE_KINDS; i++) {
+            trace_generate((trace_kind_t)i, REPLAY_READINGS, &trace);
+            _replay_report(trace, repetitions);
+        }
+    }
+
+    for (size_t p = 0; p < paths.size(); p++) {
+        if (!trace_load(paths[p], &trace)) {
+            fprintf(stderr, "replay: can't read %s\n", paths[p]);
+            return 1;
+        }
+        _replay_report(trace, repetitions);
+    }
+
+    return 0;
+}
@@ -23,6 +23,7 @@ SOFTWARE.
 #include <gtest/gtest.h>
 #include <cmath>
 #include <cfloat>
+#include <cstring>
 
 /* C++ complains about the C99 'restrict' qualifier. Just ignore it. */
 #define restrict
@@ -62,3 +63,100 @@ TEST(MatrixMath, CholeskyLLT) {
     EXPECT_NEAR(expected[11], m1[11], 1e-5);
     EXPECT_NEAR(expected[15], m1[15], 1e-5);
 }
+
+/*
+Test rank-1 downdate of a Cholesky factor. The result should match the
+decomposition of the original matrix minus the outer product of the downdate
+vector.
+*/
+TEST(MatrixMath, CholeskyDowndate) {
+    float m1[16] = {
+        18, 22,  54,  42,
+        22, 70,  86,  62,
+        54, 86, 174, 134,
+        42, 62, 134, 106
+    };
+    float x[4] = { 1.0, 2.0, 3.0, 2.5 }, m2[16], l1[16], l2[16];
+    unsigned int i, j;
+
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 4; j++) {
+            m2[i * 4 + j] = m1[i * 4 + j] - x[i] * x[j];
+        }
+    }
+
+    memset(l1, 0, sizeof(l1));
+    memset(l2, 0, sizeof(l2));
+    matrix_cholesky_decomp_scale_f(4, l1, m1, 1.0);
+    matrix_cholesky_decomp_scale_f(4, l2, m2, 1.0);
+    matrix_cholesky_downdate_f(4, l1, x);
+
+    for (i = 0; i < 16; i++) {
+        EXPECT_NEAR(l2[i], l1[i], 1e-4);
+    }
+}
+
+/*
+Test that a downdate which would result in a non-positive-definite matrix
+leaves the pivots positive instead of producing NaNs.
+*/
+TEST(MatrixMath, CholeskyDowndateClamp) {
+    float l[4] = {
+        1.0, 0.5,
+        0.0, 1.0
+    };
+    float x[2] = { 2.0, 0.0 };
+
+    matrix_cholesky_downdate_f(2, l, x);
+    EXPECT_GT(l[0], 0.0);
+    EXPECT_GT(l[3], 0.0);
+    EXPECT_FALSE(std::isnan(l[1]));
+}
+
+/*
+Test that the packed-storage decomposition and downdate give the same results
+as the full-storage versions.
+*/
+TEST(MatrixMath, CholeskyPacked) {
+    float m1[16] = {
+        18, 22,  54,  42,
+        22, 70,  86,  62,
+        54, 86, 174, 134,
+        42, 62, 134, 106
+    };
+    float x1[4] = { 1.0, 2.0, 3.0, 2.5 }, x2[4], p[10], l1[16], l2[16];
+    unsigned int i, j, k;
+
+    /* Pack the lower triangle, column by column */
+    for (j = 0, k = 0; j < 4; j++) {
+        for (i = j; i < 4; i++, k++) {
+            p[k] = m1[j * 4 + i];
+        }
+    }
+
+    memset(l1, 0, sizeof(l1));
+    memset(l2, 0, sizeof(l2));
+    matrix_cholesky_decomp_scale_f(4, l1, m1, 2.0);
+    matrix_cholesky_decomp_scale_packed_f(4, l2, p, 2.0);
+
+    for (i = 0; i < 16; i++) {
+        EXPECT_FLOAT_EQ(l1[i], l2[i]);
+    }
+
+    /* Now pack the factor and downdate it */
+    for (j = 0, k = 0; j < 4; j++) {
+        for (i = j; i < 4; i++, k++) {
+            p[k] = l1[j * 4 + i];
+        }
+    }
+
+    memcpy(x2, x1, sizeof(x2));
+    matrix_cholesky_downdate_f(4, l1, x1);
+    matrix_cholesky_downdate_packed_f(4, p, x2);
+
+    for (j = 0, k = 0; j < 4; j++) {
+        for (i = j; i < 4; i++, k++) {
+            EXPECT_FLOAT_EQ(l1[j * 4 + i], p[k]);
+        }
+    }
+}
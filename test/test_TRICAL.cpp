@@ -21,11 +21,16 @@ SOFTWARE.
 */
 
 #include <gtest/gtest.h>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <algorithm>
 
 /* C++ complains about the C99 'restrict' qualifier. Just ignore it. */
 #define restrict
 
 #include "TRICAL.h"
+#include "filter.h"
 
 
 TEST(TRICAL, Initialisation) {
@@ -53,6 +58,19 @@ TEST(TRICAL, NoiseGetSet) {
     EXPECT_FLOAT_EQ(2.0f, TRICAL_noise_get(&cal));
 }
 
+TEST(TRICAL, ProcessNoiseGetSet) {
+    TRICAL_instance_t cal;
+
+    TRICAL_init(&cal);
+    EXPECT_FLOAT_EQ(0.0f, TRICAL_process_noise_get(&cal));
+    EXPECT_FLOAT_EQ(1.0f, TRICAL_forgetting_get(&cal));
+
+    TRICAL_process_noise_set(&cal, 1e-6f);
+    TRICAL_forgetting_set(&cal, 0.99f);
+    EXPECT_FLOAT_EQ(1e-6f, TRICAL_process_noise_get(&cal));
+    EXPECT_FLOAT_EQ(0.99f, TRICAL_forgetting_get(&cal));
+}
+
 /* Check that the measurement count can be read */
 TEST(TRICAL, MeasurementCountGet) {
     TRICAL_instance_t cal;
@@ -262,18 +280,18 @@ TEST(TRICAL, EstimateGetExt) {
     cal.state[10] = 0.5;
     cal.state[11] = 1.0;
 
-    cal.state_covariance[0] = 10.0;
-    cal.state_covariance[13] = 20.0;
-    cal.state_covariance[26] = 30.0;
-    cal.state_covariance[39] = 40.0;
-    cal.state_covariance[52] = 50.0;
-    cal.state_covariance[65] = 60.0;
-    cal.state_covariance[78] = 70.0;
-    cal.state_covariance[91] = 80.0;
-    cal.state_covariance[104] = 90.0;
-    cal.state_covariance[117] = 100.0;
-    cal.state_covariance[130] = 110.0;
-    cal.state_covariance[143] = 120.0;
+    cal.state_covariance[TRICAL_COVARIANCE_INDEX(0, 0)] = 10.0;
+    cal.state_covariance[TRICAL_COVARIANCE_INDEX(1, 1)] = 20.0;
+    cal.state_covariance[TRICAL_COVARIANCE_INDEX(2, 2)] = 30.0;
+    cal.state_covariance[TRICAL_COVARIANCE_INDEX(3, 3)] = 40.0;
+    cal.state_covariance[TRICAL_COVARIANCE_INDEX(4, 4)] = 50.0;
+    cal.state_covariance[TRICAL_COVARIANCE_INDEX(5, 5)] = 60.0;
+    cal.state_covariance[TRICAL_COVARIANCE_INDEX(6, 6)] = 70.0;
+    cal.state_covariance[TRICAL_COVARIANCE_INDEX(7, 7)] = 80.0;
+    cal.state_covariance[TRICAL_COVARIANCE_INDEX(8, 8)] = 90.0;
+    cal.state_covariance[TRICAL_COVARIANCE_INDEX(9, 9)] = 100.0;
+    cal.state_covariance[TRICAL_COVARIANCE_INDEX(10, 10)] = 110.0;
+    cal.state_covariance[TRICAL_COVARIANCE_INDEX(11, 11)] = 120.0;
 
     float bias_estimate[3], scale_estimate[9], bias_estimate_variance[3],
           scale_estimate_variance[9];
@@ -341,4 +359,931 @@ TEST(TRICAL, Calibrate) {
     EXPECT_FLOAT_EQ(-3.8, result[0]);
     EXPECT_FLOAT_EQ(0.0, result[1]);
     EXPECT_FLOAT_EQ(3.8, result[2]);
+
+    /* The measurement can be calibrated in place */
+    TRICAL_measurement_calibrate(&cal, measurement, measurement);
+    EXPECT_FLOAT_EQ(-3.8, measurement[0]);
+    EXPECT_FLOAT_EQ(0.0, measurement[1]);
+    EXPECT_FLOAT_EQ(3.8, measurement[2]);
+}
+
+/*
+Check that a batch update gives exactly the same estimate as passing the
+readings to TRICAL_estimate_update one at a time.
+*/
+TEST(TRICAL, EstimateUpdateBatch) {
+    TRICAL_instance_t cal, batch_cal;
+
+    TRICAL_init(&cal);
+    TRICAL_init(&batch_cal);
+
+    float measurements[6][3] = {
+        { 2.0, 0.0, 0.0 },
+        { 1.0, 1.0, 0.0 },
+        { 1.0, 0.0, 1.0 },
+        { 0.0, 0.0, 0.0 },
+        { 1.0, -1.0, 0.0 },
+        { 1.0, 0.0, -1.0 }
+    };
+    float ref[6][3] = {
+        { 1.0, 0.0, 0.0 },
+        { 0.0, 1.0, 0.0 },
+        { 0.0, 0.0, 1.0 },
+        { -1.0, 0.0, 0.0 },
+        { 0.0, -1.0, 0.0 },
+        { 0.0, 0.0, -1.0 }
+    };
+    unsigned int i, j;
+
+    for (i = 0; i < 20; i++) {
+        for (j = 0; j < 6; j++) {
+            TRICAL_estimate_update(&cal, measurements[j], ref[j]);
+        }
+        TRICAL_estimate_update_batch(&batch_cal, &measurements[0][0], 3,
+                                     &ref[0][0], 3, 6);
+    }
+
+    EXPECT_EQ(120, TRICAL_measurement_count_get(&batch_cal));
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        EXPECT_FLOAT_EQ(cal.state[i], batch_cal.state[i]);
+    }
+    for (i = 0; i < TRICAL_COVARIANCE_DIM; i++) {
+        EXPECT_FLOAT_EQ(cal.state_covariance[i],
+                        batch_cal.state_covariance[i]);
+    }
+}
+
+/*
+Check that a reference field stride of 0 re-uses the same reference field for
+every reading in the batch.
+*/
+TEST(TRICAL, EstimateUpdateBatchFixedField) {
+    TRICAL_instance_t cal, batch_cal;
+
+    TRICAL_init(&cal);
+    TRICAL_init(&batch_cal);
+
+    float measurements[4][3] = {
+        { 1.1, 0.0, 0.0 },
+        { 0.0, 0.9, 0.0 },
+        { 0.0, 0.0, 1.0 },
+        { -1.0, 0.1, 0.0 }
+    };
+    float ref[3] = { 0.6, 0.8, 0.0 };
+    unsigned int i;
+
+    for (i = 0; i < 4; i++) {
+        TRICAL_estimate_update(&cal, measurements[i], ref);
+    }
+    TRICAL_estimate_update_batch(&batch_cal, &measurements[0][0], 3, ref, 0,
+                                 4);
+
+    EXPECT_EQ(4, TRICAL_measurement_count_get(&batch_cal));
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        EXPECT_FLOAT_EQ(cal.state[i], batch_cal.state[i]);
+    }
+}
+
+/*
+Check that one workspace can be shared between interleaved updates of several
+instances (including one in square-root mode), with the same results as the
+stack-based update functions.
+*/
+TEST(TRICAL, EstimateUpdateWorkspace) {
+    TRICAL_instance_t cal[2], ws_cal[2];
+    TRICAL_workspace_t workspace;
+    unsigned int i, j, n;
+
+    for (n = 0; n < 2; n++) {
+        TRICAL_init(&cal[n]);
+        TRICAL_init(&ws_cal[n]);
+    }
+    TRICAL_square_root_set(&cal[1], 1);
+    TRICAL_square_root_set(&ws_cal[1], 1);
+    TRICAL_workspace_init(&workspace);
+
+    float measurements[4][3] = {
+        { 1.1, 0.0, 0.0 },
+        { 0.0, 0.9, 0.0 },
+        { 0.0, 0.0, 1.0 },
+        { -1.0, 0.1, 0.0 }
+    };
+    float ref[4][3] = {
+        { 1.0, 0.0, 0.0 },
+        { 0.0, 1.0, 0.0 },
+        { 0.0, 0.0, 1.0 },
+        { -1.0, 0.0, 0.0 }
+    };
+
+    for (i = 0; i < 10; i++) {
+        for (j = 0; j < 4; j++) {
+            for (n = 0; n < 2; n++) {
+                TRICAL_estimate_update(&cal[n], measurements[j], ref[j]);
+                TRICAL_estimate_update_workspace(&ws_cal[n], &workspace,
+                                                 measurements[j], ref[j]);
+            }
+        }
+        TRICAL_estimate_update_batch(&cal[0], &measurements[0][0], 3,
+                                     &ref[0][0], 3, 4);
+        TRICAL_estimate_update_batch_workspace(&ws_cal[0], &workspace,
+                                               &measurements[0][0], 3,
+                                               &ref[0][0], 3, 4);
+    }
+
+    for (n = 0; n < 2; n++) {
+        /* Read the results through a const pointer, as a reader would */
+        const TRICAL_instance_t *snapshot = &ws_cal[n];
+
+        EXPECT_EQ(TRICAL_measurement_count_get(&cal[n]),
+                  TRICAL_measurement_count_get(snapshot));
+        for (i = 0; i < TRICAL_STATE_DIM; i++) {
+            EXPECT_FLOAT_EQ(cal[n].state[i], snapshot->state[i]);
+        }
+        for (i = 0; i < TRICAL_COVARIANCE_DIM; i++) {
+            EXPECT_FLOAT_EQ(cal[n].state_covariance[i],
+                            snapshot->state_covariance[i]);
+        }
+    }
+}
+
+TEST(TRICAL, FieldGetSet) {
+    TRICAL_instance_t cal;
+    float field[3] = { 0.0, 3.0, 4.0 }, result[3] = { 9.0, 9.0, 9.0 };
+
+    TRICAL_init(&cal);
+    EXPECT_EQ(0, TRICAL_field_get(&cal, result));
+    EXPECT_FLOAT_EQ(9.0f, result[0]);
+
+    /* The fixed field is normalized */
+    TRICAL_field_set(&cal, field);
+    EXPECT_NE(0, TRICAL_field_get(&cal, result));
+    EXPECT_FLOAT_EQ(0.0f, result[0]);
+    EXPECT_FLOAT_EQ(0.6f, result[1]);
+    EXPECT_FLOAT_EQ(0.8f, result[2]);
+
+    TRICAL_field_set(&cal, NULL);
+    EXPECT_EQ(0, TRICAL_field_get(&cal, result));
+}
+
+/*
+Check that updates using the fixed field match those passing the same field
+with every reading, for both the single and batch entry points
+*/
+TEST(TRICAL, EstimateUpdateFixedField) {
+    TRICAL_instance_t cal, fixed_cal, batch_cal;
+    float measurements[4][3] = {
+        { 1.1, 0.0, 0.0 },
+        { 0.0, 0.9, 0.0 },
+        { 0.0, 0.0, 1.0 },
+        { -1.0, 0.1, 0.0 }
+    };
+    float ref[3] = { 0.6, 0.8, 0.0 }, scaled_ref[3] = { 3.0, 4.0, 0.0 };
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    TRICAL_init(&fixed_cal);
+    TRICAL_field_set(&fixed_cal, scaled_ref);
+    memcpy(&batch_cal, &fixed_cal, sizeof(batch_cal));
+
+    for (i = 0; i < 4; i++) {
+        TRICAL_estimate_update(&cal, measurements[i], ref);
+        TRICAL_estimate_update(&fixed_cal, measurements[i], NULL);
+    }
+    TRICAL_estimate_update_batch(&batch_cal, &measurements[0][0], 3, NULL, 3,
+                                 4);
+
+    EXPECT_EQ(4, TRICAL_measurement_count_get(&fixed_cal));
+    EXPECT_EQ(4, TRICAL_measurement_count_get(&batch_cal));
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        EXPECT_FLOAT_EQ(cal.state[i], fixed_cal.state[i]);
+        EXPECT_FLOAT_EQ(cal.state[i], batch_cal.state[i]);
+    }
+}
+
+/*
+Check that converting to square-root mode and back preserves the state
+covariance.
+*/
+TEST(TRICAL, SquareRootRoundTrip) {
+    TRICAL_instance_t cal;
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        cal.state_covariance[TRICAL_COVARIANCE_INDEX(i, i)] = 1e-2f * (i + 1);
+    }
+    cal.state_covariance[TRICAL_COVARIANCE_INDEX(1, 0)] = 1e-3f;
+#ifndef TRICAL_PACKED_COVARIANCE
+    cal.state_covariance[TRICAL_STATE_DIM] = 1e-3f;
+#endif
+
+    TRICAL_covariance_t expected[TRICAL_COVARIANCE_DIM];
+    memcpy(expected, cal.state_covariance, sizeof(expected));
+
+    TRICAL_square_root_set(&cal, 1);
+    EXPECT_EQ(1, TRICAL_square_root_get(&cal));
+#ifndef TRICAL_PACKED_COVARIANCE
+    EXPECT_FLOAT_EQ(0.0, cal.state_covariance[TRICAL_STATE_DIM]);
+#endif
+
+    TRICAL_square_root_set(&cal, 0);
+    EXPECT_EQ(0, TRICAL_square_root_get(&cal));
+    for (i = 0; i < TRICAL_COVARIANCE_DIM; i++) {
+        EXPECT_NEAR(expected[i], cal.state_covariance[i], 1e-7);
+    }
+}
+
+/*
+Check that square-root mode produces the same estimates and variances as the
+standard filter, using the same data as EstimateUpdateBias.
+*/
+TEST(TRICAL, SquareRootEstimateUpdate) {
+    TRICAL_instance_t cal, sqrt_cal;
+
+    TRICAL_init(&cal);
+    TRICAL_init(&sqrt_cal);
+    TRICAL_square_root_set(&sqrt_cal, 1);
+
+    float measurements[6][3] = {
+        { 2.0, 0.0, 0.0 },
+        { 1.0, 1.0, 0.0 },
+        { 1.0, 0.0, 1.0 },
+        { 0.0, 0.0, 0.0 },
+        { 1.0, -1.0, 0.0 },
+        { 1.0, 0.0, -1.0 }
+    };
+    float ref[6][3] = {
+        { 1.0, 0.0, 0.0 },
+        { 0.0, 1.0, 0.0 },
+        { 0.0, 0.0, 1.0 },
+        { -1.0, 0.0, 0.0 },
+        { 0.0, -1.0, 0.0 },
+        { 0.0, 0.0, -1.0 }
+    };
+    unsigned int i, j;
+
+    for (i = 0; i < 200; i++) {
+        for (j = 0; j < 6; j++) {
+            TRICAL_estimate_update(&cal, measurements[j], ref[j]);
+            TRICAL_estimate_update(&sqrt_cal, measurements[j], ref[j]);
+        }
+    }
+
+    float bias[3], scale[9], bias_variance[3], scale_variance[9];
+    float sqrt_bias[3], sqrt_scale[9], sqrt_bias_variance[3],
+          sqrt_scale_variance[9];
+    TRICAL_estimate_get_ext(&cal, bias, scale, bias_variance,
+                            scale_variance);
+    TRICAL_estimate_get_ext(&sqrt_cal, sqrt_bias, sqrt_scale,
+                            sqrt_bias_variance, sqrt_scale_variance);
+
+    EXPECT_NEAR(1.0, sqrt_bias[0], 2e-2);
+    for (i = 0; i < 3; i++) {
+        EXPECT_NEAR(bias[i], sqrt_bias[i], 1e-3);
+        EXPECT_NEAR(bias_variance[i], sqrt_bias_variance[i],
+                    1e-2 * bias_variance[i] + 1e-9);
+    }
+    for (i = 0; i < 9; i++) {
+        EXPECT_NEAR(scale[i], sqrt_scale[i], 1e-3);
+        EXPECT_NEAR(scale_variance[i], sqrt_scale_variance[i],
+                    1e-2 * scale_variance[i] + 1e-9);
+    }
+}
+
+/* Check that no readings are skipped with the default (disabled) gate */
+TEST(TRICAL, GateDisabled) {
+    TRICAL_instance_t cal;
+    float measurement[3] = { 1.0, 0.0, 0.0 };
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    for (i = 0; i < 10; i++) {
+        TRICAL_estimate_update(&cal, measurement, measurement);
+    }
+
+    EXPECT_EQ(10, TRICAL_measurement_count_get(&cal));
+    EXPECT_EQ(0, TRICAL_skipped_count_get(&cal));
+}
+
+/*
+Check that with the innovation and trace criteria effectively disabled, only
+the first reading in each direction bin is used, and the skipped readings
+leave the estimate untouched
+*/
+TEST(TRICAL, GateCoverage) {
+    TRICAL_instance_t cal, reference;
+    float measurements[2][3] = {
+        { 1.0, 0.1, 0.1 },
+        { 0.1, -1.0, 0.1 }
+    };
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    TRICAL_gate_set(&cal, 1e9f, 1e9f);
+
+    TRICAL_estimate_update(&cal, measurements[0], measurements[0]);
+    memcpy(&reference, &cal, sizeof(reference));
+
+    for (i = 0; i < 20; i++) {
+        TRICAL_estimate_update(&cal, measurements[0], measurements[0]);
+    }
+
+    EXPECT_EQ(1, TRICAL_measurement_count_get(&cal));
+    EXPECT_EQ(20, TRICAL_skipped_count_get(&cal));
+    EXPECT_EQ(0, memcmp(reference.state, cal.state, sizeof(cal.state)));
+
+    /* A new direction is always used */
+    TRICAL_estimate_update(&cal, measurements[1], measurements[1]);
+    TRICAL_estimate_update(&cal, measurements[1], measurements[1]);
+
+    EXPECT_EQ(2, TRICAL_measurement_count_get(&cal));
+    EXPECT_EQ(21, TRICAL_skipped_count_get(&cal));
+
+    /* Resetting the estimate clears the coverage */
+    TRICAL_reset(&cal);
+    TRICAL_estimate_update(&cal, measurements[0], measurements[0]);
+    EXPECT_EQ(3, TRICAL_measurement_count_get(&cal));
+}
+
+/*
+Check that readings with a large innovation, or any reading while the state
+covariance trace is above the threshold, are still used
+*/
+TEST(TRICAL, GateThresholds) {
+    TRICAL_instance_t cal;
+    float measurement[3] = { 1.0, 0.0, 0.0 }, outlier[3] = { 2.0, 0.0, 0.0 };
+
+    TRICAL_init(&cal);
+    TRICAL_noise_set(&cal, 1e-3f);
+    TRICAL_gate_set(&cal, 3.0f, 1e9f);
+
+    /* The first reading always adds coverage */
+    TRICAL_estimate_update(&cal, measurement, measurement);
+    TRICAL_estimate_update(&cal, measurement, measurement);
+    EXPECT_EQ(1, TRICAL_measurement_count_get(&cal));
+    EXPECT_EQ(1, TRICAL_skipped_count_get(&cal));
+
+    /* Same direction bin, but far from the expected field norm */
+    TRICAL_estimate_update(&cal, outlier, outlier);
+    EXPECT_EQ(2, TRICAL_measurement_count_get(&cal));
+
+    /* The initial covariance trace is well above zero */
+    TRICAL_gate_set(&cal, 1e9f, 0.0f);
+    TRICAL_estimate_update(&cal, measurement, measurement);
+    EXPECT_EQ(3, TRICAL_measurement_count_get(&cal));
+    EXPECT_EQ(1, TRICAL_skipped_count_get(&cal));
+}
+
+/* Check that the batch update applies the gate to each reading */
+TEST(TRICAL, GateBatch) {
+    TRICAL_instance_t cal, batch_cal;
+    float measurements[4][3] = {
+        { 1.0, 0.1, 0.1 },
+        { 1.0, 0.1, 0.1 },
+        { 0.1, 1.0, 0.1 },
+        { 0.1, 1.0, 0.1 }
+    };
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    TRICAL_init(&batch_cal);
+    TRICAL_gate_set(&cal, 1e9f, 1e9f);
+    TRICAL_gate_set(&batch_cal, 1e9f, 1e9f);
+
+    for (i = 0; i < 4; i++) {
+        TRICAL_estimate_update(&cal, measurements[i], measurements[i]);
+    }
+    TRICAL_estimate_update_batch(&batch_cal, &measurements[0][0], 3,
+                                 &measurements[0][0], 3, 4);
+
+    EXPECT_EQ(2, TRICAL_measurement_count_get(&batch_cal));
+    EXPECT_EQ(2, TRICAL_skipped_count_get(&batch_cal));
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        EXPECT_FLOAT_EQ(cal.state[i], batch_cal.state[i]);
+    }
+}
+
+/*
+Check that the coverage limit caps the number of readings used from each
+direction, even with gating disabled
+*/
+TEST(TRICAL, CoverageLimit) {
+    TRICAL_instance_t cal;
+    float measurements[2][3] = {
+        { 1.0, 0.1, 0.1 },
+        { -1.0, 0.1, 0.1 }
+    };
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    TRICAL_coverage_limit_set(&cal, 5);
+
+    for (i = 0; i < 20; i++) {
+        TRICAL_estimate_update(&cal, measurements[0], measurements[0]);
+    }
+    EXPECT_EQ(5, TRICAL_measurement_count_get(&cal));
+    EXPECT_EQ(15, TRICAL_skipped_count_get(&cal));
+
+    TRICAL_estimate_update(&cal, measurements[1], measurements[1]);
+    EXPECT_EQ(6, TRICAL_measurement_count_get(&cal));
+
+    /* Without a limit, everything is used again */
+    TRICAL_coverage_limit_set(&cal, 0);
+    TRICAL_estimate_update(&cal, measurements[0], measurements[0]);
+    EXPECT_EQ(7, TRICAL_measurement_count_get(&cal));
+}
+
+/* Check the coverage metric counts occupied direction bins */
+TEST(TRICAL, CoverageGet) {
+    TRICAL_instance_t cal;
+    float measurements[6][3] = {
+        { 1.0, 0.1, 0.1 },
+        { 0.1, 1.0, 0.1 },
+        { 0.1, 0.1, 1.0 },
+        { -1.0, 0.1, 0.1 },
+        { 0.1, -1.0, 0.1 },
+        { 0.1, 0.1, -1.0 }
+    };
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    EXPECT_FLOAT_EQ(0.0f, TRICAL_coverage_get(&cal));
+
+    TRICAL_estimate_update(&cal, measurements[0], measurements[0]);
+    TRICAL_estimate_update(&cal, measurements[0], measurements[0]);
+    EXPECT_FLOAT_EQ(1.0f / TRICAL_COVERAGE_BINS, TRICAL_coverage_get(&cal));
+
+    for (i = 1; i < 6; i++) {
+        TRICAL_estimate_update(&cal, measurements[i], measurements[i]);
+    }
+    EXPECT_FLOAT_EQ(6.0f / TRICAL_COVERAGE_BINS, TRICAL_coverage_get(&cal));
+
+    TRICAL_reset(&cal);
+    EXPECT_FLOAT_EQ(0.0f, TRICAL_coverage_get(&cal));
+}
+
+/*
+Check the instrumentation counters: with TRICAL_STATS they track the filter
+updates, otherwise they read as zero
+*/
+TEST(TRICAL, StatsGet) {
+    TRICAL_instance_t cal;
+    TRICAL_stats_t stats;
+    float measurements[3][3] = {
+        { 1.1, 0.2, 0.2 },
+        { 0.2, 0.9, 0.2 },
+        { 0.2, 0.2, 1.2 }
+    };
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    TRICAL_noise_set(&cal, 1e-3f);
+    TRICAL_square_root_set(&cal, 1);
+    for (i = 0; i < 3; i++) {
+        TRICAL_estimate_update(&cal, measurements[i], measurements[i]);
+    }
+
+    memset(&stats, 0xFF, sizeof(stats));
+    TRICAL_stats_get(&cal, &stats);
+
+#ifdef TRICAL_STATS
+    EXPECT_EQ(3, stats.update_count);
+    EXPECT_GT(stats.min_pivot, 0.0f);
+    EXPECT_LE(stats.min_pivot, 1e-2f);
+    EXPECT_GT(stats.innovation_max, 0.0f);
+    EXPECT_LE(std::fabs(stats.innovation_mean), stats.innovation_max);
+    EXPECT_GE(stats.innovation_m2, 0.0f);
+    EXPECT_GE(stats.update_cycles, stats.cholesky_cycles);
+
+    /* Gated readings don't count as updates */
+    TRICAL_coverage_limit_set(&cal, 1);
+    TRICAL_estimate_update(&cal, measurements[0], measurements[0]);
+    TRICAL_stats_get(&cal, &stats);
+    EXPECT_EQ(3, stats.update_count);
+
+    TRICAL_stats_reset(&cal);
+    TRICAL_stats_get(&cal, &stats);
+    EXPECT_EQ(0, stats.update_count);
+    EXPECT_EQ(0, stats.update_cycles);
+#else
+    TRICAL_stats_t zero;
+    memset(&zero, 0, sizeof(zero));
+    EXPECT_EQ(0, memcmp(&zero, &stats, sizeof(stats)));
+#endif
+}
+
+/*
+Check that the state covariance stays symmetric and positive-definite over a
+long run of readings, to within the precision of TRICAL_covariance_t.
+*/
+TEST(TRICAL, CovarianceLongRun) {
+    TRICAL_instance_t cal;
+    float measurement[3], ref[3], norm;
+    unsigned int i, j, n;
+    const double tolerance =
+        64.0 * std::numeric_limits<TRICAL_covariance_t>::epsilon();
+
+    TRICAL_init(&cal);
+    TRICAL_noise_set(&cal, 1e-3f);
+
+    /* Field directions spiralling over the sphere */
+    for (n = 0; n < 2000; n++) {
+        ref[2] = 1.0f - 2.0f * (float)((n * 37u) % 1000u) / 1000.0f;
+        norm = std::sqrt(1.0f - ref[2] * ref[2]);
+        ref[0] = norm * std::cos(2.39996f * (float)n);
+        ref[1] = norm * std::sin(2.39996f * (float)n);
+
+        measurement[0] = 1.1f * ref[0] + 0.05f * ref[1] + 0.2f;
+        measurement[1] = 0.9f * ref[1] - 0.1f;
+        measurement[2] = 1.05f * ref[2] + 0.05f;
+        TRICAL_estimate_update(&cal, measurement, ref);
+    }
+
+    double worst = 0.0;
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        EXPECT_GT(cal.state_covariance[TRICAL_COVARIANCE_INDEX(i, i)], 0.0);
+
+        for (j = 0; j < i; j++) {
+#ifndef TRICAL_PACKED_COVARIANCE
+            double diff = std::fabs(
+                (double)cal.state_covariance[i + j * TRICAL_STATE_DIM] -
+                (double)cal.state_covariance[j + i * TRICAL_STATE_DIM]);
+            double scale = std::sqrt(
+                (double)cal.state_covariance[TRICAL_COVARIANCE_INDEX(i, i)] *
+                (double)cal.state_covariance[TRICAL_COVARIANCE_INDEX(j, j)]);
+            worst = std::max(worst, diff / scale);
+#endif
+        }
+    }
+    EXPECT_LE(worst, tolerance);
+
+    /* Positive-definite if the Cholesky factor has a positive diagonal */
+    TRICAL_square_root_set(&cal, 1);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        EXPECT_GT(cal.state_covariance[TRICAL_COVARIANCE_INDEX(i, i)], 0.0);
+    }
+}
+
+/*
+Generate reading `n` of a run with field directions spiralling over the
+sphere, with the bias in X set to `bias_x`
+*/
+static void _drift_reading(unsigned int n, float bias_x, float measurement[3],
+float ref[3]) {
+    float norm;
+
+    ref[2] = 1.0f - 2.0f * (float)((n * 37u) % 1000u) / 1000.0f;
+    norm = std::sqrt(1.0f - ref[2] * ref[2]);
+    ref[0] = norm * std::cos(2.39996f * (float)n);
+    ref[1] = norm * std::sin(2.39996f * (float)n);
+
+    measurement[0] = 1.1f * ref[0] + 0.05f * ref[1] + bias_x;
+    measurement[1] = 0.9f * ref[1] - 0.1f;
+    measurement[2] = 1.05f * ref[2] + 0.05f;
+}
+
+/*
+Check that with process noise, the estimate follows a change in bias after
+it has converged, in both covariance forms
+*/
+TEST(TRICAL, ProcessNoiseTracksDrift) {
+    TRICAL_instance_t cal;
+    float measurement[3], ref[3], bias_estimate[3], scale_estimate[9];
+    unsigned int n, square_root;
+
+    for (square_root = 0; square_root < 2; square_root++) {
+        TRICAL_init(&cal);
+        TRICAL_noise_set(&cal, 1e-3f);
+        TRICAL_process_noise_set(&cal, 1e-7f);
+        TRICAL_square_root_set(&cal, square_root);
+
+        for (n = 0; n < 4000; n++) {
+            _drift_reading(n, n < 2000 ? 0.2f : 0.3f, measurement, ref);
+            TRICAL_estimate_update(&cal, measurement, ref);
+
+            if (n == 1999) {
+                TRICAL_estimate_get(&cal, bias_estimate, scale_estimate);
+                EXPECT_NEAR(0.2, bias_estimate[0], 1e-3);
+            }
+        }
+
+        TRICAL_estimate_get(&cal, bias_estimate, scale_estimate);
+        EXPECT_NEAR(0.3, bias_estimate[0], 1e-3);
+        EXPECT_NEAR(-0.1, bias_estimate[1], 1e-3);
+        EXPECT_NEAR(0.05, bias_estimate[2], 1e-3);
+    }
+}
+
+/*
+Check that forgetting keeps the variances higher than they would otherwise
+be, and that it's applied the same way in square-root mode
+*/
+TEST(TRICAL, Forgetting) {
+    TRICAL_instance_t cal, forgetful, forgetful_sqrt;
+    float measurement[3], ref[3], bias_estimate[3], scale_estimate[9],
+          variance[3], forgetful_variance[3], sqrt_variance[3],
+          scale_variance[9];
+    unsigned int i, n;
+
+    TRICAL_init(&cal);
+    TRICAL_noise_set(&cal, 1e-3f);
+    memcpy(&forgetful, &cal, sizeof(forgetful));
+    TRICAL_forgetting_set(&forgetful, 0.95f);
+    memcpy(&forgetful_sqrt, &forgetful, sizeof(forgetful_sqrt));
+    TRICAL_square_root_set(&forgetful_sqrt, 1);
+
+    for (n = 0; n < 100; n++) {
+        _drift_reading(n, 0.2f, measurement, ref);
+        TRICAL_estimate_update(&cal, measurement, ref);
+        TRICAL_estimate_update(&forgetful, measurement, ref);
+        TRICAL_estimate_update(&forgetful_sqrt, measurement, ref);
+    }
+
+    TRICAL_estimate_get_ext(&cal, bias_estimate, scale_estimate, variance,
+                            scale_variance);
+    TRICAL_estimate_get_ext(&forgetful, bias_estimate, scale_estimate,
+                            forgetful_variance, scale_variance);
+    TRICAL_estimate_get_ext(&forgetful_sqrt, bias_estimate, scale_estimate,
+                            sqrt_variance, scale_variance);
+    for (i = 0; i < 3; i++) {
+        EXPECT_GT(forgetful_variance[i], 2.0f * variance[i]);
+        EXPECT_NEAR(forgetful_variance[i], sqrt_variance[i],
+                    1e-2 * forgetful_variance[i]);
+        EXPECT_NEAR(forgetful.state[i], forgetful_sqrt.state[i], 1e-4);
+    }
+}
+
+/*
+Check that non-finite readings, and updates which would leave the estimate
+non-finite, are rejected without changing the estimate
+*/
+TEST(TRICAL, HealthReject) {
+    TRICAL_instance_t cal, reference;
+    float measurement[3], ref[3];
+    unsigned int n;
+
+    TRICAL_init(&cal);
+    TRICAL_noise_set(&cal, 1e-3f);
+    for (n = 0; n < 100; n++) {
+        _drift_reading(n, 0.2f, measurement, ref);
+        EXPECT_EQ(TRICAL_STATUS_UPDATED,
+                  TRICAL_estimate_update(&cal, measurement, ref));
+    }
+    memcpy(&reference, &cal, sizeof(cal));
+
+    _drift_reading(n, 0.2f, measurement, ref);
+    measurement[1] = std::numeric_limits<float>::quiet_NaN();
+    EXPECT_EQ(TRICAL_STATUS_REJECTED,
+              TRICAL_estimate_update(&cal, measurement, ref));
+
+    _drift_reading(n, 0.2f, measurement, ref);
+    ref[2] = std::numeric_limits<float>::infinity();
+    EXPECT_EQ(TRICAL_STATUS_REJECTED,
+              TRICAL_estimate_update(&cal, measurement, ref));
+
+    /* No update can get anywhere near an infinite field norm */
+    _drift_reading(n, 0.2f, measurement, ref);
+    TRICAL_norm_set(&cal, std::numeric_limits<float>::infinity());
+    EXPECT_EQ(TRICAL_STATUS_REJECTED,
+              TRICAL_estimate_update(&cal, measurement, ref));
+    TRICAL_norm_set(&cal, 1.0f);
+
+    EXPECT_EQ(0, memcmp(reference.state, cal.state, sizeof(cal.state)));
+    EXPECT_EQ(0, memcmp(reference.state_covariance, cal.state_covariance,
+                        sizeof(cal.state_covariance)));
+    EXPECT_EQ(100u, TRICAL_measurement_count_get(&cal));
+    EXPECT_EQ(3u, TRICAL_skipped_count_get(&cal));
+    EXPECT_EQ(0u, TRICAL_repair_count_get(&cal));
+
+    /* A batch skips the bad readings and carries on with the rest */
+    float measurements[3][3], refs[3][3];
+    for (n = 0; n < 3; n++) {
+        _drift_reading(100u + n, 0.2f, measurements[n], refs[n]);
+    }
+    measurements[1][0] = std::numeric_limits<float>::quiet_NaN();
+    TRICAL_estimate_update_batch(&cal, &measurements[0][0], 3, &refs[0][0],
+                                 3, 3);
+    EXPECT_EQ(102u, TRICAL_measurement_count_get(&cal));
+    EXPECT_EQ(4u, TRICAL_skipped_count_get(&cal));
+}
+
+/*
+Check that an estimate whose covariance (or state) has been corrupted is
+repaired, keeping what it can, and carries on converging, in both covariance
+forms. A Cholesky factor with a positive diagonal can't lose positive
+definiteness, so that's only checked for the full covariance.
+*/
+TEST(TRICAL, HealthRepair) {
+    TRICAL_instance_t cal;
+    float measurement[3], ref[3], bias_estimate[3], scale_estimate[9],
+          last_bias_estimate[3];
+    unsigned int square_root, repairs, n;
+
+    for (square_root = 0; square_root < 2; square_root++) {
+        TRICAL_init(&cal);
+        TRICAL_noise_set(&cal, 1e-3f);
+        TRICAL_process_noise_set(&cal, 1e-8f);
+        TRICAL_square_root_set(&cal, square_root);
+
+        for (n = 0; n < 500; n++) {
+            _drift_reading(n, 0.2f, measurement, ref);
+            TRICAL_estimate_update(&cal, measurement, ref);
+        }
+        TRICAL_estimate_get(&cal, last_bias_estimate, scale_estimate);
+        repairs = 0;
+
+        /* Lose positive definiteness */
+        if (!square_root) {
+            cal.state_covariance[TRICAL_COVARIANCE_INDEX(1, 1)] *= -1.0f;
+            _drift_reading(n++, 0.2f, measurement, ref);
+            EXPECT_EQ(TRICAL_STATUS_REPAIRED,
+                      TRICAL_estimate_update(&cal, measurement, ref));
+            EXPECT_EQ(++repairs, TRICAL_repair_count_get(&cal));
+
+            /* The state is kept, so the estimate should barely move */
+            TRICAL_estimate_get(&cal, bias_estimate, scale_estimate);
+            EXPECT_NEAR(last_bias_estimate[0], bias_estimate[0], 1e-2);
+            EXPECT_NEAR(last_bias_estimate[1], bias_estimate[1], 1e-2);
+        }
+
+        /* A non-finite covariance is reinitialized, still keeping the state */
+        cal.state_covariance[TRICAL_COVARIANCE_INDEX(2, 0)] =
+            std::numeric_limits<float>::quiet_NaN();
+        _drift_reading(n++, 0.2f, measurement, ref);
+        EXPECT_EQ(TRICAL_STATUS_REPAIRED,
+                  TRICAL_estimate_update(&cal, measurement, ref));
+        EXPECT_EQ(++repairs, TRICAL_repair_count_get(&cal));
+        TRICAL_estimate_get(&cal, bias_estimate, scale_estimate);
+        EXPECT_NEAR(last_bias_estimate[0], bias_estimate[0], 5e-2);
+
+        /* A non-finite state can only be reset */
+        cal.state[0] = std::numeric_limits<float>::infinity();
+        _drift_reading(n++, 0.2f, measurement, ref);
+        EXPECT_EQ(TRICAL_STATUS_REPAIRED,
+                  TRICAL_estimate_update(&cal, measurement, ref));
+        EXPECT_EQ(++repairs, TRICAL_repair_count_get(&cal));
+
+        for (; n < 2000; n++) {
+            _drift_reading(n, 0.2f, measurement, ref);
+            EXPECT_NE(TRICAL_STATUS_REJECTED,
+                      TRICAL_estimate_update(&cal, measurement, ref));
+        }
+
+        TRICAL_estimate_get(&cal, bias_estimate, scale_estimate);
+        EXPECT_NEAR(0.2, bias_estimate[0], 1e-3);
+        EXPECT_NEAR(-0.1, bias_estimate[1], 1e-3);
+        EXPECT_NEAR(0.05, bias_estimate[2], 1e-3);
+        EXPECT_EQ(repairs, TRICAL_repair_count_get(&cal));
+        EXPECT_EQ(2000u, TRICAL_measurement_count_get(&cal));
+    }
+}
+
+/*
+Check that the outlier gate rejects most readings taken during a disturbance,
+so the estimate stays close to where it was while an ungated instance is
+dragged away. The gate only sees the field norm, so readings in directions
+where the disturbance barely changes the norm still get through.
+*/
+TEST(TRICAL, OutlierGate) {
+    TRICAL_instance_t cal, ungated;
+    float measurement[3], ref[3], bias_estimate[3], scale_estimate[9];
+    unsigned int n, i, skipped;
+
+    TRICAL_init(&cal);
+    TRICAL_noise_set(&cal, 1e-3f);
+    TRICAL_outlier_gate_set(&cal, 9.0f);
+    TRICAL_init(&ungated);
+    TRICAL_noise_set(&ungated, 1e-3f);
+
+    /* Clean readings get through, including while far from converged */
+    for (n = 0; n < 1000; n++) {
+        _drift_reading(n, 0.2f, measurement, ref);
+        EXPECT_EQ(TRICAL_STATUS_UPDATED,
+                  TRICAL_estimate_update(&cal, measurement, ref));
+        TRICAL_estimate_update(&ungated, measurement, ref);
+    }
+
+    /* A nearby motor adds a disturbance field to the next 50 readings */
+    for (; n < 1050; n++) {
+        _drift_reading(n, 0.2f, measurement, ref);
+        measurement[0] += 0.3f;
+        measurement[2] -= 0.2f;
+        TRICAL_estimate_update(&cal, measurement, ref);
+        TRICAL_estimate_update(&ungated, measurement, ref);
+    }
+
+    skipped = TRICAL_skipped_count_get(&cal);
+    EXPECT_GE(skipped, 30u);
+    EXPECT_EQ(1050u, TRICAL_measurement_count_get(&cal) + skipped);
+
+    float error, ungated_error;
+    TRICAL_estimate_get(&cal, bias_estimate, scale_estimate);
+    error = std::fabs(bias_estimate[0] - 0.2f) +
+            std::fabs(bias_estimate[2] - 0.05f);
+    TRICAL_estimate_get(&ungated, bias_estimate, scale_estimate);
+    ungated_error = std::fabs(bias_estimate[0] - 0.2f) +
+                    std::fabs(bias_estimate[2] - 0.05f);
+    EXPECT_LT(error, 5e-3f);
+    EXPECT_GT(ungated_error, 3.0f * error);
+
+#ifdef TRICAL_STATS
+    TRICAL_stats_t stats;
+    TRICAL_stats_get(&cal, &stats);
+    EXPECT_EQ(skipped, stats.outlier_count);
+    EXPECT_EQ(1050u - skipped, stats.update_count);
+#endif
+
+    /* Once the disturbance has gone, readings are used again */
+    for (; n < 1500; n++) {
+        _drift_reading(n, 0.2f, measurement, ref);
+        EXPECT_EQ(TRICAL_STATUS_UPDATED,
+                  TRICAL_estimate_update(&cal, measurement, ref));
+    }
+
+    TRICAL_estimate_get(&cal, bias_estimate, scale_estimate);
+    EXPECT_NEAR(0.2, bias_estimate[0], 1e-3);
+    EXPECT_NEAR(-0.1, bias_estimate[1], 1e-3);
+    EXPECT_NEAR(0.05, bias_estimate[2], 1e-3);
+
+    /* Disabling the gate lets everything through */
+    TRICAL_outlier_gate_set(&cal, 0.0f);
+    for (i = 0; i < 10; i++) {
+        _drift_reading(n + i, 0.2f, measurement, ref);
+        measurement[0] += 0.3f;
+        measurement[2] -= 0.2f;
+        EXPECT_EQ(TRICAL_STATUS_UPDATED,
+                  TRICAL_estimate_update(&cal, measurement, ref));
+    }
+    EXPECT_EQ(skipped, TRICAL_skipped_count_get(&cal));
+
+    /*
+    A reading the gate rejects after the covariance has been repaired is
+    still rejected, but the repair stands and is counted
+    */
+    TRICAL_outlier_gate_set(&cal, 9.0f);
+    cal.state_covariance[TRICAL_COVARIANCE_INDEX(1, 1)] *= -1.0f;
+    _drift_reading(n + i, 0.2f, measurement, ref);
+    for (i = 0; i < 3; i++) {
+        measurement[i] *= 3.0f;
+    }
+
+#ifdef TRICAL_STATS
+    TRICAL_stats_get(&cal, &stats);
+    uint64_t update_cycles = stats.update_cycles;
+#endif
+
+    EXPECT_EQ(TRICAL_STATUS_REJECTED,
+              TRICAL_estimate_update(&cal, measurement, ref));
+    EXPECT_EQ(1u, TRICAL_repair_count_get(&cal));
+    EXPECT_EQ(skipped + 1u, TRICAL_skipped_count_get(&cal));
+    EXPECT_LT(0.0f, cal.state_covariance[TRICAL_COVARIANCE_INDEX(1, 1)]);
+
+#ifdef TRICAL_STATS
+    /* The rejected update's time is counted too */
+    TRICAL_stats_get(&cal, &stats);
+    EXPECT_GT(stats.update_cycles, update_cycles);
+#endif
+}
+
+/*
+Check that readings rejected by the outlier gate don't count towards the
+coverage limit, so a burst of them can't fill a direction bin and lock out
+the good readings that follow
+*/
+TEST(TRICAL, OutlierGateCoverage) {
+    TRICAL_instance_t cal;
+    float measurement[3], ref[3], calibrated[3];
+    unsigned int n, i, bin, limit, total;
+
+    TRICAL_init(&cal);
+    TRICAL_noise_set(&cal, 1e-3f);
+    TRICAL_outlier_gate_set(&cal, 9.0f);
+    for (n = 0; n < 1000; n++) {
+        _drift_reading(n, 0.2f, measurement, ref);
+        TRICAL_estimate_update(&cal, measurement, ref);
+    }
+
+    /* Half as strong again as the real field */
+    _drift_reading(n, 0.2f, measurement, ref);
+    for (i = 0; i < 3; i++) {
+        measurement[i] *= 1.5f;
+    }
+    TRICAL_measurement_calibrate(&cal, measurement, calibrated);
+    bin = _trical_direction_bin(calibrated);
+    limit = cal.coverage[bin] + 1u;
+    TRICAL_coverage_limit_set(&cal, limit);
+
+    for (i = 0; i < 50; i++) {
+        EXPECT_EQ(TRICAL_STATUS_REJECTED,
+                  TRICAL_estimate_update(&cal, measurement, ref));
+    }
+    EXPECT_EQ(limit - 1u, cal.coverage[bin]);
+    EXPECT_NE(0u, _trical_filter_gate(&cal, measurement, ref, &i));
+    EXPECT_EQ(bin, i);
+
+    /* Every reading in the histogram is one the estimate used */
+    for (i = 0, total = 0; i < TRICAL_COVERAGE_BINS; i++) {
+        total += cal.coverage[i];
+    }
+    EXPECT_EQ(TRICAL_measurement_count_get(&cal), total);
 }
@@ -0,0 +1,340 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <cmath>
+
+/* C++ complains about the C99 'restrict' qualifier. Just ignore it. */
+#define restrict
+
+#include "TRICAL.h"
+#include "filter.h"
+
+/* Generate a reading of `field` as seen by a sensor with a bias of `bias` */
+static void _bank_reading(unsigned int i, float bias, float measurement[3],
+float field[3]) {
+    float theta = (float)i * 0.37f, phi = (float)i * 0.11f;
+
+    field[0] = cosf(theta) * cosf(phi);
+    field[1] = sinf(theta) * cosf(phi);
+    field[2] = sinf(phi);
+
+    measurement[0] = field[0] + bias;
+    measurement[1] = field[1] - 0.5f * bias;
+    measurement[2] = field[2] + 0.25f * bias;
+}
+
+/* Check that bank instances start in the same state as TRICAL_init */
+TEST(Bank, Initialisation) {
+    TRICAL_bank_t bank;
+    TRICAL_instance_t cal, ref;
+    unsigned int n;
+
+    TRICAL_bank_init(&bank);
+    TRICAL_init(&ref);
+
+    for (n = 0; n < TRICAL_BANK_WIDTH; n++) {
+        TRICAL_init(&cal);
+        TRICAL_bank_instance_get(&bank, n, &cal);
+        EXPECT_EQ(0, memcmp(&ref, &cal, sizeof(cal)));
+    }
+}
+
+/* Check that instances survive a round trip through the bank */
+TEST(Bank, InstanceSetGet) {
+    TRICAL_bank_t bank;
+    TRICAL_instance_t cal, out;
+    float measurement[3], field[3];
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    TRICAL_norm_set(&cal, 2.0f);
+    TRICAL_noise_set(&cal, 0.5f);
+    TRICAL_process_noise_set(&cal, 1e-6f);
+    TRICAL_forgetting_set(&cal, 0.99f);
+    TRICAL_coverage_limit_set(&cal, 30u);
+    for (i = 0; i < 20; i++) {
+        _bank_reading(i, 0.3f, measurement, field);
+        TRICAL_estimate_update(&cal, measurement, field);
+    }
+
+    TRICAL_bank_init(&bank);
+    TRICAL_bank_instance_set(&bank, 1, &cal);
+    TRICAL_init(&out);
+    TRICAL_bank_instance_get(&bank, 1, &out);
+
+    EXPECT_FLOAT_EQ(2.0f, TRICAL_norm_get(&out));
+    EXPECT_FLOAT_EQ(0.5f, TRICAL_noise_get(&out));
+    EXPECT_FLOAT_EQ(1e-6f, out.process_noise);
+    EXPECT_FLOAT_EQ(0.99f, out.forgetting);
+    EXPECT_EQ(20u, TRICAL_measurement_count_get(&out));
+
+    /* Settings the bank doesn't hold are left as they are */
+    EXPECT_EQ(0u, out.coverage_limit);
+    memcpy(&out, &cal, sizeof(out));
+    TRICAL_bank_instance_get(&bank, 1, &out);
+    EXPECT_EQ(30u, out.coverage_limit);
+    EXPECT_EQ(0, memcmp(cal.coverage, out.coverage, sizeof(cal.coverage)));
+    EXPECT_EQ(0, memcmp(cal.state, out.state, sizeof(cal.state)));
+
+    /* Only the lower triangle is stored, so allow for slight asymmetry */
+    for (i = 0; i < TRICAL_COVARIANCE_DIM; i++) {
+        EXPECT_NEAR(cal.state_covariance[i], out.state_covariance[i], 1e-9);
+    }
+
+    /* Square-root instances are converted back to a full covariance */
+    TRICAL_square_root_set(&cal, 1);
+    TRICAL_bank_instance_set(&bank, 1, &cal);
+    TRICAL_bank_instance_get(&bank, 1, &out);
+
+    TRICAL_square_root_set(&cal, 0);
+    for (i = 0; i < TRICAL_COVARIANCE_DIM; i++) {
+        EXPECT_NEAR(cal.state_covariance[i], out.state_covariance[i], 1e-6);
+    }
+}
+
+/*
+Check that each instance in the bank tracks an independent instance updated
+with the same readings, and that inactive instances are left alone
+*/
+TEST(Bank, EstimateUpdate) {
+    TRICAL_bank_t bank;
+    TRICAL_instance_t cal[TRICAL_BANK_WIDTH], out;
+    float measurements[TRICAL_BANK_WIDTH][3], fields[TRICAL_BANK_WIDTH][3];
+    unsigned int i, n, active, counts[TRICAL_BANK_WIDTH];
+
+    /*
+    Use a realistic noise level, since the covariance can collapse with
+    noise-free readings and the default noise
+    */
+    TRICAL_bank_init(&bank);
+    for (n = 0; n < TRICAL_BANK_WIDTH; n++) {
+        TRICAL_init(&cal[n]);
+        TRICAL_noise_set(&cal[n], 1e-3f);
+        if (n % 3u == 1u) {
+            TRICAL_process_noise_set(&cal[n], 1e-6f);
+            TRICAL_forgetting_set(&cal[n], 0.999f);
+        } else if (n % 3u == 2u) {
+            TRICAL_square_root_set(&cal[n], 1u);
+            TRICAL_process_noise_set(&cal[n], 1e-6f);
+        }
+        TRICAL_bank_instance_set(&bank, n, &cal[n]);
+        counts[n] = 0;
+    }
+
+    for (i = 0; i < 300; i++) {
+        /* Skip a different instance each iteration */
+        active = ((1u << (TRICAL_BANK_WIDTH - 1u)) - 1u) * 2u + 1u;
+        active &= ~(1u << (i % (TRICAL_BANK_WIDTH + 1u)));
+
+        for (n = 0; n < TRICAL_BANK_WIDTH; n++) {
+            _bank_reading(i + n, 0.1f * (float)n, measurements[n],
+                          fields[n]);
+
+            if (active & (1u << n)) {
+                TRICAL_estimate_update(&cal[n], measurements[n], fields[n]);
+                counts[n]++;
+            } else {
+                /* Garbage for inactive instances should be ignored */
+                measurements[n][0] = NAN;
+            }
+        }
+
+        TRICAL_bank_estimate_update(&bank, measurements, fields, active);
+    }
+
+    for (n = 0; n < TRICAL_BANK_WIDTH; n++) {
+        TRICAL_init(&out);
+        TRICAL_bank_instance_get(&bank, n, &out);
+
+        EXPECT_EQ(counts[n], TRICAL_measurement_count_get(&out));
+        for (i = 0; i < TRICAL_STATE_DIM; i++) {
+            EXPECT_NEAR(cal[n].state[i], out.state[i], 1e-3);
+        }
+
+        /* Including the process model, where there is one */
+        float bias[3], scale[9], variance[3], scale_variance[9],
+              expected_variance[3];
+        TRICAL_estimate_get_ext(&out, bias, scale, variance, scale_variance);
+        TRICAL_estimate_get_ext(&cal[n], bias, scale, expected_variance,
+                                scale_variance);
+        for (i = 0; i < 3; i++) {
+            EXPECT_NEAR(expected_variance[i], variance[i],
+                        1e-2 * expected_variance[i]);
+        }
+
+        float measurement[3], field[3], expected[3], calibrated[3];
+        _bank_reading(1000, 0.1f * (float)n, measurement, field);
+        TRICAL_measurement_calibrate(&cal[n], measurement, expected);
+        TRICAL_bank_measurement_calibrate(&bank, n, measurement, calibrated);
+        EXPECT_NEAR(expected[0], calibrated[0], 1e-3);
+        EXPECT_NEAR(expected[1], calibrated[1], 1e-3);
+        EXPECT_NEAR(expected[2], calibrated[2], 1e-3);
+    }
+}
+
+/*
+Check that updating separate instances in lockstep tracks updating each of
+them on its own, with per-instance settings honoured and the same readings
+skipped or rejected. There are more instances than fit in one bank, so it
+takes more than one pass.
+*/
+TEST(Bank, EstimateUpdateMulti) {
+    const unsigned int count = TRICAL_BANK_WIDTH + 3u;
+    TRICAL_instance_t multi[TRICAL_BANK_WIDTH + 3u],
+                      single[TRICAL_BANK_WIDTH + 3u],
+                      *instances[TRICAL_BANK_WIDTH + 3u];
+    float measurements[TRICAL_BANK_WIDTH + 3u][3],
+          fields[TRICAL_BANK_WIDTH + 3u][3];
+    unsigned int i, n;
+
+    for (n = 0; n < count; n++) {
+        TRICAL_init(&multi[n]);
+        TRICAL_noise_set(&multi[n], 1e-3f);
+        switch (n % 5u) {
+            case 1u:
+                TRICAL_square_root_set(&multi[n], 1u);
+                break;
+            case 2u:
+                TRICAL_process_noise_set(&multi[n], 1e-6f);
+                TRICAL_forgetting_set(&multi[n], 0.999f);
+                break;
+            case 3u:
+                TRICAL_coverage_limit_set(&multi[n], 10u);
+                break;
+            case 4u:
+                TRICAL_outlier_gate_set(&multi[n], 9.0f);
+                break;
+            default:
+                break;
+        }
+
+        memcpy(&single[n], &multi[n], sizeof(TRICAL_instance_t));
+        instances[n] = &multi[n];
+    }
+
+    for (i = 0; i < 300; i++) {
+        for (n = 0; n < count; n++) {
+            _bank_reading(i + n, 0.1f * (float)n, measurements[n],
+                          fields[n]);
+
+            /* The odd reading which isn't finite, or is way off */
+            if (i % 40u == 39u && n % 5u == 0) {
+                measurements[n][1] = NAN;
+            } else if (i % 25u == 24u && n % 5u == 4u) {
+                measurements[n][0] *= 2.0f;
+            }
+
+            TRICAL_estimate_update(&single[n], measurements[n], fields[n]);
+        }
+
+        TRICAL_estimate_update_multi(instances, measurements, fields, count);
+    }
+
+    for (n = 0; n < count; n++) {
+        EXPECT_EQ(TRICAL_measurement_count_get(&single[n]),
+                  TRICAL_measurement_count_get(&multi[n]));
+        EXPECT_EQ(TRICAL_skipped_count_get(&single[n]),
+                  TRICAL_skipped_count_get(&multi[n]));
+        EXPECT_EQ(0, memcmp(single[n].coverage, multi[n].coverage,
+                            sizeof(single[n].coverage)));
+        EXPECT_EQ(single[n].square_root, multi[n].square_root);
+        if (n % 5u == 4u) {
+            EXPECT_GT(TRICAL_skipped_count_get(&multi[n]), 0u);
+        }
+        /*
+        The bank takes a different (but equivalent) route through the
+        covariance update, particularly in square-root mode, and the rounding
+        differences grow once the covariance is small
+        */
+        for (i = 0; i < TRICAL_STATE_DIM; i++) {
+            EXPECT_NEAR(single[n].state[i], multi[n].state[i], 1e-3);
+            EXPECT_NEAR(
+                single[n].state_covariance[TRICAL_COVARIANCE_INDEX(i, i)],
+                multi[n].state_covariance[TRICAL_COVARIANCE_INDEX(i, i)],
+                0.25 * single[n].state_covariance[
+                    TRICAL_COVARIANCE_INDEX(i, i)]);
+        }
+    }
+
+    /* Instances with a fixed reference field don't need one passed in */
+    float field[3] = { 1.0f, 0.0f, 0.0f };
+    TRICAL_field_set(&multi[0], field);
+    TRICAL_estimate_update_multi(instances, measurements, NULL, 1u);
+    EXPECT_EQ(TRICAL_measurement_count_get(&single[0]) + 1u,
+              TRICAL_measurement_count_get(&multi[0]));
+}
+
+/*
+Check that an instance whose covariance the bank can't factorize, or whose
+state isn't finite, is repaired as TRICAL_estimate_update would, without
+holding up the rest of the bank
+*/
+TEST(Bank, EstimateUpdateMultiRepair) {
+    TRICAL_instance_t multi[3], single[3], *instances[3];
+    float measurements[3][3], fields[3][3];
+    unsigned int i, n;
+
+    for (n = 0; n < 3; n++) {
+        TRICAL_init(&multi[n]);
+        TRICAL_noise_set(&multi[n], 1e-3f);
+        TRICAL_square_root_set(&multi[n], n == 2u);
+        instances[n] = &multi[n];
+    }
+
+    for (i = 0; i < 300; i++) {
+        for (n = 0; n < 3; n++) {
+            _bank_reading(i + n, 0.1f, measurements[n], fields[n]);
+        }
+
+        if (i == 100) {
+            /* A negative variance, a NaN state and a negative pivot */
+            multi[0].state_covariance[TRICAL_COVARIANCE_INDEX(
+                TRICAL_STATE_DIM - 1u, TRICAL_STATE_DIM - 1u)] = -1.0f;
+            multi[1].state[2] = NAN;
+            multi[2].state_covariance[TRICAL_COVARIANCE_INDEX(0, 0)] = -1e-3f;
+            for (n = 0; n < 3; n++) {
+                memcpy(&single[n], &multi[n], sizeof(TRICAL_instance_t));
+            }
+        }
+
+        if (i >= 100) {
+            for (n = 0; n < 3; n++) {
+                TRICAL_estimate_update(&single[n], measurements[n],
+                                       fields[n]);
+            }
+        }
+
+        TRICAL_estimate_update_multi(instances, measurements, fields, 3u);
+    }
+
+    for (n = 0; n < 3; n++) {
+        EXPECT_EQ(1u, TRICAL_repair_count_get(&multi[n]));
+        EXPECT_EQ(TRICAL_repair_count_get(&single[n]),
+                  TRICAL_repair_count_get(&multi[n]));
+        EXPECT_EQ(300u, TRICAL_measurement_count_get(&multi[n]));
+        for (i = 0; i < TRICAL_STATE_DIM; i++) {
+            EXPECT_NEAR(single[n].state[i], multi[n].state[i], 1e-3);
+        }
+    }
+}
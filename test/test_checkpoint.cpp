@@ -0,0 +1,244 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include <gtest/gtest.h>
+#include <cstring>
+
+/* C++ complains about the C99 'restrict' qualifier. Just ignore it. */
+#define restrict
+
+#include "TRICAL.h"
+#include "filter.h"
+
+/* Run an instance through some readings so it has a non-trivial state */
+static void _checkpoint_instance(TRICAL_instance_t *cal) {
+    float measurement[3], ref[3];
+    unsigned int i, j;
+
+    TRICAL_init(cal);
+    TRICAL_norm_set(cal, 1.5f);
+    TRICAL_noise_set(cal, 1e-2f);
+    for (i = 0; i < 60; i++) {
+        for (j = 0; j < 3; j++) {
+            ref[j] = (float)((i * 7u + j * 3u) % 11u) / 5.0f - 1.0f;
+            measurement[j] = 1.5f * ref[j] + 0.1f * (float)j;
+        }
+        ref[i % 3] += 1.0f;
+        TRICAL_estimate_update(cal, measurement, ref);
+    }
+}
+
+/* Reference CRC-32, as used by zlib */
+static uint32_t _reference_crc32(const uint8_t *data, size_t size) {
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (unsigned int k = 0; k < 8; k++) {
+            crc = (crc & 1u) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+static void _write_crc32(uint8_t *buffer, size_t size) {
+    uint32_t crc = _reference_crc32(buffer, size - 4);
+    for (unsigned int i = 0; i < 4; i++) {
+        buffer[size - 4 + i] = (uint8_t)(crc >> (8 * i));
+    }
+}
+
+/* Check the header and CRC of a full checkpoint */
+TEST(Checkpoint, Layout) {
+    TRICAL_instance_t cal;
+    uint8_t buffer[TRICAL_CHECKPOINT_SIZE + 16];
+    uint32_t crc;
+
+    _checkpoint_instance(&cal);
+    EXPECT_EQ(TRICAL_CHECKPOINT_SIZE,
+              TRICAL_checkpoint_save(&cal, TRICAL_CHECKPOINT_FULL, buffer,
+                                     sizeof(buffer)));
+
+    EXPECT_EQ(0, memcmp(buffer, "TRIC", 4));
+    EXPECT_EQ(1, buffer[4]);
+    EXPECT_EQ(TRICAL_CHECKPOINT_FULL, buffer[5]);
+    EXPECT_EQ(TRICAL_STATE_DIM, buffer[6]);
+
+    crc = (uint32_t)buffer[TRICAL_CHECKPOINT_SIZE - 4] |
+          ((uint32_t)buffer[TRICAL_CHECKPOINT_SIZE - 3] << 8) |
+          ((uint32_t)buffer[TRICAL_CHECKPOINT_SIZE - 2] << 16) |
+          ((uint32_t)buffer[TRICAL_CHECKPOINT_SIZE - 1] << 24);
+    EXPECT_EQ(_reference_crc32(buffer, TRICAL_CHECKPOINT_SIZE - 4), crc);
+}
+
+/*
+Check that restoring a full checkpoint reproduces the instance, and that it
+carries on exactly as the original would
+*/
+TEST(Checkpoint, RoundTripFull) {
+    TRICAL_instance_t cal, restored;
+    uint8_t buffer[TRICAL_CHECKPOINT_SIZE];
+    float measurement[3] = { 1.2f, -0.4f, 0.3f },
+          ref[3] = { 0.8f, -0.3f, 0.2f };
+    unsigned int i;
+
+    _checkpoint_instance(&cal);
+    TRICAL_checkpoint_save(&cal, TRICAL_CHECKPOINT_FULL, buffer,
+                           sizeof(buffer));
+
+    TRICAL_init(&restored);
+    EXPECT_EQ(TRICAL_CHECKPOINT_OK,
+              TRICAL_checkpoint_load(&restored, buffer, sizeof(buffer)));
+
+    EXPECT_FLOAT_EQ(1.5f, TRICAL_norm_get(&restored));
+    EXPECT_FLOAT_EQ(1e-2f, TRICAL_noise_get(&restored));
+    EXPECT_EQ(60u, TRICAL_measurement_count_get(&restored));
+    EXPECT_EQ(0, memcmp(cal.state, restored.state, sizeof(cal.state)));
+    for (i = 0; i < TRICAL_COVARIANCE_DIM; i++) {
+        EXPECT_FLOAT_EQ((float)cal.state_covariance[i],
+                        (float)restored.state_covariance[i]);
+    }
+
+    TRICAL_estimate_update(&cal, measurement, ref);
+    TRICAL_estimate_update(&restored, measurement, ref);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        EXPECT_FLOAT_EQ(cal.state[i], restored.state[i]);
+    }
+}
+
+/*
+Check that checkpoints don't depend on square-root mode, in either direction
+*/
+TEST(Checkpoint, SquareRoot) {
+    TRICAL_instance_t cal, restored;
+    uint8_t buffer[TRICAL_CHECKPOINT_SIZE];
+    unsigned int i;
+
+    _checkpoint_instance(&cal);
+    TRICAL_square_root_set(&cal, 1);
+    TRICAL_checkpoint_save(&cal, TRICAL_CHECKPOINT_FULL, buffer,
+                           sizeof(buffer));
+    TRICAL_square_root_set(&cal, 0);
+
+    TRICAL_init(&restored);
+    EXPECT_EQ(TRICAL_CHECKPOINT_OK,
+              TRICAL_checkpoint_load(&restored, buffer, sizeof(buffer)));
+    for (i = 0; i < TRICAL_COVARIANCE_DIM; i++) {
+        EXPECT_NEAR(cal.state_covariance[i], restored.state_covariance[i],
+                    1e-7);
+    }
+
+    /* A square-root instance gets the Cholesky factor */
+    TRICAL_checkpoint_save(&cal, TRICAL_CHECKPOINT_FULL, buffer,
+                           sizeof(buffer));
+    TRICAL_square_root_set(&cal, 1);
+    TRICAL_init(&restored);
+    TRICAL_square_root_set(&restored, 1);
+    EXPECT_EQ(TRICAL_CHECKPOINT_OK,
+              TRICAL_checkpoint_load(&restored, buffer, sizeof(buffer)));
+    EXPECT_EQ(1u, TRICAL_square_root_get(&restored));
+    for (i = 0; i < TRICAL_COVARIANCE_DIM; i++) {
+        EXPECT_NEAR(cal.state_covariance[i], restored.state_covariance[i],
+                    1e-6);
+    }
+}
+
+/* Check that the estimate-only format keeps just the covariance diagonal */
+TEST(Checkpoint, Estimate) {
+    TRICAL_instance_t cal, restored;
+    uint8_t buffer[TRICAL_CHECKPOINT_ESTIMATE_SIZE];
+    unsigned int i, j;
+
+    _checkpoint_instance(&cal);
+    EXPECT_EQ(TRICAL_CHECKPOINT_ESTIMATE_SIZE,
+              TRICAL_checkpoint_save(&cal, TRICAL_CHECKPOINT_ESTIMATE,
+                                     buffer, sizeof(buffer)));
+
+    TRICAL_init(&restored);
+    EXPECT_EQ(TRICAL_CHECKPOINT_OK,
+              TRICAL_checkpoint_load(&restored, buffer, sizeof(buffer)));
+
+    EXPECT_EQ(60u, TRICAL_measurement_count_get(&restored));
+    EXPECT_EQ(0, memcmp(cal.state, restored.state, sizeof(cal.state)));
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        for (j = 0; j <= i; j++) {
+            if (i == j) {
+                EXPECT_FLOAT_EQ(
+                    (float)cal.state_covariance[TRICAL_COVARIANCE_INDEX(i, i)],
+                    (float)restored.state_covariance[
+                        TRICAL_COVARIANCE_INDEX(i, i)]);
+            } else {
+                EXPECT_FLOAT_EQ(0.0f, (float)restored.state_covariance[
+                    TRICAL_COVARIANCE_INDEX(i, j)]);
+            }
+        }
+    }
+}
+
+/* Check that damaged checkpoints are rejected without touching the instance */
+TEST(Checkpoint, Errors) {
+    TRICAL_instance_t cal, restored, expected;
+    uint8_t buffer[TRICAL_CHECKPOINT_SIZE], damaged[TRICAL_CHECKPOINT_SIZE];
+
+    _checkpoint_instance(&cal);
+    TRICAL_checkpoint_save(&cal, TRICAL_CHECKPOINT_FULL, buffer,
+                           sizeof(buffer));
+    TRICAL_init(&restored);
+    memcpy(&expected, &restored, sizeof(expected));
+
+    EXPECT_EQ(TRICAL_CHECKPOINT_ERROR_SIZE,
+              TRICAL_checkpoint_load(&restored, buffer, 4));
+    EXPECT_EQ(TRICAL_CHECKPOINT_ERROR_SIZE,
+              TRICAL_checkpoint_load(&restored, buffer, sizeof(buffer) - 1));
+
+    memcpy(damaged, buffer, sizeof(damaged));
+    damaged[0] = 'X';
+    EXPECT_EQ(TRICAL_CHECKPOINT_ERROR_MAGIC,
+              TRICAL_checkpoint_load(&restored, damaged, sizeof(damaged)));
+
+    memcpy(damaged, buffer, sizeof(damaged));
+    damaged[4] = 2;
+    EXPECT_EQ(TRICAL_CHECKPOINT_ERROR_VERSION,
+              TRICAL_checkpoint_load(&restored, damaged, sizeof(damaged)));
+
+    memcpy(damaged, buffer, sizeof(damaged));
+    damaged[40] ^= 0x10;
+    EXPECT_EQ(TRICAL_CHECKPOINT_ERROR_CRC,
+              TRICAL_checkpoint_load(&restored, damaged, sizeof(damaged)));
+
+    /* An estimate-only checkpoint from a smaller model, with a valid CRC */
+    memcpy(damaged, buffer, sizeof(damaged));
+    damaged[5] = TRICAL_CHECKPOINT_ESTIMATE;
+    damaged[6] = 2;
+    _write_crc32(damaged, 8 + 4 * (3 + 2 * 2) + 4);
+    EXPECT_EQ(TRICAL_CHECKPOINT_ERROR_MODEL,
+              TRICAL_checkpoint_load(&restored, damaged, sizeof(damaged)));
+
+    /* A covariance that isn't positive-definite, with a valid CRC */
+    memcpy(damaged, buffer, sizeof(damaged));
+    memset(&damaged[20 + 4 * TRICAL_STATE_DIM], 0xFF, 4);
+    _write_crc32(damaged, sizeof(damaged));
+    EXPECT_EQ(TRICAL_CHECKPOINT_ERROR_VALUE,
+              TRICAL_checkpoint_load(&restored, damaged, sizeof(damaged)));
+
+    EXPECT_EQ(0, memcmp(&expected, &restored, sizeof(expected)));
+}
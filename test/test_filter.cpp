@@ -21,6 +21,7 @@ SOFTWARE.
 */
 
 #include <gtest/gtest.h>
+#include <cstring>
 
 /* C++ complains about the C99 'restrict' qualifier. Just ignore it. */
 #define restrict
@@ -157,3 +158,78 @@ TEST(Filter, MeasurementReduction) {
     result = _trical_measurement_reduce(state, measurement, measurement);
     EXPECT_FLOAT_EQ(6.0497932, result);
 }
+
+/*
+Test the vectorized sigma point evaluation against the scalar measurement
+reduction for each sigma point.
+*/
+TEST(Filter, MeasurementReductionSigma) {
+    float state[] = {
+        0.1, -0.2, 0.05,
+        0.1, 0.05, 0.01,
+        0.05, -0.1, 0.05,
+        0.01, 0.05, 0.2
+    };
+    float llt[TRICAL_STATE_DIM * TRICAL_STATE_DIM];
+    float measurement[] = { 1.0, 2.0, 3.0 }, field[] = { 0.3, 0.5, 0.8 };
+    float estimates[TRICAL_NUM_SIGMA], sigma[TRICAL_STATE_DIM];
+    unsigned int i, j;
+
+    /* Lower-triangular factor with distinct values in every element */
+    memset(llt, 0, sizeof(llt));
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        for (j = i; j < TRICAL_STATE_DIM; j++) {
+            llt[i * TRICAL_STATE_DIM + j] = 0.01f * (float)(i + 1) +
+                                            0.001f * (float)j;
+        }
+    }
+
+    _trical_measurement_reduce_sigma(state, llt, measurement, field,
+                                     estimates);
+
+    EXPECT_FLOAT_EQ(_trical_measurement_reduce(state, measurement, field),
+                    estimates[0]);
+
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        for (j = 0; j < TRICAL_STATE_DIM; j++) {
+            sigma[j] = state[j] + llt[i * TRICAL_STATE_DIM + j];
+        }
+        EXPECT_FLOAT_EQ(_trical_measurement_reduce(sigma, measurement, field),
+                        estimates[i + 1]);
+
+        for (j = 0; j < TRICAL_STATE_DIM; j++) {
+            sigma[j] = state[j] - llt[i * TRICAL_STATE_DIM + j];
+        }
+        EXPECT_FLOAT_EQ(_trical_measurement_reduce(sigma, measurement, field),
+                        estimates[i + 1 + TRICAL_STATE_DIM]);
+    }
+}
+
+/*
+Check the direction bins: with the default resolution, each face of the cube
+is split into quadrants, and every bin is distinct
+*/
+TEST(Filter, DirectionBin) {
+    float v[3];
+    unsigned int axis, sign, i, seen = 0, bin;
+
+    for (axis = 0; axis < 3; axis++) {
+        for (sign = 0; sign < 8; sign++) {
+            for (i = 0; i < 3; i++) {
+                v[i] = (i == axis ? 1.0f : 0.5f) *
+                       ((sign >> (2 - (i + 3 - axis) % 3)) & 1 ? -1.0f : 1.0f);
+            }
+
+            bin = _trical_direction_bin(v);
+            ASSERT_LT(bin, (unsigned int)TRICAL_COVERAGE_BINS);
+            EXPECT_EQ(0, seen & (1u << bin));
+            seen |= 1u << bin;
+        }
+    }
+
+    v[0] = 0.2f;
+    v[1] = -0.9f;
+    v[2] = 0.3f;
+    /* -Y face, positive Z and X */
+    EXPECT_EQ(3u * 4u + 2u + 1u, _trical_direction_bin(v));
+}
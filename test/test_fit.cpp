@@ -0,0 +1,301 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <cmath>
+
+/* C++ complains about the C99 'restrict' qualifier. Just ignore it. */
+#define restrict
+
+#include "TRICAL.h"
+
+/*
+Like test_model.cpp, these hold for every calibration model, and are also
+built with the reduced models.
+*/
+#define FIT_READINGS 500u
+
+/* Reading `i` of a field of magnitude 2 sweeping over the sphere */
+static void _fit_field(unsigned int i, float field[3]) {
+    float theta = 0.1f * (float)i,
+          phi = asinf(2.0f * (float)i / (float)FIT_READINGS - 1.0f);
+
+    field[0] = 2.0f * cosf(theta) * cosf(phi);
+    field[1] = 2.0f * sinf(theta) * cosf(phi);
+    field[2] = 2.0f * sinf(phi);
+}
+
+/*
+Sensor distortion used by the tests: the readings are distortion * field +
+bias, so the calibration should recover a scale of inv(distortion) - I. Each
+model gets the most general distortion it can represent.
+*/
+#if TRICAL_STATE_DIM == 12
+static const float _fit_distortion[9] = {
+    1.2f, 0.1f, 0.0f,
+    0.1f, 0.9f, 0.05f,
+    0.0f, 0.05f, 1.1f
+};
+#elif TRICAL_STATE_DIM == 6
+static const float _fit_distortion[9] = {
+    2.0f, 0.0f, 0.0f,
+    0.0f, 0.8f, 0.0f,
+    0.0f, 0.0f, 1.0f
+};
+#else
+static const float _fit_distortion[9] = {
+    1.0f, 0.0f, 0.0f,
+    0.0f, 1.0f, 0.0f,
+    0.0f, 0.0f, 1.0f
+};
+#endif
+static const float _fit_bias[3] = { 0.5f, -0.25f, 0.1f };
+
+static void _fit_reading(unsigned int i, float measurement[3]) {
+    float field[3];
+    unsigned int j;
+
+    _fit_field(i, field);
+    for (j = 0; j < 3; j++) {
+        measurement[j] = _fit_distortion[j * 3 + 0] * field[0] +
+                         _fit_distortion[j * 3 + 1] * field[1] +
+                         _fit_distortion[j * 3 + 2] * field[2] +
+                         _fit_bias[j];
+    }
+}
+
+/* Magnitude of `measurement` calibrated by `cal` */
+static float _fit_calibrated_norm(TRICAL_instance_t *cal,
+const float measurement[3]) {
+    float result[3];
+
+    TRICAL_measurement_calibrate(cal, measurement, result);
+    return sqrtf(result[0] * result[0] + result[1] * result[1] +
+                 result[2] * result[2]);
+}
+
+/* Check that an exact fit recovers the bias and scale */
+TEST(Fit, Solve) {
+    TRICAL_fit_t fit;
+    float measurement[3];
+    unsigned int i;
+
+    TRICAL_fit_init(&fit);
+    for (i = 0; i < FIT_READINGS; i++) {
+        _fit_reading(i, measurement);
+        TRICAL_fit_add(&fit, measurement);
+    }
+
+    float bias_estimate[3], scale_estimate[9];
+    ASSERT_NE(0u, TRICAL_fit_solve(&fit, 2.0f, bias_estimate,
+                                   scale_estimate));
+
+    for (i = 0; i < 3; i++) {
+        EXPECT_NEAR(_fit_bias[i], bias_estimate[i], 1e-4);
+    }
+
+    /* (I + D) * distortion should be the identity */
+    unsigned int r, c;
+    for (r = 0; r < 3; r++) {
+        for (c = 0; c < 3; c++) {
+            float sum = 0.0f;
+            for (i = 0; i < 3; i++) {
+                sum += (scale_estimate[r * 3 + i] + (r == i ? 1.0f : 0.0f)) *
+                       _fit_distortion[i * 3 + c];
+            }
+            EXPECT_NEAR(r == c ? 1.0 : 0.0, sum, 1e-4);
+        }
+    }
+}
+
+/* Check that TRICAL_fit_add_many matches adding readings one at a time */
+TEST(Fit, AddMany) {
+    TRICAL_fit_t fit, fit_many;
+    float measurements[FIT_READINGS * 4];
+    unsigned int i;
+
+    TRICAL_fit_init(&fit);
+    TRICAL_fit_init(&fit_many);
+    for (i = 0; i < FIT_READINGS; i++) {
+        _fit_reading(i, &measurements[i * 4]);
+        measurements[i * 4 + 3] = 0.0f;
+        TRICAL_fit_add(&fit, &measurements[i * 4]);
+    }
+    TRICAL_fit_add_many(&fit_many, measurements, 4, FIT_READINGS);
+
+    EXPECT_EQ(FIT_READINGS, fit_many.count);
+    EXPECT_EQ(0, memcmp(&fit, &fit_many, sizeof(fit)));
+}
+
+/*
+Check that merging fits of separate shards of the readings is equivalent to
+fitting them all at once
+*/
+TEST(Fit, Merge) {
+    TRICAL_fit_t fit, shards[3];
+    float measurement[3];
+    unsigned int i;
+
+    TRICAL_fit_init(&fit);
+    for (i = 0; i < 3; i++) {
+        TRICAL_fit_init(&shards[i]);
+    }
+    for (i = 0; i < FIT_READINGS; i++) {
+        _fit_reading(i, measurement);
+        TRICAL_fit_add(&fit, measurement);
+        TRICAL_fit_add(&shards[(i * 7u) % 3u], measurement);
+    }
+
+    /* Merge as a tree: (0 + 1) + 2 */
+    TRICAL_fit_merge(&shards[0], &shards[1]);
+    TRICAL_fit_merge(&shards[0], &shards[2]);
+    EXPECT_EQ(FIT_READINGS, shards[0].count);
+
+    float bias_estimate[3], scale_estimate[9],
+          merged_bias_estimate[3], merged_scale_estimate[9];
+    ASSERT_NE(0u, TRICAL_fit_solve(&fit, 2.0f, bias_estimate,
+                                   scale_estimate));
+    ASSERT_NE(0u, TRICAL_fit_solve(&shards[0], 2.0f, merged_bias_estimate,
+                                   merged_scale_estimate));
+    for (i = 0; i < 3; i++) {
+        EXPECT_NEAR(bias_estimate[i], merged_bias_estimate[i], 1e-6);
+    }
+    for (i = 0; i < 9; i++) {
+        EXPECT_NEAR(scale_estimate[i], merged_scale_estimate[i], 1e-6);
+    }
+
+    /* Merging an empty fit changes nothing */
+    TRICAL_fit_init(&shards[1]);
+    memcpy(&fit, &shards[0], sizeof(fit));
+    TRICAL_fit_merge(&shards[0], &shards[1]);
+    EXPECT_EQ(0, memcmp(&fit, &shards[0], sizeof(fit)));
+}
+
+/* Check that readings which don't determine an ellipsoid are rejected */
+TEST(Fit, Degenerate) {
+    TRICAL_fit_t fit;
+    float measurement[3], field[3];
+    float bias_estimate[3] = { 1.0, 2.0, 3.0 }, scale_estimate[9];
+    unsigned int i;
+
+    /* No readings */
+    TRICAL_fit_init(&fit);
+    EXPECT_EQ(0u, TRICAL_fit_solve(&fit, 1.0f, bias_estimate,
+                                   scale_estimate));
+
+    /* Too few readings */
+    for (i = 0; i < 3; i++) {
+        _fit_reading(i * 100, measurement);
+        TRICAL_fit_add(&fit, measurement);
+    }
+    EXPECT_EQ(0u, TRICAL_fit_solve(&fit, 1.0f, bias_estimate,
+                                   scale_estimate));
+
+    /* Readings all in one plane */
+    TRICAL_fit_init(&fit);
+    for (i = 0; i < FIT_READINGS; i++) {
+        _fit_field(i, field);
+        measurement[0] = field[0];
+        measurement[1] = field[1];
+        measurement[2] = 0.5f;
+        TRICAL_fit_add(&fit, measurement);
+    }
+    EXPECT_EQ(0u, TRICAL_fit_solve(&fit, 1.0f, bias_estimate,
+                                   scale_estimate));
+
+    EXPECT_FLOAT_EQ(1.0, bias_estimate[0]);
+    EXPECT_FLOAT_EQ(2.0, bias_estimate[1]);
+    EXPECT_FLOAT_EQ(3.0, bias_estimate[2]);
+
+    /* A failed seed leaves the instance unchanged */
+    TRICAL_instance_t cal, reference;
+    TRICAL_init(&cal);
+    memcpy(&reference, &cal, sizeof(cal));
+    EXPECT_EQ(0u, TRICAL_fit_seed(&fit, &cal));
+    EXPECT_EQ(0, memcmp(&reference, &cal, sizeof(cal)));
+}
+
+/*
+Check that seeding an instance from a fit of noisy readings gives a
+calibration about as good as the fit, with a covariance the filter can carry
+on from, in both covariance modes. The single-precision filter needs some
+process noise to stay positive-definite once it has converged, so that's set
+as it would be in use.
+*/
+TEST(Fit, Seed) {
+    unsigned int square_root;
+
+    for (square_root = 0; square_root < 2; square_root++) {
+        TRICAL_fit_t fit;
+        TRICAL_instance_t cal;
+        float measurement[3], field[3];
+        unsigned int i, j;
+
+        TRICAL_init(&cal);
+        TRICAL_norm_set(&cal, 2.0f);
+        TRICAL_noise_set(&cal, 1e-3f);
+        TRICAL_process_noise_set(&cal, 1e-8f);
+        TRICAL_square_root_set(&cal, square_root);
+
+        TRICAL_fit_init(&fit);
+        for (i = 0; i < FIT_READINGS; i++) {
+            _fit_reading(i, measurement);
+            for (j = 0; j < 3; j++) {
+                measurement[j] += 1e-3f * sinf(7.3f * (float)(i * 3 + j));
+            }
+            TRICAL_fit_add(&fit, measurement);
+        }
+        ASSERT_NE(0u, TRICAL_fit_seed(&fit, &cal));
+
+        float bias_estimate[3], scale_estimate[9],
+              bias_variance[3], scale_variance[9];
+        TRICAL_estimate_get_ext(&cal, bias_estimate, scale_estimate,
+                                bias_variance, scale_variance);
+        for (i = 0; i < 3; i++) {
+            EXPECT_NEAR(_fit_bias[i], bias_estimate[i], 1e-2);
+            EXPECT_GT(bias_variance[i], 0.0f);
+            EXPECT_LT(bias_variance[i], 1e-4f);
+        }
+
+        for (i = 0; i < FIT_READINGS; i += 10) {
+            _fit_reading(i, measurement);
+            EXPECT_NEAR(2.0, _fit_calibrated_norm(&cal, measurement), 1e-2);
+        }
+
+        /* The filter should stay converged on further readings */
+        for (i = 0; i < FIT_READINGS; i++) {
+            _fit_reading(i, measurement);
+            _fit_field(i, field);
+            TRICAL_estimate_update(&cal, measurement, field);
+        }
+
+        TRICAL_estimate_get(&cal, bias_estimate, scale_estimate);
+        for (i = 0; i < 3; i++) {
+            EXPECT_NEAR(_fit_bias[i], bias_estimate[i], 1e-2);
+        }
+        for (i = 0; i < FIT_READINGS; i += 10) {
+            _fit_reading(i, measurement);
+            EXPECT_NEAR(2.0, _fit_calibrated_norm(&cal, measurement), 1e-2);
+        }
+    }
+}
@@ -0,0 +1,170 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <cmath>
+
+/* C++ complains about the C99 'restrict' qualifier. Just ignore it. */
+#define restrict
+
+#include "TRICAL.h"
+#include "filter.h"
+
+/*
+Tests for the fixed-point instance; like the model tests, these are also
+built with the reduced calibration models.
+*/
+
+/* Generate reading `i` of a field rotating through every direction */
+static void _fixed_field(unsigned int i, float field[3]) {
+    float theta = (float)i * 0.37f, phi = (float)i * 0.11f;
+
+    field[0] = cosf(theta) * cosf(phi);
+    field[1] = sinf(theta) * cosf(phi);
+    field[2] = sinf(phi);
+}
+
+static void _fixed_from_float(const float a[3], TRICAL_fixed_t out[3]) {
+    unsigned int k;
+    for (k = 0; k < 3; k++) {
+        out[k] = TRICAL_FIXED_FROM_FLOAT(a[k]);
+    }
+}
+
+/* Check the defaults match the floating-point instance */
+TEST(Fixed, Initialisation) {
+    TRICAL_fixed_instance_t cal;
+    unsigned int i, j;
+
+    TRICAL_fixed_init(&cal);
+    EXPECT_EQ(TRICAL_FIXED_ONE, TRICAL_fixed_norm_get(&cal));
+    EXPECT_NEAR(1e-6, TRICAL_FIXED_TO_FLOAT(TRICAL_fixed_noise_get(&cal)),
+                1e-8);
+    EXPECT_EQ(0, TRICAL_fixed_measurement_count_get(&cal));
+
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        EXPECT_EQ(0, cal.state[i]);
+        for (j = i; j < TRICAL_STATE_DIM; j++) {
+            EXPECT_NEAR(i == j ? 0.1 : 0.0, TRICAL_FIXED_TO_FLOAT(
+                cal.state_covariance[TRICAL_PACKED_INDEX(j, i)]), 1e-8);
+        }
+    }
+}
+
+/* Check that calibration matches the floating-point implementation */
+TEST(Fixed, Calibrate) {
+    TRICAL_fixed_instance_t cal;
+    TRICAL_instance_t reference;
+    float measurement[3] = { 0.5, 1.0, 1.5 }, expected[3];
+    TRICAL_fixed_t fixed_measurement[3], result[3];
+    unsigned int i;
+
+    TRICAL_fixed_init(&cal);
+    TRICAL_init(&reference);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        reference.state[i] = 0.1f * (float)(i % 4) - 0.125f;
+        cal.state[i] = TRICAL_FIXED_FROM_FLOAT(reference.state[i]);
+    }
+
+    TRICAL_measurement_calibrate(&reference, measurement, expected);
+    _fixed_from_float(measurement, fixed_measurement);
+    TRICAL_fixed_measurement_calibrate(&cal, fixed_measurement, result);
+
+    for (i = 0; i < 3; i++) {
+        EXPECT_NEAR(expected[i], TRICAL_FIXED_TO_FLOAT(result[i]), 1e-6);
+    }
+
+    /* In-place */
+    TRICAL_fixed_measurement_calibrate(&cal, fixed_measurement,
+                                       fixed_measurement);
+    EXPECT_EQ(0, memcmp(result, fixed_measurement, sizeof(result)));
+}
+
+/*
+Check that the fixed-point filter tracks the floating-point filter in
+square-root mode
+*/
+TEST(Fixed, EstimateUpdateMatchesFloat) {
+    TRICAL_fixed_instance_t cal;
+    TRICAL_instance_t reference;
+    float measurement[3], field[3];
+    TRICAL_fixed_t fixed_measurement[3], fixed_field[3];
+    unsigned int i;
+
+    TRICAL_fixed_init(&cal);
+    TRICAL_fixed_noise_set(&cal, TRICAL_FIXED_FROM_FLOAT(1e-3f));
+    TRICAL_init(&reference);
+    TRICAL_noise_set(&reference, 1e-3f);
+    TRICAL_square_root_set(&reference, 1);
+
+    for (i = 0; i < 200; i++) {
+        _fixed_field(i, field);
+        measurement[0] = field[0] * 1.1f + 0.2f;
+        measurement[1] = field[1] * 0.95f - 0.1f;
+        measurement[2] = field[2] + 0.05f;
+
+        TRICAL_estimate_update(&reference, measurement, field);
+
+        _fixed_from_float(measurement, fixed_measurement);
+        _fixed_from_float(field, fixed_field);
+        TRICAL_fixed_estimate_update(&cal, fixed_measurement, fixed_field);
+    }
+
+    EXPECT_EQ(200, TRICAL_fixed_measurement_count_get(&cal));
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        EXPECT_NEAR(reference.state[i], TRICAL_FIXED_TO_FLOAT(cal.state[i]),
+                    1e-4);
+    }
+}
+
+/* Check that the fixed-point filter converges on a pure bias */
+TEST(Fixed, EstimateUpdateBias) {
+    TRICAL_fixed_instance_t cal;
+    float measurement[3], field[3];
+    TRICAL_fixed_t fixed_measurement[3], fixed_field[3];
+    unsigned int i;
+
+    TRICAL_fixed_init(&cal);
+    TRICAL_fixed_noise_set(&cal, TRICAL_FIXED_FROM_FLOAT(1e-3f));
+
+    for (i = 0; i < 1000; i++) {
+        _fixed_field(i, field);
+        measurement[0] = field[0] + 0.5f;
+        measurement[1] = field[1] - 0.25f;
+        measurement[2] = field[2];
+
+        _fixed_from_float(measurement, fixed_measurement);
+        _fixed_from_float(field, fixed_field);
+        TRICAL_fixed_estimate_update(&cal, fixed_measurement, fixed_field);
+    }
+
+    TRICAL_fixed_t bias_estimate[3], scale_estimate[9];
+    TRICAL_fixed_estimate_get(&cal, bias_estimate, scale_estimate);
+    EXPECT_NEAR(0.5, TRICAL_FIXED_TO_FLOAT(bias_estimate[0]), 2e-2);
+    EXPECT_NEAR(-0.25, TRICAL_FIXED_TO_FLOAT(bias_estimate[1]), 2e-2);
+    EXPECT_NEAR(0.0, TRICAL_FIXED_TO_FLOAT(bias_estimate[2]), 2e-2);
+
+    for (i = 0; i < 9; i++) {
+        EXPECT_NEAR(0.0, TRICAL_FIXED_TO_FLOAT(scale_estimate[i]), 2e-2);
+    }
+}
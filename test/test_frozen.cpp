@@ -0,0 +1,146 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <limits>
+
+/* C++ complains about the C99 'restrict' qualifier. Just ignore it. */
+#define restrict
+
+#include "TRICAL.h"
+
+/* Set up an instance with an arbitrary calibration estimate */
+static void _frozen_instance(TRICAL_instance_t *cal) {
+    unsigned int i;
+
+    TRICAL_init(cal);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        cal->state[i] = 0.1f * (float)((i * 5u) % 7u) - 0.3f;
+    }
+}
+
+/* Check that the snapshot holds the bias and (I + D) */
+TEST(Frozen, Get) {
+    TRICAL_instance_t cal;
+    TRICAL_frozen_t frozen;
+    float bias_estimate[3], scale_estimate[9];
+    unsigned int i;
+
+    _frozen_instance(&cal);
+    TRICAL_frozen_get(&cal, &frozen);
+    TRICAL_estimate_get(&cal, bias_estimate, scale_estimate);
+
+    for (i = 0; i < 3; i++) {
+        EXPECT_FLOAT_EQ(bias_estimate[i], frozen.bias[i]);
+    }
+    for (i = 0; i < 9; i++) {
+        EXPECT_FLOAT_EQ(scale_estimate[i] + (i % 4 ? 0.0f : 1.0f),
+                        frozen.scale[i]);
+    }
+}
+
+/*
+Check that bulk calibration matches TRICAL_measurement_calibrate, for a count
+which doesn't divide evenly into vectors and spans several staging chunks
+*/
+TEST(Frozen, CalibrateMany) {
+    TRICAL_instance_t cal;
+    TRICAL_frozen_t frozen;
+    float measurements[301][3], calibrated[301][3], expected[3];
+    unsigned int i, j;
+
+    _frozen_instance(&cal);
+    TRICAL_frozen_get(&cal, &frozen);
+
+    for (i = 0; i < 301; i++) {
+        for (j = 0; j < 3; j++) {
+            measurements[i][j] = (float)((i * 3u + j) % 13u) * 0.25f - 1.5f;
+        }
+    }
+
+    TRICAL_calibrate_many(&frozen, measurements, calibrated, 301);
+
+    for (i = 0; i < 301; i++) {
+        TRICAL_measurement_calibrate(&cal, measurements[i], expected);
+        for (j = 0; j < 3; j++) {
+            EXPECT_FLOAT_EQ(expected[j], calibrated[i][j]);
+        }
+    }
+
+    /* Now in-place */
+    TRICAL_calibrate_many(&frozen, measurements, measurements, 301);
+    EXPECT_EQ(0, memcmp(measurements, calibrated, sizeof(calibrated)));
+
+    /* Nothing to do, so nothing should be touched */
+    TRICAL_calibrate_many(&frozen, NULL, NULL, 0);
+}
+
+/*
+Check that a non-finite measurement doesn't affect the calibration of the
+finite measurements either side of it
+*/
+TEST(Frozen, CalibrateManyNonFinite) {
+    TRICAL_instance_t cal;
+    TRICAL_frozen_t frozen;
+    float measurements[64][3], calibrated[64][3], expected[3];
+    unsigned int i, j;
+
+    _frozen_instance(&cal);
+    TRICAL_frozen_get(&cal, &frozen);
+
+    for (i = 0; i < 64; i++) {
+        for (j = 0; j < 3; j++) {
+            measurements[i][j] = (float)(i * 3u + j + 1u);
+        }
+    }
+    measurements[1][2] = std::numeric_limits<float>::infinity();
+    measurements[9][0] = std::numeric_limits<float>::quiet_NaN();
+    measurements[30][1] = -std::numeric_limits<float>::infinity();
+
+    TRICAL_calibrate_many(&frozen, measurements, calibrated, 64);
+
+    for (i = 0; i < 64; i++) {
+        if (i == 1 || i == 9 || i == 30) {
+            continue;
+        }
+
+        TRICAL_measurement_calibrate(&cal, measurements[i], expected);
+        for (j = 0; j < 3; j++) {
+            EXPECT_FLOAT_EQ(expected[j], calibrated[i][j]) << i;
+        }
+    }
+}
+
+/* Check that the snapshot doesn't change when the instance does */
+TEST(Frozen, Snapshot) {
+    TRICAL_instance_t cal;
+    TRICAL_frozen_t frozen, copy;
+    float measurement[3] = { 1.0, 0.5, 0.0 }, field[3] = { 1.0, 0.0, 0.0 };
+
+    _frozen_instance(&cal);
+    TRICAL_frozen_get(&cal, &frozen);
+    memcpy(&copy, &frozen, sizeof(copy));
+
+    TRICAL_estimate_update(&cal, measurement, field);
+    EXPECT_EQ(0, memcmp(&copy, &frozen, sizeof(copy)));
+}
@@ -0,0 +1,166 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <cmath>
+
+/* C++ complains about the C99 'restrict' qualifier. Just ignore it. */
+#define restrict
+
+#include "TRICAL.h"
+#include "filter.h"
+
+/*
+Tests which hold for every calibration model (selected by TRICAL_STATE_DIM);
+these are also built with the reduced models as unittest_bias and
+unittest_diagonal.
+*/
+
+/* Check that the scale estimate is expanded according to the model */
+TEST(Model, EstimateGet) {
+    TRICAL_instance_t cal;
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        cal.state[i] = (float)(i + 1);
+    }
+
+    float bias_estimate[3], scale_estimate[9];
+    TRICAL_estimate_get(&cal, bias_estimate, scale_estimate);
+
+    EXPECT_FLOAT_EQ(1.0, bias_estimate[0]);
+    EXPECT_FLOAT_EQ(2.0, bias_estimate[1]);
+    EXPECT_FLOAT_EQ(3.0, bias_estimate[2]);
+
+    for (i = 0; i < 9; i++) {
+#if TRICAL_STATE_DIM == 12
+        EXPECT_FLOAT_EQ((float)(i + 4), scale_estimate[i]);
+#elif TRICAL_STATE_DIM == 6
+        EXPECT_FLOAT_EQ(i % 4 ? 0.0f : (float)(i / 4 + 4), scale_estimate[i]);
+#else
+        EXPECT_FLOAT_EQ(0.0, scale_estimate[i]);
+#endif
+    }
+}
+
+/* Check that calibration applies the bias and whatever scale is modelled */
+TEST(Model, Calibrate) {
+    TRICAL_instance_t cal;
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        cal.state[i] = 0.5f;
+    }
+
+    float measurement[3] = { 1.0, 2.0, 3.0 }, result[3];
+    TRICAL_measurement_calibrate(&cal, measurement, result);
+
+#if TRICAL_STATE_DIM == 12
+    EXPECT_FLOAT_EQ(0.5f * 1.5f + 1.5f * 0.5f + 2.5f * 0.5f, result[0]);
+    EXPECT_FLOAT_EQ(0.5f * 0.5f + 1.5f * 1.5f + 2.5f * 0.5f, result[1]);
+    EXPECT_FLOAT_EQ(0.5f * 0.5f + 1.5f * 0.5f + 2.5f * 1.5f, result[2]);
+#elif TRICAL_STATE_DIM == 6
+    EXPECT_FLOAT_EQ(0.5f * 1.5f, result[0]);
+    EXPECT_FLOAT_EQ(1.5f * 1.5f, result[1]);
+    EXPECT_FLOAT_EQ(2.5f * 1.5f, result[2]);
+#else
+    EXPECT_FLOAT_EQ(0.5f, result[0]);
+    EXPECT_FLOAT_EQ(1.5f, result[1]);
+    EXPECT_FLOAT_EQ(2.5f, result[2]);
+#endif
+}
+
+/*
+Number of readings to use for the convergence tests. The bigger the model,
+the longer it takes to converge; but with noise-free readings the covariance
+of the smaller models collapses if they're run for too long.
+*/
+#define MODEL_READINGS (TRICAL_STATE_DIM == 12 ? 1000u : 500u)
+
+/* Generate reading `i` of a field rotating through every direction */
+static void _model_field(unsigned int i, float field[3]) {
+    float theta = (float)i * 0.37f, phi = (float)i * 0.11f;
+
+    field[0] = cosf(theta) * cosf(phi);
+    field[1] = sinf(theta) * cosf(phi);
+    field[2] = sinf(phi);
+}
+
+/* Check that every model converges on a pure bias */
+TEST(Model, EstimateUpdateBias) {
+    TRICAL_instance_t cal;
+    float measurement[3], field[3];
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    TRICAL_noise_set(&cal, 1e-3f);
+
+    for (i = 0; i < MODEL_READINGS; i++) {
+        _model_field(i, field);
+        measurement[0] = field[0] + 0.5f;
+        measurement[1] = field[1] - 0.25f;
+        measurement[2] = field[2];
+
+        TRICAL_estimate_update(&cal, measurement, field);
+    }
+
+    float bias_estimate[3], scale_estimate[9];
+    TRICAL_estimate_get(&cal, bias_estimate, scale_estimate);
+    EXPECT_NEAR(0.5, bias_estimate[0], 2e-2);
+    EXPECT_NEAR(-0.25, bias_estimate[1], 2e-2);
+    EXPECT_NEAR(0.0, bias_estimate[2], 2e-2);
+
+    for (i = 0; i < 9; i++) {
+        EXPECT_NEAR(0.0, scale_estimate[i], 2e-2);
+    }
+}
+
+#if TRICAL_STATE_DIM >= 6
+/* Check that the models with a scale estimate converge on a diagonal scale */
+TEST(Model, EstimateUpdateScale) {
+    TRICAL_instance_t cal;
+    float measurement[3], field[3], scale[3] = { 2.0, 0.8, 1.0 };
+    unsigned int i, k;
+
+    TRICAL_init(&cal);
+    TRICAL_noise_set(&cal, 1e-3f);
+
+    for (i = 0; i < MODEL_READINGS; i++) {
+        _model_field(i, field);
+        for (k = 0; k < 3; k++) {
+            measurement[k] = field[k] * scale[k];
+        }
+
+        TRICAL_estimate_update(&cal, measurement, field);
+    }
+
+    /* (I + D) * scale should be the identity */
+    float bias_estimate[3], scale_estimate[9];
+    TRICAL_estimate_get(&cal, bias_estimate, scale_estimate);
+    EXPECT_NEAR(-0.5, scale_estimate[0], 2e-2);
+    EXPECT_NEAR(0.25, scale_estimate[4], 2e-2);
+    EXPECT_NEAR(0.0, scale_estimate[8], 2e-2);
+}
+#endif
@@ -0,0 +1,171 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <cstddef>
+#include <cmath>
+
+/* C++ complains about the C99 'restrict' qualifier. Just ignore it. */
+#define restrict
+
+#include "TRICAL.h"
+#include "tools/pool.h"
+
+#define POOL_STREAMS 37u
+
+/*
+Bytes of TRICAL_instance_t to compare: the instrumentation counters (the
+last member) include timings, which differ from run to run
+*/
+#ifdef TRICAL_STATS
+#define POOL_COMPARE_SIZE offsetof(TRICAL_instance_t, stats)
+#else
+#define POOL_COMPARE_SIZE sizeof(TRICAL_instance_t)
+#endif
+
+/*
+Check that streams processed by the pool end up identical to the same
+streams processed one after another on a single thread
+*/
+static void _pool_check(unsigned int thread_count) {
+    TRICAL_instance_t pooled[POOL_STREAMS], serial[POOL_STREAMS];
+    TRICAL_pool_stream_t streams[POOL_STREAMS];
+    static float measurements[POOL_STREAMS][64][3];
+    float field[3] = { 1.0f, 0.0f, 0.0f };
+    unsigned int i, n, k;
+
+    for (n = 0; n < POOL_STREAMS; n++) {
+        TRICAL_init(&pooled[n]);
+        TRICAL_norm_set(&pooled[n], 1.0f + 0.1f * (float)n);
+
+        for (i = 0; i < 64; i++) {
+            for (k = 0; k < 3; k++) {
+                measurements[n][i][k] =
+                    (float)((i * 7u + k * 3u + n) % 11u) * 0.2f - 1.0f;
+            }
+        }
+
+        /* Vary the stream lengths, including an empty stream */
+        streams[n].instance = &pooled[n];
+        streams[n].measurements = &measurements[n][0][0];
+        streams[n].measurement_stride = 3;
+        streams[n].reference_fields = field;
+        streams[n].reference_field_stride = 0;
+        streams[n].count = (n * 13u) % 65u;
+
+        memcpy(&serial[n], &pooled[n], sizeof(TRICAL_instance_t));
+        if (streams[n].count) {
+            TRICAL_estimate_update_batch(&serial[n], &measurements[n][0][0],
+                                         3, field, 0, streams[n].count);
+        }
+    }
+
+    TRICAL_pool_run(streams, POOL_STREAMS, thread_count);
+
+    for (n = 0; n < POOL_STREAMS; n++) {
+        EXPECT_EQ(streams[n].count,
+                  TRICAL_measurement_count_get(&pooled[n]));
+        EXPECT_EQ(0, memcmp(&serial[n], &pooled[n], POOL_COMPARE_SIZE));
+    }
+}
+
+TEST(Pool, SingleThread) {
+    _pool_check(1);
+}
+
+TEST(Pool, MultipleThreads) {
+    _pool_check(4);
+}
+
+TEST(Pool, DefaultThreads) {
+    _pool_check(0);
+}
+
+/* More threads than streams, and no streams at all */
+TEST(Pool, FewStreams) {
+    TRICAL_instance_t cal;
+    TRICAL_pool_stream_t stream;
+    float measurements[5][3], field[3] = { 1.0f, 0.0f, 0.0f };
+    unsigned int i;
+
+    for (i = 0; i < 5; i++) {
+        measurements[i][0] = 1.0f;
+        measurements[i][1] = 0.1f * (float)i;
+        measurements[i][2] = 0.0f;
+    }
+
+    TRICAL_init(&cal);
+    stream.instance = &cal;
+    stream.measurements = &measurements[0][0];
+    stream.measurement_stride = 3;
+    stream.reference_fields = field;
+    stream.reference_field_stride = 0;
+    stream.count = 5;
+
+    TRICAL_pool_run(&stream, 1, 8);
+    EXPECT_EQ(5u, TRICAL_measurement_count_get(&cal));
+
+    TRICAL_pool_run(NULL, 0, 8);
+}
+
+/*
+Check that a sharded fit is the same whatever the number of threads, and
+matches accumulating the readings serially to within rounding
+*/
+TEST(Pool, Fit) {
+    static float measurements[3 * 4096 + 123][4];
+    TRICAL_fit_t serial, pooled[3];
+    unsigned int i, thread_counts[3] = { 1, 4, 0 };
+    const unsigned int count = sizeof(measurements) / sizeof(measurements[0]);
+
+    for (i = 0; i < count; i++) {
+        measurements[i][0] = 1.5f * cosf(0.1f * (float)i) + 0.2f;
+        measurements[i][1] = 0.8f * sinf(0.1f * (float)i) - 0.1f;
+        measurements[i][2] = cosf(0.013f * (float)i);
+        measurements[i][3] = 0.0f;
+    }
+
+    TRICAL_fit_init(&serial);
+    TRICAL_fit_add_many(&serial, &measurements[0][0], 4, count);
+
+    for (i = 0; i < 3; i++) {
+        TRICAL_fit_init(&pooled[i]);
+        TRICAL_pool_fit(&pooled[i], &measurements[0][0], 4, count,
+                        thread_counts[i]);
+        EXPECT_EQ(count, pooled[i].count);
+        EXPECT_EQ(0, memcmp(&pooled[0], &pooled[i], sizeof(TRICAL_fit_t)));
+    }
+
+    for (i = 0; i < TRICAL_FIT_MOMENTS; i++) {
+        EXPECT_NEAR(serial.moments[i], pooled[0].moments[i],
+                    1e-12 * fabs(serial.moments[i]) + 1e-9);
+    }
+    for (i = 0; i < TRICAL_FIT_TERMS; i++) {
+        EXPECT_NEAR(serial.terms[i], pooled[0].terms[i],
+                    1e-12 * fabs(serial.terms[i]) + 1e-9);
+    }
+
+    /* No readings leaves the fit as it was */
+    TRICAL_pool_fit(&pooled[1], NULL, 4, 0, 4);
+    EXPECT_EQ(0, memcmp(&pooled[0], &pooled[1], sizeof(TRICAL_fit_t)));
+}
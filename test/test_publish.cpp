@@ -0,0 +1,206 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+
+/* C++ complains about the C99 'restrict' qualifier. Just ignore it. */
+#define restrict
+
+#include "TRICAL.h"
+#include "filter.h"
+
+#define PUBLISH_READERS 3u
+#define PUBLISH_ITERATIONS 20000u
+
+TEST(Published, Init) {
+    TRICAL_published_t published;
+    TRICAL_frozen_t frozen;
+    float measurement[3] = { 0.5f, -1.0f, 2.0f }, result[3];
+
+    TRICAL_published_init(&published);
+    EXPECT_EQ(0u, TRICAL_published_get(&published, &frozen));
+
+    TRICAL_published_calibrate(&published, measurement, result);
+    EXPECT_FLOAT_EQ(0.5f, result[0]);
+    EXPECT_FLOAT_EQ(-1.0f, result[1]);
+    EXPECT_FLOAT_EQ(2.0f, result[2]);
+}
+
+/*
+Check that updates are published, and that calibrating from the published
+estimate matches calibrating from the instance itself
+*/
+TEST(Published, EstimateUpdate) {
+    TRICAL_instance_t cal;
+    TRICAL_published_t published;
+    TRICAL_frozen_t frozen, expected;
+    float measurements[4][3] = {
+        { 1.1f, 0.0f, 0.0f },
+        { 0.0f, 0.9f, 0.0f },
+        { 0.0f, 0.0f, 1.0f },
+        { -1.0f, 0.1f, 0.0f }
+    };
+    float field[3] = { 1.0f, 0.0f, 0.0f }, result[3], expected_result[3];
+    unsigned int i, sequence;
+
+    TRICAL_init(&cal);
+    TRICAL_published_init(&published);
+    TRICAL_published_set(&cal, &published);
+    sequence = TRICAL_published_get(&published, &frozen);
+
+    for (i = 0; i < 4; i++) {
+        TRICAL_estimate_update(&cal, measurements[i], field);
+    }
+    EXPECT_EQ(sequence + 4u, TRICAL_published_get(&published, &frozen));
+
+    /* A batch is published once, at the end */
+    TRICAL_estimate_update_batch(&cal, &measurements[0][0], 3, field, 0, 4);
+    EXPECT_EQ(sequence + 5u, TRICAL_published_get(&published, &frozen));
+
+    TRICAL_frozen_get(&cal, &expected);
+    EXPECT_EQ(0, memcmp(&expected, &frozen, sizeof(frozen)));
+
+    TRICAL_published_calibrate(&published, measurements[3], result);
+    TRICAL_measurement_calibrate(&cal, measurements[3], expected_result);
+    for (i = 0; i < 3; i++) {
+        EXPECT_FLOAT_EQ(expected_result[i], result[i]);
+    }
+
+    /* Once detached, updates aren't published */
+    TRICAL_published_set(&cal, NULL);
+    TRICAL_estimate_update(&cal, measurements[0], field);
+    EXPECT_EQ(sequence + 5u, TRICAL_published_get(&published, &frozen));
+}
+
+struct publish_reader_t {
+    const TRICAL_published_t *published;
+    unsigned int torn;
+    unsigned int reads;
+};
+
+/*
+Reads the published estimate until the writer's final publication appears.
+Every estimate the writer publishes has the same value in each bias element,
+so a reader which mixes up two publications would see different values.
+*/
+static void *_publish_reader(void *arg) {
+    publish_reader_t *reader = (publish_reader_t *)arg;
+    TRICAL_frozen_t frozen;
+    unsigned int sequence;
+
+    do {
+        sequence = TRICAL_published_get(reader->published, &frozen);
+        if (frozen.bias[0] != frozen.bias[1] ||
+                frozen.bias[0] != frozen.bias[2]) {
+            reader->torn++;
+        }
+        reader->reads++;
+    } while (sequence <= PUBLISH_ITERATIONS);
+
+    return NULL;
+}
+
+TEST(Published, ConcurrentReaders) {
+    TRICAL_instance_t cal;
+    TRICAL_published_t published;
+    publish_reader_t readers[PUBLISH_READERS];
+    pthread_t threads[PUBLISH_READERS];
+    unsigned int i, j;
+
+    TRICAL_init(&cal);
+    TRICAL_published_init(&published);
+    TRICAL_published_set(&cal, &published);
+
+    for (i = 0; i < PUBLISH_READERS; i++) {
+        readers[i].published = &published;
+        readers[i].torn = 0;
+        readers[i].reads = 0;
+        ASSERT_EQ(0, pthread_create(&threads[i], NULL, _publish_reader,
+                                    &readers[i]));
+    }
+
+    /* Publish a sequence of distinct estimates */
+    for (i = 1; i <= PUBLISH_ITERATIONS; i++) {
+        for (j = 0; j < TRICAL_STATE_DIM; j++) {
+            cal.state[j] = (float)i;
+        }
+        TRICAL_published_set(&cal, &published);
+    }
+
+    for (i = 0; i < PUBLISH_READERS; i++) {
+        pthread_join(threads[i], NULL);
+        EXPECT_EQ(0u, readers[i].torn);
+        EXPECT_LT(0u, readers[i].reads);
+    }
+}
+
+/*
+Check the overlap the concurrent test can rarely hit: a reader starts
+copying one buffer, then the writer completes one publication (to the other
+buffer) and pauses part way through the next, which rewrites the reader's
+buffer. The reader has to retry, and meanwhile new readers get the last
+complete estimate without waiting for the writer.
+*/
+TEST(Published, WriterMidCopy) {
+    TRICAL_instance_t cal;
+    TRICAL_published_t published;
+    TRICAL_frozen_t frozen, *buffer;
+    unsigned int sequence, j;
+
+    TRICAL_init(&cal);
+    TRICAL_published_init(&published);
+    TRICAL_published_set(&cal, &published);
+
+    /* The reader starts its copy */
+    sequence = published.sequence;
+    const TRICAL_frozen_t *reading =
+        &published.estimate[(sequence >> 1) & 1u];
+
+    /* The writer's next publication goes to the other buffer */
+    for (j = 0; j < TRICAL_STATE_DIM; j++) {
+        cal.state[j] = 1.0f;
+    }
+    TRICAL_published_set(&cal, &published);
+    EXPECT_EQ(0u, _trical_published_retry(&published, sequence));
+
+    /* The one after that rewrites the reader's buffer, and pauses */
+    buffer = _trical_publish_begin(&published);
+    EXPECT_EQ(reading, buffer);
+    buffer->bias[0] = 2.0f;
+    EXPECT_NE(0u, _trical_published_retry(&published, sequence));
+
+    EXPECT_EQ(2u, TRICAL_published_get(&published, &frozen));
+    EXPECT_FLOAT_EQ(1.0f, frozen.bias[0]);
+    EXPECT_FLOAT_EQ(1.0f, frozen.bias[1]);
+    EXPECT_FLOAT_EQ(1.0f, frozen.bias[2]);
+
+    buffer->bias[1] = 2.0f;
+    buffer->bias[2] = 2.0f;
+    _trical_publish_end(&published);
+    EXPECT_NE(0u, _trical_published_retry(&published, sequence));
+
+    EXPECT_EQ(3u, TRICAL_published_get(&published, &frozen));
+    EXPECT_FLOAT_EQ(2.0f, frozen.bias[0]);
+    EXPECT_FLOAT_EQ(2.0f, frozen.bias[1]);
+    EXPECT_FLOAT_EQ(2.0f, frozen.bias[2]);
+}
@@ -0,0 +1,257 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <cmath>
+
+/* C++ complains about the C99 'restrict' qualifier. Just ignore it. */
+#define restrict
+
+#include "TRICAL.h"
+
+/* Sample `i` of a slowly rotating, biased field */
+static void _queue_sample(unsigned int i, float measurement[3],
+float field[3]) {
+    float a = 0.05f * (float)i, b = 0.013f * (float)i;
+
+    field[0] = cosf(a) * cosf(b);
+    field[1] = sinf(a) * cosf(b);
+    field[2] = sinf(b);
+
+    measurement[0] = field[0] + 0.1f;
+    measurement[1] = field[1] - 0.05f;
+    measurement[2] = field[2] + 0.02f;
+}
+
+/*
+Check that pumping queued samples gives exactly the same result as passing
+them to TRICAL_estimate_update directly, and that the budget is respected
+*/
+TEST(Queue, PumpMatchesEstimateUpdate) {
+    TRICAL_instance_t cal, queued_cal;
+    TRICAL_queue_t queue;
+    float measurement[3], field[3];
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    TRICAL_init(&queued_cal);
+    TRICAL_queue_init(&queue, TRICAL_QUEUE_DROP_OLDEST);
+    TRICAL_queue_set(&queued_cal, &queue);
+
+    for (i = 0; i < 40; i++) {
+        _queue_sample(i, measurement, field);
+        TRICAL_estimate_update(&cal, measurement, field);
+        EXPECT_EQ(1u, TRICAL_queue_push(&queue, measurement, field));
+    }
+    EXPECT_EQ(40u, TRICAL_queue_count_get(&queue));
+
+    EXPECT_EQ(16u, TRICAL_pump(&queued_cal, 16));
+    EXPECT_EQ(24u, TRICAL_queue_count_get(&queue));
+    EXPECT_EQ(24u, TRICAL_pump(&queued_cal, 100));
+    EXPECT_EQ(0u, TRICAL_queue_count_get(&queue));
+    EXPECT_EQ(0u, TRICAL_pump(&queued_cal, 100));
+
+    EXPECT_EQ(0u, TRICAL_queue_dropped_get(&queue));
+    EXPECT_EQ(cal.measurement_count, queued_cal.measurement_count);
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        EXPECT_FLOAT_EQ(cal.state[i], queued_cal.state[i]);
+    }
+}
+
+/* Samples pushed without a field use the instance's fixed field */
+TEST(Queue, FixedField) {
+    TRICAL_instance_t cal, queued_cal;
+    TRICAL_queue_t queue;
+    float measurement[3], field[3] = { 0.0f, 0.6f, 0.8f };
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    TRICAL_init(&queued_cal);
+    TRICAL_field_set(&queued_cal, field);
+    TRICAL_queue_init(&queue, TRICAL_QUEUE_DROP_OLDEST);
+    TRICAL_queue_set(&queued_cal, &queue);
+
+    for (i = 0; i < 8; i++) {
+        measurement[0] = 0.1f * (float)i;
+        measurement[1] = 0.6f;
+        measurement[2] = 0.8f - 0.05f * (float)i;
+        TRICAL_estimate_update(&cal, measurement, field);
+        TRICAL_queue_push(&queue, measurement, NULL);
+    }
+
+    EXPECT_EQ(8u, TRICAL_pump(&queued_cal, 8));
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        EXPECT_FLOAT_EQ(cal.state[i], queued_cal.state[i]);
+    }
+}
+
+/* When the queue overflows, the oldest samples are the ones lost */
+TEST(Queue, DropOldest) {
+    TRICAL_instance_t cal, queued_cal;
+    TRICAL_queue_t queue;
+    float measurement[3], field[3];
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    TRICAL_init(&queued_cal);
+    TRICAL_queue_init(&queue, TRICAL_QUEUE_DROP_OLDEST);
+    TRICAL_queue_set(&queued_cal, &queue);
+
+    for (i = 0; i < TRICAL_QUEUE_CAPACITY + 5u; i++) {
+        _queue_sample(i, measurement, field);
+        EXPECT_EQ(1u, TRICAL_queue_push(&queue, measurement, field));
+        if (i >= 5u) {
+            TRICAL_estimate_update(&cal, measurement, field);
+        }
+    }
+    EXPECT_EQ(TRICAL_QUEUE_CAPACITY, TRICAL_queue_count_get(&queue));
+
+    EXPECT_EQ(TRICAL_QUEUE_CAPACITY, TRICAL_pump(&queued_cal, 1000));
+    EXPECT_EQ(5u, TRICAL_queue_dropped_get(&queue));
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        EXPECT_FLOAT_EQ(cal.state[i], queued_cal.state[i]);
+    }
+}
+
+/*
+Under decimation, a full queue drops the new sample and thins out the
+following ones until it's been drained
+*/
+TEST(Queue, Decimate) {
+    TRICAL_instance_t cal;
+    TRICAL_queue_t queue;
+    float measurement[3], field[3];
+    unsigned int i, queued = 0;
+
+    TRICAL_init(&cal);
+    TRICAL_queue_init(&queue, TRICAL_QUEUE_DECIMATE);
+    TRICAL_queue_set(&cal, &queue);
+
+    for (i = 0; i < TRICAL_QUEUE_CAPACITY; i++) {
+        _queue_sample(i, measurement, field);
+        queued += TRICAL_queue_push(&queue, measurement, field);
+    }
+    EXPECT_EQ(TRICAL_QUEUE_CAPACITY, queued);
+
+    /* Full: dropped, and only every second sample is kept after that */
+    EXPECT_EQ(0u, TRICAL_queue_push(&queue, measurement, field));
+    TRICAL_pump(&cal, TRICAL_QUEUE_CAPACITY / 2u);
+    queued = 0;
+    for (i = 0; i < 8u; i++) {
+        queued += TRICAL_queue_push(&queue, measurement, field);
+    }
+    EXPECT_EQ(4u, queued);
+    EXPECT_EQ(5u, TRICAL_queue_dropped_get(&queue));
+
+    /* Once drained, every sample is queued again */
+    TRICAL_pump(&cal, TRICAL_QUEUE_CAPACITY);
+    queued = 0;
+    for (i = 0; i < 8u; i++) {
+        queued += TRICAL_queue_push(&queue, measurement, field);
+    }
+    EXPECT_EQ(8u, queued);
+}
+
+/*
+With the coverage policy, a full queue only accepts samples pointing in a
+new direction
+*/
+TEST(Queue, PreferCoverage) {
+    TRICAL_instance_t cal;
+    TRICAL_queue_t queue;
+    float x[3] = { 1.0f, 0.0f, 0.0f }, y[3] = { 0.0f, 1.0f, 0.0f };
+    unsigned int i;
+
+    TRICAL_init(&cal);
+    TRICAL_queue_init(&queue, TRICAL_QUEUE_PREFER_COVERAGE);
+    TRICAL_queue_set(&cal, &queue);
+
+    for (i = 0; i < TRICAL_QUEUE_CAPACITY; i++) {
+        EXPECT_EQ(1u, TRICAL_queue_push(&queue, x, x));
+    }
+    EXPECT_EQ(0u, TRICAL_queue_push(&queue, x, x));
+    EXPECT_EQ(1u, TRICAL_queue_push(&queue, y, y));
+    EXPECT_EQ(0u, TRICAL_queue_push(&queue, y, y));
+    EXPECT_EQ(1u, TRICAL_queue_push(&queue, x, x));
+
+    EXPECT_EQ(TRICAL_QUEUE_CAPACITY, TRICAL_queue_count_get(&queue));
+    EXPECT_EQ(2u, TRICAL_queue_dropped_get(&queue));
+
+    /* Overwritten samples are counted once the consumer reaches them */
+    EXPECT_EQ(TRICAL_QUEUE_CAPACITY, TRICAL_pump(&cal, 1000));
+    EXPECT_EQ(4u, TRICAL_queue_dropped_get(&queue));
+}
+
+struct queue_producer_t {
+    TRICAL_queue_t *queue;
+    unsigned int count;
+};
+
+static void *_queue_producer(void *arg) {
+    queue_producer_t *producer = (queue_producer_t *)arg;
+    float measurement[3], field[3];
+    unsigned int i;
+
+    for (i = 0; i < producer->count; i++) {
+        _queue_sample(i, measurement, field);
+        while (!TRICAL_queue_push(producer->queue, measurement, field));
+    }
+
+    return NULL;
+}
+
+/*
+Push from one thread while pumping from another; with decimation disabled by
+retrying pushes until they succeed, nothing should be lost or reordered
+*/
+TEST(Queue, Concurrent) {
+    TRICAL_instance_t cal, queued_cal;
+    TRICAL_queue_t queue;
+    queue_producer_t producer;
+    pthread_t thread;
+    float measurement[3], field[3];
+    unsigned int i, processed = 0;
+
+    TRICAL_init(&cal);
+    TRICAL_init(&queued_cal);
+    TRICAL_noise_set(&cal, 1e-2f);
+    TRICAL_noise_set(&queued_cal, 1e-2f);
+    TRICAL_queue_init(&queue, TRICAL_QUEUE_DECIMATE);
+    TRICAL_queue_set(&queued_cal, &queue);
+
+    producer.queue = &queue;
+    producer.count = 2000u;
+    ASSERT_EQ(0, pthread_create(&thread, NULL, _queue_producer, &producer));
+    while (processed < producer.count) {
+        processed += TRICAL_pump(&queued_cal, 7);
+    }
+    pthread_join(thread, NULL);
+
+    for (i = 0; i < producer.count; i++) {
+        _queue_sample(i, measurement, field);
+        TRICAL_estimate_update(&cal, measurement, field);
+    }
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        EXPECT_FLOAT_EQ(cal.state[i], queued_cal.state[i]);
+    }
+}
@@ -0,0 +1,122 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <cmath>
+
+#include "trace.h"
+
+/*
+Regression tests over the replay corpus: every estimator variant has to end
+up with the same calibration as the reference, to within a tolerance, on
+every trace. Throughput is left to the replay harness, since timings aren't
+reliable enough to fail a test on.
+*/
+#define REPLAY_TEST_READINGS 2000u
+
+/*
+Largest difference from the reference estimate allowed for the
+single-precision variants, and for the fixed-point filter
+*/
+#define REPLAY_STATE_TOLERANCE 5e-4f
+#define REPLAY_FIXED_STATE_TOLERANCE 1e-3f
+
+/* Largest increase in the RMS calibrated norm error over the reference */
+#define REPLAY_NORM_TOLERANCE 1e-4f
+
+/* Check that traces survive the binary format, and bad ones are rejected */
+TEST(Replay, Format) {
+    trace_t trace, decoded;
+    std::vector<uint8_t> buffer, reencoded;
+
+    trace_generate(TRACE_DISTURBED, 100u, &trace);
+    EXPECT_EQ(100u, trace.count());
+    EXPECT_EQ(300u, trace.fields.size());
+
+    /* Generated traces are already quantized, so encoding is lossless */
+    trace_encode(trace, &buffer);
+    EXPECT_EQ(TRACE_HEADER_SIZE + 100u * TRACE_READING_SIZE, buffer.size());
+    ASSERT_TRUE(trace_decode(&buffer[0], buffer.size(), &decoded));
+    EXPECT_FLOAT_EQ(trace.field_norm, decoded.field_norm);
+    EXPECT_FLOAT_EQ(trace.measurement_noise, decoded.measurement_noise);
+    EXPECT_TRUE(trace.measurements == decoded.measurements);
+    EXPECT_TRUE(trace.fields == decoded.fields);
+
+    trace_encode(decoded, &reencoded);
+    EXPECT_TRUE(buffer == reencoded);
+
+    /* Truncated, or with the wrong magic */
+    trace_t unchanged;
+    unchanged.field_norm = 2.0f;
+    EXPECT_FALSE(trace_decode(&buffer[0], buffer.size() - 1u, &unchanged));
+    EXPECT_FALSE(trace_decode(&buffer[0], TRACE_HEADER_SIZE - 1u,
+                              &unchanged));
+    buffer[3] = '2';
+    EXPECT_FALSE(trace_decode(&buffer[0], buffer.size(), &unchanged));
+    EXPECT_FLOAT_EQ(2.0f, unchanged.field_norm);
+    EXPECT_EQ(0u, unchanged.count());
+}
+
+/* Check that every variant matches the reference on every trace */
+TEST(Replay, Variants) {
+    trace_t trace;
+    replay_result_t reference, result;
+    float reference_error, tolerance;
+    unsigned int kind;
+    size_t v;
+
+    ASSERT_STREQ("reference", replay_variants[0].name);
+
+    for (kind = 0; kind < TRACE_KINDS; kind++) {
+        trace_generate((trace_kind_t)kind, REPLAY_TEST_READINGS, &trace);
+        replay_variants[0].run(trace, 1u, &reference);
+        reference_error = replay_norm_error(trace, reference.state);
+
+        for (v = 1; v < replay_variant_count; v++) {
+            replay_variants[v].run(trace, 1u, &result);
+
+            tolerance = strcmp(replay_variants[v].name, "fixed") ?
+                        REPLAY_STATE_TOLERANCE : REPLAY_FIXED_STATE_TOLERANCE;
+            EXPECT_LE(replay_state_delta(result.state, reference.state),
+                      tolerance)
+                << trace.name << ", " << replay_variants[v].name;
+            EXPECT_LE(replay_norm_error(trace, result.state),
+                      reference_error + REPLAY_NORM_TOLERANCE)
+                << trace.name << ", " << replay_variants[v].name;
+        }
+    }
+}
+
+/*
+Check the reference itself still calibrates the one trace which covers
+every direction without any disturbances, so the variants can't all drift
+together. The trace's noise alone gives an RMS norm error of about 1.2e-3.
+*/
+TEST(Replay, Reference) {
+    trace_t trace;
+    replay_result_t reference;
+
+    trace_generate(TRACE_TUMBLE, REPLAY_TEST_READINGS, &trace);
+    replay_variants[0].run(trace, 1u, &reference);
+    EXPECT_LT(replay_norm_error(trace, reference.state), 3e-3f);
+}
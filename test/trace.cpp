@@ -0,0 +1,475 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <chrono>
+#include <cmath>
+#include <cfloat>
+#include <cstdio>
+#include <cstring>
+
+#include "trace.h"
+#include "filter.h"
+
+const float trace_bias[3] = { 0.12f, -0.2f, 0.05f };
+const float trace_scale[9] = {
+    1.05f, 0.02f, -0.01f,
+    0.02f, 0.95f, 0.03f,
+    -0.01f, 0.03f, 1.01f
+};
+
+static const char *const _trace_names[TRACE_KINDS] = {
+    "tumble", "planar", "static", "disturbed"
+};
+
+/* Field direction (before distortion) of reading `i` of trace `kind` */
+static void _trace_field(trace_kind_t kind, size_t i, float field[3]) {
+    float t = (float)i, theta, phi;
+
+    switch (kind) {
+        case TRACE_PLANAR:
+            /*
+            Inclination of 60 degrees, turning once every 500 readings, with
+            a few degrees of pitch and roll
+            */
+            theta = t * (6.2831853f / 500.0f);
+            phi = -1.0472f + 0.05f * sinf(t * 0.031f) +
+                  0.03f * cosf(t * 0.017f);
+            break;
+        case TRACE_STATIC:
+            theta = 0.7f + 0.002f * sinf(t * 0.05f);
+            phi = 0.4f + 0.002f * cosf(t * 0.07f);
+            break;
+        case TRACE_TUMBLE:
+        case TRACE_DISTURBED:
+        default:
+            /* A spiral over the sphere, as in the benchmarks */
+            theta = t * 0.0137f * 7.0f;
+            phi = sinf(t * 0.0031f) * 1.4f;
+            break;
+    }
+
+    field[0] = cosf(theta) * cosf(phi);
+    field[1] = sinf(theta) * cosf(phi);
+    field[2] = sinf(phi);
+}
+
+void trace_generate(trace_kind_t kind, size_t count, trace_t *trace) {
+    trace_t generated;
+    float field[3], disturbance;
+    unsigned int lcg = 12345u + (unsigned int)kind;
+    size_t i, j;
+
+    generated.field_norm = 1.0f;
+    generated.measurement_noise = 1e-2f;
+    generated.measurements.resize(count * 3u);
+    generated.fields.resize(count * 3u);
+
+    for (i = 0; i < count; i++) {
+        _trace_field(kind, i, field);
+
+        /*
+        The disturbance field ramps up and decays over 60 readings, every
+        400 readings
+        */
+        disturbance = 0.0f;
+        if (kind == TRACE_DISTURBED && i % 400u >= 200u &&
+                i % 400u < 260u) {
+            disturbance = 0.4f * sinf((float)(i % 400u - 200u) *
+                                      (3.1415927f / 60.0f));
+        }
+
+        for (j = 0; j < 3; j++) {
+            lcg = lcg * 1664525u + 1013904223u;
+            generated.measurements[i * 3u + j] =
+                trace_scale[j * 3 + 0] * field[0] +
+                trace_scale[j * 3 + 1] * field[1] +
+                trace_scale[j * 3 + 2] * field[2] + trace_bias[j] +
+                ((float)(lcg >> 8) / 16777216.0f - 0.5f) * 4e-3f;
+            generated.fields[i * 3u + j] = field[j];
+        }
+
+        generated.measurements[i * 3u] += disturbance;
+        generated.measurements[i * 3u + 2u] -= 0.5f * disturbance;
+    }
+
+    /* Quantize through the binary format, as a recorded trace would be */
+    std::vector<uint8_t> buffer;
+    trace_encode(generated, &buffer);
+    trace_decode(&buffer[0], buffer.size(), trace);
+    trace->name = _trace_names[kind];
+}
+
+static void _put_u32(uint8_t *out, uint32_t value) {
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+    out[2] = (uint8_t)(value >> 16);
+    out[3] = (uint8_t)(value >> 24);
+}
+
+static uint32_t _get_u32(const uint8_t *in) {
+    return (uint32_t)in[0] | ((uint32_t)in[1] << 8) |
+           ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static void _put_f32(uint8_t *out, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    _put_u32(out, bits);
+}
+
+static float _get_f32(const uint8_t *in) {
+    uint32_t bits = _get_u32(in);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static void _put_i16(uint8_t *out, float value) {
+    long rounded = lroundf(value);
+
+    if (rounded > 32767) {
+        rounded = 32767;
+    } else if (rounded < -32767) {
+        rounded = -32767;
+    }
+
+    out[0] = (uint8_t)(rounded & 0xFF);
+    out[1] = (uint8_t)((rounded >> 8) & 0xFF);
+}
+
+static int16_t _get_i16(const uint8_t *in) {
+    return (int16_t)(uint16_t)((unsigned int)in[0] |
+                               ((unsigned int)in[1] << 8));
+}
+
+void trace_encode(const trace_t &trace, std::vector<uint8_t> *buffer) {
+    size_t i, count = trace.count();
+    float range = FLT_MIN, lsb;
+
+    for (i = 0; i < count * 3u; i++) {
+        if (std::fabs(trace.measurements[i]) > range) {
+            range = std::fabs(trace.measurements[i]);
+        }
+    }
+    lsb = range / 32767.0f;
+
+    buffer->assign(TRACE_HEADER_SIZE + count * TRACE_READING_SIZE, 0);
+    uint8_t *out = &(*buffer)[0];
+    memcpy(out, "TRC1", 4);
+    _put_u32(&out[4], (uint32_t)count);
+    _put_f32(&out[8], trace.field_norm);
+    _put_f32(&out[12], trace.measurement_noise);
+    _put_f32(&out[16], lsb);
+
+    out += TRACE_HEADER_SIZE;
+    for (i = 0; i < count * 3u; i += 3u, out += TRACE_READING_SIZE) {
+        _put_i16(&out[0], trace.measurements[i] / lsb);
+        _put_i16(&out[2], trace.measurements[i + 1u] / lsb);
+        _put_i16(&out[4], trace.measurements[i + 2u] / lsb);
+        _put_i16(&out[6], trace.fields[i] * 32767.0f);
+        _put_i16(&out[8], trace.fields[i + 1u] * 32767.0f);
+        _put_i16(&out[10], trace.fields[i + 2u] * 32767.0f);
+    }
+}
+
+bool trace_decode(const uint8_t *buffer, size_t size, trace_t *trace) {
+    size_t i, count;
+    float lsb;
+
+    if (size < TRACE_HEADER_SIZE || memcmp(buffer, "TRC1", 4) != 0) {
+        return false;
+    }
+
+    count = _get_u32(&buffer[4]);
+    lsb = _get_f32(&buffer[16]);
+    if (size != TRACE_HEADER_SIZE + count * TRACE_READING_SIZE ||
+            !(lsb > 0.0f && lsb <= FLT_MAX)) {
+        return false;
+    }
+
+    trace->field_norm = _get_f32(&buffer[8]);
+    trace->measurement_noise = _get_f32(&buffer[12]);
+    trace->measurements.resize(count * 3u);
+    trace->fields.resize(count * 3u);
+
+    const uint8_t *in = &buffer[TRACE_HEADER_SIZE];
+    for (i = 0; i < count * 3u; i += 3u, in += TRACE_READING_SIZE) {
+        trace->measurements[i] = (float)_get_i16(&in[0]) * lsb;
+        trace->measurements[i + 1u] = (float)_get_i16(&in[2]) * lsb;
+        trace->measurements[i + 2u] = (float)_get_i16(&in[4]) * lsb;
+        trace->fields[i] = (float)_get_i16(&in[6]) * (1.0f / 32767.0f);
+        trace->fields[i + 1u] = (float)_get_i16(&in[8]) * (1.0f / 32767.0f);
+        trace->fields[i + 2u] = (float)_get_i16(&in[10]) * (1.0f / 32767.0f);
+    }
+
+    return true;
+}
+
+bool trace_load(const char *path, trace_t *trace) {
+    std::vector<uint8_t> buffer;
+    uint8_t chunk[4096];
+    size_t read;
+    FILE *file = fopen(path, "rb");
+
+    if (!file) {
+        return false;
+    }
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        buffer.insert(buffer.end(), chunk, chunk + read);
+    }
+    fclose(file);
+
+    trace->name = path;
+    return !buffer.empty() && trace_decode(&buffer[0], buffer.size(), trace);
+}
+
+bool trace_save(const char *path, const trace_t &trace) {
+    std::vector<uint8_t> buffer;
+    bool ok;
+    FILE *file = fopen(path, "wb");
+
+    if (!file) {
+        return false;
+    }
+    trace_encode(trace, &buffer);
+    ok = fwrite(&buffer[0], 1, buffer.size(), file) == buffer.size();
+    return fclose(file) == 0 && ok;
+}
+
+/*
+Runs `body` (which replays the whole trace) `repetitions` times, each after
+calling `setup`, and returns the fastest time in ns. Only `body` is timed.
+*/
+template <typename Setup, typename Body>
+static double _replay_time(unsigned int repetitions, Setup setup,
+Body body) {
+    double best = DBL_MAX, ns;
+    unsigned int r;
+
+    for (r = 0; r < (repetitions ? repetitions : 1u); r++) {
+        setup();
+
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        body();
+        ns = std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - start).count();
+
+        if (ns < best) {
+            best = ns;
+        }
+    }
+
+    return best;
+}
+
+static void _replay_init(const trace_t &trace, TRICAL_instance_t *instance) {
+    TRICAL_init(instance);
+    TRICAL_norm_set(instance, trace.field_norm);
+    TRICAL_noise_set(instance, trace.measurement_noise);
+}
+
+static void _replay_filter(const trace_t &trace, unsigned int repetitions,
+replay_result_t *result, unsigned int square_root) {
+    TRICAL_instance_t instance;
+    size_t i, count = trace.count();
+
+    result->ns_per_reading = _replay_time(repetitions, [&]() {
+        _replay_init(trace, &instance);
+        TRICAL_square_root_set(&instance, square_root);
+    }, [&]() {
+        for (i = 0; i < count; i++) {
+            _trical_filter_iterate(&instance, NULL,
+                                   &trace.measurements[i * 3u],
+                                   &trace.fields[i * 3u]);
+        }
+    }) / (double)count;
+    memcpy(result->state, instance.state, sizeof(result->state));
+}
+
+static void _replay_reference(const trace_t &trace, unsigned int repetitions,
+replay_result_t *result) {
+    _replay_filter(trace, repetitions, result, 0);
+}
+
+static void _replay_square_root(const trace_t &trace,
+unsigned int repetitions, replay_result_t *result) {
+    _replay_filter(trace, repetitions, result, 1u);
+}
+
+static void _replay_batch(const trace_t &trace, unsigned int repetitions,
+replay_result_t *result) {
+    TRICAL_instance_t instance;
+    size_t count = trace.count();
+
+    result->ns_per_reading = _replay_time(repetitions, [&]() {
+        _replay_init(trace, &instance);
+    }, [&]() {
+        TRICAL_estimate_update_batch(&instance, &trace.measurements[0], 3,
+                                     &trace.fields[0], 3,
+                                     (unsigned int)count);
+    }) / (double)count;
+    memcpy(result->state, instance.state, sizeof(result->state));
+}
+
+/*
+The bank and multi-instance variants run TRICAL_BANK_WIDTH copies of the
+trace side by side, so their time is per reading per instance
+*/
+static void _replay_bank(const trace_t &trace, unsigned int repetitions,
+replay_result_t *result) {
+    TRICAL_bank_t bank;
+    TRICAL_instance_t instance;
+    float measurements[TRICAL_BANK_WIDTH][3], fields[TRICAL_BANK_WIDTH][3];
+    size_t i, count = trace.count();
+    unsigned int w;
+
+    result->ns_per_reading = _replay_time(repetitions, [&]() {
+        TRICAL_bank_init(&bank);
+        _replay_init(trace, &instance);
+        for (w = 0; w < TRICAL_BANK_WIDTH; w++) {
+            TRICAL_bank_instance_set(&bank, w, &instance);
+        }
+    }, [&]() {
+        for (i = 0; i < count; i++) {
+            for (w = 0; w < TRICAL_BANK_WIDTH; w++) {
+                memcpy(measurements[w], &trace.measurements[i * 3u],
+                       sizeof(measurements[w]));
+                memcpy(fields[w], &trace.fields[i * 3u], sizeof(fields[w]));
+            }
+            TRICAL_bank_estimate_update(&bank, measurements, fields, ~0u);
+        }
+    }) / (double)(count * TRICAL_BANK_WIDTH);
+
+    TRICAL_bank_instance_get(&bank, 0, &instance);
+    memcpy(result->state, instance.state, sizeof(result->state));
+}
+
+static void _replay_multi(const trace_t &trace, unsigned int repetitions,
+replay_result_t *result) {
+    TRICAL_instance_t instances[TRICAL_BANK_WIDTH],
+                      *pointers[TRICAL_BANK_WIDTH];
+    float measurements[TRICAL_BANK_WIDTH][3], fields[TRICAL_BANK_WIDTH][3];
+    size_t i, count = trace.count();
+    unsigned int w;
+
+    for (w = 0; w < TRICAL_BANK_WIDTH; w++) {
+        pointers[w] = &instances[w];
+    }
+
+    result->ns_per_reading = _replay_time(repetitions, [&]() {
+        for (w = 0; w < TRICAL_BANK_WIDTH; w++) {
+            _replay_init(trace, &instances[w]);
+        }
+    }, [&]() {
+        for (i = 0; i < count; i++) {
+            for (w = 0; w < TRICAL_BANK_WIDTH; w++) {
+                memcpy(measurements[w], &trace.measurements[i * 3u],
+                       sizeof(measurements[w]));
+                memcpy(fields[w], &trace.fields[i * 3u], sizeof(fields[w]));
+            }
+            TRICAL_estimate_update_multi(pointers, measurements, fields,
+                                         TRICAL_BANK_WIDTH);
+        }
+    }) / (double)(count * TRICAL_BANK_WIDTH);
+    memcpy(result->state, instances[0].state, sizeof(result->state));
+}
+
+/* The fixed-point filter, on the readings converted to Q2.29 */
+static void _replay_fixed(const trace_t &trace, unsigned int repetitions,
+replay_result_t *result) {
+    TRICAL_fixed_instance_t instance;
+    std::vector<TRICAL_fixed_t> measurements(trace.measurements.size()),
+                                fields(trace.fields.size());
+    size_t i, count = trace.count();
+
+    for (i = 0; i < count * 3u; i++) {
+        measurements[i] = TRICAL_FIXED_FROM_FLOAT(trace.measurements[i]);
+        fields[i] = TRICAL_FIXED_FROM_FLOAT(trace.fields[i]);
+    }
+
+    result->ns_per_reading = _replay_time(repetitions, [&]() {
+        TRICAL_fixed_init(&instance);
+        TRICAL_fixed_norm_set(&instance,
+                              TRICAL_FIXED_FROM_FLOAT(trace.field_norm));
+        TRICAL_fixed_noise_set(&instance,
+            TRICAL_FIXED_FROM_FLOAT(trace.measurement_noise));
+    }, [&]() {
+        for (i = 0; i < count; i++) {
+            TRICAL_fixed_estimate_update(&instance, &measurements[i * 3u],
+                                         &fields[i * 3u]);
+        }
+    }) / (double)count;
+
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        result->state[i] = TRICAL_FIXED_TO_FLOAT(instance.state[i]);
+    }
+}
+
+const replay_variant_t replay_variants[] = {
+    { "reference", _replay_reference },
+    { "square_root", _replay_square_root },
+    { "batch", _replay_batch },
+    { "bank", _replay_bank },
+    { "multi", _replay_multi },
+    { "fixed", _replay_fixed }
+};
+
+const size_t replay_variant_count =
+    sizeof(replay_variants) / sizeof(replay_variants[0]);
+
+float replay_norm_error(const trace_t &trace,
+const float state[TRICAL_STATE_DIM]) {
+    TRICAL_instance_t instance;
+    float calibrated[3], norm;
+    double sum = 0.0;
+    size_t i, count = trace.count();
+
+    _replay_init(trace, &instance);
+    memcpy(instance.state, state, sizeof(instance.state));
+
+    for (i = 0; i < count; i++) {
+        TRICAL_measurement_calibrate(&instance, &trace.measurements[i * 3u],
+                                     calibrated);
+        norm = sqrtf(calibrated[0] * calibrated[0] +
+                     calibrated[1] * calibrated[1] +
+                     calibrated[2] * calibrated[2]);
+        sum += (double)((norm - trace.field_norm) *
+                        (norm - trace.field_norm));
+    }
+
+    return count ? (float)std::sqrt(sum / (double)count) : 0.0f;
+}
+
+float replay_state_delta(const float a[TRICAL_STATE_DIM],
+const float b[TRICAL_STATE_DIM]) {
+    float delta = 0.0f;
+    unsigned int i;
+
+    for (i = 0; i < TRICAL_STATE_DIM; i++) {
+        if (std::fabs(a[i] - b[i]) > delta) {
+            delta = std::fabs(a[i] - b[i]);
+        }
+    }
+
+    return delta;
+}
@@ -0,0 +1,162 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef TRICAL_TRACE_H_
+#define TRICAL_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* C++ complains about the C99 'restrict' qualifier. Just ignore it. */
+#define restrict
+
+#include "TRICAL.h"
+
+/*
+Sensor traces for replaying through every estimator, shared by the replay
+tests (test_replay.cpp) and the replay harness (replay.cpp).
+
+A trace is stored in a compact little-endian binary format, 12 bytes per
+reading after a 24-byte header:
+
+    offset  size  contents
+    0       4     magic, "TRC1"
+    4       4     number of readings (uint32)
+    8       4     field norm (float32)
+    12      4     measurement noise to configure the filter with (float32)
+    16      4     measurement LSB: the value of one count (float32)
+    20      4     reserved, zero
+    24      12n   readings: the measurement in counts (3 x int16), then the
+                  reference field direction in Q15 (3 x int16)
+
+Recorded traces are converted to this format offline; the synthetic traces
+are generated on the fly, but always go through the same encoding, so a trace
+replays the same whether it was generated or loaded from a file.
+*/
+#define TRACE_HEADER_SIZE 24u
+#define TRACE_READING_SIZE 12u
+
+struct trace_t {
+    const char *name;
+    float field_norm;
+    float measurement_noise;
+
+    /* Decoded readings, three floats per reading */
+    std::vector<float> measurements;
+    std::vector<float> fields;
+
+    size_t count() const {
+        return measurements.size() / 3u;
+    }
+};
+
+/* The synthetic traces */
+enum trace_kind_t {
+    /* The sensor tumbling, so the field sweeps over the whole sphere */
+    TRACE_TUMBLE = 0,
+
+    /*
+    A ground vehicle driving in circles: the field turns about the vertical
+    at a fixed inclination, with a little pitch and roll
+    */
+    TRACE_PLANAR,
+
+    /* The sensor sitting still, so only the noise changes */
+    TRACE_STATIC,
+
+    /* Tumbling, with bursts of an external disturbance field */
+    TRACE_DISTURBED,
+
+    TRACE_KINDS
+};
+
+/*
+Generates the synthetic trace `kind` with `count` readings, through the
+binary encoding. The readings are of the true field distorted by
+trace_bias and trace_scale, plus noise; the noise is pseudo-random but the
+same every time.
+*/
+void trace_generate(trace_kind_t kind, size_t count, trace_t *trace);
+
+/* The sensor distortion applied by trace_generate */
+extern const float trace_bias[3];
+extern const float trace_scale[9];
+
+/*
+Encodes `trace` in the binary format to `buffer`, replacing its contents.
+The measurement LSB is chosen to fit the largest measurement component.
+*/
+void trace_encode(const trace_t &trace, std::vector<uint8_t> *buffer);
+
+/*
+Decodes the binary trace in `buffer` into `trace` (whose name is left as it
+is). Returns false, leaving `trace` unchanged, if `buffer` isn't a valid
+trace.
+*/
+bool trace_decode(const uint8_t *buffer, size_t size, trace_t *trace);
+
+/* Reads and decodes, or encodes and writes, the trace file `path` */
+bool trace_load(const char *path, trace_t *trace);
+bool trace_save(const char *path, const trace_t &trace);
+
+/*
+The final estimate of a replay, and the time it took. `state` holds the
+instance's state vector (bias, then the scale parameters of the calibration
+model).
+*/
+struct replay_result_t {
+    float state[TRICAL_STATE_DIM];
+    double ns_per_reading;
+};
+
+/*
+An estimator variant: runs every reading of `trace` through a newly
+initialized estimator `repetitions` times, and reports the final estimate
+and the fastest time per reading
+*/
+struct replay_variant_t {
+    const char *name;
+    void (*run)(const trace_t &trace, unsigned int repetitions,
+                replay_result_t *result);
+};
+
+/*
+Every estimator variant built into this configuration. The first is the
+reference: _trical_filter_iterate, one reading at a time, with the full
+state covariance.
+*/
+extern const replay_variant_t replay_variants[];
+extern const size_t replay_variant_count;
+
+/*
+Root mean square error of the magnitude of the readings of `trace`,
+calibrated by the estimate in `state`, against the field norm
+*/
+float replay_norm_error(const trace_t &trace,
+const float state[TRICAL_STATE_DIM]);
+
+/* Largest absolute difference between two estimates */
+float replay_state_delta(const float a[TRICAL_STATE_DIM],
+const float b[TRICAL_STATE_DIM]);
+
+#endif
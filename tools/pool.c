@@ -0,0 +1,265 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "TRICAL.h"
+#include "pool.h"
+
+/* Upper limit on the number of threads in a single TRICAL_pool_run call */
+#define TRICAL_POOL_MAX_THREADS 256u
+
+/* Number of readings in each shard of a TRICAL_pool_fit call */
+#define TRICAL_POOL_FIT_SHARD 4096u
+
+/*
+State shared between the workers of a single TRICAL_pool_run call. The only
+thing that's written after startup is `next_stream`, which is only ever
+modified with an atomic increment; everything a worker touches within a
+stream belongs to that stream alone.
+*/
+typedef struct {
+    TRICAL_pool_stream_t *streams;
+    unsigned int stream_count;
+    volatile unsigned int next_stream;
+} _trical_pool_t;
+
+/*
+State shared between the workers of a single TRICAL_pool_fit call; as for
+_trical_pool_t, only `next_shard` is written after startup, and each shard
+has its own partial fit.
+*/
+typedef struct {
+    const float *measurements;
+    unsigned int measurement_stride;
+    unsigned int count;
+    TRICAL_fit_t *partials;
+    unsigned int shard_count;
+    volatile unsigned int next_shard;
+} _trical_pool_fit_t;
+
+static void *_trical_pool_worker(void *arg);
+static void *_trical_pool_fit_worker(void *arg);
+static unsigned int _trical_pool_thread_count(unsigned int thread_count,
+unsigned int work_count);
+static void _trical_pool_start(void *(*worker)(void *), void *arg,
+unsigned int thread_count);
+
+/*
+_trical_pool_worker
+Claims and processes streams until there are none left.
+*/
+static void *_trical_pool_worker(void *arg) {
+    _trical_pool_t *pool = (_trical_pool_t*)arg;
+    TRICAL_pool_stream_t *stream;
+    unsigned int i;
+
+    while (1) {
+        i = __sync_fetch_and_add(&pool->next_stream, 1u);
+        if (i >= pool->stream_count) {
+            break;
+        }
+
+        stream = &pool->streams[i];
+        if (stream->count) {
+            TRICAL_estimate_update_batch(stream->instance,
+                stream->measurements, stream->measurement_stride,
+                stream->reference_fields, stream->reference_field_stride,
+                stream->count);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+TRICAL_pool_run
+Processes all `stream_count` streams in `streams` using up to `thread_count`
+threads (or one per online CPU if `thread_count` is 0), and returns once all
+of them are done.
+
+Each stream is updated by exactly one thread, in order, so the result for
+every instance is identical to calling TRICAL_estimate_update_batch on it
+directly. Threads claim the next unprocessed stream as soon as they finish
+their current one, so long and short streams balance out across the pool.
+Streams must not share instances.
+
+If threads can't be created, the remaining streams are processed on the
+calling thread.
+*/
+void TRICAL_pool_run(TRICAL_pool_stream_t streams[],
+unsigned int stream_count, unsigned int thread_count) {
+    assert(streams || !stream_count);
+
+    _trical_pool_t pool;
+
+    pool.streams = streams;
+    pool.stream_count = stream_count;
+    pool.next_stream = 0;
+
+    _trical_pool_start(_trical_pool_worker, &pool,
+                       _trical_pool_thread_count(thread_count, stream_count));
+}
+
+/*
+_trical_pool_fit_worker
+Claims and accumulates shards until there are none left.
+*/
+static void *_trical_pool_fit_worker(void *arg) {
+    _trical_pool_fit_t *pool = (_trical_pool_fit_t*)arg;
+    unsigned int i, first, count;
+
+    while (1) {
+        i = __sync_fetch_and_add(&pool->next_shard, 1u);
+        if (i >= pool->shard_count) {
+            break;
+        }
+
+        first = i * TRICAL_POOL_FIT_SHARD;
+        count = pool->count - first;
+        if (count > TRICAL_POOL_FIT_SHARD) {
+            count = TRICAL_POOL_FIT_SHARD;
+        }
+
+        TRICAL_fit_init(&pool->partials[i]);
+        TRICAL_fit_add_many(&pool->partials[i],
+            &pool->measurements[first * pool->measurement_stride],
+            pool->measurement_stride, count);
+    }
+
+    return NULL;
+}
+
+/*
+TRICAL_pool_fit
+Adds `count` readings to `fit`, as for TRICAL_fit_add_many, using up to
+`thread_count` threads (or one per online CPU if `thread_count` is 0).
+
+The readings are split into fixed-size shards, each accumulated into its own
+partial fit, and the partial fits are then merged pairwise in a fixed tree,
+so the result doesn't depend on the number of threads; it only differs from
+TRICAL_fit_add_many (which accumulates the readings one after another) by
+rounding.
+
+If the partial fits can't be allocated, the readings are added on the calling
+thread with TRICAL_fit_add_many.
+*/
+void TRICAL_pool_fit(TRICAL_fit_t *fit, const float measurements[],
+unsigned int measurement_stride, unsigned int count,
+unsigned int thread_count) {
+    assert(fit);
+    assert(measurements || !count);
+
+    _trical_pool_fit_t pool;
+    unsigned int i, step;
+
+    pool.measurements = measurements;
+    pool.measurement_stride = measurement_stride;
+    pool.count = count;
+    pool.shard_count = count / TRICAL_POOL_FIT_SHARD +
+                       (count % TRICAL_POOL_FIT_SHARD ? 1u : 0u);
+    pool.next_shard = 0;
+
+    if (!pool.shard_count) {
+        return;
+    }
+
+    pool.partials = (TRICAL_fit_t*)malloc(pool.shard_count *
+                                          sizeof(TRICAL_fit_t));
+    if (!pool.partials) {
+        TRICAL_fit_add_many(fit, measurements, measurement_stride, count);
+        return;
+    }
+
+    _trical_pool_start(_trical_pool_fit_worker, &pool,
+                       _trical_pool_thread_count(thread_count,
+                                                 pool.shard_count));
+
+    /*
+    Tree reduction: merge shard i + step into shard i for every i that's a
+    multiple of 2 * step, doubling step until everything is in shard 0. That
+    keeps every partial a sum of similarly-sized parts, which loses less
+    precision than adding each shard to a running total.
+    */
+    for (step = 1u; step < pool.shard_count; step *= 2u) {
+        for (i = 0; i + step < pool.shard_count; i += 2u * step) {
+            TRICAL_fit_merge(&pool.partials[i], &pool.partials[i + step]);
+        }
+    }
+
+    TRICAL_fit_merge(fit, &pool.partials[0]);
+    free(pool.partials);
+}
+
+/*
+_trical_pool_thread_count
+Returns the number of threads to use for `work_count` items of work, given
+the `thread_count` requested (0 meaning one per online CPU).
+*/
+static unsigned int _trical_pool_thread_count(unsigned int thread_count,
+unsigned int work_count) {
+    if (thread_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpus > 0 ? (unsigned int)cpus : 1u;
+    }
+
+    /* No point starting more threads than there is work */
+    if (thread_count > work_count) {
+        thread_count = work_count;
+    }
+    if (thread_count > TRICAL_POOL_MAX_THREADS) {
+        thread_count = TRICAL_POOL_MAX_THREADS;
+    }
+
+    return thread_count;
+}
+
+/*
+_trical_pool_start
+Runs `worker` on up to `thread_count` threads, including the calling thread,
+and waits for them all to return. If threads can't be created, the calling
+thread is the only worker.
+*/
+static void _trical_pool_start(void *(*worker)(void *), void *arg,
+unsigned int thread_count) {
+    pthread_t threads[TRICAL_POOL_MAX_THREADS];
+    unsigned int i, started;
+
+    /*
+    The calling thread is one of the workers, so start one fewer thread than
+    requested.
+    */
+    for (started = 0; started + 1u < thread_count; started++) {
+        if (pthread_create(&threads[started], NULL, worker, arg)) {
+            break;
+        }
+    }
+
+    worker(arg);
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
@@ -0,0 +1,91 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _TRICAL_POOL_H_
+#define _TRICAL_POOL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Host-side driver for calibrating many independent sensor streams at once
+(e.g. a day of logs from a fleet of vehicles). Requires POSIX threads, so it
+isn't part of the embedded library.
+*/
+
+/*
+One sensor stream: an instance (initialized by the caller, with the desired
+field norm and noise already set) and the readings to feed it, laid out as
+for TRICAL_estimate_update_batch.
+*/
+typedef struct {
+    TRICAL_instance_t *instance;
+
+    float *measurements;
+    unsigned int measurement_stride;
+    float *reference_fields;
+    unsigned int reference_field_stride;
+    unsigned int count;
+} TRICAL_pool_stream_t;
+
+/*
+TRICAL_pool_run
+Processes all `stream_count` streams in `streams` using up to `thread_count`
+threads (or one per online CPU if `thread_count` is 0), and returns once all
+of them are done.
+
+Each stream is updated by exactly one thread, in order, so the result for
+every instance is identical to calling TRICAL_estimate_update_batch on it
+directly. Threads claim the next unprocessed stream as soon as they finish
+their current one, so long and short streams balance out across the pool.
+Streams must not share instances.
+
+If threads can't be created, the remaining streams are processed on the
+calling thread.
+*/
+void TRICAL_pool_run(TRICAL_pool_stream_t streams[],
+unsigned int stream_count, unsigned int thread_count);
+
+/*
+TRICAL_pool_fit
+Adds `count` readings to `fit`, as for TRICAL_fit_add_many, using up to
+`thread_count` threads (or one per online CPU if `thread_count` is 0).
+
+The readings are split into fixed-size shards, each accumulated into its own
+partial fit, and the partial fits are then merged pairwise in a fixed tree,
+so the result doesn't depend on the number of threads; it only differs from
+TRICAL_fit_add_many (which accumulates the readings one after another) by
+rounding.
+
+If the partial fits can't be allocated, the readings are added on the calling
+thread with TRICAL_fit_add_many.
+*/
+void TRICAL_pool_fit(TRICAL_fit_t *fit, const float measurements[],
+unsigned int measurement_stride, unsigned int count,
+unsigned int thread_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,399 @@
+/*
+Copyright (C) 2013 Ben Dyer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Command-line calibration tool, for running TRICAL over large log files.
+
+Usage: trical [-c] [-f] [-b <block size>] [-r <record file>] <field norm>
+              <noise> < input > output
+
+By default, the input is a stream of raw little-endian float32 measurement
+triples, and the output is a stream of calibrated float32 triples in the same
+format. With -c, the input and output are comma-separated text instead, one
+measurement per line (as for `python -m TRICAL`).
+
+Readings are processed in blocks (of 4096 measurements by default): each
+block is used to update the calibration estimate, and is then calibrated
+using the estimate as of the end of the block.
+
+With -f, each input record has 6 values: the measurement, followed by the
+reference field direction. Otherwise the measurement itself is used as the
+reference field direction.
+
+Once the input is exhausted, the final calibration estimate is written to
+stderr. With -r, it's also written to the specified file as a binary record
+of little-endian float32 values: bias[3], scale[9], bias variance[3] and
+scale variance[9], followed by the measurement count as a little-endian
+uint32.
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "TRICAL.h"
+
+#define TRICAL_TOOL_DEFAULT_BLOCK 4096u
+#define TRICAL_TOOL_LINE_LENGTH 512u
+
+typedef struct {
+    unsigned int csv;
+    unsigned int reference_fields;
+    unsigned int block_size;
+    const char *record_path;
+} _trical_tool_options_t;
+
+static unsigned int _host_is_big_endian(void);
+static void _swap_floats(float *values, size_t count);
+static size_t _read_binary(FILE *in, float *raw, size_t record_length,
+size_t max_records);
+static size_t _read_csv(FILE *in, float *raw, size_t record_length,
+size_t max_records);
+static int _write_block(FILE *out, unsigned int csv, float output[][3],
+size_t count);
+static int _write_record(const char *path, TRICAL_instance_t *instance);
+static void _print_estimate(TRICAL_instance_t *instance);
+static void _usage(void);
+
+/*
+_host_is_big_endian
+Returns non-zero if the host stores floats big-endian, in which case the
+binary streams need to be byte-swapped.
+*/
+static unsigned int _host_is_big_endian(void) {
+    const uint32_t one = 1u;
+    unsigned char first;
+
+    memcpy(&first, &one, 1);
+    return first == 0;
+}
+
+/*
+_swap_floats
+Reverses the byte order of each of the `count` values in `values`.
+*/
+static void _swap_floats(float *values, size_t count) {
+    uint32_t v;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        memcpy(&v, &values[i], sizeof(v));
+        v = (v >> 24) | ((v >> 8) & 0xff00u) | ((v << 8) & 0xff0000u) |
+            (v << 24);
+        memcpy(&values[i], &v, sizeof(v));
+    }
+}
+
+/*
+_read_binary
+Reads up to `max_records` records of `record_length` float32 values from
+`in` into `raw`, and returns the number of complete records read.
+*/
+static size_t _read_binary(FILE *in, float *raw, size_t record_length,
+size_t max_records) {
+    size_t record_bytes = record_length * sizeof(float), bytes, records;
+
+    bytes = fread(raw, 1, record_bytes * max_records, in);
+    records = bytes / record_bytes;
+
+    if (bytes % record_bytes) {
+        fprintf(stderr, "trical: ignoring incomplete record at end of "
+                "input\n");
+    }
+
+    if (_host_is_big_endian()) {
+        _swap_floats(raw, records * record_length);
+    }
+
+    return records;
+}
+
+/*
+_read_csv
+Reads up to `max_records` lines of `record_length` comma-separated values
+from `in` into `raw`, and returns the number of records read. Lines which
+don't have the right number of values are skipped.
+*/
+static size_t _read_csv(FILE *in, float *raw, size_t record_length,
+size_t max_records) {
+    char line[TRICAL_TOOL_LINE_LENGTH], *p, *end;
+    size_t records = 0, i;
+
+    while (records < max_records && fgets(line, sizeof(line), in)) {
+        float *record = &raw[records * record_length];
+
+        p = line;
+        for (i = 0; i < record_length; i++) {
+            record[i] = strtof(p, &end);
+            if (end == p) {
+                break;
+            }
+
+            /* Skip whitespace and the separator */
+            p = end + strspn(end, " \t");
+            if (i + 1 < record_length) {
+                if (*p != ',') {
+                    break;
+                }
+                p++;
+            }
+        }
+
+        if (i == record_length && strspn(p, " \t\r\n") == strlen(p)) {
+            records++;
+        }
+    }
+
+    return records;
+}
+
+/*
+_write_block
+Writes the `count` calibrated measurements in `output` to `out`, returning
+zero on success.
+*/
+static int _write_block(FILE *out, unsigned int csv, float output[][3],
+size_t count) {
+    size_t i;
+
+    if (csv) {
+        for (i = 0; i < count; i++) {
+            if (fprintf(out, "%.7f,%.7f,%.7f\n", (double)output[i][0],
+                        (double)output[i][1], (double)output[i][2]) < 0) {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    if (_host_is_big_endian()) {
+        _swap_floats(&output[0][0], count * 3u);
+    }
+
+    return fwrite(output, 3u * sizeof(float), count, out) == count ? 0 : -1;
+}
+
+/*
+_write_record
+Writes the calibration estimate of `instance` to the file at `path` in the
+binary record format described above, returning zero on success.
+*/
+static int _write_record(const char *path, TRICAL_instance_t *instance) {
+    float values[24];
+    uint32_t count = TRICAL_measurement_count_get(instance);
+    FILE *f;
+    int result;
+
+    TRICAL_estimate_get_ext(instance, &values[0], &values[3], &values[12],
+                            &values[15]);
+
+    if (_host_is_big_endian()) {
+        _swap_floats(values, 24);
+        count = (count >> 24) | ((count >> 8) & 0xff00u) |
+                ((count << 8) & 0xff0000u) | (count << 24);
+    }
+
+    f = fopen(path, "wb");
+    if (!f) {
+        return -1;
+    }
+
+    result = (fwrite(values, sizeof(values), 1, f) == 1 &&
+              fwrite(&count, sizeof(count), 1, f) == 1) ? 0 : -1;
+
+    if (fclose(f)) {
+        result = -1;
+    }
+
+    return result;
+}
+
+/*
+_print_estimate
+Writes the calibration estimate of `instance` to stderr, in the same format
+as `python -m TRICAL`.
+*/
+static void _print_estimate(TRICAL_instance_t *instance) {
+    float b[3], d[9];
+
+    TRICAL_estimate_get(instance, b, d);
+
+    fprintf(stderr, "################# CALIBRATION #################\n");
+    fprintf(stderr, " b = [%10.7f, %10.7f, %10.7f]\n", (double)b[0],
+            (double)b[1], (double)b[2]);
+    fprintf(stderr, " D = [ [ %10.7f, %10.7f, %10.7f ]\n", (double)d[0],
+            (double)d[1], (double)d[2]);
+    fprintf(stderr, "       [ %10.7f, %10.7f, %10.7f ]\n", (double)d[3],
+            (double)d[4], (double)d[5]);
+    fprintf(stderr, "       [ %10.7f, %10.7f, %10.7f ] ]\n", (double)d[6],
+            (double)d[7], (double)d[8]);
+}
+
+static void _usage(void) {
+    fprintf(stderr, "Usage: trical [-c] [-f] [-b <block size>] "
+            "[-r <record file>] <field norm> <noise>\n"
+            "  -c  read and write comma-separated text instead of float32\n"
+            "  -f  input records include a reference field direction\n"
+            "  -b  number of measurements per block (default %u)\n"
+            "  -r  write the final calibration record to a file\n",
+            TRICAL_TOOL_DEFAULT_BLOCK);
+}
+
+int main(int argc, char *argv[]) {
+    _trical_tool_options_t options;
+    TRICAL_instance_t instance;
+    TRICAL_frozen_t frozen;
+    float norm, noise, *raw, (*measurements)[3], (*fields)[3], (*output)[3];
+    size_t record_length, count, i;
+    char *end;
+    int opt, status = 0;
+    long block;
+
+    options.csv = 0;
+    options.reference_fields = 0;
+    options.block_size = TRICAL_TOOL_DEFAULT_BLOCK;
+    options.record_path = NULL;
+
+    while ((opt = getopt(argc, argv, "cfb:r:")) != -1) {
+        switch (opt) {
+            case 'c':
+                options.csv = 1;
+                break;
+            case 'f':
+                options.reference_fields = 1;
+                break;
+            case 'b':
+                block = strtol(optarg, &end, 10);
+                if (*end || block <= 0 || block > 1L << 24) {
+                    _usage();
+                    return 1;
+                }
+                options.block_size = (unsigned int)block;
+                break;
+            case 'r':
+                options.record_path = optarg;
+                break;
+            default:
+                _usage();
+                return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        _usage();
+        return 1;
+    }
+
+    norm = strtof(argv[optind], &end);
+    if (*end || !(norm > 0.0f)) {
+        fprintf(stderr, "trical: field norm must be > 0.0\n");
+        return 1;
+    }
+
+    noise = strtof(argv[optind + 1], &end);
+    if (*end || !(noise > 0.0f)) {
+        fprintf(stderr, "trical: noise must be > 0.0\n");
+        return 1;
+    }
+
+    TRICAL_init(&instance);
+    TRICAL_norm_set(&instance, norm);
+    TRICAL_noise_set(&instance, noise);
+
+    record_length = options.reference_fields ? 6u : 3u;
+    raw = malloc(options.block_size * record_length * sizeof(float));
+    output = malloc(options.block_size * sizeof(*output));
+    measurements = options.reference_fields ?
+        malloc(options.block_size * sizeof(*measurements)) :
+        (float (*)[3])raw;
+    if (!raw || !output || !measurements) {
+        fprintf(stderr, "trical: out of memory\n");
+        return 2;
+    }
+
+    fields = options.reference_fields ?
+        malloc(options.block_size * sizeof(*fields)) : measurements;
+    if (!fields) {
+        fprintf(stderr, "trical: out of memory\n");
+        return 2;
+    }
+
+    while (1) {
+        count = options.csv ?
+            _read_csv(stdin, raw, record_length, options.block_size) :
+            _read_binary(stdin, raw, record_length, options.block_size);
+        if (!count) {
+            break;
+        }
+
+        /* Split out the reference fields, if they're in the input */
+        if (options.reference_fields) {
+            for (i = 0; i < count; i++) {
+                memcpy(measurements[i], &raw[i * 6u], 3u * sizeof(float));
+                memcpy(fields[i], &raw[i * 6u + 3u], 3u * sizeof(float));
+            }
+        }
+
+        TRICAL_estimate_update_batch(&instance, &measurements[0][0], 3,
+                                     &fields[0][0], 3, (unsigned int)count);
+
+        TRICAL_frozen_get(&instance, &frozen);
+        TRICAL_calibrate_many(&frozen, measurements, output,
+                              (unsigned int)count);
+
+        if (_write_block(stdout, options.csv, output, count)) {
+            fprintf(stderr, "trical: error writing output\n");
+            status = 2;
+            break;
+        }
+    }
+
+    if (ferror(stdin)) {
+        fprintf(stderr, "trical: error reading input\n");
+        status = 2;
+    }
+    if (fflush(stdout)) {
+        fprintf(stderr, "trical: error writing output\n");
+        status = 2;
+    }
+
+    _print_estimate(&instance);
+
+    if (options.record_path &&
+            _write_record(options.record_path, &instance)) {
+        fprintf(stderr, "trical: error writing %s\n", options.record_path);
+        status = 2;
+    }
+
+    if (options.reference_fields) {
+        free(fields);
+        free(measurements);
+    }
+    free(output);
+    free(raw);
+
+    return status;
+}